@@ -0,0 +1,47 @@
+# Headless benchmarks: build with qmake in this directory, run
+# ./spacer-benchmark --help for the options.
+QT       += core gui concurrent
+
+TARGET = spacer-benchmark
+TEMPLATE = app
+
+CONFIG += c++14 console
+
+# gzip compressed file listings; see ListingImporter.
+unix: LIBS += -lz
+CONFIG -= app_bundle
+
+INCLUDEPATH += ..
+
+SOURCES += \
+    main.cpp \
+    treegenerator.cpp \
+    ../deviceprofiles.cpp \
+    ../filetypes.cpp \
+    ../folderscanner.cpp \
+    ../foldertree.cpp \
+    ../listingimporter.cpp \
+    ../scanbackend.cpp \
+    ../scanfilter.cpp \
+    ../searchindex.cpp \
+    ../snapshot.cpp \
+    ../snapshotdiff.cpp \
+    ../trace.cpp \
+    ../treemaplayout.cpp \
+    ../treemaprenderer.cpp
+
+HEADERS += \
+    treegenerator.h \
+    ../deviceprofiles.h \
+    ../filetypes.h \
+    ../folderscanner.h \
+    ../foldertree.h \
+    ../listingimporter.h \
+    ../scanbackend.h \
+    ../scanfilter.h \
+    ../searchindex.h \
+    ../snapshot.h \
+    ../snapshotdiff.h \
+    ../trace.h \
+    ../treemaplayout.h \
+    ../treemaprenderer.h
@@ -0,0 +1,322 @@
+#include "treegenerator.h"
+#include "folderscanner.h"
+#include "listingimporter.h"
+#include "searchindex.h"
+#include "snapshotdiff.h"
+#include "treemaplayout.h"
+#include "treemaprenderer.h"
+#include "trace.h"
+
+#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QImage>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QPainter>
+#include <QTemporaryFile>
+#include <QTextStream>
+#include <QThread>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <vector>
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+struct Timing {
+    double minMs = 0;
+    double medianMs = 0;
+};
+
+// Peak resident set size of the process so far, in KiB; 0 where unknown.
+static qint64 peakMemoryKb() {
+#ifdef Q_OS_UNIX
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return usage.ru_maxrss;
+#endif
+    return 0;
+}
+
+// Runs work repeat times, each after an untimed setup.
+static Timing measure(int repeat, const std::function<void()> &setup, const std::function<void()> &work) {
+    std::vector<double> runs;
+    for (int i = 0; i < repeat; i++) {
+        if (setup)
+            setup();
+        QElapsedTimer timer;
+        timer.start();
+        work();
+        runs.push_back(timer.nsecsElapsed() / 1e6);
+    }
+    std::sort(runs.begin(), runs.end());
+    Timing timing;
+    timing.minMs = runs.front();
+    timing.medianMs = runs[runs.size() / 2];
+    return timing;
+}
+
+static QJsonObject result(const QString &name, const Timing &timing, int repeat) {
+    QJsonObject object;
+    object["name"] = name;
+    object["repeat"] = repeat;
+    object["minMs"] = timing.minMs;
+    object["medianMs"] = timing.medianMs;
+    object["peakRssKb"] = peakMemoryKb();
+    QTextStream(stderr) << QString("%1: %2 ms median, %3 ms best\n")
+                               .arg(name, -28)
+                               .arg(timing.medianMs, 0, 'f', 2)
+                               .arg(timing.minMs, 0, 'f', 2);
+    return object;
+}
+
+static double perSecond(qint64 count, double ms) {
+    return ms > 0 ? count * 1000.0 / ms : 0.0;
+}
+
+// The deepest folder along the first-child links, for a small change as
+// far from the root as the tree goes.
+static NodeIndex deepestFolder(const FolderTree &tree) {
+    NodeIndex folder = tree.root();
+    while (tree.node(folder).firstChild != NoIndex)
+        folder = tree.node(folder).firstChild;
+    return folder;
+}
+
+int main(int argc, char *argv[])
+{
+    // Rendering needs fonts but no screen.
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QGuiApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Times tree building, search, scanning, layout and rendering on a synthetic tree "
+                                     "and prints the results as JSON.");
+    parser.addHelpOption();
+    TreeShape shape;
+    QCommandLineOption depthOption("depth", "Levels of folders below the root.", "n", QString::number(shape.depth));
+    QCommandLineOption fanOutOption("fan-out", "Subfolders per folder.", "n", QString::number(shape.fanOut));
+    QCommandLineOption filesOption("files", "Average files per folder.", "n", QString::number(shape.filesPerFolder));
+    QCommandLineOption medianOption("median-size", "Median file size in bytes.", "bytes", QString::number(shape.medianFileSize));
+    QCommandLineOption spreadOption("size-spread", "Log-normal sigma of the file sizes.", "sigma", QString::number(shape.sizeSpread));
+    QCommandLineOption seedOption("seed", "Random seed; the same seed gives the same tree.", "n", QString::number(shape.seed));
+    QCommandLineOption scanDirOption("scan-dir", "Also benchmark scanning, of a copy of the tree generated in this "
+                                     "directory (reused if it already exists).", "path");
+    QCommandLineOption threadsOption("threads", "Scanner threads (default: one per core).", "count", "0");
+    QCommandLineOption sizesOption("sizes", "Comma-separated resolutions for layout and rendering.", "list",
+                                   "1280x800,1920x1200,3840x2160");
+    QCommandLineOption squarifiedOption("squarified", "Lay out in squarified rows instead of by halving.");
+    QCommandLineOption repeatOption("repeat", "Runs per benchmark.", "n", "5");
+    QCommandLineOption outputOption("output", "Write the JSON here instead of to standard output.", "file");
+    QCommandLineOption traceOption("trace", "Also record a Chrome trace of the whole run to file.", "file");
+    parser.addOptions({depthOption, fanOutOption, filesOption, medianOption, spreadOption, seedOption,
+                       scanDirOption, threadsOption, sizesOption, squarifiedOption, repeatOption, outputOption, traceOption});
+    parser.process(app);
+
+    shape.depth = parser.value(depthOption).toInt();
+    shape.fanOut = parser.value(fanOutOption).toInt();
+    shape.filesPerFolder = parser.value(filesOption).toInt();
+    shape.medianFileSize = parser.value(medianOption).toDouble();
+    shape.sizeSpread = parser.value(spreadOption).toDouble();
+    shape.seed = parser.value(seedOption).toULongLong();
+    const int repeat = std::max(1, parser.value(repeatOption).toInt());
+    if (parser.isSet(traceOption))
+        Trace::setEnabled(true);
+
+    QJsonObject shapeObject;
+    shapeObject["depth"] = shape.depth;
+    shapeObject["fanOut"] = shape.fanOut;
+    shapeObject["filesPerFolder"] = shape.filesPerFolder;
+    shapeObject["medianFileSize"] = shape.medianFileSize;
+    shapeObject["sizeSpread"] = shape.sizeSpread;
+    shapeObject["seed"] = QString::number(shape.seed);
+    QJsonArray results;
+
+    // Building the tree in memory: the cost of the tree itself, without
+    // any file system underneath.
+    TreeGenerator generator(shape);
+    std::shared_ptr<FolderTree> tree;
+    Timing timing = measure(repeat, [&] { tree.reset(); }, [&] { tree = generator.build("/synthetic"); });
+    QJsonObject build = result("tree.build", timing, repeat);
+    build["folders"] = qint64(tree->folderCount());
+    build["files"] = qint64(tree->fileCount());
+    build["treeBytes"] = tree->memoryUsage();
+    build["filesPerSecond"] = perSecond(tree->fileCount(), timing.medianMs);
+    results.append(build);
+
+    // Indexing the tree for search, then a few kinds of query over all of it.
+    SearchIndex index;
+    timing = measure(repeat, nullptr, [&] { index.build(*tree); });
+    QJsonObject indexing = result("search.index", timing, repeat);
+    indexing["indexBytes"] = index.memoryUsage();
+    results.append(indexing);
+    for (const char *text : {"file1", "file*.jp*g", "type:video size>10M", "size>1G", "/^file\\d+\\.log$/"}) {
+        const SearchQuery query = SearchQuery::parse(text);
+        SearchResult found;
+        timing = measure(repeat, nullptr, [&] { found = index.search(*tree, tree->root(), query, 100); });
+        QJsonObject search = result(QString("search %1").arg(text), timing, repeat);
+        search["query"] = text;
+        search["matches"] = found.count();
+        results.append(search);
+    }
+
+    // Comparing with an earlier scan of the same tree. Generated folders
+    // have no mtime, so nothing is skipped: the cost of the full walk.
+    {
+        const std::shared_ptr<FolderTree> earlier = generator.build("/synthetic");
+        SnapshotDiff diff;
+        timing = measure(repeat, nullptr, [&] { diff.compare(*earlier, *tree); });
+        QJsonObject comparing = result("diff.compare", timing, repeat);
+        comparing["foldersCompared"] = qint64(diff.foldersCompared());
+        comparing["diffBytes"] = diff.memoryUsage();
+        results.append(comparing);
+    }
+
+    // Importing the tree from a listing as find -printf '%s %p\n' writes it.
+    {
+        QTemporaryFile listing;
+        if (listing.open()) {
+            QByteArray lines;
+            for (FileIndex file = 0; file < tree->fileCount(); file++) {
+                lines += QByteArray::number(tree->file(file).size) + ' ' + QFile::encodeName(tree->filePath(file)) + '\n';
+                if (lines.size() > (1 << 20)) {
+                    listing.write(lines);
+                    lines.clear();
+                }
+            }
+            listing.write(lines);
+            listing.flush();
+            std::shared_ptr<FolderTree> imported;
+            ScanStats stats;
+            timing = measure(repeat, [&] { imported.reset(); }, [&] {
+                ListingImporter importer(parser.value(threadsOption).toInt());
+                imported = importer.import(listing.fileName());
+                stats = importer.stats();
+            });
+            QJsonObject importing = result("listing.import", timing, repeat);
+            importing["listingBytes"] = listing.size();
+            importing["threads"] = stats.threads;
+            importing["megabytesPerSecond"] = perSecond(listing.size(), timing.medianMs) / (1024 * 1024);
+            importing["linesPerSecond"] = perSecond(tree->fileCount(), timing.medianMs);
+            importing["sameTotals"] = imported && imported->node(imported->root()).totalSize == tree->node(tree->root()).totalSize;
+            results.append(importing);
+        }
+    }
+
+    if (parser.isSet(scanDirOption)) {
+        const QString scanDir = parser.value(scanDirOption);
+        if (!QFileInfo(scanDir).exists()) {
+            QTextStream(stderr) << "Generating " << shape.expectedFileCount() << " files in " << scanDir << "...\n";
+            if (!TreeGenerator(shape).create(scanDir))
+                return 1;
+        }
+        ScanOptions options;
+        options.threadCount = parser.value(threadsOption).toInt();
+        options.useSnapshots = false;
+        ScanStats stats;
+        timing = measure(repeat, nullptr, [&] {
+            FolderScanner scanner(options);
+            scanner.scan(scanDir);
+            stats = scanner.stats();
+        });
+        QJsonObject scan = result("scan", timing, repeat);
+        scan["threads"] = stats.threads;
+        scan["backend"] = stats.backend;
+        scan["folders"] = stats.dirs;
+        scan["files"] = stats.files;
+        scan["statCalls"] = stats.statCalls;
+        scan["dirsPerSecond"] = perSecond(stats.dirs, timing.medianMs);
+        scan["filesPerSecond"] = perSecond(stats.files, timing.medianMs);
+        results.append(scan);
+    }
+
+    TreemapRenderer renderer(QGuiApplication::font());
+    const NodeIndex deep = deepestFolder(*tree);
+    for (const QString &size : parser.value(sizesOption).split(',')) {
+        const QStringList parts = size.split('x');
+        if (parts.size() != 2)
+            continue;
+        const QRectF outerRect = QRectF(0, 0, parts[0].toInt(), parts[1].toInt()).adjusted(1, 1, -1, -1);
+        const QRectF treeRect = renderer.treeRect(outerRect);
+
+        // From scratch, as after a resize or a new tree.
+        std::unique_ptr<TreemapLayout> layout;
+        timing = measure(repeat, [&] {
+            layout.reset(new TreemapLayout);
+            layout->setLabelHeight(renderer.folderLabelHeight());
+            layout->setSquarified(parser.isSet(squarifiedOption));
+        }, [&] { layout->layout(*tree, tree->root(), treeRect); });
+        QJsonObject cold = result("layout.cold " + size, timing, repeat);
+        cold["resolution"] = size;
+        cold["items"] = int(layout->items().size());
+        results.append(cold);
+
+        // Nothing changed: the cached layout is handed out again.
+        timing = measure(repeat, nullptr, [&] { layout->layout(*tree, tree->root(), treeRect); });
+        QJsonObject cached = result("layout.cached " + size, timing, repeat);
+        cached["resolution"] = size;
+        results.append(cached);
+
+        // One folder deep down grew: only the levels above it are redone.
+        timing = measure(repeat, [&] { tree->addSize(deep, 4096); },
+                         [&] { layout->layout(*tree, tree->root(), treeRect); });
+        QJsonObject changed = result("layout.change " + size, timing, repeat);
+        changed["resolution"] = size;
+        results.append(changed);
+
+        // Eliding and measuring every label, as on the first frame.
+        std::shared_ptr<TreemapFrame> frame;
+        timing = measure(repeat, [&] { renderer.clearLabels(); },
+                         [&] { frame = renderer.prepare(*tree, tree->root(), *layout, outerRect, outerRect); });
+        QJsonObject labels = result("labels " + size, timing, repeat);
+        labels["resolution"] = size;
+        results.append(labels);
+
+        // The next frame of the same view, with every label kept.
+        timing = measure(repeat, nullptr,
+                         [&] { frame = renderer.prepare(*tree, tree->root(), *layout, outerRect, outerRect); });
+        QJsonObject prepared = result("frame " + size, timing, repeat);
+        prepared["resolution"] = size;
+        results.append(prepared);
+
+        QImage image(outerRect.adjusted(-1, -1, 1, 1).size().toSize(), QImage::Format_ARGB32_Premultiplied);
+        timing = measure(repeat, [&] { image.fill(Qt::white); }, [&] {
+            QPainter painter(&image);
+            painter.setRenderHint(QPainter::Antialiasing);
+            renderer.render(painter, *frame, outerRect);
+        });
+        QJsonObject render = result("render " + size, timing, repeat);
+        render["resolution"] = size;
+        render["items"] = int(layout->items().size());
+        render["framesPerSecond"] = perSecond(1, timing.medianMs);
+        results.append(render);
+    }
+
+    QJsonObject report;
+    report["benchmark"] = "spacer";
+    report["qtVersion"] = qVersion();
+    report["idealThreads"] = QThread::idealThreadCount();
+    report["shape"] = shapeObject;
+    report["squarified"] = parser.isSet(squarifiedOption);
+    report["results"] = results;
+    report["peakRssKb"] = peakMemoryKb();
+    if (parser.isSet(traceOption))
+        Trace::save(parser.value(traceOption));
+    const QByteArray json = QJsonDocument(report).toJson();
+    if (parser.isSet(outputOption)) {
+        QFile file(parser.value(outputOption));
+        if (!file.open(QIODevice::WriteOnly) || file.write(json) != json.size()) {
+            QTextStream(stderr) << "Cannot write " << file.fileName() << "\n";
+            return 1;
+        }
+    } else {
+        QTextStream(stdout) << json;
+    }
+    return 0;
+}
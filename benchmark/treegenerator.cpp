@@ -0,0 +1,131 @@
+#include "treegenerator.h"
+#include "folderscanner.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QStringList>
+#include <QDebug>
+#include <cmath>
+
+static const char *const EXTENSIONS[] = {
+    "jpg", "png", "mp4", "mkv", "mp3", "txt", "log", "cpp", "h", "o",
+    "so", "zip", "gz", "pdf", "iso", "bin",
+};
+static const int EXTENSION_COUNT = int(sizeof(EXTENSIONS) / sizeof(EXTENSIONS[0]));
+
+qint64 TreeShape::folderCount() const
+{
+    qint64 count = 0;
+    qint64 level = 1;
+    for (int i = 0; i <= depth; i++) {
+        count += level;
+        level *= fanOut;
+    }
+    return count;
+}
+
+// Feeds the generated tree straight into a FolderTree. Like the scanner,
+// it adds up a folder's files before passing their sizes up the tree.
+struct MemorySink {
+    FolderTree &tree;
+    std::vector<NodeIndex> folders;
+    CategorySizes added;
+
+    void file(const QByteArray &name, qint64 size)
+    {
+        // The scanner leaves small files out; so does this.
+        if (size < MIN_FILE_SIZE)
+            return;
+        const FileIndex index = tree.addFile(folders.back(), name.constData(), name.size(), size);
+        added.add(tree.file(index).type, size);
+    }
+    void flush()
+    {
+        tree.addSize(folders.back(), added);
+        added = CategorySizes();
+    }
+    void enter(const QByteArray &name)
+    {
+        flush();
+        folders.push_back(tree.addFolder(folders.back(), name.constData(), name.size()));
+    }
+    void leave()
+    {
+        flush();
+        folders.pop_back();
+    }
+};
+
+// Writes the generated tree to disk.
+struct DiskSink {
+    QStringList paths;
+    bool ok = true;
+
+    void file(const QByteArray &name, qint64 size)
+    {
+        QFile file(paths.last() + '/' + QFile::decodeName(name));
+        ok = ok && file.open(QIODevice::WriteOnly) && file.resize(size);
+    }
+    void enter(const QByteArray &name)
+    {
+        paths.append(paths.last() + '/' + QFile::decodeName(name));
+        ok = ok && QDir().mkdir(paths.last());
+    }
+    void leave() { paths.removeLast(); }
+};
+
+TreeGenerator::TreeGenerator(const TreeShape &shape)
+    : m_shape(shape), m_sizes(std::log(shape.medianFileSize), shape.sizeSpread)
+{
+}
+
+std::shared_ptr<FolderTree> TreeGenerator::build(const QString &rootPath)
+{
+    auto tree = std::make_shared<FolderTree>();
+    MemorySink sink{*tree, std::vector<NodeIndex>(1, tree->createRoot(rootPath)), CategorySizes()};
+    reset();
+    generate(sink, 0);
+    sink.flush();
+    tree->sortBySize(tree->root());
+    return tree;
+}
+
+bool TreeGenerator::create(const QString &path)
+{
+    if (QFileInfo(path).exists() || !QDir().mkpath(path)) {
+        qDebug() << "Cannot create a fresh tree at" << path;
+        return false;
+    }
+    DiskSink sink;
+    sink.paths.append(path);
+    reset();
+    generate(sink, 0);
+    if (!sink.ok)
+        qDebug() << "Failed to write the tree below" << path;
+    return sink.ok;
+}
+
+template<typename Sink>
+void TreeGenerator::generate(Sink &sink, int depth)
+{
+    const int files = m_shape.filesPerFolder / 2 + int(m_random() % quint64(m_shape.filesPerFolder + 1));
+    for (int i = 0; i < files; i++) {
+        const char *extension = EXTENSIONS[m_random() % EXTENSION_COUNT];
+        const qint64 size = std::max<qint64>(1, qint64(m_sizes(m_random)));
+        sink.file("file" + QByteArray::number(i) + '.' + extension, size);
+    }
+    if (depth >= m_shape.depth)
+        return;
+    for (int i = 0; i < m_shape.fanOut; i++) {
+        sink.enter("dir" + QByteArray::number(i));
+        generate(sink, depth + 1);
+        sink.leave();
+    }
+}
+
+void TreeGenerator::reset()
+{
+    m_random.seed(m_shape.seed);
+    m_sizes.reset();
+}
@@ -0,0 +1,47 @@
+#ifndef TREEGENERATOR_H
+#define TREEGENERATOR_H
+
+#include "foldertree.h"
+
+#include <QString>
+#include <memory>
+#include <random>
+
+// Shape of a synthetic directory tree. Every folder above depth has
+// fanOut subfolders; folders hold filesPerFolder files on average (between
+// half and one and a half times that), with log-normally distributed sizes.
+// The same shape and seed always give the same tree.
+struct TreeShape {
+    int depth = 4;
+    int fanOut = 8;
+    int filesPerFolder = 50;
+    double medianFileSize = 16 * 1024;
+    double sizeSpread = 2.0;          // Sigma of the size's natural log.
+    quint64 seed = 1;
+
+    qint64 folderCount() const;
+    qint64 expectedFileCount() const { return folderCount() * filesPerFolder; }
+};
+
+class TreeGenerator
+{
+public:
+    explicit TreeGenerator(const TreeShape &shape);
+
+    // Builds the tree in memory, as a finished scan of it would leave it.
+    std::shared_ptr<FolderTree> build(const QString &rootPath);
+    // Creates the tree on disk below path, which must not exist yet. Files
+    // are sparse, so they take their size in the listing but little space.
+    bool create(const QString &path);
+
+private:
+    template<typename Sink>
+    void generate(Sink &sink, int depth);
+    void reset();
+
+    TreeShape m_shape;
+    std::mt19937_64 m_random;
+    std::lognormal_distribution<double> m_sizes;
+};
+
+#endif // TREEGENERATOR_H
@@ -0,0 +1,181 @@
+#include "deviceprofiles.h"
+
+#include <QFile>
+#include <QList>
+#include <QMutexLocker>
+#include <algorithm>
+
+#ifdef Q_OS_UNIX
+#include <sys/stat.h>
+#endif
+#ifdef Q_OS_LINUX
+#include <sys/sysmacros.h>
+#endif
+
+// Spinning disks: one worker waits on the disk while the other gets its
+// next directory ready.
+static const int ROTATIONAL_READS = 2;
+// Network file systems: enough to hide the round trips, few enough not to
+// swamp a server others use too.
+static const int NETWORK_READS = 4;
+
+// File systems whose files live on another machine.
+static const char *const NETWORK_FILE_SYSTEMS[] = {
+    "nfs", "nfs4", "cifs", "smb3", "smbfs", "9p", "afs", "ceph", "glusterfs", "lustre",
+    "fuse.sshfs", "fuse.glusterfs", "fuse.rclone", "fuse.s3fs", "fuse.davfs2",
+};
+
+#ifdef Q_OS_LINUX
+// Mountinfo writes spaces and the like in paths as \ and three octal digits.
+static QByteArray unescapeMountPath(const QByteArray &path)
+{
+    QByteArray result;
+    result.reserve(path.size());
+    for (int i = 0; i < path.size(); i++) {
+        if (path[i] == '\\' && i + 3 < path.size()) {
+            bool ok = false;
+            const int value = path.mid(i + 1, 3).toInt(&ok, 8);
+            if (ok) {
+                result += char(value);
+                i += 3;
+                continue;
+            }
+        }
+        result += path[i];
+    }
+    return result;
+}
+#endif
+
+// Each line of mountinfo reads "id parent major:minor root mountpoint
+// options [tags...] - type source options".
+std::vector<MountEntry> mountTable()
+{
+    std::vector<MountEntry> mounts;
+#ifdef Q_OS_LINUX
+    QFile file("/proc/self/mountinfo");
+    if (!file.open(QIODevice::ReadOnly))
+        return mounts;
+    // Read in one go: procfs files report a size of 0.
+    for (const QByteArray &line : file.readAll().split('\n')) {
+        const QList<QByteArray> fields = line.split(' ');
+        const int separator = fields.indexOf("-");
+        if (fields.size() < 5 || separator < 0 || separator + 2 >= fields.size())
+            continue;
+        const QList<QByteArray> number = fields[2].split(':');
+        if (number.size() != 2)
+            continue;
+        mounts.push_back({quint64(makedev(number[0].toUInt(), number[1].toUInt())),
+                          fields[separator + 1], fields[separator + 2], unescapeMountPath(fields[4])});
+    }
+#endif
+    return mounts;
+}
+
+#ifdef Q_OS_LINUX
+// Whether sysfs says the block device spins. A partition has no queue of
+// its own; it shares the whole disk's.
+static bool isRotational(quint64 device)
+{
+    const QByteArray base = "/sys/dev/block/" + QByteArray::number(major(device)) + ':' +
+                            QByteArray::number(minor(device));
+    for (const QByteArray &queue : {base + "/queue/rotational", base + "/../queue/rotational"}) {
+        QFile file(QString::fromLatin1(queue));
+        if (file.open(QIODevice::ReadOnly))
+            return file.readAll().trimmed() == "1";
+    }
+    return false;
+}
+#endif
+
+DeviceProfiles::DeviceProfiles(Kind override)
+    : m_override(override)
+{
+    if (m_override == Auto)
+        m_mounts = mountTable();
+}
+
+DeviceProfiles::Kind DeviceProfiles::kindOf(quint64 device)
+{
+    if (m_override != Auto)
+        return m_override;
+    if (device == 0)
+        return Solid;
+    QMutexLocker locker(&m_mutex);
+    const auto it = m_kinds.constFind(device);
+    if (it != m_kinds.constEnd())
+        return it.value();
+    const Kind kind = detect(device);
+    m_kinds.insert(device, kind);
+    return kind;
+}
+
+DeviceProfiles::Kind DeviceProfiles::detect(quint64 device) const
+{
+#ifdef Q_OS_LINUX
+    // Block devices have a major number; network, memory and some
+    // multi-disk file systems get an anonymous one with major 0, and only
+    // the mount table tells what is underneath.
+    if (major(device) != 0)
+        return isRotational(device) ? Rotational : Solid;
+    const auto mount = std::find_if(m_mounts.begin(), m_mounts.end(),
+                                    [device](const MountEntry &entry) { return entry.device == device; });
+    if (mount == m_mounts.end())
+        return Solid;
+    if (isNetworkType(mount->type))
+        return Network;
+    // Btrfs and the like name the disk they are on as their source.
+    struct stat st;
+    if (mount->source.startsWith("/dev/") && stat(mount->source.constData(), &st) == 0 && S_ISBLK(st.st_mode))
+        return isRotational(st.st_rdev) ? Rotational : Solid;
+#else
+    Q_UNUSED(device);
+#endif
+    return Solid;
+}
+
+int DeviceProfiles::readLimit(Kind kind, int threads)
+{
+    switch (kind) {
+    case Rotational:
+        return std::min(threads, ROTATIONAL_READS);
+    case Network:
+        return std::min(threads, NETWORK_READS);
+    default:
+        return threads;
+    }
+}
+
+bool DeviceProfiles::isNetworkType(const QByteArray &type)
+{
+    for (const char *name : NETWORK_FILE_SYSTEMS) {
+        if (type == name)
+            return true;
+    }
+    return false;
+}
+
+DeviceProfiles::Kind DeviceProfiles::kindFromString(const QString &value)
+{
+    if (value == "ssd" || value == "solid")
+        return Solid;
+    if (value == "hdd" || value == "rotational")
+        return Rotational;
+    if (value == "network")
+        return Network;
+    return Auto;
+}
+
+const char *DeviceProfiles::kindName(Kind kind)
+{
+    switch (kind) {
+    case Solid:
+        return "ssd";
+    case Rotational:
+        return "hdd";
+    case Network:
+        return "network";
+    default:
+        return "auto";
+    }
+}
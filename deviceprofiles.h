@@ -0,0 +1,63 @@
+#ifndef DEVICEPROFILES_H
+#define DEVICEPROFILES_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+#include <vector>
+
+// One line of /proc/self/mountinfo.
+struct MountEntry {
+    quint64 device;                   // st_dev of the files on it.
+    QByteArray type;                  // "ext4", "nfs4", "fuse.sshfs"...
+    QByteArray source;                // "/dev/sda1", "server:/export"...
+    QByteArray mountPoint;            // "/home", "/mnt/data"...
+};
+
+// The mounted file systems; empty where there is no mountinfo.
+std::vector<MountEntry> mountTable();
+
+// What kind of storage each file system of a scan is on, which decides how
+// hard the scanner may push it:
+//
+// - Solid state disks, and anything in memory, answer many requests at
+//   once; every worker may read from them.
+// - Spinning disks serve one request at a time and pay for every seek, so
+//   a couple of workers read from one, in inode order.
+// - Network file systems take parallel requests but share the server with
+//   others; a few workers read from one.
+//
+// The kind comes from the block device's queue/rotational in sysfs, or for
+// file systems without one from the mount's type. Thread safe; each device
+// is looked at once.
+class DeviceProfiles
+{
+public:
+    enum Kind { Auto, Solid, Rotational, Network };
+
+    // Anything but Auto applies to every device, whatever it looks like.
+    explicit DeviceProfiles(Kind override = Auto);
+
+    // Never Auto; a device of 0, not known, counts as solid.
+    Kind kindOf(quint64 device);
+
+    // How many workers may read from one device of this kind at once.
+    static int readLimit(Kind kind, int threads);
+    // Whether to look at a directory's entries in inode order.
+    static bool readsInInodeOrder(Kind kind) { return kind == Rotational; }
+    // Whether a file system of this type keeps its files on another machine.
+    static bool isNetworkType(const QByteArray &type);
+    static Kind kindFromString(const QString &value);
+    static const char *kindName(Kind kind);
+
+private:
+    Kind detect(quint64 device) const;
+
+    const Kind m_override;
+    std::vector<MountEntry> m_mounts;
+    QMutex m_mutex;
+    QHash<quint64, Kind> m_kinds;
+};
+
+#endif // DEVICEPROFILES_H
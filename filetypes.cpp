@@ -0,0 +1,158 @@
+#include "filetypes.h"
+
+#include <cstring>
+#include <vector>
+
+// Extensions of each category, in FileCategory order and space separated; an extension listed twice
+// keeps its first place.
+static const char *const CATEGORY_EXTENSIONS[FILE_CATEGORY_COUNT] = {
+    "",
+    "jpg jpeg png gif bmp tiff ico",
+    "mp4 avi mkv mov wmv flv webm",
+    "mp3 wav aac ogg flac m4a",
+    "txt md log csv rtf",
+    "doc docx xls xlsx ppt pptx",
+    "pdf",
+    "zip 7z rar tar gz bz2 xz iso",
+    "cs cpp c java py js html css php rb go",
+    "dll bin dat sys",
+    "exe cmd com bat scr",
+    "db sql mdb accdb sqlite",
+    "svg eps ai",
+    "sh",
+    "conf ini cfg",
+    "out run appimage",
+};
+
+static const char *const CATEGORY_NAMES[FILE_CATEGORY_COUNT] = {
+    "Other files", "Images", "Video", "Audio", "Text", "Documents", "PDF", "Archives",
+    "Source code", "Libraries and data", "Executables", "Databases", "Vector graphics",
+    "Shell scripts", "Configuration", "Programs",
+};
+
+namespace {
+
+// Extensions of up to eight bytes, lower-cased and packed into an integer,
+// in a small open-addressing table: a lookup is a multiply and a compare
+// or two, with no allocation.
+class ExtensionTable
+{
+public:
+    ExtensionTable()
+        : m_slots(SLOT_COUNT)
+    {
+        m_types.push_back({OtherFiles, 0});
+        for (int category = 0; category < FILE_CATEGORY_COUNT; category++) {
+            int rank = 0;
+            for (const char *p = CATEGORY_EXTENSIONS[category]; *p;) {
+                const int length = int(strcspn(p, " "));
+                const quint64 key = pack(p, length);
+                if (key != 0 && find(key) == UnknownFileType) {
+                    Slot *slot = &m_slots[slotOf(key)];
+                    while (slot->key != 0)
+                        slot = &m_slots[(slot - m_slots.data() + 1) & (SLOT_COUNT - 1)];
+                    slot->key = key;
+                    slot->type = FileType(m_types.size());
+                    m_types.push_back({FileCategory(category), rank++});
+                }
+                p += length;
+                while (*p == ' ')
+                    p++;
+            }
+        }
+    }
+
+    FileType find(quint64 key) const
+    {
+        if (key == 0)
+            return UnknownFileType;
+        for (size_t slot = slotOf(key); m_slots[slot].key != 0; slot = (slot + 1) & (SLOT_COUNT - 1)) {
+            if (m_slots[slot].key == key)
+                return m_slots[slot].type;
+        }
+        return UnknownFileType;
+    }
+
+    // Zero for an extension that is empty or too long to be a known one.
+    static quint64 pack(const char *extension, int length)
+    {
+        if (length <= 0 || length > 8)
+            return 0;
+        quint64 key = 0;
+        for (int i = 0; i < length; i++) {
+            char c = extension[i];
+            if (c >= 'A' && c <= 'Z')
+                c += 'a' - 'A';
+            key = (key << 8) | static_cast<unsigned char>(c);
+        }
+        return key;
+    }
+
+    struct Info {
+        FileCategory category;
+        int rank;
+    };
+    int count() const { return int(m_types.size()); }
+    Info info(FileType type) const { return type < m_types.size() ? m_types[type] : m_types[0]; }
+
+private:
+    static const size_t SLOT_COUNT = 256;
+
+    struct Slot {
+        quint64 key = 0;
+        FileType type = UnknownFileType;
+    };
+
+    static size_t slotOf(quint64 key) { return size_t((key * 0x9e3779b97f4a7c15ull) >> 56); }
+
+    std::vector<Info> m_types;
+    std::vector<Slot> m_slots;
+};
+
+const ExtensionTable &table()
+{
+    static const ExtensionTable extensions;
+    return extensions;
+}
+
+} // namespace
+
+FileType fileTypeOf(const char *name, int length)
+{
+    for (int i = length - 1; i >= 0; i--) {
+        if (name[i] == '.')
+            return extensionType(name + i + 1, length - i - 1);
+    }
+    return UnknownFileType;
+}
+
+FileType extensionType(const char *extension, int length)
+{
+    return table().find(ExtensionTable::pack(extension, length));
+}
+
+int fileTypeCount()
+{
+    return table().count();
+}
+
+FileCategory fileCategory(FileType type)
+{
+    return table().info(type).category;
+}
+
+int fileTypeRank(FileType type)
+{
+    return table().info(type).rank;
+}
+
+QString categoryName(FileCategory category)
+{
+    return category < FILE_CATEGORY_COUNT ? QString(CATEGORY_NAMES[category]) : QString(CATEGORY_NAMES[0]);
+}
+
+bool isMediaType(FileType type)
+{
+    const FileCategory category = fileCategory(type);
+    return category == ImageFiles || category == VideoFiles || category == AudioFiles;
+}
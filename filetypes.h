@@ -0,0 +1,33 @@
+#ifndef FILETYPES_H
+#define FILETYPES_H
+
+#include <QString>
+
+// Files are classified by extension once, as they are added to a tree. A
+// FileType stands for one known extension, or 0 for any other; every type
+// belongs to a FileCategory such as images or archives, by which folders
+// keep the totals of their subtree.
+typedef quint8 FileType;
+typedef quint8 FileCategory;
+
+static const FileType UnknownFileType = 0;
+static const FileCategory OtherFiles = 0;
+static const FileCategory ImageFiles = 1;
+static const FileCategory VideoFiles = 2;
+static const FileCategory AudioFiles = 3;
+static const int FILE_CATEGORY_COUNT = 16;
+
+// The type of a file name, by whatever follows its last dot.
+FileType fileTypeOf(const char *name, int length);
+// The type of an extension given without the dot.
+FileType extensionType(const char *extension, int length);
+int fileTypeCount();
+
+FileCategory fileCategory(FileType type);
+// Where the type's extension is listed within its category, from 0.
+int fileTypeRank(FileType type);
+QString categoryName(FileCategory category);
+// Images, video and audio.
+bool isMediaType(FileType type);
+
+#endif // FILETYPES_H
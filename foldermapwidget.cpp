@@ -1,5 +1,9 @@
 #include "foldermapwidget.h"
+#include "searchindex.h"
+#include "snapshot.h"
+#include "trace.h"
 #include <QDir>
+#include <QFile>
 #include <QFileInfo>
 #include <QPainter>
 #include <QPainterPath>
@@ -8,96 +12,50 @@
 #include <QToolTip>
 #include <QMouseEvent>
 #include <QFontMetrics>
+#include <QDateTime>
 #include <QDebug>
 #include <algorithm>
 #include <QDesktopServices>
 #include <QUrl>
 #include <cmath>
+#include <cstdlib>
 #include <QApplication>
 #include <QCursor>
+#include <QElapsedTimer>
+#include <QEasingCurve>
+#include <QThread>
+#include <QtConcurrent/QtConcurrent>
+#include <numeric>
 
-// Adjustable Parameters
-static const int CORNER_ROUNDNESS = 3;
-static const double GAP_BETWEEN_ITEMS = 1.5;
-static const int EXTRA_SIDE_BUFFER = 2;
-static const int TOP_MARGIN_FOLDER_LABEL = 4;
-static const int SIDE_MARGIN_FOLDER_LABEL = 2;
-static const int BOTTOM_MARGIN_FOLDER_LABEL = 2;
-static const int FILE_FONT_SIZE = 5;
-static const int FOLDER_FONT_SIZE = 5;
-static const double ROLLUP_THRESHOLD = 3.0;
-
-// Color settings
-//static const QColor COLOR_ROLLUP = Qt::darkGray;
-static const QColor COLOR_ROLLUP = QColor(180, 180, 180);  // Softer gray
-
-#include <QColor>
-#include <QFileInfo>
-#include <QString>
-#include <vector>
+// Categories listed in a folder's tooltip.
+static const size_t BREAKDOWN_CATEGORIES = 5;
 
-#include <QColor>
-#include <QFileInfo>
-#include <QString>
-#include <vector>
-
-// Function to adjust color based on index
-static QColor adjustColor(QColor baseColor, int index, int variation = 20) {
-    int r = qBound(0, baseColor.red() + index * variation - 10, 255);
-    int g = qBound(0, baseColor.green() + index * variation - 10, 255);
-    int b = qBound(0, baseColor.blue() + index * variation - 10, 255);
-    return QColor(r, g, b);
-}
-
-// Extended File Type Coloring with Less Pastel Tones
-static QColor getFileTypeColor(const QString &filePath) {
-    QString ext = QFileInfo(filePath).suffix().toLower();
-
-    struct FileTypeGroup {
-        std::vector<QString> extensions;
-        QColor baseColor;
-    };
-
-    // Define file type groups with slightly richer colors
-    std::vector<FileTypeGroup> fileGroups = {
-        {{"jpg", "jpeg", "png", "gif", "bmp", "tiff", "ico"}, QColor(240, 180, 140)}, // Warmer Peach
-        {{"mp4", "avi", "mkv", "mov", "wmv", "flv", "webm"}, QColor(255, 225, 100)}, // Stronger Yellow
-        {{"mp3", "wav", "aac", "ogg", "flac", "m4a"}, QColor(200, 90, 200)}, // Richer Lavender
-        {{"txt", "md", "log", "csv", "rtf"}, QColor(180, 160, 180)}, // Deeper Lavender
-        {{"doc", "docx", "xls", "xlsx", "ppt", "pptx"}, QColor(100, 230, 100)}, // Deeper Green
-        {{"pdf"}, QColor(230, 200, 80)}, // Stronger Gold
-        {{"zip", "7z", "rar", "tar", "gz", "bz2", "xz", "iso"}, QColor(230, 210, 150)}, // Warmer Beige
-        {{"cs", "cpp", "c", "java", "py", "js", "html", "css", "php", "rb", "go"}, QColor(120, 170, 220)}, // Richer Blue
-        {{"dll", "bin", "dat", "sys"}, QColor(120, 200, 220)}, // Stronger Cyan
-        {{"exe", "cmd", "com", "bat", "scr"}, QColor(190, 60, 60)}, // Stronger Red
-        {{"db", "sql", "mdb", "accdb", "sqlite"}, QColor(100, 150, 100)}, // Deeper Sage
-        {{"svg", "eps", "ai"}, QColor(250, 120, 140)}, // Stronger Pink
-        {{"sh"}, QColor(80, 200, 80)}, // Vibrant Green
-        {{"conf", "ini", "cfg"}, QColor(190, 140, 80)}, // Deeper Tan
-        {{"out", "run", "appimage"}, QColor(90, 110, 140)}, // Deeper Blue Gray
-        {{"log"}, QColor(220, 110, 90)}, // Stronger Coral
-    };
-
-    // Search for the extension in the file groups
-    for (const auto &group : fileGroups) {
-        auto it = std::find(group.extensions.begin(), group.extensions.end(), ext);
-        if (it != group.extensions.end()) {
-            int index = std::distance(group.extensions.begin(), it);
-            return adjustColor(group.baseColor, index);
-        }
-    }
+// Size of one backing-store tile, in widget pixels.
+static const int TILE_SIZE = 256;
 
-    return QColor(100, 170, 220); // Default: Richer Sky Blue
-}
-
-static QColor getFolderDepthColor(int depth) {
-    double maxDepth = 10.0;
-    double factor = std::min(depth / maxDepth, 1.0);
-    int r = static_cast<int>(200 * (1 - factor) + 150 * factor);
-    int g = static_cast<int>(238 * (1 - factor) + 170 * factor);
-    int b = static_cast<int>(200 * (1 - factor) + 120 * factor);
-    return QColor(r, g, b);
-}
+// Progressive scan: how often partial results are published, and how long
+// the GUI thread may spend applying them per tick.
+static const int SCAN_PUBLISH_INTERVAL_MS = 100;
+static const int SCAN_APPLY_BUDGET_MS = 30;
+// Watching: change events are collected and applied in batches this far
+// apart, within the same kind of budget.
+static const int WATCH_INTERVAL_MS = 250;
+static const int WATCH_APPLY_BUDGET_MS = 20;
+// Scan focus: the largest folders on screen, read before the rest.
+static const int SCAN_FOCUS_FOLDERS = 16;
+// Search: the largest matches listed, and while a scan keeps changing the
+// tree, how often the index is built again.
+static const int SEARCH_LIST_SIZE = 100;
+static const int SEARCH_REFRESH_MS = 1000;
+// Comparing: the folders listed as having grown most.
+static const int GROWTH_LIST_SIZE = 100;
+// Zooming: how long it takes, how far into it the inner map has faded in,
+// and how many maps of folders next to the one shown are kept.
+static const int ZOOM_DURATION_MS = 250;
+static const qreal ZOOM_FADE = 0.3;
+static const size_t NEIGHBOUR_FRAMES = 3;
+// Quitting: how often to look whether a discarded scan has stopped.
+static const int STOP_POLL_MS = 10;
 
 void setBusyCursor() {
     QApplication::setOverrideCursor(Qt::WaitCursor);
@@ -107,371 +65,1266 @@ void restoreCursor() {
     QApplication::restoreOverrideCursor();
 }
 
-static void divideDisplayArea(QList<RenderItem> &items, int start, int count, const QRectF &area, double totalSize, double gap)
+FolderMapWidget::FolderMapWidget(QWidget *parent)
+    : QWidget(parent)
 {
-    double safeWidth = std::max(0.0, area.width());
-    double safeHeight = std::max(0.0, area.height());
-    QRectF safeArea(area.x(), area.y(), safeWidth, safeHeight);
+    setAutoFillBackground(true);
+    setMouseTracking(true);
 
-    if (count <= 0)
-        return;
-    if (count == 1) {
-        items[start].rect = safeArea;
+    m_scanTimer = new QTimer(this);
+    m_scanTimer->setInterval(SCAN_PUBLISH_INTERVAL_MS);
+    connect(m_scanTimer, &QTimer::timeout, this, &FolderMapWidget::publishScanProgress);
+
+    m_watchTimer = new QTimer(this);
+    m_watchTimer->setInterval(WATCH_INTERVAL_MS);
+    connect(m_watchTimer, &QTimer::timeout, this, &FolderMapWidget::applyFileChanges);
+
+    m_frameWatcher = new QFutureWatcher<MadeFrame>(this);
+    connect(m_frameWatcher, &QFutureWatcher<MadeFrame>::finished, this, &FolderMapWidget::frameReady);
+    m_layout.setCancelFlag(&m_cancelFrame);
+    m_nearLayout.setCancelFlag(&m_cancelFrame);
+
+    m_zoomAnimation = new QVariantAnimation(this);
+    m_zoomAnimation->setStartValue(0.0);
+    m_zoomAnimation->setEndValue(1.0);
+    m_zoomAnimation->setDuration(ZOOM_DURATION_MS);
+    m_zoomAnimation->setEasingCurve(QEasingCurve::OutCubic);
+    connect(m_zoomAnimation, &QVariantAnimation::valueChanged, this, &FolderMapWidget::stepZoom);
+    connect(m_zoomAnimation, &QVariantAnimation::finished, this, &FolderMapWidget::endZoom);
+
+    m_saveWatcher = new QFutureWatcher<bool>(this);
+    connect(m_saveWatcher, &QFutureWatcher<bool>::finished, this, &FolderMapWidget::snapshotSaved);
+
+    m_indexWatcher = new QFutureWatcher<std::shared_ptr<SearchIndex>>(this);
+    connect(m_indexWatcher, &QFutureWatcher<std::shared_ptr<SearchIndex>>::finished, this,
+            &FolderMapWidget::searchIndexBuilt);
+
+    // Before the trace is saved, and long before the statics the workers
+    // write to are destroyed.
+    connect(qApp, &QCoreApplication::aboutToQuit, this, &FolderMapWidget::stopScans);
+}
+
+FolderMapWidget::~FolderMapWidget()
+{
+    waitForFrame();
+    waitForSave();
+    if (m_importer)
+        QApplication::restoreOverrideCursor();
+    stopScans();
+}
+
+void FolderMapWidget::setScanOptions(const ScanOptions &options)
+{
+    m_scanOptions = options;
+}
+
+void FolderMapWidget::setSquarified(bool squarified)
+{
+    waitForFrame();
+    m_layout.setSquarified(squarified);
+    m_nearLayout.setSquarified(squarified);
+    m_style++;
+    m_hoverItem = -1;
+    update();
+}
+
+void FolderMapWidget::setStatsVisible(bool visible)
+{
+    m_showStats = visible;
+    update();
+}
+
+void FolderMapWidget::setSearch(const QString &text)
+{
+    waitForFrame();
+    QString error;
+    m_query = SearchQuery::parse(text, &error);
+    m_searching = !m_query.isEmpty();
+    m_searchPending = m_searching;
+    m_search = SearchResult();
+    // Half typed queries are often wrong; the index is kept for the next.
+    if (text.trimmed().isEmpty())
+        m_searchIndex.clear();
+    if (!m_searching)
+        emit searchUpdated(error, QStringList());
+    m_style++;
+    update();
+}
+
+void FolderMapWidget::revealMatch(int row)
+{
+    if (!m_tree || row < 0 || row >= int(m_search.largest().size()))
         return;
+    setRootFolder(m_tree->file(m_search.largest()[row]).parent);
+}
+
+// Brings the search up to date with the tree; true if the result changed.
+// A stale index is built again on the pool, and the search follows once it
+// is. While a scan runs the tree changes on every tick, so the index is
+// only built again every SEARCH_REFRESH_MS then.
+bool FolderMapWidget::updateSearch()
+{
+    if (!m_searching)
+        return false;
+    if (!m_searchIndex.isCurrent(*m_tree)) {
+        if (!m_indexing && (m_searchPending || m_scanners.empty() || m_searchClock.elapsed() >= SEARCH_REFRESH_MS))
+            buildSearchIndex();
+        return false;
     }
-    int groupACount = 0;
-    double sizeA = 0;
-    int i = start;
-    sizeA += items[i].size;
-    groupACount++;
-    i++;
-    while (i < start + count && (sizeA + items[i].size) * 2 < totalSize && items[i].size > 0) {
-        sizeA += items[i].size;
-        groupACount++;
-        i++;
+    if (!m_searchPending)
+        return false;
+    runSearch();
+    return true;
+}
+
+// Searches the current index, which takes milliseconds, and lists the
+// largest matches.
+void FolderMapWidget::runSearch()
+{
+    TraceSpan span("search", "search");
+    m_search = m_searchIndex.search(*m_tree, m_tree->root(), m_query, SEARCH_LIST_SIZE);
+    m_searchPending = false;
+    QStringList largest;
+    for (FileIndex file : m_search.largest())
+        largest.append(formatFileSize(m_tree->file(file).size) + "  " + m_tree->filePath(file));
+    emit searchUpdated(QString("%1 matching files, %2, found in %3 ms")
+                           .arg(m_search.count())
+                           .arg(formatFileSize(m_search.bytes()))
+                           .arg(m_search.elapsedMs(), 0, 'f', 1),
+                       largest);
+}
+
+void FolderMapWidget::buildSearchIndex()
+{
+    m_indexing = m_tree;
+    const std::shared_ptr<const FolderTree> tree = m_tree;
+    m_indexWatcher->setFuture(QtConcurrent::run([tree] {
+        TraceSpan span("search index", "search");
+        auto index = std::make_shared<SearchIndex>();
+        index->build(*tree);
+        return index;
+    }));
+}
+
+// Takes the new index, unless the tree or the search went away meanwhile,
+// and searches it right away unless a frame is being made, which reads the
+// result; the next request then does.
+void FolderMapWidget::searchIndexBuilt()
+{
+    if (!m_indexing)
+        return;
+    const std::shared_ptr<SearchIndex> built = m_indexWatcher->result();
+    const bool current = m_indexing == m_tree && m_searching;
+    m_indexing.reset();
+    if (!current)
+        return;
+    m_searchIndex = std::move(*built);
+    m_searchClock.start();
+    m_searchPending = true;
+    if (!m_making) {
+        runSearch();
+        m_style++;
     }
-    int groupBCount = count - groupACount;
-    double sizeB = totalSize - sizeA;
+    update();
+}
 
-    bool horizontalSplit = safeWidth >= safeHeight;
-    if (horizontalSplit) {
-        double effectiveWidth = std::max(0.0, safeWidth - gap);
-        double mid = (totalSize > 0) ? (sizeA / totalSize) * effectiveWidth : effectiveWidth / 2.0;
-        QRectF areaA(safeArea.x(), safeArea.y(), std::max(0.0, mid), safeHeight);
-        QRectF areaB(safeArea.x() + mid + gap, safeArea.y(), std::max(0.0, safeWidth - mid - gap), safeHeight);
-        divideDisplayArea(items, start, groupACount, areaA, sizeA, gap);
-        divideDisplayArea(items, start + groupACount, groupBCount, areaB, sizeB, gap);
+// Waits until the index being built, if any, is done, before the tree
+// changes.
+void FolderMapWidget::waitForSearchIndex()
+{
+    if (!m_indexing)
+        return;
+    TraceSpan span("wait for search index", "search");
+    m_indexWatcher->waitForFinished();
+    searchIndexBuilt();
+}
+
+QString FolderMapWidget::scanRootPath() const
+{
+    if (!m_tree || m_tree->isEmpty())
+        return QString();
+    return m_tree->folderPath(m_tree->root());
+}
+
+bool FolderMapWidget::compareWith(const QString &snapshotFile)
+{
+    std::shared_ptr<Snapshot> snapshot = Snapshot::open(snapshotFile);
+    if (!snapshot || !m_tree)
+        return false;
+    waitForFrame();
+    std::shared_ptr<FolderTree> before = std::make_shared<FolderTree>();
+    before->adopt(snapshot);
+    // Tried right away, so a snapshot of other folders is turned down.
+    SnapshotDiff diff;
+    if (!diff.compare(*before, *m_tree))
+        return false;
+    m_before = before;
+    m_beforeSavedAt = snapshot->savedAt();
+    // Half a tree would look as if most of it had gone; a running scan's
+    // is compared once it is done.
+    if (m_scanners.empty()) {
+        m_diff = std::move(diff);
+        m_diffVersion = m_tree->version();
+        m_diffPending = false;
+        publishComparison();
     } else {
-        double effectiveHeight = std::max(0.0, safeHeight - gap);
-        double mid = (totalSize > 0) ? (sizeA / totalSize) * effectiveHeight : effectiveHeight / 2.0;
-        QRectF areaA(safeArea.x(), safeArea.y(), safeWidth, std::max(0.0, mid));
-        QRectF areaB(safeArea.x(), safeArea.y() + mid + gap, safeWidth, std::max(0.0, safeHeight - mid - gap));
-        divideDisplayArea(items, start, groupACount, areaA, sizeA, gap);
-        divideDisplayArea(items, start + groupACount, groupBCount, areaB, sizeB, gap);
+        m_diff.clear();
+        m_diffPending = true;
     }
+    m_style++;
+    update();
+    return true;
 }
 
-FolderMapWidget::FolderMapWidget(QWidget *parent)
-    : QWidget(parent)
+void FolderMapWidget::clearComparison()
 {
-    setAutoFillBackground(true);
-    setMouseTracking(true);
+    waitForFrame();
+    m_before.reset();
+    m_diff.clear();
+    m_diffPending = false;
+    if (m_renderer)
+        m_renderer->setDiff(nullptr);
+    emit comparisonUpdated(QString(), QStringList());
+    m_style++;
+    update();
 }
 
-#include <QtConcurrent/QtConcurrent>
+void FolderMapWidget::revealGrowth(int row)
+{
+    if (!m_tree || !m_before)
+        return;
+    const std::vector<NodeIndex> grown = m_diff.grownFolders(GROWTH_LIST_SIZE);
+    if (row >= 0 && row < int(grown.size()))
+        setRootFolder(grown[row]);
+}
+
+// Compares the tree with the earlier scan again once it has changed; true
+// if the result changed. Not while a scan runs, as above.
+bool FolderMapWidget::updateComparison()
+{
+    if (!m_before || !m_scanners.empty() || (!m_diffPending && m_diffVersion == m_tree->version()))
+        return false;
+    m_diffPending = false;
+    m_diffVersion = m_tree->version();
+    m_diff.compare(*m_before, *m_tree);
+    publishComparison();
+    return true;
+}
+
+void FolderMapWidget::publishComparison()
+{
+    if (m_diff.top() == NoIndex) {
+        emit comparisonUpdated("Not the same folders as the earlier scan", QStringList());
+        return;
+    }
+    QStringList grown;
+    for (NodeIndex folder : m_diff.grownFolders(GROWTH_LIST_SIZE))
+        grown.append("+" + formatFileSize(m_diff.folderDelta(folder)) + "  " + m_tree->folderPath(folder));
+    emit comparisonUpdated(QString("Since %1: %2 files added, %3; %4 removed, %5; compared in %6 ms")
+                               .arg(QDateTime::fromMSecsSinceEpoch(m_beforeSavedAt).toString("yyyy-MM-dd hh:mm"))
+                               .arg(m_diff.addedFiles())
+                               .arg(formatFileSize(m_diff.addedBytes()))
+                               .arg(m_diff.removedFiles())
+                               .arg(formatFileSize(m_diff.removedBytes()))
+                               .arg(m_diff.elapsedMs(), 0, 'f', 1),
+                           grown);
+}
+
+// Starts over with tree, dropping whatever was about the last one.
+void FolderMapWidget::resetTree(const std::shared_ptr<FolderTree> &tree)
+{
+    waitForFrame();
+    // The previous scans, if any, stop without holding up the new one.
+    dropScanners();
+    m_importer.reset();
+    m_generation++;
+    m_watchTimer->stop();
+    m_watcher.reset();
+    m_treeChanged = false;
+    m_imported = false;
+    m_scanStats = ScanStats();
+    m_tree = tree;
+    // The new tree may well sit where the old one did, so isCurrent()
+    // can't tell them apart.
+    m_searchIndex.clear();
+    m_searchPending = m_searching;
+    m_search = SearchResult();
+    // A comparison goes on with the new tree, if it is of the same folders.
+    m_diff.clear();
+    m_diffPending = true;
+    m_layout.invalidate();
+    m_nearLayout.invalidate();
+    if (m_renderer) {
+        m_renderer->clearLabels();
+        m_renderer->setDiff(nullptr);
+    }
+    // Its items are of the old tree.
+    m_shown.reset();
+    m_hoverItem = -1;
+    endZoom();
+    m_neighbours.clear();
+    m_zoomTarget = NoIndex;
+}
 
 void FolderMapWidget::buildFolderTree(const QString &path)
 {
-    QApplication::setOverrideCursor(Qt::WaitCursor); // Set busy cursor
+    if (m_importer)
+        QApplication::restoreOverrideCursor();
+    resetTree(std::make_shared<FolderTree>());
+    std::unique_ptr<FolderScanner> scanner(new FolderScanner(m_scanOptions));
+    // A saved snapshot is shown right away and checked in the background;
+    // without one, scan from scratch.
+    std::shared_ptr<Snapshot> snapshot;
+    if (m_scanOptions.useSnapshots && !m_scanOptions.summarizes())
+        snapshot = Snapshot::open(Snapshot::fileFor(path));
+    if (snapshot && snapshot->rootPath() == path) {
+        m_tree->adopt(snapshot);
+        scanner->revalidate(*m_tree, snapshot);
+    } else {
+        scanner->start(path, *m_tree);
+    }
+    addScanner(std::move(scanner));
+    rootFolder = m_tree->root();
+    emit rootFolderChanged(path);
+    update();
+}
 
-    QtConcurrent::run([this, path]() {
-        rootFolder = buildFolderTreeRecursive(path);
+void FolderMapWidget::importListing(const QString &fileName)
+{
+    // The tree on screen stays until the new one is complete, but no
+    // longer changes.
+    dropScanners();
+    m_watchTimer->stop();
+    m_watcher.reset();
+    if (!m_importer)
+        QApplication::setOverrideCursor(Qt::BusyCursor);
+    m_importer.reset(new ListingImporter(m_scanOptions.threadCount));
+    if (!m_importer->start(fileName)) {
+        emit scanFinished(m_importer->errorString());
+        m_importer.reset();
+        QApplication::restoreOverrideCursor();
+        return;
+    }
+    m_scanTimer->start();
+}
 
-        QMetaObject::invokeMethod(this, [this]() {
-            if (rootFolder)
-                emit rootFolderChanged(rootFolder->path);
+// Reports how far the import got, and once it is done shows its tree.
+void FolderMapWidget::publishImportProgress()
+{
+    ScanStats stats = m_importer->stats();
+    if (!m_importer->isFinished()) {
+        m_scanStats = stats;
+        emit scanProgress(stats.summary());
+        if (m_showStats)
             update();
-            QApplication::restoreOverrideCursor(); // Restore cursor on UI thread
-        }, Qt::QueuedConnection);
+        return;
+    }
+    m_scanTimer->stop();
+    QApplication::restoreOverrideCursor();
+    const std::shared_ptr<FolderTree> tree = m_importer->takeTree();
+    const QString error = m_importer->errorString();
+    m_importer.reset();
+    if (!tree) {
+        emit scanFinished(error);
+        return;
+    }
+    resetTree(tree);
+    m_imported = true;
+    m_scanStats = stats;
+    rootFolder = m_tree->root();
+    emit rootFolderChanged(m_tree->folderPath(rootFolder));
+    emit scanFinished(stats.summary());
+    update();
+}
+
+void FolderMapWidget::addScanner(std::unique_ptr<FolderScanner> scanner)
+{
+    // The map stays usable while the scan runs, so show a busy arrow
+    // rather than a wait cursor.
+    if (m_scanners.empty())
+        QApplication::setOverrideCursor(Qt::BusyCursor);
+    m_scanners.push_back({std::move(scanner), m_generation});
+    m_scanFocus.clear();
+    m_scanTimer->start();
+}
+
+// Cancels a scan, or lets go of a finished one. Its worker threads finish
+// the directory they are reading and are joined on a thread of their own,
+// so neither the GUI nor the thread pool, which lays out and renders the
+// map, waits for a slow disk.
+void FolderMapWidget::discardScanner(std::unique_ptr<FolderScanner> scanner)
+{
+    reapScanners(false);
+    scanner->cancel();
+    DiscardedScan discarded;
+    discarded.stopped = std::make_shared<std::atomic<bool>>(false);
+    FolderScanner *running = scanner.get();
+    const std::shared_ptr<std::atomic<bool>> stopped = discarded.stopped;
+    discarded.stopping = std::thread([running, stopped] {
+        running->stop();
+        *stopped = true;
+    });
+    discarded.scanner = std::move(scanner);
+    m_discarded.push_back(std::move(discarded));
+}
+
+// Deletes the discarded scans that have stopped. Quitting waits for the
+// others as well, except for those stuck in a read on a hung mount, which
+// may never return; they are left running.
+void FolderMapWidget::reapScanners(bool quitting)
+{
+    for (auto it = m_discarded.begin(); it != m_discarded.end();) {
+        while (quitting && !*it->stopped && !it->scanner->hasHungReads())
+            QThread::msleep(STOP_POLL_MS);
+        if (*it->stopped) {
+            it->stopping.join();
+        } else if (quitting) {
+            it->stopping.detach();
+            it->scanner.release();
+        } else {
+            ++it;
+            continue;
+        }
+        it = m_discarded.erase(it);
+    }
+}
+
+// Stops every scan before the application quits.
+void FolderMapWidget::stopScans()
+{
+    dropScanners();
+    reapScanners(true);
+}
+
+void FolderMapWidget::dropScanners()
+{
+    if (m_scanners.empty())
+        return;
+    for (RunningScan &running : m_scanners)
+        discardScanner(std::move(running.scanner));
+    m_scanners.clear();
+    m_scanFocus.clear();
+    QApplication::restoreOverrideCursor();
+}
+
+// Points the running scans at what is on screen: the shown folder first,
+// and within it the folders with the largest tiles, so the visible part of
+// the map settles before folders that are off screen or too small to see.
+void FolderMapWidget::updateScanFocus()
+{
+    if (m_scanners.empty() || rootFolder == NoIndex || !m_shown || width() <= 0 || height() <= 0)
+        return;
+    std::vector<const LayoutItem *> folders;
+    for (const LayoutItem &item : m_shown->items) {
+        if (item.isFolder && !item.isRollup && item.index != rootFolder)
+            folders.push_back(&item);
+    }
+    const size_t count = std::min<size_t>(folders.size(), SCAN_FOCUS_FOLDERS);
+    std::partial_sort(folders.begin(), folders.begin() + count, folders.end(),
+                      [](const LayoutItem *a, const LayoutItem *b) {
+        return a->rect.width() * a->rect.height() > b->rect.width() * b->rect.height();
     });
+    folders.resize(count);
+
+    std::vector<NodeIndex> nodes(1, rootFolder);
+    for (const LayoutItem *item : folders)
+        nodes.push_back(item->index);
+    if (nodes == m_scanFocus)
+        return;
+    m_scanFocus = nodes;
+
+    // Weight 1 below the shown folder, more below the bigger tiles.
+    const qreal viewArea = qreal(width()) * height();
+    std::vector<ScanFocus> focus;
+    focus.push_back({m_tree->folderPath(rootFolder), 1.0f});
+    for (const LayoutItem *item : folders)
+        focus.push_back({m_tree->folderPath(item->index), float(1 + item->rect.width() * item->rect.height() / viewArea)});
+    for (RunningScan &running : m_scanners)
+        running.scanner->setFocus(focus);
 }
 
-std::shared_ptr<FolderNode> FolderMapWidget::buildFolderTreeRecursive(const QString &path)
+// Applies whatever the scanners have read since the last tick. The tree is
+// only ever modified here, on the GUI thread, so every paint sees a
+// consistent tree while the scanner threads keep reading.
+void FolderMapWidget::publishScanProgress()
 {
-    auto node = std::make_shared<FolderNode>();
-    node->path = path;
-    QDir dir(path);
-    if (!dir.exists()) {
-        qDebug() << "Directory does not exist:" << path;
-        return node;
+    if (m_importer) {
+        publishImportProgress();
+        return;
     }
-    QFileInfoList fileInfos = dir.entryInfoList(QDir::Files | QDir::NoDotAndDotDot);
-    for (const QFileInfo &fi : fileInfos) {
-        if (fi.size() >= 100) {
-            node->files.append(qMakePair(fi.absoluteFilePath(), fi.size()));
-            node->totalSize += fi.size();
+    if (m_scanners.empty()) {
+        m_scanTimer->stop();
+        return;
+    }
+    // The next tick, then; the results keep meanwhile.
+    if (m_making || m_saving || m_indexing)
+        return;
+    const int budget = SCAN_APPLY_BUDGET_MS / int(m_scanners.size());
+    QString finished;
+    for (auto it = m_scanners.begin(); it != m_scanners.end();) {
+        FolderScanner &scanner = *it->scanner;
+        if (it->generation != m_generation) {
+            discardScanner(std::move(it->scanner));
+            it = m_scanners.erase(it);
+        } else if (scanner.applyPending(*m_tree, budget)) {
+            m_scanStats = scanner.stats();
+            finished = m_scanStats.summary();
+            qDebug() << finished;
+            m_treeChanged = m_treeChanged || scanner.changedTree();
+            // A worker may still be stuck in a read given up on.
+            discardScanner(std::move(it->scanner));
+            it = m_scanners.erase(it);
+        } else {
+            ++it;
         }
     }
-    QFileInfoList dirInfos = dir.entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot);
-    for (const QFileInfo &di : dirInfos) {
-        auto child = buildFolderTreeRecursive(di.absoluteFilePath());
-        if (child && child->totalSize > 0) {
-            node->subFolders.append(child);
-            node->totalSize += child->totalSize;
+    if (m_scanners.empty()) {
+        m_scanTimer->stop();
+        if (m_treeChanged && m_scanOptions.useSnapshots)
+            saveSnapshot();
+        m_treeChanged = false;
+        if (m_scanOptions.summarizes())
+            showDetail(rootFolder);
+        if (m_scanOptions.watchChanges && !m_scanOptions.summarizes()) {
+            if (!m_watcher)
+                m_watcher.reset(new FolderWatcher(m_scanOptions));
+            m_watcher->watch(*m_tree);
+            m_watchTimer->start();
         }
+        emit scanFinished(finished);
+        QApplication::restoreOverrideCursor();
+    } else {
+        m_scanStats = m_scanners.back().scanner->stats();
+        emit scanProgress(m_scanStats.summary());
+        updateScanFocus();
+    }
+    Trace::counter("folders scanned", m_scanStats.dirs);
+    Trace::counter("files scanned", m_scanStats.files);
+    update();
+}
+
+// Writes the snapshot of the tree on the pool, which can take a while for
+// a large one; the tree is held in case it is replaced meanwhile.
+void FolderMapWidget::saveSnapshot()
+{
+    // One at a time, as the next may well be of the same file.
+    waitForSave();
+    m_saving = true;
+    const std::shared_ptr<const FolderTree> tree = m_tree;
+    const QString fileName = Snapshot::fileFor(m_tree->folderPath(m_tree->root()));
+    m_saveWatcher->setFuture(QtConcurrent::run([tree, fileName] { return Snapshot::save(*tree, fileName); }));
+}
+
+void FolderMapWidget::snapshotSaved()
+{
+    if (!m_saving)
+        return;
+    m_saving = false;
+}
+
+// Waits until the snapshot being written, if any, is done, before the tree
+// changes.
+void FolderMapWidget::waitForSave()
+{
+    if (!m_saving)
+        return;
+    TraceSpan span("wait for snapshot", "snapshot");
+    m_saveWatcher->waitForFinished();
+    snapshotSaved();
+}
+
+// Brings the tree up to date with what changed on disk. Only the changed
+// folders and their ancestors get a new layout; new subfolders are scanned
+// like a zoom-out's siblings, and the watcher waits while any scan writes
+// to the tree.
+void FolderMapWidget::applyFileChanges()
+{
+    if (!m_watcher)
+        return;
+    if (!m_scanners.empty() || m_making || m_saving || m_indexing) {
+        m_watcher->readEvents();
+        return;
+    }
+    std::vector<NodeIndex> newFolders;
+    if (m_watcher->update(*m_tree, WATCH_APPLY_BUDGET_MS, newFolders))
+        update();
+    for (NodeIndex folder : newFolders) {
+        std::unique_ptr<FolderScanner> scanner(new FolderScanner(m_scanOptions));
+        scanner->startAt(*m_tree, folder);
+        addScanner(std::move(scanner));
     }
-    return node;
 }
 
 void FolderMapWidget::paintEvent(QPaintEvent *event)
 {
-    Q_UNUSED(event);
-    m_renderItems.clear();
+    TraceSpan span("paint", "paint");
+    QElapsedTimer timer;
+    timer.start();
     QPainter painter(this);
-    painter.setRenderHint(QPainter::Antialiasing);
 
-    if (!rootFolder)
+    if (!m_tree || rootFolder == NoIndex)
         return;
 
-    // Define the outermost folder rectangle with margins
-    QRectF outerRect = rect().adjusted(1, 1, -1, -1);
+    // A resize ends a zoom; its tiles are of the old size.
+    if (isZooming() && size() != m_shownKey.size)
+        endZoom();
+    if (isZooming()) {
+        drawZoom(painter);
+        if (m_showStats)
+            drawStats(painter);
+        m_frame.paintMs = timer.nsecsElapsed() / 1e6;
+        return;
+    }
 
-    painter.setPen(QColor(150, 150, 150));
-    QPainterPath outerPath;
-    outerPath.addRoundedRect(outerRect, CORNER_ROUNDNESS, CORNER_ROUNDNESS);
-    painter.fillPath(outerPath, painter.brush());
-    painter.drawPath(outerPath);
+    requestFrame();
+    // Until the first frame of a tree is done there is nothing to show.
+    if (!m_shown)
+        return;
+    updateTiles();
+    for (int tile = 0; tile < int(m_tiles.size()); tile++) {
+        const QRect area = tileRect(tile);
+        if (event->rect().intersects(area))
+            painter.drawImage(area.topLeft(), m_tiles[tile]);
+    }
 
-    // Draw the root folder name label inside the outer rectangle
-    QFont originalFont = painter.font();
-    QFont folderLabelFont = originalFont;
-    folderLabelFont.setBold(true);
-    folderLabelFont.setPointSize(FOLDER_FONT_SIZE + 2);
-    painter.setFont(folderLabelFont);
+    // Hover highlight, drawn over the tiles so moving the mouse never
+    // re-renders the map.
+    const int hover = m_hoverItem;
+    if (hover >= 0 && hover < int(m_shown->items.size())) {
+        painter.setRenderHint(QPainter::Antialiasing);
+        QPainterPath path;
+        path.addRoundedRect(m_shown->items[hover].rect.adjusted(0.5, 0.5, -0.5, -0.5), 3, 3);
+        painter.fillPath(path, QColor(255, 255, 255, 70));
+        painter.setPen(QPen(QColor(40, 40, 40), 1.5));
+        painter.drawPath(path);
+    }
+    if (m_showStats)
+        drawStats(painter);
+    m_frame.paintMs = timer.nsecsElapsed() / 1e6;
+}
 
-    QFontMetrics fm(painter.font());
-    QString folderName = QFileInfo(rootFolder->path).fileName();
-    if (folderName.isEmpty())
-        folderName = rootFolder->path;
-    QString elidedText = fm.elidedText(folderName, Qt::ElideRight, static_cast<int>(outerRect.width() - 20));
+void FolderMapWidget::drawStats(QPainter &painter)
+{
+    QString text = QString("Tree: %1 folders, %2 files, %3 MiB\n"
+                           "Layout: %4 ms, %5 items\nPrepare: %6 ms, %7 frames dropped\n"
+                           "Render: %8 ms, %9 tiles\nPaint: %10 ms")
+                       .arg(m_tree->folderCount())
+                       .arg(m_tree->fileCount())
+                       .arg(m_tree->memoryUsage() / (1024.0 * 1024.0), 0, 'f', 1)
+                       .arg(m_frame.layoutMs, 0, 'f', 2)
+                       .arg(m_shown->items.size())
+                       .arg(m_frame.prepareMs, 0, 'f', 2)
+                       .arg(m_frame.dropped)
+                       .arg(m_frame.renderMs, 0, 'f', 2)
+                       .arg(m_frame.tiles)
+                       .arg(m_frame.paintMs, 0, 'f', 2);
+    if (m_searching)
+        text += QString("\nSearch: %1 ms, index %2 ms, %3 MiB")
+                    .arg(m_search.elapsedMs(), 0, 'f', 2)
+                    .arg(m_searchIndex.buildMs(), 0, 'f', 1)
+                    .arg(m_searchIndex.memoryUsage() / (1024.0 * 1024.0), 0, 'f', 1);
+    if (m_before)
+        text += QString("\nCompare: %1 ms, %2 folders, %3 skipped, %4 MiB")
+                    .arg(m_diff.elapsedMs(), 0, 'f', 2)
+                    .arg(m_diff.foldersCompared())
+                    .arg(m_diff.foldersSkipped())
+                    .arg(m_diff.memoryUsage() / (1024.0 * 1024.0), 0, 'f', 1);
+    if (m_watcher)
+        text += QString("\nWatching: %1 folders, %2 polled").arg(m_watcher->watchedCount()).arg(m_watcher->polledCount());
+    text += "\n\n" + m_scanStats.details();
 
-    QRectF labelRect(outerRect.left() + SIDE_MARGIN_FOLDER_LABEL,
-                     outerRect.top() + TOP_MARGIN_FOLDER_LABEL,
-                     outerRect.width() - 2 * SIDE_MARGIN_FOLDER_LABEL,
-                     fm.height());
-    painter.setPen(Qt::black);
-    painter.drawText(labelRect, Qt::AlignCenter, elidedText);
+    painter.setRenderHint(QPainter::Antialiasing);
+    const QRect bounds = rect().adjusted(8, 8, -8, -8);
+    QRect area = painter.boundingRect(bounds, Qt::AlignRight | Qt::AlignTop, text);
+    area.adjust(-6, -4, 6, 4);
+    painter.setPen(Qt::NoPen);
+    painter.setBrush(QColor(0, 0, 0, 170));
+    painter.drawRoundedRect(area, 4, 4);
+    painter.setPen(Qt::white);
+    painter.drawText(bounds, Qt::AlignRight | Qt::AlignTop, text);
+}
 
-    // Adjust the inner area (treemap) so it doesn't overlap the label
-    QRectF treeRect = outerRect.adjusted(10, fm.height() + 10, -10, -10);
+FolderMapWidget::FrameKey FolderMapWidget::frameKey() const
+{
+    FrameKey key;
+    key.generation = m_generation;
+    key.root = rootFolder;
+    key.version = m_tree->version();
+    key.style = m_style;
+    key.size = size();
+    key.ratio = devicePixelRatioF();
+    return key;
+}
 
-    // Render the inner folder map starting at depth 1 so inner folders get a different shade
-    renderFolderMap(painter, rootFolder, treeRect, 1);
+// Whether a frame made for key would look as one made now does, if it
+// were of the same folder and the tree hadn't changed since.
+bool FolderMapWidget::sameView(const FrameKey &key) const
+{
+    return key.generation == m_generation && key.style == m_style && key.size == size() &&
+           key.ratio == devicePixelRatioF();
 }
 
-// Function to format file sizes in a human-readable format
-static QString formatFileSize(qint64 size) {
-    if (size < 1024) return QString::number(size) + " B";
-    double kb = size / 1024.0;
-    if (kb < 1024) return QString::number(kb, 'f', 1) + " KB";
-    double mb = kb / 1024.0;
-    if (mb < 1024) return QString::number(mb, 'f', 1) + " MB";
-    double gb = mb / 1024.0;
-    return QString::number(gb, 'f', 1) + " GB";
+// The area of a tile in a map of size, with its tiles in columns.
+static QRect tileArea(int tile, int columns, const QSize &size) {
+    const int x = (tile % columns) * TILE_SIZE;
+    const int y = (tile / columns) * TILE_SIZE;
+    return QRect(x, y, std::min(TILE_SIZE, size.width() - x), std::min(TILE_SIZE, size.height() - y));
 }
 
+// Draws what of frame lies in area into image, which is made first if null.
+static void paintTile(QImage &image, const TreemapRenderer &renderer, const TreemapFrame &frame, const QRect &area,
+                      qreal ratio, const QColor &background) {
+    if (image.isNull()) {
+        image = QImage(area.size() * ratio, QImage::Format_ARGB32_Premultiplied);
+        image.setDevicePixelRatio(ratio);
+    }
+    image.fill(background);
+    QPainter painter(&image);
+    painter.setRenderHint(QPainter::Antialiasing);
+    painter.translate(-area.topLeft());
+    painter.setClipRect(area);
+    renderer.render(painter, frame, area);
+}
 
-void FolderMapWidget::renderFolderMap(QPainter &painter, const std::shared_ptr<FolderNode> &node, const QRectF &rect, int depth)
+// Starts making a frame of the view as it is now, unless the one shown or
+// the one being made is of it already. One being made of an older view,
+// such as before a resize, is called off, and the next paint after it has
+// stopped starts over with the newest. Once the view is up to date, the
+// maps of the folders next to it are made.
+void FolderMapWidget::requestFrame()
 {
-    QList<RenderItem> items;
-    for (const auto &sub : node->subFolders)
-        items.append({sub->path, sub->totalSize, true, sub, QRectF()});
-    for (const auto &file : node->files)
-        items.append({file.first, file.second, false, nullptr, QRectF()});
-    if (items.isEmpty()) {
-        qDebug() << "No items to render for node:" << node->path;
+    if (m_making) {
+        // The map of a neighbour gives way to the view, and to the map of
+        // another neighbour once the mouse has moved on.
+        const bool stale = m_makingNeighbour
+                               ? !(m_shown && m_shownKey == frameKey()) || (m_makingKey.root != m_zoomTarget &&
+                                                                            m_makingKey.root != m_tree->node(rootFolder).parent)
+                               : !(m_makingKey == frameKey());
+        if (stale)
+            m_cancelFrame = true;
         return;
     }
-    std::sort(items.begin(), items.end(), [](const RenderItem &a, const RenderItem &b) {
-        return a.size > b.size;
-    });
-    qint64 total = 0;
-    for (const auto &item : items)
-        total += item.size;
-    double gap = GAP_BETWEEN_ITEMS;
-    divideDisplayArea(items, 0, items.size(), rect, total, gap);
-
-    // --- Rollup small items ---
-    QList<RenderItem> tinyItems;
-    for (int i = items.size() - 1; i >= 0; i--) {
-        const RenderItem &it = items.at(i);
-        if (it.rect.width() < ROLLUP_THRESHOLD || it.rect.height() < ROLLUP_THRESHOLD) {
-            tinyItems.append(it);
-            items.removeAt(i);
-        }
+    // Nothing reads them now, so the search and the comparison may change.
+    if (updateSearch())
+        m_style++;
+    if (updateComparison())
+        m_style++;
+    const FrameKey key = frameKey();
+    if (m_shown && key == m_shownKey) {
+        requestNeighbour();
+        return;
+    }
+    if (key.size.isEmpty())
+        return;
+    startFrame(key, false);
+}
+
+// Starts making the map of the folder a double click would zoom into, or
+// else of the parent of the one shown, unless it is at hand already. While
+// a scan changes the tree all the time, an older map will do for a zoom.
+void FolderMapWidget::requestNeighbour()
+{
+    if (m_making || isZooming() || !m_tree || rootFolder == NoIndex || !m_shown || !(m_shownKey == frameKey()))
+        return;
+    m_neighbours.erase(std::remove_if(m_neighbours.begin(), m_neighbours.end(),
+                                      [this](const Neighbour &near) { return !sameView(near.key); }),
+                       m_neighbours.end());
+    const NodeIndex roots[] = {m_zoomTarget, m_tree->node(rootFolder).parent};
+    for (const NodeIndex root : roots) {
+        if (root == NoIndex || root == rootFolder)
+            continue;
+        const Neighbour *near = neighbour(root);
+        if (near && (near->key.version == m_tree->version() || !m_scanners.empty()))
+            continue;
+        FrameKey key = frameKey();
+        key.root = root;
+        startFrame(key, true);
+        return;
+    }
+}
+
+// Lays out and prepares the frame for key on the pool thread: of the view,
+// with the layout of the view, or of a neighbour, with a layout of its own
+// and drawn into tiles as well.
+void FolderMapWidget::startFrame(const FrameKey &key, bool neighbour)
+{
+    // Fonts and labels are kept between frames; only a new font or pixel
+    // ratio starts over.
+    if (!m_renderer || m_renderer->font() != font() || m_renderer->ratio() != key.ratio) {
+        m_renderer.reset(new TreemapRenderer(font(), key.ratio));
+        m_neighbours.clear();
     }
-    if (!tinyItems.isEmpty()) {
-        int rollupCount = tinyItems.size();
-        qint64 rollupSize = 0, rollupMaxSize = 0;
-        for (const auto &it : tinyItems) {
-            rollupSize += it.size;
-            if (it.size > rollupMaxSize)
-                rollupMaxSize = it.size;
+    m_renderer->setHighlight(m_searching ? &m_search : nullptr);
+    m_renderer->setDiff(m_before && m_diff.top() != NoIndex ? &m_diff : nullptr);
+    TreemapLayout *layout = neighbour ? &m_nearLayout : &m_layout;
+    layout->setLabelHeight(m_renderer->folderLabelHeight());
+
+    m_making = true;
+    m_makingNeighbour = neighbour;
+    m_makingKey = key;
+    m_cancelFrame = false;
+    // The tree is held, not just pointed to, in case it is replaced before
+    // the frame is handed over.
+    const std::shared_ptr<const FolderTree> tree = m_tree;
+    TreemapRenderer *renderer = m_renderer.get();
+    const std::atomic<bool> *cancel = &m_cancelFrame;
+    const QColor background = palette().color(backgroundRole());
+    m_frameWatcher->setFuture(QtConcurrent::run([tree, layout, renderer, cancel, key, neighbour, background] {
+        TraceSpan span(neighbour ? "neighbour frame" : "frame", "layout");
+        MadeFrame made;
+        const QRectF area(QPointF(0, 0), QSizeF(key.size));
+        const QRectF outerRect = area.adjusted(1, 1, -1, -1);
+        QElapsedTimer timer;
+        timer.start();
+        layout->layout(*tree, key.root, renderer->treeRect(outerRect));
+        made.layoutMs = timer.nsecsElapsed() / 1e6;
+        if (layout->cancelled() || cancel->load())
+            return made;
+        made.changedAll = layout->changedAll();
+        made.changed = layout->changedAreas();
+        timer.restart();
+        std::shared_ptr<const TreemapFrame> frame = renderer->prepare(*tree, key.root, *layout, outerRect, area);
+        made.prepareMs = timer.nsecsElapsed() / 1e6;
+        if (neighbour) {
+            if (cancel->load())
+                return made;
+            const int columns = (key.size.width() + TILE_SIZE - 1) / TILE_SIZE;
+            const int rows = (key.size.height() + TILE_SIZE - 1) / TILE_SIZE;
+            made.tiles.resize(size_t(columns) * rows);
+            std::vector<int> tiles(made.tiles.size());
+            std::iota(tiles.begin(), tiles.end(), 0);
+            QtConcurrent::blockingMap(tiles, [&](int tile) {
+                paintTile(made.tiles[tile], *renderer, *frame, tileArea(tile, columns, key.size), key.ratio,
+                          background);
+            });
         }
-        RenderItem rollupItem;
-        rollupItem.path = QString("Rollup (%1)").arg(rollupCount);
-        rollupItem.size = rollupSize;
-        rollupItem.isFolder = false;
-        rollupItem.isRollup = true;
-        rollupItem.rollupCount = rollupCount;
-        rollupItem.rollupMaxSize = rollupMaxSize;
-        items.append(rollupItem);
-        std::sort(items.begin(), items.end(), [](const RenderItem &a, const RenderItem &b) {
-            return a.size > b.size;
-        });
-        total = 0;
-        for (const auto &it : items)
-            total += it.size;
-        divideDisplayArea(items, 0, items.size(), rect, total, gap);
-    }
-    for (const auto &item : items)
-        m_renderItems.append(item);
-
-    QFont originalFont = painter.font();
-    QFont fileFont = originalFont;
-    fileFont.setPointSize(FILE_FONT_SIZE);
-    fileFont.setBold(false);
-
-    QFont folderFont = originalFont;
-    folderFont.setPointSize(FOLDER_FONT_SIZE);
-    folderFont.setBold(true);  // Folder names in bold
-
-    // Constants for minimum label size.
-    const qreal MIN_LABEL_WIDTH = 50.0;
-
-    // Draw each item with rounded corners and a 1-pixel gap.
-    for (const auto &item : items) {
-        QColor fillColor;
-        if (item.isRollup)
-            fillColor = COLOR_ROLLUP;
-        else if (item.isFolder)
-            fillColor = getFolderDepthColor(depth);
-        else
-            fillColor = getFileTypeColor(item.path);
-        QRectF innerRect = item.rect.adjusted(0.5, 0.5, -0.5, -0.5);
-        QPainterPath path;
-        path.addRoundedRect(innerRect, CORNER_ROUNDNESS, CORNER_ROUNDNESS);
-        painter.setPen(QColor(100, 100, 100));
-        painter.fillPath(path, fillColor);
-        painter.drawPath(path);
-        painter.setPen(Qt::black);
-        if (item.isRollup) {
-            painter.setFont(folderFont);
-            QFontMetrics fmRollup(painter.font());
-            QString rollupText = item.path;
-            painter.drawText(innerRect, Qt::AlignCenter, rollupText);
-        } else if (item.isFolder) {
-            // For folders: display the name with its size (in brackets) on the same line.
-            painter.setFont(folderFont);
-            QFontMetrics fmFolder(painter.font());
-            // Check if there is enough space to print the text.
-            bool canDrawText = (item.rect.width() >= MIN_LABEL_WIDTH &&
-                                item.rect.height() >= (TOP_MARGIN_FOLDER_LABEL + fmFolder.height()));
-            if (canDrawText) {
-                QString folderName = QFileInfo(item.path).fileName();
-                QString sizeStr = QString(" (%1)").arg(formatFileSize(item.size));
-
-                // Use a smaller, non-bold font for the size text.
-                QFont folderSizeFont = folderFont;
-                folderSizeFont.setBold(false);
-                folderSizeFont.setPointSize(folderFont.pointSize() - 1);
-                QFontMetrics fmFolderSize(folderSizeFont);
-
-                int availableWidth = static_cast<int>(item.rect.width() - 2 * SIDE_MARGIN_FOLDER_LABEL);
-                int sizeTextWidth = fmFolderSize.horizontalAdvance(sizeStr);
-                QString elidedFolderName = fmFolder.elidedText(folderName, Qt::ElideRight, availableWidth - sizeTextWidth);
-                int folderNameWidth = fmFolder.horizontalAdvance(elidedFolderName);
-                int totalTextWidth = folderNameWidth + sizeTextWidth;
-                double startX = item.rect.left() + SIDE_MARGIN_FOLDER_LABEL +
-                                (item.rect.width() - 2 * SIDE_MARGIN_FOLDER_LABEL - totalTextWidth) / 2.0;
-                int baseline = item.rect.top() + TOP_MARGIN_FOLDER_LABEL + fmFolder.ascent();
-
-                // Draw folder name.
-                painter.setFont(folderFont);
-                painter.drawText(QPointF(startX, baseline), elidedFolderName);
-                // Draw the size in the smaller font.
-                painter.setFont(folderSizeFont);
-                painter.drawText(QPointF(startX + folderNameWidth, baseline), sizeStr);
-            }
-            // Compute child area. If text wasn't drawn, the child area shifts up.
-            int textHeight = canDrawText ? fmFolder.height() : 0;
-            QRectF childRect(item.rect.left() + SIDE_MARGIN_FOLDER_LABEL + EXTRA_SIDE_BUFFER,
-                             item.rect.top() + TOP_MARGIN_FOLDER_LABEL + textHeight,
-                             item.rect.width() - 2 * SIDE_MARGIN_FOLDER_LABEL - 2 * EXTRA_SIDE_BUFFER,
-                             item.rect.height() - TOP_MARGIN_FOLDER_LABEL - textHeight - BOTTOM_MARGIN_FOLDER_LABEL);
-            if (childRect.width() > 50 && childRect.height() > 30) {
-                renderFolderMap(painter, item.folder, childRect, depth + 1);
-            }
-        } else {
-            // For files: display name on the first line and size underneath.
-            painter.setFont(fileFont);
-            QFontMetrics fmFile(painter.font());
-            // Check if there is enough space to print the filename and size.
-            bool canDrawText = (innerRect.width() >= MIN_LABEL_WIDTH && innerRect.height() >= (fmFile.height() * 2));
-            if (canDrawText) {
-                QString filename = QFileInfo(item.path).fileName();
-                QString elidedName = fmFile.elidedText(filename, Qt::ElideRight, static_cast<int>(innerRect.width()));
-                QString sizeStr = formatFileSize(item.size);
-                QRectF nameRect(innerRect.left(), innerRect.top(), innerRect.width(), fmFile.height());
-                QRectF sizeRect(innerRect.left(), innerRect.top() + fmFile.height(), innerRect.width(), fmFile.height());
-                painter.drawText(nameRect, Qt::AlignCenter, elidedName);
-                painter.drawText(sizeRect, Qt::AlignCenter, sizeStr);
+        made.frame = std::move(frame);
+        return made;
+    }));
+}
+
+// Takes over the frame just made, if it is still of the view shown; an
+// older one is dropped, and the next paint asks for another. That of a
+// neighbour is kept for a zoom.
+void FolderMapWidget::frameReady()
+{
+    if (!m_making)
+        return;
+    m_making = false;
+    const MadeFrame made = m_frameWatcher->result();
+    if (m_makingNeighbour) {
+        if (made.frame && sameView(m_makingKey))
+            keepNeighbour({m_makingKey, made.frame, made.tiles});
+        // Another neighbour may be wanted, once whatever called this is done.
+        QTimer::singleShot(0, this, &FolderMapWidget::requestNeighbour);
+        return;
+    }
+    if (!made.frame || !(m_makingKey == frameKey())) {
+        m_framesDropped = true;
+        m_frame.dropped++;
+        update();
+        return;
+    }
+    // A new tile grid, another look or changes that were never drawn mean
+    // every tile; otherwise only those under what changed.
+    const int columns = (m_makingKey.size.width() + TILE_SIZE - 1) / TILE_SIZE;
+    const int rows = (m_makingKey.size.height() + TILE_SIZE - 1) / TILE_SIZE;
+    const bool newGrid = columns != m_tileColumns || rows != m_tileRows || m_makingKey.ratio != m_tileRatio;
+    const bool restyled = !m_shown || m_makingKey.style != m_shownKey.style;
+    m_shown = made.frame;
+    m_shownKey = m_makingKey;
+    m_frame.layoutMs = made.layoutMs;
+    m_frame.prepareMs = made.prepareMs;
+    if (newGrid) {
+        m_tileColumns = columns;
+        m_tileRows = rows;
+        m_tileRatio = m_makingKey.ratio;
+        m_tiles.assign(size_t(columns) * rows, QImage());
+        m_tileDirty.assign(m_tiles.size(), 1);
+    } else if (made.changedAll || restyled || m_framesDropped) {
+        std::fill(m_tileDirty.begin(), m_tileDirty.end(), 1);
+    } else {
+        for (const QRectF &area : made.changed) {
+            // One pixel of slack for antialiased edges.
+            const QRect changed = area.toAlignedRect().adjusted(-1, -1, 1, 1);
+            for (int tile = 0; tile < int(m_tiles.size()); tile++) {
+                if (!m_tileDirty[tile] && tileRect(tile).intersects(changed))
+                    m_tileDirty[tile] = 1;
             }
         }
     }
-    painter.setFont(originalFont);
+    m_framesDropped = false;
+    // Item positions may have shifted; find the hovered one again.
+    m_hoverItem = underMouse() ? m_shown->itemAt(mapFromGlobal(QCursor::pos())) : -1;
+    update();
+}
+
+// Calls off the frame being made, if any, and waits until it has stopped,
+// before the tree or anything else it reads changes.
+void FolderMapWidget::waitForFrame()
+{
+    if (!m_making)
+        return;
+    TraceSpan span("wait for frame", "layout");
+    m_cancelFrame = true;
+    m_frameWatcher->waitForFinished();
+    frameReady();
+}
+
+// The map of root made ahead for the view as it is, if any, though maybe
+// of an older version of the tree.
+const FolderMapWidget::Neighbour *FolderMapWidget::neighbour(NodeIndex root) const
+{
+    for (const Neighbour &near : m_neighbours) {
+        if (near.key.root == root && sameView(near.key))
+            return &near;
+    }
+    return nullptr;
+}
+
+// Keeps the map of a neighbour in place of an older one of the same folder
+// and, past NEIGHBOUR_FRAMES, of the one kept longest.
+void FolderMapWidget::keepNeighbour(const Neighbour &neighbour)
+{
+    m_neighbours.erase(std::remove_if(m_neighbours.begin(), m_neighbours.end(),
+                                      [&](const Neighbour &near) { return near.key.root == neighbour.key.root; }),
+                       m_neighbours.end());
+    m_neighbours.push_back(neighbour);
+    if (m_neighbours.size() > NEIGHBOUR_FRAMES)
+        m_neighbours.erase(m_neighbours.begin());
+}
+
+// Re-renders the tiles that the newest frame changed, spread over the
+// thread pool.
+void FolderMapWidget::updateTiles()
+{
+    std::vector<int> dirty;
+    for (int tile = 0; tile < int(m_tiles.size()); tile++) {
+        if (m_tileDirty[tile])
+            dirty.push_back(tile);
+    }
+    m_frame.tiles = int(dirty.size());
+    if (dirty.empty())
+        return;
+    // The frame doesn't change, so with the background read here the tiles
+    // need nothing else from the GUI thread, which waits until all are done.
+    const QColor background = palette().color(backgroundRole());
+    QElapsedTimer timer;
+    timer.start();
+    QtConcurrent::blockingMap(dirty, [this, background](int tile) { renderTile(tile, background); });
+    std::fill(m_tileDirty.begin(), m_tileDirty.end(), 0);
+    m_frame.renderMs = timer.nsecsElapsed() / 1e6;
 }
 
+void FolderMapWidget::renderTile(int tile, const QColor &background)
+{
+    TraceSpan span("renderTile", "paint");
+    paintTile(m_tiles[tile], *m_renderer, *m_shown, tileRect(tile), m_tileRatio, background);
+}
+
+// Of the shown frame, which may be of another size than the widget while
+// the next is made.
+QRect FolderMapWidget::tileRect(int tile) const
+{
+    return tileArea(tile, m_tileColumns, m_shownKey.size);
+}
 
+void FolderMapWidget::setHoverItem(int item)
+{
+    if (item == m_hoverItem)
+        return;
+    if (!m_shown)
+        return;
+    const std::vector<LayoutItem> &items = m_shown->items;
+    if (m_hoverItem >= 0 && m_hoverItem < int(items.size()))
+        update(items[m_hoverItem].rect.toAlignedRect().adjusted(-2, -2, 2, 2));
+    m_hoverItem = item;
+    if (item >= 0)
+        update(items[item].rect.toAlignedRect().adjusted(-2, -2, 2, 2));
+}
 
 void FolderMapWidget::zoomOut()
 {
-    if (!rootFolder)
+    if (!m_tree || rootFolder == NoIndex)
         return;
-    QDir dir(rootFolder->path);
+    // Inside the scanned tree, zooming out is just a step up the parent links.
+    const NodeIndex parent = m_tree->node(rootFolder).parent;
+    if (parent != NoIndex) {
+        zoomTo(parent);
+        return;
+    }
+
+    // Nothing is known above the root of an imported listing.
+    if (m_imported)
+        return;
+
+    const QString rootPath = m_tree->folderPath(rootFolder);
+    QDir dir(rootPath);
 
     // Prevent zooming out to root '/'
     if (dir.cdUp() && dir.absolutePath() != "/") {
-        qDebug() << "Zooming out from" << rootFolder->path << "to" << dir.absolutePath();
-        buildFolderTree(dir.absolutePath());
+        qDebug() << "Zooming out from" << rootPath << "to" << dir.absolutePath();
+        // Graft what we have under a new root and scan only the rest of the
+        // parent: its files and the sibling directories.
+        const NodeIndex scanned = rootFolder;
+        waitForFrame();
+        waitForSave();
+        waitForSearchIndex();
+        const NodeIndex newRoot = m_tree->addParentRoot(dir.absolutePath());
+        std::unique_ptr<FolderScanner> scanner(new FolderScanner(m_scanOptions));
+        scanner->startAt(*m_tree, newRoot, m_tree->folderNameBytes(scanned));
+        addScanner(std::move(scanner));
+        setRootFolder(newRoot);
     } else {
-        qDebug() << "Cannot zoom out further from" << rootFolder->path;
+        qDebug() << "Cannot zoom out further from" << rootPath;
+    }
+}
+
+void FolderMapWidget::setRootFolder(NodeIndex folder)
+{
+    rootFolder = folder;
+    m_hoverItem = -1;
+    emit rootFolderChanged(m_tree->folderPath(rootFolder));
+    update();
+}
+
+// Shows folder, zooming over from the one shown if either lies inside the
+// other and the map of folder was made ahead; otherwise it just jumps.
+void FolderMapWidget::zoomTo(NodeIndex folder)
+{
+    endZoom();
+    // The map of folder may be about done, and would come next anyway.
+    if (m_making && m_makingNeighbour && m_makingKey.root == folder) {
+        m_frameWatcher->waitForFinished();
+        frameReady();
+    }
+    const NodeIndex from = rootFolder;
+    setRootFolder(folder);
+    const Neighbour *to = neighbour(folder);
+    if (!to || !m_shown || !sameView(m_shownKey) ||
+        std::find(m_tileDirty.begin(), m_tileDirty.end(), 1) != m_tileDirty.end())
+        return;
+    bool in = false;
+    bool out = false;
+    for (NodeIndex up = m_tree->node(folder).parent; up != NoIndex && !in; up = m_tree->node(up).parent)
+        in = up == from;
+    for (NodeIndex up = m_tree->node(from).parent; up != NoIndex && !in && !out; up = m_tree->node(up).parent)
+        out = up == folder;
+    if (!in && !out)
+        return;
+    // Where the inner folder is in the map of the outer one.
+    const TreemapFrame &outer = in ? *m_shown : *to->frame;
+    const NodeIndex inner = in ? folder : from;
+    auto item = std::find_if(outer.items.begin(), outer.items.end(), [inner](const LayoutItem &item) {
+        return item.isFolder && !item.isRollup && item.index == inner;
+    });
+    if (item == outer.items.end() || item->rect.width() < 1 || item->rect.height() < 1)
+        return;
+    m_zoomArea = item->rect;
+    m_zoomingIn = in;
+
+    // The map zoomed from is a neighbour of the one zoomed to.
+    const Neighbour next = *to;
+    keepNeighbour({m_shownKey, m_shown, m_tiles});
+    m_zoomTiles = m_tiles;
+    m_shown = next.frame;
+    m_shownKey = next.key;
+    m_tiles = next.tiles;
+    m_zoomAnimation->start();
+    update();
+}
+
+void FolderMapWidget::stepZoom()
+{
+    update();
+}
+
+void FolderMapWidget::endZoom()
+{
+    if (!isZooming())
+        return;
+    m_zoomAnimation->stop();
+    m_zoomTiles.clear();
+    update();
+}
+
+// The size and start of the part of a map seen along one axis, t of the way
+// from the whole of it, of length full, to the stretch from start to start
+// + length. It shrinks at an even rate about the point that stays put.
+static void zoomSpan(qreal full, qreal start, qreal length, qreal t, qreal &seenStart, qreal &seenLength) {
+    const qreal ratio = length / full;
+    seenLength = full * std::pow(ratio, t);
+    if (std::abs(1 - ratio) < 1e-9)
+        seenStart = start * t;
+    else
+        seenStart = start / (1 - ratio) * (1 - seenLength / full);
+}
+
+// One step of a zoom: the outer map is stretched about the inner folder
+// until that fills the widget, or shrunk back, and the inner map is drawn
+// over the area of the folder, fading in as it grows.
+void FolderMapWidget::drawZoom(QPainter &painter)
+{
+    const qreal step = m_zoomAnimation->currentValue().toReal();
+    // 0 is the outer map as it is, 1 the inner one.
+    const qreal t = m_zoomingIn ? step : 1 - step;
+    const QSizeF full(m_shownKey.size);
+    qreal left, width, top, height;
+    zoomSpan(full.width(), m_zoomArea.left(), m_zoomArea.width(), t, left, width);
+    zoomSpan(full.height(), m_zoomArea.top(), m_zoomArea.height(), t, top, height);
+    const qreal sx = full.width() / width;
+    const qreal sy = full.height() / height;
+    const QRectF outer(-left * sx, -top * sy, full.width() * sx, full.height() * sy);
+    const QRectF inner((m_zoomArea.left() - left) * sx, (m_zoomArea.top() - top) * sy, m_zoomArea.width() * sx,
+                       m_zoomArea.height() * sy);
+    painter.setRenderHint(QPainter::SmoothPixmapTransform);
+    drawTiles(painter, m_zoomingIn ? m_zoomTiles : m_tiles, outer);
+    painter.setOpacity(std::min<qreal>(1, t / ZOOM_FADE));
+    drawTiles(painter, m_zoomingIn ? m_tiles : m_zoomTiles, inner);
+    painter.setOpacity(1);
+}
+
+// Draws the tiles of a map the size of the one shown stretched to target,
+// leaving out those that end up outside the widget.
+void FolderMapWidget::drawTiles(QPainter &painter, const std::vector<QImage> &tiles, const QRectF &target) const
+{
+    const qreal sx = target.width() / m_shownKey.size.width();
+    const qreal sy = target.height() / m_shownKey.size.height();
+    const QRectF bounds(rect());
+    for (int tile = 0; tile < int(tiles.size()); tile++) {
+        const QRect area = tileRect(tile);
+        const QRectF to(target.left() + area.left() * sx, target.top() + area.top() * sy, area.width() * sx,
+                        area.height() * sy);
+        if (to.intersects(bounds))
+            painter.drawImage(to, tiles[tile]);
+    }
+}
+
+// The folder a double click at pos would zoom into, if any.
+NodeIndex FolderMapWidget::zoomTargetAt(const QPoint &pos) const
+{
+    for (int i = m_shown ? m_shown->itemAt(pos) : -1; i >= 0; i = m_shown->itemAt(pos, i)) {
+        const LayoutItem &item = m_shown->items[i];
+        if (item.isFolder && !item.isRollup)
+            return item.index == rootFolder ? NoIndex : item.index;
     }
+    return NoIndex;
+}
+
+// In a summary, a folder the user zooms into is scanned again in full
+// detail. That waits until no scan is running, since one might still be
+// adding to the folder; the whole tree is never redone this way.
+void FolderMapWidget::showDetail(NodeIndex folder)
+{
+    if (!m_scanOptions.summarizes() || !m_scanners.empty() || folder == m_tree->root() ||
+        !m_tree->hasGroups(folder))
+        return;
+    ScanOptions options = m_scanOptions;
+    options.summaryFiles = 0;
+    waitForFrame();
+    waitForSave();
+    waitForSearchIndex();
+    m_tree->clearFolder(folder);
+    std::unique_ptr<FolderScanner> scanner(new FolderScanner(options));
+    scanner->startAt(*m_tree, folder);
+    addScanner(std::move(scanner));
+    update();
+}
+
+// The largest kinds of file in a folder, one per line, from the totals the
+// tree keeps per category.
+static QString typeBreakdown(const FolderTree &tree, NodeIndex folder)
+{
+    const CategorySizes sizes = tree.categorySizes(folder);
+    const qint64 total = sizes.total();
+    if (total <= 0)
+        return QString();
+    std::vector<int> order;
+    for (int c = 0; c < FILE_CATEGORY_COUNT; c++) {
+        if (sizes.size[c] > 0)
+            order.push_back(c);
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return sizes.size[a] > sizes.size[b]; });
+    QString text;
+    for (size_t i = 0; i < order.size() && i < BREAKDOWN_CATEGORIES; i++) {
+        const int c = order[i];
+        text += QString("\n%1: %2%, %3 files")
+                    .arg(categoryName(FileCategory(c)))
+                    .arg(100.0 * sizes.size[c] / total, 0, 'f', 1)
+                    .arg(sizes.count[c]);
+    }
+    return text;
+}
+
+// How an item changed since the earlier scan, for its tooltip.
+static QString changeText(const SnapshotDiff &diff, const LayoutItem &item)
+{
+    const SnapshotDiff::Change change = item.isFolder ? diff.folderChange(item.index) : diff.fileChange(item.index);
+    if (change == SnapshotDiff::Added)
+        return "\nNew since the earlier scan";
+    if (!item.isFolder)
+        return change == SnapshotDiff::Unchanged ? QString() : "\nChanged size since the earlier scan";
+    const qint64 delta = diff.folderDelta(item.index);
+    if (delta == 0)
+        return QString();
+    return QString("\n%1%2 since the earlier scan").arg(delta > 0 ? "+" : "-").arg(formatFileSize(std::abs(delta)));
 }
 
 void FolderMapWidget::mouseMoveEvent(QMouseEvent *event)
 {
-    for (int i = m_renderItems.size() - 1; i >= 0; i--) {
-        const RenderItem &item = m_renderItems.at(i);
-        if (item.rect.contains(event->pos())) {
-            QString tooltipText;
-            if (item.isRollup)
-                tooltipText = QString("Rolled up %1 items").arg(item.rollupCount);
-            else
-                tooltipText = QFileInfo(item.path).fileName();
-            QToolTip::showText(event->globalPos(), tooltipText, this);
-            return;
-        }
+    if (isZooming()) {
+        event->ignore();
+        return;
+    }
+    const int hit = m_shown ? m_shown->itemAt(event->pos()) : -1;
+    setHoverItem(hit);
+    // Its map is made ahead for a double click.
+    const NodeIndex target = zoomTargetAt(event->pos());
+    if (target != m_zoomTarget) {
+        m_zoomTarget = target;
+        requestFrame();
+    }
+    if (hit >= 0) {
+        const LayoutItem &item = m_shown->items[hit];
+        QString tooltipText;
+        if (item.isRollup && item.index != NoIndex)
+            tooltipText = QString("%1: %2 files, not listed one by one")
+                              .arg(m_tree->groupName(item.index))
+                              .arg(item.rollupCount);
+        else if (item.isRollup)
+            tooltipText = QString("Rolled up %1 items").arg(item.rollupCount);
+        else if (item.isFolder)
+            tooltipText = m_tree->folderName(item.index) + typeBreakdown(*m_tree, item.index);
+        else
+            tooltipText = m_tree->fileName(item.index);
+        if (m_before && !item.isRollup)
+            tooltipText += changeText(m_diff, item);
+        QToolTip::showText(event->globalPos(), tooltipText, this);
+        return;
     }
     QToolTip::hideText();
     event->ignore();
 }
 
+void FolderMapWidget::leaveEvent(QEvent *event)
+{
+    setHoverItem(-1);
+    QWidget::leaveEvent(event);
+}
+
 void FolderMapWidget::mouseDoubleClickEvent(QMouseEvent *event)
 {
-    for (int i = m_renderItems.size() - 1; i >= 0; i--) {
-        const RenderItem &item = m_renderItems.at(i);
-        if (item.rect.contains(event->pos())) {
-            if (item.isFolder && !item.isRollup && item.folder) {
-                rootFolder = item.folder;
-                QDir d(rootFolder->path);
-                if (d.cdUp())
-                    emit rootFolderChanged(d.absolutePath());
-                else
-                    emit rootFolderChanged(rootFolder->path);
-                update();
+    // Innermost item first, then the folders around it.
+    for (int i = m_shown ? m_shown->itemAt(event->pos()) : -1; i >= 0; i = m_shown->itemAt(event->pos(), i)) {
+        const LayoutItem &item = m_shown->items[i];
+        if (item.isFolder && !item.isRollup) {
+            zoomTo(item.index);
+            showDetail(item.index);
+            return;
+        } else if (!item.isFolder && !item.isRollup) { // Open media files in default viewer
+            if (isMediaType(m_tree->file(item.index).type)) {
+                QDesktopServices::openUrl(QUrl::fromLocalFile(m_tree->filePath(item.index)));
                 return;
-            } else if (!item.isFolder) { // Open media files in default viewer
-                QString ext = QFileInfo(item.path).suffix().toLower();
-                if (ext == "jpg" || ext == "jpeg" || ext == "png" || ext == "gif" ||
-                    ext == "bmp" || ext == "tiff" || ext == "ico" ||
-                    ext == "mp4" || ext == "avi" || ext == "mkv" || ext == "mov" ||
-                    ext == "wmv" || ext == "flv" || ext == "webm" ||
-                    ext == "mp3" || ext == "wav" || ext == "aac" || ext == "ogg" ||
-                    ext == "flac" || ext == "m4a") {
-                    QDesktopServices::openUrl(QUrl::fromLocalFile(item.path));
-                    return;
-                }
             }
         }
     }
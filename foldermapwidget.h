@@ -1,56 +1,273 @@
 #ifndef FOLDERMAPWIDGET_H
 #define FOLDERMAPWIDGET_H
 
+#include "foldertree.h"
+#include "folderscanner.h"
+#include "folderwatcher.h"
+#include "listingimporter.h"
+#include "searchindex.h"
+#include "snapshotdiff.h"
+#include "treemaplayout.h"
+#include "treemaprenderer.h"
+
 #include <QWidget>
+#include <QFutureWatcher>
 #include <QString>
 #include <QList>
 #include <QRectF>
+#include <QImage>
+#include <QElapsedTimer>
+#include <QStringList>
 #include <memory>
 #include <QMouseEvent>
 #include <QPaintEvent>
-
-// Represents a folder node in the tree.
-struct FolderNode {
-    QString path;
-    QList<QPair<QString, qint64>> files; // Pair of file path and size.
-    QList<std::shared_ptr<FolderNode>> subFolders;
-    qint64 totalSize = 0;
-};
-
-// RenderItem holds information for drawing an item.
-struct RenderItem {
-    QString path;
-    qint64 size;
-    bool isFolder;
-    std::shared_ptr<FolderNode> folder; // Valid if isFolder is true.
-    QRectF rect;                      // Assigned by the treemap subdivision algorithm.
-    bool isRollup = false;
-    int rollupCount = 0;
-    qint64 rollupMaxSize = 0;
-};
+#include <QTimer>
+#include <QVariantAnimation>
+#include <atomic>
+#include <thread>
+#include <vector>
 
 class FolderMapWidget : public QWidget
 {
     Q_OBJECT
 public:
     explicit FolderMapWidget(QWidget *parent = nullptr);
+    ~FolderMapWidget() override;
     void buildFolderTree(const QString &path);
+    // Shows the folders of a file listing instead of scanning them; see
+    // ListingImporter. "-" reads standard input.
+    void importListing(const QString &fileName);
     void zoomOut();
+    void setScanOptions(const ScanOptions &options);
+    // Shows scan, layout and paint counters over the map.
+    void setStatsVisible(bool visible);
+    // Squarified tiles instead of halving by size; see TreemapLayout.
+    void setSquarified(bool squarified);
+    // Highlights the files of the tree that match text, in the syntax of
+    // SearchQuery; an empty text ends the search.
+    void setSearch(const QString &text);
+    // Shows the folder of one of the largest matches, by its row in the
+    // last searchUpdated().
+    void revealMatch(int row);
+    // Colours the map by what changed since the scan saved in a snapshot,
+    // which must be of the same folder, one above or one below it. False
+    // if it can't be read or covers other folders.
+    bool compareWith(const QString &snapshotFile);
+    // The top of the tree, whose snapshot a scan saves, whatever folder is
+    // shown; empty before the first scan.
+    QString scanRootPath() const;
+    void clearComparison();
+    // Shows one of the folders that grew most, by its row in the last
+    // comparisonUpdated().
+    void revealGrowth(int row);
 
 signals:
     void rootFolderChanged(const QString &newRoot);
+    void scanProgress(const QString &summary);
+    void scanFinished(const QString &summary);
+    // After every search: how many files matched, or what is wrong with
+    // the query, and the largest matches as "size  path", largest first.
+    void searchUpdated(const QString &summary, const QStringList &largest);
+    // After every comparison: what was added and removed in all, and the
+    // folders that grew most as "+size  path", most first.
+    void comparisonUpdated(const QString &summary, const QStringList &grown);
 
 protected:
     void paintEvent(QPaintEvent *event) override;
     void mouseMoveEvent(QMouseEvent *event) override;
     void mouseDoubleClickEvent(QMouseEvent *event) override;
+    void leaveEvent(QEvent *event) override;
+
+private slots:
+    void publishScanProgress();
+    void applyFileChanges();
+    void stepZoom();
+    void endZoom();
+    void snapshotSaved();
+    void stopScans();
 
 private:
-    std::shared_ptr<FolderNode> buildFolderTreeRecursive(const QString &path);
-    void renderFolderMap(QPainter &painter, const std::shared_ptr<FolderNode> &node, const QRectF &rect, int depth = 0);
+    void addScanner(std::unique_ptr<FolderScanner> scanner);
+    void dropScanners();
+    void discardScanner(std::unique_ptr<FolderScanner> scanner);
+    void reapScanners(bool quitting);
+    void resetTree(const std::shared_ptr<FolderTree> &tree);
+    void publishImportProgress();
+    void updateScanFocus();
+    void setRootFolder(NodeIndex folder);
+    void zoomTo(NodeIndex folder);
+    void showDetail(NodeIndex folder);
+    // What a frame was made for; another one is needed once this changes.
+    struct FrameKey {
+        quint32 generation = 0;
+        NodeIndex root = NoIndex;
+        quint32 version = 0;          // Of the tree.
+        quint32 style = 0;            // See m_style.
+        QSize size;
+        qreal ratio = 0;
+
+        bool operator==(const FrameKey &other) const
+        {
+            return generation == other.generation && root == other.root && version == other.version &&
+                   style == other.style && size == other.size && ratio == other.ratio;
+        }
+    };
+    // A frame as the pool thread hands it over, with what changed since the
+    // layout before; no frame if it was called off. The frame of another
+    // folder than the one shown comes drawn into tiles.
+    struct MadeFrame {
+        std::shared_ptr<const TreemapFrame> frame;
+        bool changedAll = false;
+        std::vector<QRectF> changed;
+        std::vector<QImage> tiles;
+        double layoutMs = 0;
+        double prepareMs = 0;
+    };
+    // The frame and tiles of a folder next to the one shown.
+    struct Neighbour {
+        FrameKey key;
+        std::shared_ptr<const TreemapFrame> frame;
+        std::vector<QImage> tiles;
+    };
+
+    FrameKey frameKey() const;
+    bool sameView(const FrameKey &key) const;
+    void requestFrame();
+    void requestNeighbour();
+    void startFrame(const FrameKey &key, bool neighbour);
+    void frameReady();
+    void saveSnapshot();
+    void waitForSave();
+    void waitForFrame();
+    const Neighbour *neighbour(NodeIndex root) const;
+    void keepNeighbour(const Neighbour &neighbour);
+    NodeIndex zoomTargetAt(const QPoint &pos) const;
+    bool isZooming() const { return !m_zoomTiles.empty(); }
+    void drawZoom(QPainter &painter);
+    void drawTiles(QPainter &painter, const std::vector<QImage> &tiles, const QRectF &target) const;
+    void updateTiles();
+    void renderTile(int tile, const QColor &background);
+    QRect tileRect(int tile) const;
+    void setHoverItem(int item);
+    void drawStats(QPainter &painter);
+    bool updateSearch();
+    void runSearch();
+    void buildSearchIndex();
+    void searchIndexBuilt();
+    void waitForSearchIndex();
+    bool updateComparison();
+    void publishComparison();
 
-    std::shared_ptr<FolderNode> rootFolder;
-    QList<RenderItem> m_renderItems;
+    std::shared_ptr<FolderTree> m_tree;
+    // The folder shown; the scanned tree's root may lie further up.
+    NodeIndex rootFolder = NoIndex;
+    // The map is made in two stages. Laying it out and preparing its
+    // labels and colours happen on a pool thread, one frame at a time; the
+    // GUI thread only draws the newest finished frame into the tiles. The
+    // layout and the renderer belong to the frame being made until it is
+    // handed over, and the tree, the search result and the comparison don't
+    // change meanwhile: scan results and file changes wait for the next
+    // tick, and everything else waits for the frame, which stops early.
+    TreemapLayout m_layout;
+    std::unique_ptr<TreemapRenderer> m_renderer;
+    QFutureWatcher<MadeFrame> *m_frameWatcher;
+    bool m_making = false;
+    bool m_makingNeighbour = false;
+    FrameKey m_makingKey;
+    std::atomic<bool> m_cancelFrame{false};
+    // Whether a frame was made but not shown since the last one that was,
+    // so that what changed in it was never drawn.
+    bool m_framesDropped = false;
+    std::shared_ptr<const TreemapFrame> m_shown;
+    FrameKey m_shownKey;
+    // Bumped when the same tree is to look different: another search,
+    // comparison or kind of layout.
+    quint32 m_style = 0;
+    // The shown frame, kept as a grid of tiles; paintEvent only blits them.
+    std::vector<QImage> m_tiles;
+    std::vector<char> m_tileDirty;
+    int m_tileColumns = 0;
+    int m_tileRows = 0;
+    qreal m_tileRatio = 0;
+    int m_hoverItem = -1;
+    // Zooming: the maps of the parent of the folder shown and of the folder
+    // a double click would zoom into are made ahead, with a layout of their
+    // own, whenever the view is up to date and nothing else is being made.
+    // A zoom to one of them shows its tiles at once, and animates between
+    // the two maps by stretching the tiles of both, so a step of it costs
+    // no more than a blit of the widget, however large the tree.
+    TreemapLayout m_nearLayout;
+    std::vector<Neighbour> m_neighbours;
+    NodeIndex m_zoomTarget = NoIndex;
+    QVariantAnimation *m_zoomAnimation;
+    std::vector<QImage> m_zoomTiles;  // Of the map zoomed from, while zooming.
+    QRectF m_zoomArea;                // Of the inner folder in the outer map.
+    bool m_zoomingIn = false;
+    ScanOptions m_scanOptions;
+    // Scans feeding m_tree: the initial one plus one per zoom-out past the
+    // scanned root. Each is tagged with the tree it was started for; a
+    // scanner from an older generation never touches the current tree.
+    struct RunningScan {
+        std::unique_ptr<FolderScanner> scanner;
+        quint32 generation;
+    };
+    std::vector<RunningScan> m_scanners;
+    quint32 m_generation = 0;
+    // Scans let go of, whose workers are being joined on a thread of their
+    // own until stopped is set.
+    struct DiscardedScan {
+        std::unique_ptr<FolderScanner> scanner;
+        std::thread stopping;
+        std::shared_ptr<std::atomic<bool>> stopped;
+    };
+    std::vector<DiscardedScan> m_discarded;
+    // The folders the running scans were last told to read first.
+    std::vector<NodeIndex> m_scanFocus;
+    bool m_treeChanged = false;       // Since the last snapshot was saved or loaded.
+    // The snapshot is written on the pool. Like a frame being made, it
+    // reads the tree, which meanwhile only changes once it is written.
+    QFutureWatcher<bool> *m_saveWatcher;
+    bool m_saving = false;
+    // Reads a listing into a tree of its own, which replaces m_tree once
+    // complete. An imported tree is of folders somewhere else: it is
+    // neither watched, nor saved, nor zoomed out of.
+    std::unique_ptr<ListingImporter> m_importer;
+    bool m_imported = false;
+    QTimer *m_scanTimer;
+    // Follows the file system once the scans are done.
+    std::unique_ptr<FolderWatcher> m_watcher;
+    QTimer *m_watchTimer;
+    // For the stats overlay: the current or last scan, and the last frame.
+    bool m_showStats = false;
+    ScanStats m_scanStats;
+    struct FrameStats {
+        double layoutMs = 0;
+        double prepareMs = 0;
+        int dropped = 0;              // Frames called off or out of date when done.
+        double renderMs = 0;
+        double paintMs = 0;
+        int tiles = 0;
+    };
+    FrameStats m_frame;
+    // The search, if any: its query, the index of the tree, and the result
+    // the renderer highlights.
+    bool m_searching = false;
+    bool m_searchPending = false;     // The query changed since the last search.
+    SearchQuery m_query;
+    SearchIndex m_searchIndex;
+    SearchResult m_search;
+    QElapsedTimer m_searchClock;      // Since the index was last built.
+    // The next index is built on the pool, of the tree held here. Like a
+    // frame being made, it reads the tree, which meanwhile doesn't change.
+    QFutureWatcher<std::shared_ptr<SearchIndex>> *m_indexWatcher;
+    std::shared_ptr<const FolderTree> m_indexing;
+    // The comparison, if any: the earlier scan, as a tree of its own, and
+    // what changed since then, redone whenever the tree settles.
+    std::shared_ptr<FolderTree> m_before;
+    qint64 m_beforeSavedAt = 0;
+    SnapshotDiff m_diff;
+    bool m_diffPending = false;       // The tree changed since the last comparison.
+    quint32 m_diffVersion = 0;
 };
 
 #endif // FOLDERMAPWIDGET_H
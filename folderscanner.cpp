@@ -0,0 +1,915 @@
+#include "folderscanner.h"
+#include "snapshot.h"
+#include "trace.h"
+
+#include <QDir>
+#include <QFile>
+#include <QElapsedTimer>
+#include <QMutexLocker>
+#include <QStringList>
+#include <QThread>
+#include <QDebug>
+#include <QHash>
+#include <algorithm>
+
+// How long an idle worker sleeps before it looks for stealable work again.
+static const int IDLE_WAIT_MS = 5;
+// How many of the slowest directory reads a scan remembers.
+static const size_t SLOWEST_KEPT = 10;
+// Summary scans: file groups per folder, the last one taking everything
+// that doesn't get a group of its own, and the longest extension that
+// gets one; longer "extensions" are usually random suffixes.
+static const int MAX_FILE_GROUPS = 8;
+static const int MAX_EXTENSION_LENGTH = 12;
+
+double ScanStats::dirsPerSecond() const
+{
+    return elapsedMs > 0 ? dirs * 1000.0 / elapsedMs : 0.0;
+}
+
+double ScanStats::filesPerSecond() const
+{
+    return elapsedMs > 0 ? files * 1000.0 / elapsedMs : 0.0;
+}
+
+QString ScanStats::summary() const
+{
+    if (revalidation && !complete) {
+        return QString("Checking snapshot... %1 folders so far, %2 changed")
+            .arg(dirs)
+            .arg(changedDirs);
+    }
+    if (revalidation) {
+        return QString("Checked %1 folders against the snapshot in %2 s, %3 changed (%4 threads, %5)")
+            .arg(dirs)
+            .arg(elapsedMs / 1000.0, 0, 'f', 2)
+            .arg(changedDirs)
+            .arg(threads)
+            .arg(backend);
+    }
+    if (imported) {
+        const double mibPerSecond = elapsedMs > 0 ? listingBytes * 1000.0 / elapsedMs / (1024 * 1024) : 0.0;
+        if (!complete) {
+            return QString("Reading listing... %1 folders, %2 files so far (%3 MiB/s)")
+                .arg(dirs)
+                .arg(files)
+                .arg(mibPerSecond, 0, 'f', 0);
+        }
+        return QString("Read a listing of %1 folders, %2 files in %3 s (%4 MiB/s, %5 files/s, %6 threads, %7)")
+            .arg(dirs)
+            .arg(files)
+            .arg(elapsedMs / 1000.0, 0, 'f', 2)
+            .arg(mibPerSecond, 0, 'f', 0)
+            .arg(filesPerSecond(), 0, 'f', 0)
+            .arg(threads)
+            .arg(backend);
+    }
+    if (!complete) {
+        return QString("Scanning... %1 folders, %2 files so far (%3 dirs/s, %4 files/s)")
+            .arg(dirs)
+            .arg(files)
+            .arg(dirsPerSecond(), 0, 'f', 0)
+            .arg(filesPerSecond(), 0, 'f', 0);
+    }
+    return QString("Scanned %1 folders, %2 files in %3 s (%4 dirs/s, %5 files/s, %6 threads, %7)")
+        .arg(dirs)
+        .arg(files)
+        .arg(elapsedMs / 1000.0, 0, 'f', 2)
+        .arg(dirsPerSecond(), 0, 'f', 0)
+        .arg(filesPerSecond(), 0, 'f', 0)
+        .arg(threads)
+        .arg(backend);
+}
+
+QString ScanStats::details() const
+{
+    QString text = QString("Folders: %1 (%2/s)\nFiles: %3 (%4/s)\nStat calls: %5\nListing bytes: %6 KiB\n"
+                           "Elapsed: %7 s, applying: %8 s\nThreads: %9 (%10)")
+                       .arg(dirs)
+                       .arg(dirsPerSecond(), 0, 'f', 0)
+                       .arg(files)
+                       .arg(filesPerSecond(), 0, 'f', 0)
+                       .arg(statCalls)
+                       .arg(listingBytes / 1024)
+                       .arg(elapsedMs / 1000.0, 0, 'f', 2)
+                       .arg(applyMs / 1000.0, 0, 'f', 2)
+                       .arg(threads)
+                       .arg(backend);
+    if (revalidation)
+        text += QString("\nChanged since snapshot: %1").arg(changedDirs);
+    if (skippedLines > 0)
+        text += QString("\nListing lines not understood: %1").arg(skippedLines);
+    if (foldedFiles > 0)
+        text += QString("\nFolded into groups: %1 files").arg(foldedFiles);
+    if (!devices.isEmpty())
+        text += QString("\nDevices: %1").arg(devices);
+    if (deviceWaits > 0)
+        text += QString("\nWaited for a busy disk or server: %1 folders").arg(deviceWaits);
+    if (skippedDirs > 0)
+        text += QString("\nSkipped on pseudo, other or slow file systems: %1 folders").arg(skippedDirs);
+    if (slowMounts > 0)
+        text += QString("\nFile systems given up as too slow: %1").arg(slowMounts);
+    if (repeatedDirs > 0 || repeatedLinks > 0)
+        text += QString("\nCounted once: %1 folders, %2 linked files").arg(repeatedDirs).arg(repeatedLinks);
+    if (!slowest.empty()) {
+        text += "\nSlowest folders:";
+        for (const SlowDirectory &dir : slowest)
+            text += QString("\n  %1 ms  %2").arg(dir.ms, 0, 'f', 1).arg(dir.path);
+    }
+    return text;
+}
+
+// The extension a file is grouped by: lower case, without the dot, and
+// empty if there is none or it is too long to be one.
+static QByteArray extensionOf(const DirListing &listing, const DirListing::Entry &file)
+{
+    const char *name = listing.names.constData() + file.nameOffset;
+    int dot = int(file.nameLength) - 1;
+    while (dot > 0 && name[dot] != '.')
+        dot--;
+    const int length = int(file.nameLength) - dot - 1;
+    if (dot <= 0 || length == 0 || length > MAX_EXTENSION_LENGTH)
+        return QByteArray();
+    return QByteArray(name + dot + 1, length).toLower();
+}
+
+// Keeps a listing's keep largest files and folds the others into groups by
+// extension, largest groups first; returns how many were folded. Files the
+// map leaves out anyway are dropped first.
+static qint64 summarize(DirListing &listing, int keep)
+{
+    std::vector<DirListing::Entry> &files = listing.files;
+    files.erase(std::remove_if(files.begin(), files.end(), [](const DirListing::Entry &file) {
+        return file.size < MIN_FILE_SIZE;
+    }), files.end());
+    if (int(files.size()) <= keep)
+        return 0;
+    std::nth_element(files.begin(), files.begin() + keep, files.end(),
+                     [](const DirListing::Entry &a, const DirListing::Entry &b) { return a.size > b.size; });
+
+    struct Folded {
+        QByteArray extension;
+        qint64 size;
+        quint32 count;
+    };
+    std::vector<Folded> folded;
+    QHash<QByteArray, int> positions;
+    for (auto file = files.begin() + keep; file != files.end(); ++file) {
+        const QByteArray extension = extensionOf(listing, *file);
+        int position = positions.value(extension, -1);
+        if (position < 0) {
+            position = int(folded.size());
+            positions.insert(extension, position);
+            folded.push_back({extension, 0, 0});
+        }
+        folded[position].size += file->size;
+        folded[position].count++;
+    }
+    const qint64 count = qint64(files.size()) - keep;
+    files.resize(keep);
+
+    std::sort(folded.begin(), folded.end(), [](const Folded &a, const Folded &b) { return a.size > b.size; });
+    Folded rest{QByteArray(), 0, 0};
+    std::vector<Folded> groups;
+    for (const Folded &group : folded) {
+        if (!group.extension.isEmpty() && int(groups.size()) < MAX_FILE_GROUPS - 1) {
+            groups.push_back(group);
+        } else {
+            rest.size += group.size;
+            rest.count += group.count;
+        }
+    }
+    if (rest.count > 0)
+        groups.push_back(rest);
+    // Smallest first, like the files: the tree prepends.
+    std::sort(groups.begin(), groups.end(), [](const Folded &a, const Folded &b) { return a.size < b.size; });
+    for (const Folded &group : groups) {
+        DirListing::Group entry;
+        entry.nameOffset = quint32(listing.names.size());
+        entry.nameLength = quint32(group.extension.size());
+        entry.size = group.size;
+        entry.count = group.count;
+        listing.names.append(group.extension);
+        listing.groups.push_back(entry);
+    }
+    return count;
+}
+
+FolderScanner::FolderScanner(const ScanOptions &options)
+    : m_threadCount(options.threadCount > 0 ? options.threadCount : QThread::idealThreadCount()),
+      m_filter(new ScanFilter(options)),
+      m_devices(options.deviceProfile),
+      m_summaryFiles(options.summaryFiles),
+      m_memoryLimit(options.memoryLimit),
+      m_keepFiles(options.summaryFiles)
+{
+    if (m_threadCount < 1)
+        m_threadCount = 1;
+    for (int i = 0; i < m_threadCount; i++) {
+        m_queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue));
+        m_queues.back()->backend = ScanBackend::create(options.backend);
+        m_queues.back()->backend->setCancelFlag(&m_stopping);
+        m_queues.back()->backend->setFilter(m_filter.get());
+    }
+    m_stats.threads = m_threadCount;
+    m_stats.backend = m_queues.front()->backend->name();
+}
+
+FolderScanner::~FolderScanner()
+{
+    stop();
+}
+
+void FolderScanner::cancel()
+{
+    m_stopping = true;
+    QMutexLocker locker(&m_idleMutex);
+    m_workAvailable.wakeAll();
+}
+
+void FolderScanner::stop()
+{
+    cancel();
+    stopWorkers();
+}
+
+bool FolderScanner::hasHungReads() const
+{
+    if (m_filter->timeoutMs() <= 0)
+        return false;
+    const qint64 now = m_timer.elapsed();
+    for (const auto &queue : m_queues) {
+        QMutexLocker locker(&queue->mutex);
+        if (queue->reading && now - queue->readStartMs > m_filter->timeoutMs())
+            return true;
+    }
+    return false;
+}
+
+std::shared_ptr<FolderTree> FolderScanner::scan(const QString &path)
+{
+    auto tree = std::make_shared<FolderTree>();
+    start(path, *tree);
+    while (!applyPending(*tree)) {
+        QMutexLocker locker(&m_resultMutex);
+        if (m_results.empty())
+            m_resultsReady.wait(&m_resultMutex, IDLE_WAIT_MS);
+    }
+    return tree;
+}
+
+void FolderScanner::start(const QString &path, FolderTree &tree)
+{
+    startAt(tree, tree.createRoot(path));
+}
+
+void FolderScanner::startAt(FolderTree &tree, NodeIndex folder, const QByteArray &skipChild)
+{
+    m_skipChild = skipChild;
+    m_top = folder;
+    m_jobNodes.assign(1, folder);
+    m_nextJobId = 1;
+    m_filter->setTop(tree.folderPath(folder));
+    startJobs({0, tree.folderPath(folder)});
+}
+
+void FolderScanner::revalidate(FolderTree &tree, const std::shared_ptr<const Snapshot> &snapshot)
+{
+    m_snapshot = snapshot;
+    m_stats.revalidation = true;
+    m_top = tree.root();
+    m_jobNodes.clear();
+    m_nextJobId = 0;
+    m_filter->setTop(tree.folderPath(tree.root()));
+    startJobs({NoIndex, tree.folderPath(tree.root()), tree.root()});
+}
+
+void FolderScanner::startJobs(const Job &first)
+{
+    m_timer.start();
+    m_finished = false;
+    if (!QDir(first.path).exists()) {
+        qDebug() << "Directory does not exist:" << first.path;
+        return;
+    }
+    m_dirCount = 0;
+    m_fileCount = 0;
+    m_changedDirs = 0;
+    m_statCalls = 0;
+    m_listingBytes = 0;
+    m_foldedFiles = 0;
+    m_applyNs = 0;
+    for (auto &queue : m_queues) {
+        queue->slowest.clear();
+        queue->slowestFloorNs = 0;
+        queue->device = nullptr;
+    }
+    m_deviceSlots.clear();
+    m_deviceWaits = 0;
+    m_pendingJobs = 0;
+    pushJob(0, first);
+
+    for (int i = 0; i < m_threadCount; i++)
+        m_workers.emplace_back(&FolderScanner::workerLoop, this, i);
+}
+
+bool FolderScanner::applyPending(FolderTree &tree, int budgetMs)
+{
+    if (m_finished)
+        return true;
+    TraceSpan span("applyPending", "scan");
+    QElapsedTimer budget;
+    budget.start();
+    dropHungReads();
+    if (m_summaryFiles > 0 && m_memoryLimit > 0) {
+        // Full detail up to half the limit, then fewer and fewer files.
+        const double left = 1.0 - double(tree.memoryUsage()) / m_memoryLimit;
+        m_keepFiles = int(m_summaryFiles * qBound(0.0, 2 * left, 1.0));
+    }
+    while (true) {
+        if (m_backlogPos == m_backlog.size()) {
+            m_backlog.clear();
+            m_backlogPos = 0;
+            QMutexLocker locker(&m_resultMutex);
+            if (m_results.empty()) {
+                // Workers queue a listing before retiring its job, so no
+                // pending jobs and no queued listings means we are done.
+                if (m_pendingJobs != 0) {
+                    m_applyNs += budget.nsecsElapsed();
+                    return false;
+                }
+                break;
+            }
+            m_backlog.swap(m_results);
+        }
+        applyResult(tree, m_backlog[m_backlogPos++]);
+        if (budgetMs >= 0 && (m_backlogPos & 63) == 0 && budget.elapsed() >= budgetMs) {
+            m_applyNs += budget.nsecsElapsed();
+            return false;
+        }
+    }
+
+    // A worker stuck in a read given up on can't be joined here; the
+    // destructor does, once the read returns.
+    if (m_abandonedReads == 0)
+        stopWorkers();
+    tree.sortBySize(m_top);
+    m_applyNs += budget.nsecsElapsed();
+    m_stats = stats();
+    m_finished = true;
+    m_stats.bytes = tree.isEmpty() ? 0 : tree.node(tree.root()).totalSize;
+    m_stats.complete = true;
+    return true;
+}
+
+ScanStats FolderScanner::stats() const
+{
+    if (m_finished)
+        return m_stats;
+    ScanStats running = m_stats;
+    running.dirs = m_dirCount;
+    running.files = m_fileCount;
+    running.changedDirs = m_changedDirs;
+    running.statCalls = m_statCalls;
+    running.listingBytes = m_listingBytes;
+    running.foldedFiles = m_foldedFiles;
+    running.skippedDirs = m_filter->skippedDirs();
+    running.repeatedDirs = m_filter->repeatedDirs();
+    running.repeatedLinks = m_filter->repeatedLinks();
+    running.slowMounts = m_filter->slowDevices();
+    running.deviceWaits = m_deviceWaits;
+    {
+        QMutexLocker locker(&m_deviceMutex);
+        int kinds[DeviceProfiles::Network + 1] = {};
+        for (const auto &device : m_deviceSlots) {
+            if (device.first != 0)
+                kinds[device.second.kind]++;
+        }
+        QStringList counts;
+        for (int kind = DeviceProfiles::Solid; kind <= DeviceProfiles::Network; kind++) {
+            if (kinds[kind] > 0)
+                counts << QString("%1 %2").arg(kinds[kind]).arg(DeviceProfiles::kindName(DeviceProfiles::Kind(kind)));
+        }
+        running.devices = counts.join(", ");
+    }
+    running.applyMs = m_applyNs / 1000000;
+    running.elapsedMs = m_timer.isValid() ? m_timer.elapsed() : 0;
+    running.slowest.clear();
+    for (const auto &queue : m_queues) {
+        QMutexLocker locker(&queue->mutex);
+        running.slowest.insert(running.slowest.end(), queue->slowest.begin(), queue->slowest.end());
+    }
+    std::sort(running.slowest.begin(), running.slowest.end(),
+              [](const ScanStats::SlowDirectory &a, const ScanStats::SlowDirectory &b) { return a.ms > b.ms; });
+    if (running.slowest.size() > SLOWEST_KEPT)
+        running.slowest.resize(SLOWEST_KEPT);
+    return running;
+}
+
+void FolderScanner::stopWorkers()
+{
+    {
+        QMutexLocker locker(&m_idleMutex);
+        m_workAvailable.wakeAll();
+    }
+    for (auto &worker : m_workers)
+        worker.join();
+    m_workers.clear();
+}
+
+void FolderScanner::workerLoop(int index)
+{
+    WorkQueue &own = *m_queues[index];
+    Job job;
+    while (!m_stopping) {
+        if (takeJob(index, job)) {
+            // Without a free slot the job waits with its device and this
+            // worker looks for something else to do.
+            DeviceSlots *device = beginRead(own, job);
+            while (device) {
+                own.backend->setInodeOrder(DeviceProfiles::readsInInodeOrder(device->kind));
+                if (readDirectory(index, job))
+                    finishJob();
+                if (!endRead(*device, job))
+                    break;
+            }
+            continue;
+        }
+        if (m_pendingJobs == 0)
+            return;
+        QMutexLocker locker(&m_idleMutex);
+        if (m_pendingJobs == 0 || m_stopping)
+            return;
+        m_idleWorkers++;
+        m_workAvailable.wait(&m_idleMutex, IDLE_WAIT_MS);
+        m_idleWorkers--;
+    }
+}
+
+FolderScanner::DeviceSlots *FolderScanner::beginRead(WorkQueue &own, const Job &job)
+{
+    if (!own.device || own.deviceId != job.device) {
+        QMutexLocker locker(&m_deviceMutex);
+        auto it = m_deviceSlots.find(job.device);
+        if (it == m_deviceSlots.end()) {
+            DeviceSlots added;
+            added.kind = m_devices.kindOf(job.device);
+            added.limit = DeviceProfiles::readLimit(added.kind, m_threadCount);
+            it = m_deviceSlots.emplace(job.device, std::move(added)).first;
+        }
+        own.deviceId = job.device;
+        own.device = &it->second;
+    }
+    DeviceSlots &device = *own.device;
+    // With a slot for every worker there is nothing to count.
+    if (device.limit >= m_threadCount)
+        return &device;
+    QMutexLocker locker(&m_deviceMutex);
+    if (device.active < device.limit) {
+        device.active++;
+        return &device;
+    }
+    // Still pending, so the scan doesn't end while it waits.
+    if (job.weight > 0)
+        device.waiting.push_front(job);
+    else
+        device.waiting.push_back(job);
+    m_deviceWaits++;
+    return nullptr;
+}
+
+bool FolderScanner::endRead(DeviceSlots &device, Job &next)
+{
+    if (device.limit >= m_threadCount)
+        return false;
+    QMutexLocker locker(&m_deviceMutex);
+    if (device.waiting.empty() || m_stopping) {
+        device.active--;
+        return false;
+    }
+    next = std::move(device.waiting.front());
+    device.waiting.pop_front();
+    return true;
+}
+
+void FolderScanner::finishJob()
+{
+    // Children were pushed before this decrement, so zero really means done.
+    if (--m_pendingJobs == 0) {
+        {
+            QMutexLocker locker(&m_idleMutex);
+            m_workAvailable.wakeAll();
+        }
+        QMutexLocker locker(&m_resultMutex);
+        m_resultsReady.wakeAll();
+    }
+}
+
+bool FolderScanner::lighter(const Job &a, const Job &b)
+{
+    return a.weight < b.weight || (a.weight == b.weight && a.id < b.id);
+}
+
+bool FolderScanner::takeJob(int index, Job &job)
+{
+    if (m_urgentCount > 0) {
+        QMutexLocker locker(&m_urgentMutex);
+        if (!m_urgent.empty()) {
+            std::pop_heap(m_urgent.begin(), m_urgent.end(), lighter);
+            job = std::move(m_urgent.back());
+            m_urgent.pop_back();
+            m_urgentCount--;
+            return true;
+        }
+    }
+    {
+        WorkQueue &own = *m_queues[index];
+        QMutexLocker locker(&own.mutex);
+        if (!own.jobs.empty()) {
+            job = std::move(own.jobs.back());
+            own.jobs.pop_back();
+            return true;
+        }
+    }
+    // Steal the oldest job of another worker: it is the closest to the root
+    // and therefore most likely to carry a large subtree with it.
+    for (int i = 1; i < m_threadCount; i++) {
+        WorkQueue &victim = *m_queues[(index + i) % m_threadCount];
+        QMutexLocker locker(&victim.mutex);
+        if (!victim.jobs.empty()) {
+            job = std::move(victim.jobs.front());
+            victim.jobs.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void FolderScanner::pushJob(int index, Job job)
+{
+    ++m_pendingJobs;
+    if (job.weight > 0) {
+        QMutexLocker locker(&m_urgentMutex);
+        m_urgent.push_back(std::move(job));
+        std::push_heap(m_urgent.begin(), m_urgent.end(), lighter);
+        m_urgentCount++;
+    } else {
+        WorkQueue &own = *m_queues[index];
+        QMutexLocker locker(&own.mutex);
+        own.jobs.push_back(std::move(job));
+    }
+    if (m_idleWorkers > 0) {
+        QMutexLocker locker(&m_idleMutex);
+        m_workAvailable.wakeOne();
+    }
+}
+
+void FolderScanner::setFocus(const std::vector<ScanFocus> &focus)
+{
+    // Longest path first, so the first match is the deepest.
+    auto sorted = std::make_shared<std::vector<ScanFocus>>(focus);
+    std::stable_sort(sorted->begin(), sorted->end(), [](const ScanFocus &a, const ScanFocus &b) {
+        return a.path.size() > b.path.size();
+    });
+    {
+        QMutexLocker locker(&m_focusMutex);
+        m_focus = sorted;
+    }
+
+    // Weigh every pending job again: jobs that lost their focus go back to
+    // the first worker's deque, newly focused ones move to the heap.
+    QMutexLocker urgentLocker(&m_urgentMutex);
+    std::vector<Job> unfocused;
+    std::vector<Job> focused;
+    for (Job &job : m_urgent) {
+        job.weight = focusWeight(*sorted, job.path);
+        (job.weight > 0 ? focused : unfocused).push_back(std::move(job));
+    }
+    for (auto &queue : m_queues) {
+        QMutexLocker locker(&queue->mutex);
+        std::deque<Job> kept;
+        for (Job &job : queue->jobs) {
+            job.weight = focusWeight(*sorted, job.path);
+            if (job.weight > 0)
+                focused.push_back(std::move(job));
+            else
+                kept.push_back(std::move(job));
+        }
+        if (queue == m_queues.front())
+            kept.insert(kept.begin(), std::make_move_iterator(unfocused.begin()), std::make_move_iterator(unfocused.end()));
+        queue->jobs.swap(kept);
+    }
+    m_urgent.swap(focused);
+    std::make_heap(m_urgent.begin(), m_urgent.end(), lighter);
+    m_urgentCount = int(m_urgent.size());
+}
+
+float FolderScanner::focusWeight(const std::vector<ScanFocus> &focus, const QString &path)
+{
+    for (const ScanFocus &area : focus) {
+        const int length = area.path.size();
+        if (path.startsWith(area.path) &&
+            (path.size() == length || area.path.endsWith('/') || path.at(length) == '/'))
+            return area.weight;
+    }
+    return 0;
+}
+
+std::shared_ptr<const std::vector<ScanFocus>> FolderScanner::currentFocus()
+{
+    QMutexLocker locker(&m_focusMutex);
+    return m_focus;
+}
+
+bool FolderScanner::readDirectory(int index, const Job &job)
+{
+    WorkQueue &own = *m_queues[index];
+    TraceSpan span("readDirectory", "scan");
+    span.setDetail(job.path);
+    QElapsedTimer timer;
+    timer.start();
+    const bool timed = beginTimedRead(own, job);
+    // A snapshot folder whose mtime hasn't moved has the same entries as
+    // when it was saved; only its subdirectories still need a look. This
+    // reads the snapshot's own read-only copy, never the live tree.
+    if (job.known != NoIndex) {
+        const FolderNode &saved = m_snapshot->node(job.known);
+        const qint64 modified = own.backend->modificationTime(job.path);
+        m_statCalls++;
+        if (modified >= 0 && modified == saved.modified) {
+            if (timed && !endTimedRead(own))
+                return false;
+            std::vector<Job> children;
+            for (NodeIndex child = saved.firstChild; child != NoIndex; child = m_snapshot->node(child).nextSibling) {
+                children.push_back({NoIndex, childPath(job.path, m_snapshot->name(child)), child});
+                children.back().device = childDevice(children.back().path, job.device);
+            }
+            m_fileCount += saved.fileCount;
+            m_dirCount++;
+            const auto focus = currentFocus();
+            for (Job &child : children) {
+                child.weight = focus ? focusWeight(*focus, child.path) : 0;
+                pushJob(index, std::move(child));
+            }
+            recordReadTime(own, job.path, timer.nsecsElapsed());
+            return true;
+        }
+    }
+
+    Result result;
+    result.job = job.id;
+    result.node = job.known;
+    // On a file system found too slow, the directory stays empty.
+    bool read = true;
+    if (readHung(job.device))
+        m_filter->markSlow(job.device);
+    if (m_filter->admitRead(job.device)) {
+        read = own.backend->readDirectory(job.path, result.listing);
+    } else {
+        result.listing.clear();
+        result.listing.device = job.device;
+    }
+    if (timed && !endTimedRead(own))
+        return false;
+    // A cancelled scan publishes nothing more.
+    if (m_stopping)
+        return true;
+    if (!read) {
+        qDebug() << "Cannot read directory:" << job.path;
+        // What could be read is shown, but without an mtime, so that a
+        // scan resumed from the snapshot reads the folder again.
+        result.listing.modified = -1;
+    }
+    const qint64 listedFiles = qint64(result.listing.files.size());
+    if (m_summaryFiles > 0)
+        m_foldedFiles += summarize(result.listing, m_keepFiles.load(std::memory_order_relaxed));
+
+    // Smallest first: the tree prepends, so the file list ends up largest
+    // first and the layout never has to sort it.
+    std::sort(result.listing.files.begin(), result.listing.files.end(),
+              [](const DirListing::Entry &a, const DirListing::Entry &b) { return a.size < b.size; });
+
+    std::vector<DirListing::Entry> &dirs = result.listing.dirs;
+    if (job.id == 0 && !m_skipChild.isEmpty()) {
+        const DirListing &listing = result.listing;
+        dirs.erase(std::remove_if(dirs.begin(), dirs.end(), [&](const DirListing::Entry &dir) {
+            return listing.name(dir) == m_skipChild;
+        }), dirs.end());
+    }
+    if (job.known != NoIndex) {
+        // Subdirectories that were saved before get checked in turn; the
+        // others are new and are scanned like any other.
+        QHash<QByteArray, NodeIndex> saved;
+        for (NodeIndex child = m_snapshot->node(job.known).firstChild; child != NoIndex; child = m_snapshot->node(child).nextSibling)
+            saved.insert(m_snapshot->name(child), child);
+        for (const DirListing::Entry &dir : dirs)
+            result.known.push_back(saved.value(result.listing.name(dir), NoIndex));
+        m_changedDirs++;
+    }
+    result.firstChildJob = m_nextJobId.fetch_add(static_cast<quint32>(dirs.size()));
+    std::vector<Job> children;
+    children.reserve(dirs.size());
+    for (size_t i = 0; i < dirs.size(); i++) {
+        const NodeIndex known = result.known.empty() ? NoIndex : result.known[i];
+        children.push_back({result.firstChildJob + static_cast<quint32>(i), childPath(job.path, result.listing.name(dirs[i])), known});
+        children.back().device = childDevice(children.back().path, result.listing.device);
+    }
+    m_fileCount += listedFiles;
+    m_dirCount++;
+    m_statCalls += result.listing.statCalls;
+    m_listingBytes += result.listing.names.size() +
+                      qint64(result.listing.files.size() + dirs.size()) * qint64(sizeof(DirListing::Entry)) +
+                      qint64(result.listing.groups.size()) * qint64(sizeof(DirListing::Group));
+    recordReadTime(own, job.path, timer.nsecsElapsed());
+
+    {
+        QMutexLocker locker(&m_resultMutex);
+        m_results.push_back(std::move(result));
+    }
+    const auto focus = currentFocus();
+    for (Job &child : children) {
+        child.weight = focus ? focusWeight(*focus, child.path) : 0;
+        pushJob(index, std::move(child));
+    }
+    return true;
+}
+
+// Notes that own's worker starts a read of job, if on a file system that
+// may hang; true if it did.
+bool FolderScanner::beginTimedRead(WorkQueue &own, const Job &job)
+{
+    if (!m_filter->mayHang(job.device))
+        return false;
+    QMutexLocker locker(&own.mutex);
+    own.reading = true;
+    own.abandoned = false;
+    own.readStartMs = m_timer.elapsed();
+    own.readJob = job;
+    return true;
+}
+
+// Ends the read begun by beginTimedRead(); false if the scan gave up on it
+// meanwhile, and so has published its folder already.
+bool FolderScanner::endTimedRead(WorkQueue &own)
+{
+    QMutexLocker locker(&own.mutex);
+    own.reading = false;
+    if (!own.abandoned)
+        return true;
+    own.abandoned = false;
+    m_abandonedReads--;
+    return false;
+}
+
+// Whether a read on device has gone on for longer than the mount timeout,
+// so that it counts as slow before the next tick gives up on the read.
+bool FolderScanner::readHung(quint64 device)
+{
+    if (!m_filter->mayHang(device))
+        return false;
+    const qint64 now = m_timer.elapsed();
+    for (auto &queue : m_queues) {
+        QMutexLocker locker(&queue->mutex);
+        if (queue->reading && queue->readJob.device == device && now - queue->readStartMs > m_filter->timeoutMs())
+            return true;
+    }
+    return false;
+}
+
+// Gives up on the reads that have gone on for longer than the mount
+// timeout, and on the jobs queued for a file system given up on. Their
+// jobs are done: a new folder stays empty, without an mtime so that it is
+// read again next time, and a snapshot folder keeps what was saved.
+void FolderScanner::dropHungReads()
+{
+    if (m_filter->timeoutMs() <= 0)
+        return;
+    const qint64 now = m_timer.elapsed();
+    std::vector<Job> dropped;
+    for (auto &queue : m_queues) {
+        QMutexLocker locker(&queue->mutex);
+        if (queue->reading && !queue->abandoned && now - queue->readStartMs > m_filter->timeoutMs()) {
+            queue->abandoned = true;
+            m_abandonedReads++;
+            m_filter->markSlow(queue->readJob.device);
+            dropped.push_back(queue->readJob);
+        }
+    }
+    if (m_filter->slowDevices() > 0) {
+        // Queued behind a hung read, they would wait for it to return.
+        const auto live = [this](const Job &job) { return !m_filter->isSlow(job.device); };
+        for (auto &queue : m_queues) {
+            QMutexLocker locker(&queue->mutex);
+            std::deque<Job> &jobs = queue->jobs;
+            const auto kept = std::stable_partition(jobs.begin(), jobs.end(), live);
+            dropped.insert(dropped.end(), std::make_move_iterator(kept), std::make_move_iterator(jobs.end()));
+            jobs.erase(kept, jobs.end());
+        }
+        QMutexLocker locker(&m_deviceMutex);
+        for (auto &device : m_deviceSlots) {
+            std::deque<Job> &waiting = device.second.waiting;
+            if (waiting.empty() || !m_filter->isSlow(device.first))
+                continue;
+            dropped.insert(dropped.end(), std::make_move_iterator(waiting.begin()), std::make_move_iterator(waiting.end()));
+            waiting.clear();
+        }
+    }
+    if (dropped.empty())
+        return;
+    {
+        QMutexLocker locker(&m_resultMutex);
+        for (const Job &job : dropped) {
+            if (job.known != NoIndex)
+                continue;
+            Result result;
+            result.job = job.id;
+            result.firstChildJob = m_nextJobId;
+            result.listing.clear();
+            result.listing.device = job.device;
+            result.listing.modified = -1;
+            m_results.push_back(std::move(result));
+        }
+    }
+    m_dirCount += qint64(dropped.size());
+    // Published before they are done, as workers do.
+    for (size_t i = 0; i < dropped.size(); i++)
+        finishJob();
+}
+
+// The device a job below parentDevice reads from: that of a file system
+// that may hang mounted right there, which its read is timed against.
+quint64 FolderScanner::childDevice(const QString &path, quint64 parentDevice) const
+{
+    const quint64 mounted = m_filter->mountedAt(path);
+    return mounted ? mounted : parentDevice;
+}
+
+void FolderScanner::recordReadTime(WorkQueue &own, const QString &path, qint64 ns)
+{
+    if (ns <= own.slowestFloorNs)
+        return;
+    QMutexLocker locker(&own.mutex);
+    auto &slowest = own.slowest;
+    const double ms = ns / 1e6;
+    slowest.push_back({path, ms});
+    std::sort(slowest.begin(), slowest.end(),
+              [](const ScanStats::SlowDirectory &a, const ScanStats::SlowDirectory &b) { return a.ms > b.ms; });
+    if (slowest.size() > SLOWEST_KEPT) {
+        slowest.pop_back();
+        own.slowestFloorNs = qint64(slowest.back().ms * 1e6);
+    }
+}
+
+void FolderScanner::applyResult(FolderTree &tree, const Result &result)
+{
+    const NodeIndex node = result.node != NoIndex ? result.node : m_jobNodes[result.job];
+    const DirListing &listing = result.listing;
+    const char *names = listing.names.constData();
+    if (result.node != NoIndex) {
+        // A changed snapshot folder: its files are replaced by the new
+        // listing, and subdirectories that are gone are dropped.
+        tree.clearFiles(node);
+        std::vector<NodeIndex> kept(result.known);
+        std::sort(kept.begin(), kept.end());
+        for (NodeIndex child = tree.node(node).firstChild; child != NoIndex;) {
+            const NodeIndex next = tree.node(child).nextSibling;
+            if (!std::binary_search(kept.begin(), kept.end(), child))
+                tree.removeFolder(child);
+            child = next;
+        }
+    }
+    tree.setModified(node, listing.modified);
+    m_treeChanged = true;
+    CategorySizes added;
+    for (const DirListing::Entry &file : listing.files) {
+        if (file.size >= MIN_FILE_SIZE) {
+            const FileIndex index = tree.addFile(node, names + file.nameOffset, file.nameLength, file.size, file.modified);
+            added.add(tree.file(index).type, file.size);
+        }
+    }
+    for (const DirListing::Group &group : listing.groups) {
+        const GroupIndex index = tree.addGroup(node, names + group.nameOffset, group.nameLength, group.count, group.size);
+        added.add(tree.group(index).type, group.size, group.count);
+    }
+    if (!listing.dirs.empty()) {
+        const size_t end = result.firstChildJob + listing.dirs.size();
+        if (m_jobNodes.size() < end)
+            m_jobNodes.resize(end, NoIndex);
+        for (size_t i = 0; i < listing.dirs.size(); i++) {
+            if (!result.known.empty() && result.known[i] != NoIndex)
+                continue;
+            const DirListing::Entry &dir = listing.dirs[i];
+            m_jobNodes[result.firstChildJob + i] = tree.addFolder(node, names + dir.nameOffset, dir.nameLength);
+        }
+    }
+    // Every ancestor's totals grow right away, so a partial tree already
+    // has consistent sizes at every level.
+    tree.addSize(node, added);
+}
+
+QString FolderScanner::childPath(const QString &parent, const QByteArray &name)
+{
+    if (parent.endsWith('/'))
+        return parent + QFile::decodeName(name);
+    return parent + '/' + QFile::decodeName(name);
+}
@@ -0,0 +1,281 @@
+#ifndef FOLDERSCANNER_H
+#define FOLDERSCANNER_H
+
+#include "deviceprofiles.h"
+#include "foldertree.h"
+#include "scanbackend.h"
+#include "scanfilter.h"
+
+#include <QMutex>
+#include <QWaitCondition>
+#include <QString>
+#include <QElapsedTimer>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Files smaller than this are left out of the map entirely.
+static const qint64 MIN_FILE_SIZE = 100;
+
+// Tunables for a scan. A threadCount of 0 means one worker per core.
+struct ScanOptions {
+    int threadCount = 0;
+    ScanBackend::Kind backend = ScanBackend::Auto;
+    bool useSnapshots = true;         // Start from a saved snapshot and save new ones.
+    bool watchChanges = true;         // Keep the tree up to date once scanned.
+    // Above zero, a summary scan: each folder keeps only this many of its
+    // largest files and the others are counted per extension. Summaries
+    // are neither watched nor saved as snapshots.
+    int summaryFiles = 0;
+    // For a summary scan, in bytes: as the tree grows towards this, folders
+    // keep fewer files, down to none.
+    qint64 memoryLimit = 0;
+    // Stay on the file system the scan starts on, like du -x.
+    bool oneFileSystem = false;
+    // Leave out /proc, /sys and the like.
+    bool skipPseudoFileSystems = true;
+    // A directory on a network or FUSE file system that takes longer than
+    // this to read, in ms, marks its file system as too slow, and the rest
+    // of it is skipped; 0 waits for anything. Local disks are never timed.
+    int mountTimeoutMs = 10000;
+    // What to treat every file system as; Auto looks each one up, and
+    // limits how many workers read from it at once to what it takes well.
+    DeviceProfiles::Kind deviceProfile = DeviceProfiles::Auto;
+
+    bool summarizes() const { return summaryFiles > 0; }
+};
+
+// Throughput figures of a scan, either running or complete.
+struct ScanStats {
+    qint64 dirs = 0;
+    qint64 files = 0;
+    qint64 bytes = 0;
+    qint64 elapsedMs = 0;
+    int threads = 0;
+    QString backend;
+    bool complete = false;
+    bool revalidation = false;        // Checking a snapshot rather than a fresh scan.
+    bool imported = false;            // Read from a file listing; see ListingImporter.
+    qint64 skippedLines = 0;          // Of the listing, that weren't size and path.
+    qint64 changedDirs = 0;
+    qint64 statCalls = 0;
+    qint64 listingBytes = 0;          // Read into directory listings, names and entries,
+                                      // or of an imported listing.
+    qint64 applyMs = 0;               // Spent adding listings to the tree.
+    qint64 foldedFiles = 0;           // Counted into file groups by a summary scan.
+    qint64 skippedDirs = 0;           // On pseudo, other or slow file systems.
+    qint64 repeatedDirs = 0;          // Reached again through a symlink or bind mount.
+    qint64 repeatedLinks = 0;         // Hard links or symlinks to a file already counted.
+    int slowMounts = 0;
+    QString devices;                  // How many file systems of each kind were read.
+    qint64 deviceWaits = 0;           // Folders that waited for a busy disk or server.
+
+    // The directories that took longest to read, slowest first.
+    struct SlowDirectory {
+        QString path;
+        double ms;
+    };
+    std::vector<SlowDirectory> slowest;
+
+    double dirsPerSecond() const;
+    double filesPerSecond() const;
+    QString summary() const;
+    // Every counter, one per line, for the stats overlay.
+    QString details() const;
+};
+
+// A folder the user can see, and how much room it takes on screen.
+struct ScanFocus {
+    QString path;
+    float weight;
+};
+
+// Parallel directory scanner. Every directory is one job; each worker keeps
+// its own deque of jobs, works on it LIFO (depth first, good locality) and
+// steals FIFO from the other workers when it runs dry, so big subtrees get
+// spread over all threads without a central queue becoming the bottleneck.
+//
+// Workers never touch the tree. They queue their listings, and whichever
+// single thread owns the FolderTree applies them with applyPending(), so the
+// tree is always consistent between two calls and readers on that thread
+// need no locking. A folder's listing is always queued before any job below
+// it, so its node exists by the time its children's listings are applied.
+//
+// Jobs below a focused folder skip the queues: they go to a shared heap,
+// heaviest first, which every worker drains before its own deque.
+//
+// Each device only gets as many readers at once as its kind takes well
+// (see DeviceProfiles). A job for a device that has them all waits with
+// the device, and the first of its readers to finish takes it over, so
+// the other workers move on to other devices instead of queueing up.
+//
+// A read on a network or FUSE file system may hang for good. Each tick,
+// applyPending() gives up on those that have gone on for longer than the
+// mount timeout, and on the jobs waiting for the same file system: their
+// new folders are published empty, snapshot folders keep what was saved,
+// and their jobs are counted done, so the scan finishes without them. A
+// read given up on that does return is dropped.
+class FolderScanner
+{
+public:
+    explicit FolderScanner(const ScanOptions &options = ScanOptions());
+    // Stops the workers; listings not yet applied are dropped.
+    ~FolderScanner();
+    // Asks the workers to stop without waiting for them; a directory being
+    // read is abandoned part way. The scan never finishes after this.
+    void cancel();
+    // Cancels and waits for the workers, as the destructor does.
+    void stop();
+    // Whether a worker is in a read that has gone on for longer than the
+    // mount timeout, which it may never return from.
+    bool hasHungReads() const;
+
+    // Scans path and blocks until the whole tree is built.
+    std::shared_ptr<FolderTree> scan(const QString &path);
+
+    // Resets tree to an empty root for path and starts the workers.
+    void start(const QString &path, FolderTree &tree);
+    // Starts the workers on folder, an existing and still empty folder of
+    // tree, leaving out its subdirectory skipChild, which is already scanned.
+    void startAt(FolderTree &tree, NodeIndex folder, const QByteArray &skipChild = QByteArray());
+    // Brings tree, freshly adopted from snapshot, up to date: directories
+    // whose mtime still matches are trusted, the others are read again and
+    // new subdirectories scanned.
+    void revalidate(FolderTree &tree, const std::shared_ptr<const Snapshot> &snapshot);
+    // Applies the listings queued since the last call, for at most budgetMs
+    // milliseconds (no limit if negative). Returns true once everything has
+    // been read and applied; the tree is then sorted and final.
+    bool applyPending(FolderTree &tree, int budgetMs = -1);
+    // Reads the folders below these paths first, the heaviest first; the
+    // deepest matching path decides. Pending jobs are re-sorted right away.
+    void setFocus(const std::vector<ScanFocus> &focus);
+
+    ScanStats stats() const;
+    int threadCount() const { return m_threadCount; }
+    // Whether the scan has changed the tree at all.
+    bool changedTree() const { return m_treeChanged; }
+
+private:
+    struct Job {
+        quint32 id;
+        QString path;
+        NodeIndex known = NoIndex;    // Folder of the snapshot being revalidated.
+        float weight = 0;             // Above zero: below a focused folder.
+        quint64 device = 0;           // The parent's file system, if known.
+    };
+
+    struct Result {
+        quint32 job;
+        quint32 firstChildJob;
+        DirListing listing;
+        // For a changed snapshot folder: the folder, and per listed
+        // subdirectory the folder it already is, or NoIndex if it is new.
+        NodeIndex node = NoIndex;
+        std::vector<NodeIndex> known;
+    };
+
+    // Reads in flight on one device, against its limit, and the jobs that
+    // wait for one of them to finish.
+    struct DeviceSlots {
+        DeviceProfiles::Kind kind = DeviceProfiles::Solid;
+        int limit = 0;
+        int active = 0;
+        std::deque<Job> waiting;
+    };
+
+    struct WorkQueue {
+        QMutex mutex;
+        std::deque<Job> jobs;
+        std::unique_ptr<ScanBackend> backend;
+        // This worker's slowest reads, and the time a read must beat to
+        // get in, so the mutex is only taken when one does.
+        std::vector<ScanStats::SlowDirectory> slowest;
+        std::atomic<qint64> slowestFloorNs{0};
+        // The device of this worker's last job, to skip the lookup.
+        quint64 deviceId = 0;
+        DeviceSlots *device = nullptr;
+        // The read this worker is in, if on a file system that may hang:
+        // its job, when it started, and whether the scan gave up on it.
+        bool reading = false;
+        bool abandoned = false;
+        qint64 readStartMs = 0;
+        Job readJob;
+    };
+
+    void workerLoop(int index);
+    void startJobs(const Job &first);
+    void stopWorkers();
+    bool takeJob(int index, Job &job);
+    void pushJob(int index, Job job);
+    // Heap order of the urgent jobs: heaviest first.
+    static bool lighter(const Job &a, const Job &b);
+    static float focusWeight(const std::vector<ScanFocus> &focus, const QString &path);
+    std::shared_ptr<const std::vector<ScanFocus>> currentFocus();
+    // Takes a read slot on job's device, or queues job there if none is
+    // free and returns null.
+    DeviceSlots *beginRead(WorkQueue &own, const Job &job);
+    // Hands the slot over to the next waiting job, if there is one, in next.
+    bool endRead(DeviceSlots &device, Job &next);
+    void finishJob();
+    // False if the scan gave up on the read meanwhile and counted it done.
+    bool readDirectory(int index, const Job &job);
+    bool beginTimedRead(WorkQueue &own, const Job &job);
+    bool endTimedRead(WorkQueue &own);
+    bool readHung(quint64 device);
+    void dropHungReads();
+    quint64 childDevice(const QString &path, quint64 parentDevice) const;
+    void recordReadTime(WorkQueue &own, const QString &path, qint64 ns);
+    void applyResult(FolderTree &tree, const Result &result);
+    static QString childPath(const QString &parent, const QByteArray &name);
+
+    int m_threadCount;
+    std::vector<std::unique_ptr<WorkQueue>> m_queues;
+    std::atomic<qint64> m_pendingJobs{0};
+    std::atomic<int> m_idleWorkers{0};
+    std::atomic<qint64> m_dirCount{0};
+    std::atomic<qint64> m_fileCount{0};
+    std::atomic<quint32> m_nextJobId{0};
+    std::atomic<qint64> m_statCalls{0};
+    std::atomic<qint64> m_listingBytes{0};
+    std::atomic<qint64> m_foldedFiles{0};
+    std::unique_ptr<ScanFilter> m_filter;
+    DeviceProfiles m_devices;
+    mutable QMutex m_deviceMutex;
+    std::unordered_map<quint64, DeviceSlots> m_deviceSlots;
+    std::atomic<qint64> m_deviceWaits{0};
+    std::atomic<int> m_abandonedReads{0};   // Given up on, but still in flight.
+    int m_summaryFiles;
+    qint64 m_memoryLimit;
+    // Files per folder a summary scan keeps at the moment; shrinks with the
+    // memory left.
+    std::atomic<int> m_keepFiles;
+    qint64 m_applyNs = 0;
+    QMutex m_idleMutex;
+    QWaitCondition m_workAvailable;
+    QMutex m_resultMutex;
+    QWaitCondition m_resultsReady;
+    std::vector<Result> m_results;
+    std::vector<Result> m_backlog;
+    size_t m_backlogPos = 0;
+    std::vector<NodeIndex> m_jobNodes;
+    NodeIndex m_top = NoIndex;        // Where the scan started.
+    QByteArray m_skipChild;
+    std::shared_ptr<const Snapshot> m_snapshot;
+    std::atomic<qint64> m_changedDirs{0};
+    bool m_treeChanged = false;
+    QMutex m_focusMutex;
+    std::shared_ptr<const std::vector<ScanFocus>> m_focus;
+    QMutex m_urgentMutex;
+    std::vector<Job> m_urgent;        // A heap by weight.
+    std::atomic<int> m_urgentCount{0};
+    std::vector<std::thread> m_workers;
+    std::atomic<bool> m_stopping{false};
+    bool m_finished = false;
+    QElapsedTimer m_timer;
+    ScanStats m_stats;
+};
+
+#endif // FOLDERSCANNER_H
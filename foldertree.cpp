@@ -0,0 +1,545 @@
+#include "foldertree.h"
+#include "snapshot.h"
+
+#include <QFile>
+#include <algorithm>
+#include <cstring>
+
+NameId NamePool::intern(const char *data, int length)
+{
+    if (m_slots.empty() || (m_count + 1) * 10 > m_slots.size() * 7)
+        rehash(std::max<size_t>(1024, m_slots.size() * 2));
+    const size_t mask = m_slots.size() - 1;
+    size_t slot = hash(data, length) & mask;
+    while (m_slots[slot] != NoIndex) {
+        int storedLength;
+        const char *stored = this->data(m_slots[slot], storedLength);
+        if (storedLength == length && memcmp(stored, data, length) == 0)
+            return m_slots[slot];
+        slot = (slot + 1) & mask;
+    }
+    const NameId id = store(data, length);
+    m_slots[slot] = id;
+    m_count++;
+    return id;
+}
+
+const char *NamePool::data(NameId id, int &length) const
+{
+    const char *entry = m_blocks[id >> BLOCK_BITS] + (id & (BLOCK_SIZE - 1));
+    quint16 storedLength;
+    memcpy(&storedLength, entry, sizeof(storedLength));
+    length = storedLength;
+    return entry + sizeof(storedLength);
+}
+
+QByteArray NamePool::bytes(NameId id) const
+{
+    int length;
+    const char *name = data(id, length);
+    return QByteArray(name, length);
+}
+
+QString NamePool::string(NameId id) const
+{
+    return QFile::decodeName(bytes(id));
+}
+
+qint64 NamePool::memoryUsage() const
+{
+    return qint64(m_owned.size()) * BLOCK_SIZE + qint64(m_slots.size()) * sizeof(NameId);
+}
+
+void NamePool::clear()
+{
+    m_blocks.clear();
+    m_blockLengths.clear();
+    m_owned.clear();
+    m_blockUsed = BLOCK_SIZE;
+    m_slots.clear();
+    m_count = 0;
+}
+
+void NamePool::adopt(const std::vector<char *> &blocks, const std::vector<quint32> &lengths, quint32 count)
+{
+    clear();
+    m_blocks = blocks;
+    m_blockLengths = lengths;
+    m_count = count;
+}
+
+// FNV-1a; names are short, so anything fancier doesn't pay off.
+quint32 NamePool::hash(const char *data, int length)
+{
+    quint32 h = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        h ^= static_cast<unsigned char>(data[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+NameId NamePool::store(const char *data, int length)
+{
+    const quint16 storedLength = static_cast<quint16>(std::min(length, 0xffff));
+    const quint32 needed = sizeof(storedLength) + storedLength;
+    if (m_blockUsed + needed > BLOCK_SIZE) {
+        m_owned.emplace_back(new char[BLOCK_SIZE]);
+        m_blocks.push_back(m_owned.back().get());
+        m_blockLengths.push_back(0);
+        m_blockUsed = 0;
+    }
+    char *entry = m_blocks.back() + m_blockUsed;
+    memcpy(entry, &storedLength, sizeof(storedLength));
+    memcpy(entry + sizeof(storedLength), data, storedLength);
+    const NameId id = (static_cast<quint32>(m_blocks.size() - 1) << BLOCK_BITS) | m_blockUsed;
+    m_blockUsed += needed;
+    m_blockLengths.back() = m_blockUsed;
+    return id;
+}
+
+void NamePool::rehash(size_t slotCount)
+{
+    std::vector<NameId> table(slotCount, NoIndex);
+    if (m_slots.empty() && m_count > 0) {
+        // Adopted names have no table yet: walk the blocks instead.
+        while ((m_count + 1) * 10 > table.size() * 7)
+            table.assign(table.size() * 2, NoIndex);
+        for (size_t block = 0; block < m_blocks.size(); block++) {
+            for (quint32 offset = 0; offset < m_blockLengths[block];) {
+                const NameId id = (static_cast<quint32>(block) << BLOCK_BITS) | offset;
+                int length;
+                data(id, length);
+                insertSlot(table, id);
+                offset += sizeof(quint16) + length;
+            }
+        }
+    } else {
+        for (NameId id : m_slots) {
+            if (id != NoIndex)
+                insertSlot(table, id);
+        }
+    }
+    m_slots.swap(table);
+}
+
+void NamePool::insertSlot(std::vector<NameId> &table, NameId id) const
+{
+    const size_t mask = table.size() - 1;
+    int length;
+    const char *name = data(id, length);
+    size_t slot = hash(name, length) & mask;
+    while (table[slot] != NoIndex)
+        slot = (slot + 1) & mask;
+    table[slot] = id;
+}
+
+NodeIndex FolderTree::createRoot(const QString &path)
+{
+    m_nodes.clear();
+    m_files.clear();
+    m_groups.clear();
+    m_categories.clear();
+    m_names.clear();
+    m_snapshot.reset();
+    const QByteArray encoded = QFile::encodeName(path);
+    FolderNode root;
+    root.name = m_names.intern(encoded.constData(), encoded.size());
+    m_root = m_nodes.append(root);
+    m_version++;
+    return m_root;
+}
+
+NodeIndex FolderTree::addParentRoot(const QString &parentPath)
+{
+    const NodeIndex oldRoot = m_root;
+    const QByteArray encoded = QFile::encodeName(parentPath);
+    FolderNode root;
+    root.name = m_names.intern(encoded.constData(), encoded.size());
+    if (oldRoot != NoIndex) {
+        // The old root's name was its whole path; keep only the last component.
+        QByteArray path = m_names.bytes(m_nodes[oldRoot].name);
+        while (path.size() > 1 && path.endsWith('/'))
+            path.chop(1);
+        const QByteArray name = path.mid(path.lastIndexOf('/') + 1);
+        m_nodes[oldRoot].name = m_names.intern(name.constData(), name.size());
+        root.firstChild = oldRoot;
+        root.childCount = 1;
+        root.totalSize = m_nodes[oldRoot].totalSize;
+    }
+    root.stamp = ++m_version;
+    m_root = m_nodes.append(root);
+    if (oldRoot != NoIndex) {
+        m_nodes[oldRoot].parent = m_root;
+        addCategories(m_root, categorySizes(oldRoot));
+    }
+    return m_root;
+}
+
+NodeIndex FolderTree::addFolder(NodeIndex parent, const char *name, int length)
+{
+    FolderNode folder;
+    folder.name = m_names.intern(name, length);
+    folder.parent = parent;
+    FolderNode &parentNode = m_nodes[parent];
+    folder.nextSibling = parentNode.firstChild;
+    const NodeIndex index = m_nodes.append(folder);
+    // m_nodes[parent] is still valid: arena elements never move.
+    parentNode.firstChild = index;
+    parentNode.childCount++;
+    parentNode.stamp = ++m_version;
+    return index;
+}
+
+FileIndex FolderTree::addFile(NodeIndex parent, const char *name, int length, qint64 size, qint64 modified)
+{
+    FileEntry file;
+    file.size = size;
+    file.modifiedDay = dayOf(modified);
+    file.name = m_names.intern(name, length);
+    file.type = fileTypeOf(name, length);
+    file.parent = parent;
+    FolderNode &parentNode = m_nodes[parent];
+    file.next = parentNode.firstFile;
+    const FileIndex index = m_files.append(file);
+    parentNode.firstFile = index;
+    parentNode.fileCount++;
+    parentNode.stamp = ++m_version;
+    return index;
+}
+
+GroupIndex FolderTree::addGroup(NodeIndex parent, const char *extension, int length, quint32 count, qint64 size)
+{
+    FileGroup group;
+    group.size = size;
+    group.count = count;
+    group.extension = m_names.intern(extension, length);
+    group.type = extensionType(extension, length);
+    group.parent = parent;
+    FolderNode &parentNode = m_nodes[parent];
+    group.next = parentNode.firstGroup;
+    const GroupIndex index = m_groups.append(group);
+    parentNode.firstGroup = index;
+    parentNode.stamp = ++m_version;
+    return index;
+}
+
+void FolderTree::addSize(NodeIndex index, qint64 delta)
+{
+    const quint32 stamp = ++m_version;
+    for (; index != NoIndex; index = m_nodes[index].parent) {
+        m_nodes[index].totalSize += delta;
+        m_nodes[index].stamp = stamp;
+    }
+}
+
+void FolderTree::addSize(NodeIndex index, const CategorySizes &added)
+{
+    const qint64 bytes = added.total();
+    if (bytes != 0)
+        addSize(index, bytes);
+    addCategories(index, added);
+}
+
+void FolderTree::addCategories(NodeIndex index, const CategorySizes &delta)
+{
+    quint32 changed = 0;
+    for (int c = 0; c < FILE_CATEGORY_COUNT; c++) {
+        if (delta.size[c] != 0 || delta.count[c] != 0)
+            changed |= 1u << c;
+    }
+    if (changed == 0)
+        return;
+    for (; index != NoIndex; index = m_nodes[index].parent) {
+        // Update the categories the folder has, then add the missing ones.
+        quint32 missing = changed;
+        for (CategoryIndex i = m_nodes[index].firstCategory; i != NoIndex; i = m_categories[i].next) {
+            CategoryTotal &total = m_categories[i];
+            if (missing & (1u << total.category)) {
+                total.size += delta.size[total.category];
+                total.count += quint32(delta.count[total.category]);
+                missing &= ~(1u << total.category);
+            }
+        }
+        for (int c = 0; missing != 0; c++) {
+            if (!(missing & (1u << c)))
+                continue;
+            missing &= ~(1u << c);
+            CategoryTotal total;
+            total.size = delta.size[c];
+            total.count = quint32(delta.count[c]);
+            total.category = FileCategory(c);
+            total.next = m_nodes[index].firstCategory;
+            m_nodes[index].firstCategory = m_categories.append(total);
+        }
+    }
+}
+
+CategorySizes FolderTree::categorySizes(NodeIndex index) const
+{
+    CategorySizes sizes;
+    for (CategoryIndex i = m_nodes[index].firstCategory; i != NoIndex; i = m_categories[i].next) {
+        const CategoryTotal &total = m_categories[i];
+        sizes.size[total.category] += total.size;
+        sizes.count[total.category] += total.count;
+    }
+    return sizes;
+}
+
+void FolderTree::sortBySize(NodeIndex top)
+{
+    std::vector<quint32> order;
+    std::vector<NodeIndex> stack(1, top);
+    while (!stack.empty()) {
+        const NodeIndex n = stack.back();
+        stack.pop_back();
+        sortLists(n, order);
+        for (NodeIndex c = m_nodes[n].firstChild; c != NoIndex; c = m_nodes[c].nextSibling)
+            stack.push_back(c);
+    }
+}
+
+void FolderTree::sortFolder(NodeIndex index)
+{
+    std::vector<quint32> order;
+    sortLists(index, order);
+}
+
+void FolderTree::sortLists(NodeIndex index, std::vector<quint32> &order)
+{
+    FolderNode &folder = m_nodes[index];
+    bool reordered = false;
+    if (folder.childCount > 1) {
+        order.clear();
+        for (NodeIndex c = folder.firstChild; c != NoIndex; c = m_nodes[c].nextSibling)
+            order.push_back(c);
+        auto largerFirst = [this](NodeIndex a, NodeIndex b) {
+            return m_nodes[a].totalSize > m_nodes[b].totalSize;
+        };
+        if (!std::is_sorted(order.begin(), order.end(), largerFirst)) {
+            std::stable_sort(order.begin(), order.end(), largerFirst);
+            folder.firstChild = order.front();
+            for (size_t i = 0; i < order.size(); i++)
+                m_nodes[order[i]].nextSibling = i + 1 < order.size() ? order[i + 1] : NoIndex;
+            reordered = true;
+        }
+    }
+    if (folder.fileCount > 1) {
+        order.clear();
+        for (FileIndex f = folder.firstFile; f != NoIndex; f = m_files[f].next)
+            order.push_back(f);
+        auto largerFirst = [this](FileIndex a, FileIndex b) {
+            return m_files[a].size > m_files[b].size;
+        };
+        if (!std::is_sorted(order.begin(), order.end(), largerFirst)) {
+            std::stable_sort(order.begin(), order.end(), largerFirst);
+            folder.firstFile = order.front();
+            for (size_t i = 0; i < order.size(); i++)
+                m_files[order[i]].next = i + 1 < order.size() ? order[i + 1] : NoIndex;
+            reordered = true;
+        }
+    }
+    // Only folders whose order changed, and the ones above them, need
+    // a new layout.
+    if (reordered) {
+        const quint32 stamp = ++m_version;
+        for (NodeIndex i = index; i != NoIndex; i = m_nodes[i].parent)
+            m_nodes[i].stamp = stamp;
+    }
+}
+
+void FolderTree::clearFiles(NodeIndex index)
+{
+    FolderNode &folder = m_nodes[index];
+    CategorySizes removed;
+    for (FileIndex f = folder.firstFile; f != NoIndex; f = m_files[f].next)
+        removed.add(m_files[f].type, -m_files[f].size, -1);
+    for (GroupIndex g = folder.firstGroup; g != NoIndex; g = m_groups[g].next)
+        removed.add(m_groups[g].type, -m_groups[g].size, -qint64(m_groups[g].count));
+    folder.firstFile = NoIndex;
+    folder.fileCount = 0;
+    folder.firstGroup = NoIndex;
+    folder.stamp = ++m_version;
+    addSize(index, removed);
+}
+
+void FolderTree::removeFolder(NodeIndex index)
+{
+    const NodeIndex parent = m_nodes[index].parent;
+    if (parent == NoIndex)
+        return;
+    FolderNode &parentNode = m_nodes[parent];
+    NodeIndex *link = &parentNode.firstChild;
+    while (*link != NoIndex && *link != index)
+        link = &m_nodes[*link].nextSibling;
+    if (*link == NoIndex)
+        return;
+    *link = m_nodes[index].nextSibling;
+    parentNode.childCount--;
+    parentNode.stamp = ++m_version;
+    addSize(parent, -m_nodes[index].totalSize);
+    CategorySizes removed = categorySizes(index);
+    for (int c = 0; c < FILE_CATEGORY_COUNT; c++) {
+        removed.size[c] = -removed.size[c];
+        removed.count[c] = -removed.count[c];
+    }
+    addCategories(parent, removed);
+}
+
+void FolderTree::clearFolder(NodeIndex index)
+{
+    while (m_nodes[index].firstChild != NoIndex)
+        removeFolder(m_nodes[index].firstChild);
+    clearFiles(index);
+}
+
+void FolderTree::removeFiles(NodeIndex folder, std::vector<FileIndex> files)
+{
+    std::sort(files.begin(), files.end());
+    FolderNode &node = m_nodes[folder];
+    CategorySizes removed;
+    FileIndex *link = &node.firstFile;
+    while (*link != NoIndex) {
+        FileEntry &file = m_files[*link];
+        if (std::binary_search(files.begin(), files.end(), *link)) {
+            removed.add(file.type, -file.size, -1);
+            node.fileCount--;
+            *link = file.next;
+        } else {
+            link = &file.next;
+        }
+    }
+    node.stamp = ++m_version;
+    addSize(folder, removed);
+}
+
+void FolderTree::setFileSize(FileIndex index, qint64 size)
+{
+    FileEntry &file = m_files[index];
+    const qint64 delta = size - file.size;
+    file.size = size;
+    // A folder's stamp covers its own files too, so it moves even when the
+    // total doesn't.
+    m_nodes[file.parent].stamp = ++m_version;
+    if (delta != 0) {
+        CategorySizes changed;
+        changed.add(file.type, delta, 0);
+        addSize(file.parent, changed);
+    }
+}
+
+void FolderTree::setFileModified(FileIndex index, qint64 modified)
+{
+    FileEntry &file = m_files[index];
+    file.modifiedDay = dayOf(modified);
+    m_nodes[file.parent].stamp = ++m_version;
+}
+
+quint16 FolderTree::dayOf(qint64 modified)
+{
+    if (modified < 0)
+        return 0;
+    return quint16(std::min<qint64>(modified / MS_PER_DAY + 1, 0xffff));
+}
+
+void FolderTree::adopt(const std::shared_ptr<Snapshot> &snapshot)
+{
+    const Snapshot::Header &header = *snapshot->m_header;
+    uchar *base = snapshot->m_private;
+    m_nodes.adopt(reinterpret_cast<FolderNode *>(base + header.nodesOffset), header.nodeCount);
+    m_files.adopt(reinterpret_cast<FileEntry *>(base + header.filesOffset), header.fileCount);
+    m_categories.adopt(reinterpret_cast<CategoryTotal *>(base + header.categoriesOffset), header.categoryCount);
+    const auto *table = reinterpret_cast<const Snapshot::NameBlock *>(base + header.blockTableOffset);
+    std::vector<char *> blocks;
+    std::vector<quint32> lengths;
+    for (quint32 i = 0; i < header.nameBlockCount; i++) {
+        blocks.push_back(reinterpret_cast<char *>(base + table[i].offset));
+        lengths.push_back(table[i].length);
+    }
+    m_names.adopt(blocks, lengths, header.nameCount);
+    m_groups.clear();
+    m_root = header.root;
+    // Past every stamp in the saved nodes, so cached layouts can't mistake
+    // a new change for an old one.
+    m_version = header.treeVersion + 1;
+    m_snapshot = snapshot;
+}
+
+void FolderTree::appendPath(NodeIndex index, QByteArray &path) const
+{
+    const FolderNode &folder = m_nodes[index];
+    if (folder.parent != NoIndex) {
+        appendPath(folder.parent, path);
+        if (!path.endsWith('/'))
+            path.append('/');
+    }
+    int length;
+    const char *name = m_names.data(folder.name, length);
+    path.append(name, length);
+}
+
+QString FolderTree::folderPath(NodeIndex index) const
+{
+    QByteArray path;
+    appendPath(index, path);
+    return QFile::decodeName(path);
+}
+
+QString FolderTree::filePath(FileIndex index) const
+{
+    const FileEntry &entry = m_files[index];
+    QByteArray path;
+    appendPath(entry.parent, path);
+    if (!path.endsWith('/'))
+        path.append('/');
+    int length;
+    const char *name = m_names.data(entry.name, length);
+    path.append(name, length);
+    return QFile::decodeName(path);
+}
+
+QString FolderTree::folderName(NodeIndex index) const
+{
+    QString name = m_names.string(m_nodes[index].name);
+    if (index == m_root) {
+        // The root carries its whole path; show just the last component.
+        const QString trimmed = name.endsWith('/') ? name.left(name.size() - 1) : name;
+        const int slash = trimmed.lastIndexOf('/');
+        if (slash >= 0 && slash + 1 < trimmed.size())
+            return trimmed.mid(slash + 1);
+    }
+    return name;
+}
+
+QString FolderTree::fileName(FileIndex index) const
+{
+    return m_names.string(m_files[index].name);
+}
+
+bool FolderTree::hasGroups(NodeIndex top) const
+{
+    if (m_groups.size() == 0)
+        return false;
+    std::vector<NodeIndex> stack(1, top);
+    while (!stack.empty()) {
+        const FolderNode &folder = m_nodes[stack.back()];
+        stack.pop_back();
+        if (folder.firstGroup != NoIndex)
+            return true;
+        for (NodeIndex c = folder.firstChild; c != NoIndex; c = m_nodes[c].nextSibling)
+            stack.push_back(c);
+    }
+    return false;
+}
+
+QString FolderTree::groupName(GroupIndex index) const
+{
+    const QString extension = m_names.string(m_groups[index].extension);
+    return extension.isEmpty() ? QString("Other files") : "*." + extension;
+}
+
+qint64 FolderTree::memoryUsage() const
+{
+    return m_nodes.memoryUsage() + m_files.memoryUsage() + m_groups.memoryUsage() + m_categories.memoryUsage() +
+           m_names.memoryUsage();
+}
@@ -0,0 +1,293 @@
+#ifndef FOLDERTREE_H
+#define FOLDERTREE_H
+
+#include "filetypes.h"
+
+#include <QByteArray>
+#include <QString>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+class Snapshot;
+
+typedef quint32 NodeIndex;
+typedef quint32 FileIndex;
+typedef quint32 GroupIndex;
+typedef quint32 CategoryIndex;
+typedef quint32 NameId;
+
+static const quint32 NoIndex = 0xffffffffu;
+
+// Growable array stored in fixed-size chunks. Elements never move once
+// appended, growth never copies, and indices stay valid for the life of the
+// arena.
+template<typename T>
+class Arena
+{
+public:
+    quint32 append(const T &value)
+    {
+        const quint32 index = m_size++;
+        if ((index & CHUNK_MASK) == 0)
+            m_chunks.push_back(newChunk());
+        m_chunks[index >> CHUNK_BITS][index & CHUNK_MASK] = value;
+        return index;
+    }
+
+    T &operator[](quint32 index) { return m_chunks[index >> CHUNK_BITS][index & CHUNK_MASK]; }
+    const T &operator[](quint32 index) const { return m_chunks[index >> CHUNK_BITS][index & CHUNK_MASK]; }
+
+    quint32 size() const { return m_size; }
+    qint64 memoryUsage() const { return qint64(m_owned.size()) * CHUNK_SIZE * sizeof(T); }
+
+    void clear()
+    {
+        m_chunks.clear();
+        m_owned.clear();
+        m_size = 0;
+    }
+
+    // Takes over count elements stored back to back at data, such as a
+    // mapped snapshot, without copying them; data must stay valid and
+    // writable as long as the arena uses it. Only a partly filled last chunk
+    // is copied, so that appending can go on.
+    void adopt(T *data, quint32 count)
+    {
+        clear();
+        for (quint32 i = 0; i < count; i += CHUNK_SIZE) {
+            if (count - i >= CHUNK_SIZE) {
+                m_chunks.push_back(data + i);
+            } else {
+                m_chunks.push_back(newChunk());
+                std::copy(data + i, data + count, m_chunks.back());
+            }
+        }
+        m_size = count;
+    }
+
+    // The elements in storage order, chunk by chunk, for writing them out.
+    int chunkCount() const { return int(m_chunks.size()); }
+    const T *chunk(int i) const { return m_chunks[i]; }
+    quint32 chunkLength(int i) const { return std::min(CHUNK_SIZE, m_size - quint32(i) * CHUNK_SIZE); }
+
+private:
+    static const int CHUNK_BITS = 16;
+    static const quint32 CHUNK_SIZE = 1u << CHUNK_BITS;
+    static const quint32 CHUNK_MASK = CHUNK_SIZE - 1;
+
+    T *newChunk()
+    {
+        m_owned.emplace_back(new T[CHUNK_SIZE]);
+        return m_owned.back().get();
+    }
+
+    std::vector<T *> m_chunks;
+    std::vector<std::unique_ptr<T[]>> m_owned;
+    quint32 m_size = 0;
+};
+
+// Interned file and folder names, stored once each as raw bytes in the file
+// system's encoding behind a 16-bit length. A NameId packs the block number
+// and the offset inside the block.
+class NamePool
+{
+public:
+    // A NameId is (block << BLOCK_BITS) | offset.
+    static const int BLOCK_BITS = 20;
+
+    NameId intern(const char *data, int length);
+    const char *data(NameId id, int &length) const;
+    QByteArray bytes(NameId id) const;
+    QString string(NameId id) const;
+    // FNV-1a, the hash names are interned by.
+    static quint32 hash(const char *data, int length);
+
+    quint32 count() const { return m_count; }
+    qint64 memoryUsage() const;
+    void clear();
+
+    // Takes over name blocks stored elsewhere, such as in a mapped snapshot,
+    // the same way Arena::adopt does. New names go to blocks of their own;
+    // the lookup table is only rebuilt once the first one is interned.
+    void adopt(const std::vector<char *> &blocks, const std::vector<quint32> &lengths, quint32 count);
+    int blockCount() const { return int(m_blocks.size()); }
+    const char *block(int i) const { return m_blocks[i]; }
+    quint32 blockLength(int i) const { return m_blockLengths[i]; }
+
+private:
+    static const quint32 BLOCK_SIZE = 1u << BLOCK_BITS;
+
+    NameId store(const char *data, int length);
+    void rehash(size_t slotCount);
+    void insertSlot(std::vector<NameId> &table, NameId id) const;
+
+    std::vector<char *> m_blocks;
+    std::vector<quint32> m_blockLengths;
+    std::vector<std::unique_ptr<char[]>> m_owned;
+    quint32 m_blockUsed = BLOCK_SIZE;
+    std::vector<NameId> m_slots;
+    quint32 m_count = 0;
+};
+
+// A folder. Children and files are singly linked lists threaded through the
+// arenas, largest first once the tree has been finalized.
+struct FolderNode {
+    qint64 totalSize = 0;
+    NameId name = NoIndex;
+    NodeIndex parent = NoIndex;
+    NodeIndex firstChild = NoIndex;
+    NodeIndex nextSibling = NoIndex;
+    FileIndex firstFile = NoIndex;
+    quint32 childCount = 0;
+    quint32 fileCount = 0;
+    quint32 stamp = 0;                // Tree version of the last change at or below this folder.
+    GroupIndex firstGroup = NoIndex;  // Files a summary scan folded, largest group first.
+    CategoryIndex firstCategory = NoIndex; // Totals per file category, of the whole subtree.
+    qint64 modified = -1;             // The directory's mtime when it was read, in ms since the epoch.
+};
+
+// A file: 24 bytes plus its share of the name pool. The modification time
+// is only kept to the day, which fits in the padding.
+struct FileEntry {
+    qint64 size = 0;
+    NameId name = NoIndex;
+    NodeIndex parent = NoIndex;
+    FileIndex next = NoIndex;
+    FileType type = UnknownFileType;  // From the name, when it was added.
+    quint16 modifiedDay = 0;          // See FolderTree::dayOf(); 0 if not known.
+};
+
+// Files of one folder that a summary scan counted instead of keeping: all
+// those with one extension, or all the rest.
+struct FileGroup {
+    qint64 size = 0;
+    quint32 count = 0;
+    NameId extension = NoIndex;       // Lower case, without the dot; empty for the rest.
+    NodeIndex parent = NoIndex;
+    GroupIndex next = NoIndex;
+    FileType type = UnknownFileType;
+};
+
+// One category's share of a folder's subtree.
+struct CategoryTotal {
+    qint64 size = 0;
+    quint32 count = 0;
+    FileCategory category = OtherFiles;
+    CategoryIndex next = NoIndex;
+};
+
+// Bytes and files per category of some set of files, such as one listing
+// or a whole subtree; negative for files taken away.
+struct CategorySizes {
+    qint64 size[FILE_CATEGORY_COUNT] = {};
+    qint64 count[FILE_CATEGORY_COUNT] = {};
+
+    void add(FileType type, qint64 bytes, qint64 files = 1)
+    {
+        const FileCategory category = fileCategory(type);
+        size[category] += bytes;
+        count[category] += files;
+    }
+    qint64 total() const
+    {
+        qint64 bytes = 0;
+        for (qint64 s : size)
+            bytes += s;
+        return bytes;
+    }
+};
+
+// Flat, index-based folder tree. Only name components are stored; full paths
+// are rebuilt on demand by walking the parent links up to the root, whose
+// name is its complete path.
+class FolderTree
+{
+public:
+    NodeIndex createRoot(const QString &path);
+    // Puts a new root for parentPath above the current one, which becomes
+    // its only child; everything scanned so far is kept.
+    NodeIndex addParentRoot(const QString &parentPath);
+    NodeIndex addFolder(NodeIndex parent, const char *name, int length);
+    FileIndex addFile(NodeIndex parent, const char *name, int length, qint64 size, qint64 modified = -1);
+    // Adds folded files; like addFile, leaves the totals to addSize.
+    GroupIndex addGroup(NodeIndex parent, const char *extension, int length, quint32 count, qint64 size);
+    // Adds delta to a folder's total and to those of all its ancestors; the
+    // second form also to their totals per category, for files just added.
+    void addSize(NodeIndex index, qint64 delta);
+    void addSize(NodeIndex index, const CategorySizes &added);
+    // Orders every child and file list in top's subtree by size, largest
+    // first; sortFolder does the same for one folder's own lists.
+    void sortBySize(NodeIndex top);
+    void sortFolder(NodeIndex index);
+    // Drops a folder's files and file groups, a folder with everything
+    // below it, or everything below a folder, and takes their size off the
+    // totals. The entries stay in the arenas, unreachable.
+    void clearFiles(NodeIndex index);
+    void removeFolder(NodeIndex index);
+    void clearFolder(NodeIndex index);
+    void removeFiles(NodeIndex folder, std::vector<FileIndex> files);
+    // Changes a file's size and every total above it.
+    void setFileSize(FileIndex index, qint64 size);
+    void setModified(NodeIndex index, qint64 modified) { m_nodes[index].modified = modified; }
+    void setFileModified(FileIndex index, qint64 modified);
+
+    // File mtimes, from ms since the epoch to the day they are kept as: 1
+    // for the first day of 1970, 0 for none or anything before.
+    static quint16 dayOf(qint64 modified);
+    static qint64 dayStart(quint16 day) { return (qint64(day) - 1) * MS_PER_DAY; }
+
+    // Makes the tree the one stored in snapshot, using its arrays in place.
+    void adopt(const std::shared_ptr<Snapshot> &snapshot);
+
+    // Bumped by every change; see FolderNode::stamp for where it happened.
+    quint32 version() const { return m_version; }
+
+    NodeIndex root() const { return m_root; }
+    bool isEmpty() const { return m_root == NoIndex; }
+    const FolderNode &node(NodeIndex index) const { return m_nodes[index]; }
+    const FileEntry &file(FileIndex index) const { return m_files[index]; }
+    const FileGroup &group(GroupIndex index) const { return m_groups[index]; }
+    quint32 folderCount() const { return m_nodes.size(); }
+    quint32 fileCount() const { return m_files.size(); }
+    quint32 groupCount() const { return m_groups.size(); }
+    // What a folder's subtree holds, per category; kept up to date as files
+    // come and go, so this only reads the folder's own short list.
+    CategorySizes categorySizes(NodeIndex index) const;
+    // Whether a summary scan folded any files in top's subtree.
+    bool hasGroups(NodeIndex top) const;
+
+    QString folderPath(NodeIndex index) const;
+    QString filePath(FileIndex index) const;
+    QString folderName(NodeIndex index) const;
+    QString fileName(FileIndex index) const;
+    // "*.jpg", or "Other files" for the group without an extension.
+    QString groupName(GroupIndex index) const;
+    // The stored name, in the file system's encoding; the root's is its path.
+    QByteArray folderNameBytes(NodeIndex index) const { return m_names.bytes(m_nodes[index].name); }
+    QByteArray fileNameBytes(FileIndex index) const { return m_names.bytes(m_files[index].name); }
+    const NamePool &names() const { return m_names; }
+
+    qint64 memoryUsage() const;
+
+private:
+    friend class Snapshot;
+
+    static const qint64 MS_PER_DAY = 24 * 3600 * 1000;
+
+    void appendPath(NodeIndex index, QByteArray &path) const;
+    void sortLists(NodeIndex index, std::vector<quint32> &order);
+    // Adds delta to the category totals of a folder and its ancestors.
+    void addCategories(NodeIndex index, const CategorySizes &delta);
+
+    Arena<FolderNode> m_nodes;
+    Arena<FileEntry> m_files;
+    Arena<FileGroup> m_groups;
+    Arena<CategoryTotal> m_categories;
+    NamePool m_names;
+    NodeIndex m_root = NoIndex;
+    quint32 m_version = 0;
+    std::shared_ptr<Snapshot> m_snapshot;
+};
+
+#endif // FOLDERTREE_H
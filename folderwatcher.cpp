@@ -0,0 +1,262 @@
+#include "folderwatcher.h"
+#include "trace.h"
+
+#include <QFile>
+#include <QDebug>
+#include <algorithm>
+
+#ifdef Q_OS_LINUX
+#include <sys/inotify.h>
+#include <cerrno>
+#include <unistd.h>
+#endif
+
+// Unwatched folders have their mtime checked this often.
+static const int POLL_INTERVAL_MS = 5000;
+
+#ifdef Q_OS_LINUX
+// Anything that changes a folder's listing or one of its files' sizes. The
+// folder's own deletion or move shows up in its parent's events.
+static const uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO |
+                                   IN_ONLYDIR | IN_EXCL_UNLINK;
+#endif
+
+FolderWatcher::FolderWatcher(const ScanOptions &options)
+    : m_backend(ScanBackend::create(options.backend)),
+      m_filter(options, false)
+{
+    m_backend->setFilter(&m_filter);
+#ifdef Q_OS_LINUX
+    m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_fd < 0)
+        qDebug() << "inotify unavailable; polling for changes instead";
+    m_events.resize(64 * 1024);
+#endif
+    m_sincePoll.start();
+}
+
+FolderWatcher::~FolderWatcher()
+{
+#ifdef Q_OS_LINUX
+    // Closing the descriptor drops every watch at once.
+    if (m_fd >= 0)
+        close(m_fd);
+#endif
+}
+
+void FolderWatcher::watch(const FolderTree &tree)
+{
+    if (tree.isEmpty())
+        return;
+    if (m_state.empty())
+        m_filter.setTop(tree.folderPath(tree.root()));
+    m_state.resize(tree.folderCount(), Unwatched);
+    m_dirtyFlag.resize(tree.folderCount(), 0);
+    std::vector<NodeIndex> stack(1, tree.root());
+    while (!stack.empty()) {
+        const NodeIndex folder = stack.back();
+        stack.pop_back();
+        if (m_state[folder] == Unwatched) {
+            m_state[folder] = Queued;
+            m_toWatch.push_back(folder);
+        }
+        for (NodeIndex child = tree.node(folder).firstChild; child != NoIndex; child = tree.node(child).nextSibling)
+            stack.push_back(child);
+    }
+}
+
+void FolderWatcher::readEvents()
+{
+#ifdef Q_OS_LINUX
+    if (m_fd < 0)
+        return;
+    while (true) {
+        const ssize_t length = read(m_fd, m_events.data(), m_events.size());
+        if (length <= 0)
+            break;
+        for (ssize_t offset = 0; offset < length;) {
+            const inotify_event *event = reinterpret_cast<const inotify_event *>(m_events.data() + offset);
+            offset += sizeof(inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Events were lost, so any watched folder may have changed.
+                qDebug() << "Change events overflowed; checking every watched folder";
+                for (NodeIndex folder = 0; folder < m_state.size(); folder++) {
+                    if (m_state[folder] >= 0)
+                        markDirty(folder);
+                }
+                continue;
+            }
+            const NodeIndex folder = m_nodeOf.value(event->wd, NoIndex);
+            if (folder == NoIndex)
+                continue;
+            if (event->mask & IN_IGNORED) {
+                // The folder is gone or its file system unmounted.
+                m_nodeOf.remove(event->wd);
+                m_state[folder] = Unwatched;
+                continue;
+            }
+            markDirty(folder);
+        }
+    }
+#endif
+}
+
+bool FolderWatcher::update(FolderTree &tree, int budgetMs, std::vector<NodeIndex> &newFolders)
+{
+    TraceSpan span("update", "watch");
+    QElapsedTimer budget;
+    budget.start();
+    readEvents();
+    m_state.resize(tree.folderCount(), Unwatched);
+    m_dirtyFlag.resize(tree.folderCount(), 0);
+
+    const quint32 version = tree.version();
+    while (!m_dirty.empty() && budget.elapsed() < budgetMs) {
+        const NodeIndex folder = m_dirty.back();
+        m_dirty.pop_back();
+        m_dirtyFlag[folder] = 0;
+        refresh(tree, folder, newFolders);
+    }
+
+    if (!m_polled.empty() && m_pollPos >= m_polled.size() && m_sincePoll.elapsed() >= POLL_INTERVAL_MS) {
+        m_polled.erase(std::remove_if(m_polled.begin(), m_polled.end(), [this](NodeIndex folder) {
+            return m_state[folder] != Polled;
+        }), m_polled.end());
+        m_pollPos = 0;
+        m_sincePoll.restart();
+    }
+    for (int checked = 0; m_pollPos < m_polled.size(); checked++) {
+        if ((checked & 63) == 63 && budget.elapsed() >= budgetMs)
+            break;
+        const NodeIndex folder = m_polled[m_pollPos++];
+        if (m_state[folder] != Polled)
+            continue;
+        const qint64 modified = m_backend->modificationTime(tree.folderPath(folder));
+        if (modified >= 0 && modified != tree.node(folder).modified)
+            markDirty(folder);
+    }
+
+    for (int added = 0; !m_toWatch.empty(); added++) {
+        if ((added & 63) == 63 && budget.elapsed() >= budgetMs)
+            break;
+        const NodeIndex folder = m_toWatch.front();
+        m_toWatch.pop_front();
+        addWatch(tree, folder);
+    }
+    return tree.version() != version;
+}
+
+void FolderWatcher::addWatch(const FolderTree &tree, NodeIndex folder)
+{
+    if (m_state[folder] != Queued)
+        return;
+    const QString path = tree.folderPath(folder);
+#ifdef Q_OS_LINUX
+    if (m_fd >= 0 && !m_limitReached) {
+        const int wd = inotify_add_watch(m_fd, QFile::encodeName(path).constData(), WATCH_MASK);
+        if (wd >= 0) {
+            m_state[folder] = wd;
+            m_nodeOf.insert(wd, folder);
+        } else if (errno == ENOSPC || errno == ENOMEM) {
+            qDebug() << "Watch limit reached after" << m_nodeOf.size() << "folders; polling the rest";
+            m_limitReached = true;
+        }
+    }
+#endif
+    if (m_state[folder] == Queued) {
+        m_state[folder] = Polled;
+        m_polled.push_back(folder);
+    }
+    // Changes between the scan and now came without an event.
+    const qint64 modified = m_backend->modificationTime(path);
+    if (modified < 0 && tree.node(folder).parent != NoIndex)
+        markDirty(tree.node(folder).parent);
+    else if (modified >= 0 && modified != tree.node(folder).modified)
+        markDirty(folder);
+}
+
+void FolderWatcher::markDirty(NodeIndex folder)
+{
+    if (m_state[folder] == Removed || m_dirtyFlag[folder])
+        return;
+    m_dirtyFlag[folder] = 1;
+    m_dirty.push_back(folder);
+}
+
+// Lists folder again and applies the difference to the tree.
+void FolderWatcher::refresh(FolderTree &tree, NodeIndex folder, std::vector<NodeIndex> &newFolders)
+{
+    if (m_state[folder] == Removed)
+        return;
+    const FolderNode &node = tree.node(folder);
+    if (!m_backend->readDirectory(tree.folderPath(folder), m_listing)) {
+        // Most likely gone; its parent's listing will tell.
+        if (node.parent != NoIndex)
+            markDirty(node.parent);
+        return;
+    }
+    const char *names = m_listing.names.constData();
+
+    QHash<QByteArray, FileIndex> files;
+    for (FileIndex file = node.firstFile; file != NoIndex; file = tree.file(file).next)
+        files.insert(tree.fileNameBytes(file), file);
+    CategorySizes added;
+    for (const DirListing::Entry &entry : m_listing.files) {
+        if (entry.size < MIN_FILE_SIZE)
+            continue;
+        const QByteArray name = m_listing.name(entry);
+        const FileIndex known = files.value(name, NoIndex);
+        if (known == NoIndex) {
+            const FileIndex index = tree.addFile(folder, names + entry.nameOffset, entry.nameLength, entry.size,
+                                                 entry.modified);
+            added.add(tree.file(index).type, entry.size);
+        } else {
+            if (tree.file(known).size != entry.size)
+                tree.setFileSize(known, entry.size);
+            if (tree.file(known).modifiedDay != FolderTree::dayOf(entry.modified))
+                tree.setFileModified(known, entry.modified);
+            files.remove(name);
+        }
+    }
+    tree.addSize(folder, added);
+    if (!files.isEmpty()) {
+        const QList<FileIndex> gone = files.values();
+        tree.removeFiles(folder, std::vector<FileIndex>(gone.begin(), gone.end()));
+    }
+    // The layout relies on files being largest first.
+    tree.sortFolder(folder);
+
+    QHash<QByteArray, NodeIndex> children;
+    for (NodeIndex child = node.firstChild; child != NoIndex; child = tree.node(child).nextSibling)
+        children.insert(tree.folderNameBytes(child), child);
+    for (const DirListing::Entry &entry : m_listing.dirs) {
+        if (children.remove(m_listing.name(entry)) == 0)
+            newFolders.push_back(tree.addFolder(folder, names + entry.nameOffset, entry.nameLength));
+    }
+    for (NodeIndex child : children.values()) {
+        forget(tree, child);
+        tree.removeFolder(child);
+    }
+    tree.setModified(folder, m_listing.modified);
+}
+
+// Drops the watches of a folder and everything below it.
+void FolderWatcher::forget(const FolderTree &tree, NodeIndex folder)
+{
+    std::vector<NodeIndex> stack(1, folder);
+    while (!stack.empty()) {
+        const NodeIndex current = stack.back();
+        stack.pop_back();
+        if (current < m_state.size()) {
+#ifdef Q_OS_LINUX
+            if (m_state[current] >= 0) {
+                inotify_rm_watch(m_fd, m_state[current]);
+                m_nodeOf.remove(m_state[current]);
+            }
+#endif
+            m_state[current] = Removed;
+        }
+        for (NodeIndex child = tree.node(current).firstChild; child != NoIndex; child = tree.node(child).nextSibling)
+            stack.push_back(child);
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef FOLDERWATCHER_H
+#define FOLDERWATCHER_H
+
+#include "foldertree.h"
+#include "folderscanner.h"
+#include "scanbackend.h"
+#include "scanfilter.h"
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <deque>
+#include <memory>
+#include <vector>
+
+// Keeps a scanned tree in step with the file system. Every folder gets an
+// inotify watch where the platform has one; change events only mark their
+// folder dirty, and update() reads each dirty folder again and applies the
+// difference (new, removed and resized files, new and removed subfolders)
+// to the tree, so totals change along the path to the root and nothing else.
+//
+// Folders that can't be watched, because the watch limit is reached or
+// there is no inotify, are polled instead: their mtime is checked every
+// POLL_INTERVAL_MS, a few at a time.
+//
+// Like FolderScanner, the watcher is driven from the thread that owns the
+// tree and never touches it anywhere else.
+class FolderWatcher
+{
+public:
+    explicit FolderWatcher(const ScanOptions &options = ScanOptions());
+    ~FolderWatcher();
+
+    // Starts watching every folder of tree that isn't watched yet; call it
+    // again whenever folders have been added by a scan.
+    void watch(const FolderTree &tree);
+    // Collects the queued change events without touching the tree, for
+    // while a scan is still writing to it.
+    void readEvents();
+    // Reads events, then applies changes for at most budgetMs milliseconds.
+    // New subfolders are added empty and returned in newFolders for the
+    // caller to scan. Returns whether the tree changed.
+    bool update(FolderTree &tree, int budgetMs, std::vector<NodeIndex> &newFolders);
+
+    int watchedCount() const { return m_nodeOf.size(); }
+    int polledCount() const { return int(m_polled.size()); }
+
+private:
+    // Per folder: a watch descriptor, or one of these.
+    enum State { Unwatched = -1, Queued = -2, Polled = -3, Removed = -4 };
+
+    void addWatch(const FolderTree &tree, NodeIndex folder);
+    void markDirty(NodeIndex folder);
+    void refresh(FolderTree &tree, NodeIndex folder, std::vector<NodeIndex> &newFolders);
+    void forget(const FolderTree &tree, NodeIndex folder);
+
+    std::unique_ptr<ScanBackend> m_backend;
+    // Keeps refreshes off the file systems the scan left out.
+    ScanFilter m_filter;
+    int m_fd = -1;
+    bool m_limitReached = false;
+    std::vector<int> m_state;
+    std::vector<char> m_dirtyFlag;
+    QHash<int, NodeIndex> m_nodeOf;
+    std::deque<NodeIndex> m_toWatch;
+    std::vector<NodeIndex> m_dirty;
+    std::vector<NodeIndex> m_polled;
+    size_t m_pollPos = 0;
+    QElapsedTimer m_sincePoll;
+    std::vector<char> m_events;
+    DirListing m_listing;
+};
+
+#endif // FOLDERWATCHER_H
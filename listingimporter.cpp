@@ -0,0 +1,614 @@
+#include "listingimporter.h"
+#include "trace.h"
+
+#include <QMutexLocker>
+#include <QThread>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <unordered_set>
+
+#ifdef Q_OS_UNIX
+#include <zlib.h>
+#endif
+
+// How much of the listing one parser takes at a time, and how many chunks
+// per parser may be read ahead of the builder.
+static const qint64 CHUNK_SIZE = 16 * 1024 * 1024;
+static const int CHUNKS_PER_PARSER = 2;
+// Compressed input is read this much at a time.
+static const int INPUT_SIZE = 1024 * 1024;
+
+// Whether the name starting at c, with left bytes to the end of the path,
+// is hidden: it starts with a dot and isn't "." or "..".
+static bool isHiddenName(const char *c, qint64 left) {
+    if (left == 0 || c[0] != '.')
+        return false;
+    if (left == 1 || c[1] == '/')
+        return false;
+    return !(c[1] == '.' && (left == 2 || c[2] == '/'));
+}
+
+// Whether path lies below folder.
+static bool isBelow(const char *path, quint32 length, const char *folder, quint32 folderLength) {
+    return length > folderLength && path[folderLength] == '/' && memcmp(path, folder, folderLength) == 0;
+}
+
+ListingImporter::ListingImporter(int threadCount)
+    : m_threadCount(threadCount > 0 ? threadCount : QThread::idealThreadCount())
+{
+}
+
+ListingImporter::~ListingImporter()
+{
+    cancel();
+    stopThreads();
+#ifdef Q_OS_UNIX
+    if (m_inflate) {
+        inflateEnd(m_inflate);
+        delete m_inflate;
+    }
+#endif
+}
+
+void ListingImporter::cancel()
+{
+    m_cancel = true;
+    QMutexLocker locker(&m_mutex);
+    m_progress.wakeAll();
+}
+
+void ListingImporter::stopThreads()
+{
+    if (m_reader.joinable())
+        m_reader.join();
+    for (std::thread &parser : m_parsers) {
+        if (parser.joinable())
+            parser.join();
+    }
+    m_parsers.clear();
+    if (m_builder.joinable())
+        m_builder.join();
+}
+
+bool ListingImporter::start(const QString &fileName)
+{
+    m_timer.start();
+    bool opened;
+    if (fileName == "-") {
+        opened = m_file.open(stdin, QIODevice::ReadOnly);
+    } else {
+        m_file.setFileName(fileName);
+        opened = m_file.open(QIODevice::ReadOnly);
+    }
+    if (!opened) {
+        m_error = QString("Can't read %1: %2").arg(fileName, m_file.errorString());
+        return false;
+    }
+    // gzip starts with 1f 8b.
+    const QByteArray magic = m_file.peek(2);
+    m_compressed = magic.size() == 2 && uchar(magic[0]) == 0x1f && uchar(magic[1]) == 0x8b;
+    if (m_compressed) {
+#ifdef Q_OS_UNIX
+        m_inflate = new z_stream();
+        // 16 + MAX_WBITS: a gzip header, not a zlib one.
+        if (inflateInit2(m_inflate, 16 + MAX_WBITS) != Z_OK) {
+            m_error = QString("Can't decompress %1").arg(fileName);
+            return false;
+        }
+        m_input.resize(INPUT_SIZE);
+#else
+        m_error = QString("Can't read %1: this build can't decompress gzip").arg(fileName);
+        return false;
+#endif
+    } else if (!m_file.isSequential() && m_file.size() > 0) {
+        // Mapped, the listing is parsed where it lies; where that doesn't
+        // work, it is read like a pipe.
+        m_map = reinterpret_cast<const char *>(m_file.map(0, m_file.size()));
+        m_mapSize = m_map ? m_file.size() : 0;
+    }
+    m_reader = std::thread(&ListingImporter::readLoop, this);
+    for (int i = 0; i < m_threadCount; i++)
+        m_parsers.emplace_back(&ListingImporter::parseLoop, this);
+    m_builder = std::thread(&ListingImporter::buildLoop, this);
+    return true;
+}
+
+std::shared_ptr<FolderTree> ListingImporter::import(const QString &fileName)
+{
+    if (!start(fileName))
+        return nullptr;
+    stopThreads();
+    return takeTree();
+}
+
+std::shared_ptr<FolderTree> ListingImporter::takeTree()
+{
+    if (!m_finished)
+        return nullptr;
+    stopThreads();
+    QMutexLocker locker(&m_mutex);
+    if (!m_error.isEmpty() || !m_stats.complete)
+        return nullptr;
+    return std::move(m_tree);
+}
+
+QString ListingImporter::errorString() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_error;
+}
+
+void ListingImporter::fail(const QString &error)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_error.isEmpty())
+        m_error = error;
+    m_cancel = true;
+    m_progress.wakeAll();
+}
+
+ScanStats ListingImporter::stats() const
+{
+    if (m_finished)
+        return m_stats;
+    ScanStats running;
+    running.imported = true;
+    running.dirs = m_dirCount;
+    running.files = m_fileCount;
+    running.listingBytes = m_bytesRead;
+    running.skippedLines = m_skippedLines;
+    running.elapsedMs = m_timer.elapsed();
+    running.threads = m_threadCount;
+    running.backend = m_compressed ? "gzip listing" : m_map ? "mapped listing" : "listing";
+    return running;
+}
+
+// Cuts the listing into chunks and queues them, no more than a few per
+// parser ahead of the builder.
+void ListingImporter::readLoop()
+{
+    const size_t window = size_t(m_threadCount) * CHUNKS_PER_PARSER;
+    while (!m_cancel) {
+        std::shared_ptr<Chunk> chunk = std::make_shared<Chunk>();
+        TraceSpan span("read chunk", "import");
+        if (!nextChunk(*chunk))
+            break;
+        QMutexLocker locker(&m_mutex);
+        while (m_chunks.size() >= window && !m_cancel)
+            m_progress.wait(&m_mutex);
+        m_chunks.push_back(std::move(chunk));
+        m_progress.wakeAll();
+    }
+    QMutexLocker locker(&m_mutex);
+    m_readDone = true;
+    m_progress.wakeAll();
+}
+
+// The next run of whole lines, or false at the end of the listing.
+bool ListingImporter::nextChunk(Chunk &chunk)
+{
+    if (m_map) {
+        if (m_mapPos >= m_mapSize)
+            return false;
+        qint64 end = std::min(m_mapPos + CHUNK_SIZE, m_mapSize);
+        if (end < m_mapSize) {
+            const void *newline = memchr(m_map + end, '\n', size_t(m_mapSize - end));
+            end = newline ? static_cast<const char *>(newline) - m_map + 1 : m_mapSize;
+        }
+        chunk.data = m_map + m_mapPos;
+        chunk.length = end - m_mapPos;
+        m_mapPos = end;
+        m_bytesRead = end;
+        return true;
+    }
+
+    // From a pipe or through zlib: a buffer of its own, starting with what
+    // the last one cut off and ending with its last whole line.
+    QByteArray &buffer = chunk.buffer;
+    buffer = m_carry;
+    m_carry.clear();
+    int lineEnd = -1;
+    while (lineEnd < 0 && !m_inputEnded && !m_cancel) {
+        const int used = buffer.size();
+        buffer.resize(int(used + CHUNK_SIZE));
+        qint64 read = 0;
+        while (used + read < buffer.size() && !m_inputEnded) {
+            const qint64 count = readInput(buffer.data() + used + read, buffer.size() - used - read);
+            if (count < 0)
+                return false;
+            if (count == 0)
+                m_inputEnded = true;
+            read += count;
+        }
+        buffer.resize(int(used + read));
+        m_bytesRead += read;
+        lineEnd = m_inputEnded ? buffer.size() - 1 : buffer.lastIndexOf('\n');
+    }
+    if (buffer.isEmpty())
+        return false;
+    m_carry = buffer.mid(lineEnd + 1);
+    buffer.truncate(lineEnd + 1);
+    chunk.data = buffer.constData();
+    chunk.length = buffer.size();
+    return true;
+}
+
+// Up to capacity bytes of the listing; 0 at its end, -1 after an error.
+qint64 ListingImporter::readInput(char *data, qint64 capacity)
+{
+    if (!m_inflate) {
+        const qint64 count = m_file.read(data, capacity);
+        if (count < 0)
+            fail(QString("Can't read the listing: %1").arg(m_file.errorString()));
+        return count;
+    }
+#ifdef Q_OS_UNIX
+    z_stream &stream = *m_inflate;
+    stream.next_out = reinterpret_cast<Bytef *>(data);
+    stream.avail_out = uInt(capacity);
+    while (stream.avail_out > 0) {
+        if (stream.avail_in == 0) {
+            const qint64 count = m_file.read(m_input.data(), m_input.size());
+            if (count < 0) {
+                fail(QString("Can't read the listing: %1").arg(m_file.errorString()));
+                return -1;
+            }
+            if (count == 0) {
+                if (!m_betweenMembers) {
+                    fail("The compressed listing is cut short");
+                    return -1;
+                }
+                break;
+            }
+            stream.next_in = reinterpret_cast<Bytef *>(m_input.data());
+            stream.avail_in = uInt(count);
+        }
+        const int status = inflate(&stream, Z_NO_FLUSH);
+        if (status == Z_STREAM_END) {
+            // Files made by pigz or by joining gzip files hold several
+            // members one after the other.
+            inflateReset(&stream);
+            m_betweenMembers = true;
+        } else if (status == Z_OK) {
+            m_betweenMembers = false;
+        } else if (status != Z_BUF_ERROR) {
+            fail(QString("The compressed listing is damaged: %1").arg(stream.msg ? stream.msg : "unknown error"));
+            return -1;
+        }
+    }
+    return capacity - stream.avail_out;
+#else
+    return -1;
+#endif
+}
+
+void ListingImporter::parseLoop()
+{
+    while (true) {
+        std::shared_ptr<Chunk> chunk;
+        {
+            QMutexLocker locker(&m_mutex);
+            while (!m_cancel) {
+                const auto it = std::find_if(m_chunks.begin(), m_chunks.end(),
+                                             [](const std::shared_ptr<Chunk> &c) { return !c->taken; });
+                if (it != m_chunks.end()) {
+                    chunk = *it;
+                    chunk->taken = true;
+                    break;
+                }
+                if (m_readDone)
+                    return;
+                m_progress.wait(&m_mutex);
+            }
+            if (!chunk)
+                return;
+        }
+        parse(*chunk);
+        QMutexLocker locker(&m_mutex);
+        chunk->parsed = true;
+        m_progress.wakeAll();
+    }
+}
+
+// Splits a chunk into lines of an optional type letter, a size and a path,
+// separated by a space or a tab.
+void ListingImporter::parse(Chunk &chunk)
+{
+    TraceSpan span("parse chunk", "import");
+    const char *data = chunk.data;
+    const char *end = data + chunk.length;
+    chunk.lines.reserve(size_t(chunk.length / 64));
+    for (const char *start = data; start < end;) {
+        const char *stop = static_cast<const char *>(memchr(start, '\n', size_t(end - start)));
+        if (!stop)
+            stop = end;
+        const char *p = start;
+        const char *lineEnd = stop > start && stop[-1] == '\r' ? stop - 1 : stop;
+        start = stop + 1;
+        if (p == lineEnd)
+            continue;
+
+        Line line;
+        line.type = 0;
+        if (lineEnd - p > 2 && ((p[0] >= 'a' && p[0] <= 'z') || (p[0] >= 'A' && p[0] <= 'Z')) &&
+            (p[1] == ' ' || p[1] == '\t')) {
+            line.type = p[0];
+            p += 2;
+        }
+        const char *digits = p;
+        qint64 size = 0;
+        while (p < lineEnd && *p >= '0' && *p <= '9')
+            size = size * 10 + (*p++ - '0');
+        if (p == digits || p == lineEnd || (*p != ' ' && *p != '\t') || p + 1 == lineEnd) {
+            chunk.skipped++;
+            continue;
+        }
+        p++;
+        qint64 length = lineEnd - p;
+        while (length > 1 && p[length - 1] == '/')
+            length--;
+        line.size = size;
+        line.path = quint32(p - data);
+        line.length = quint32(length);
+        line.hidden = 0;
+        // One pass over the components for the name and hidden ones.
+        for (const char *c = p;;) {
+            const qint64 left = p + length - c;
+            if (isHiddenName(c, left))
+                line.hidden = quint32(c - p);
+            const void *slash = memchr(c, '/', size_t(left));
+            if (!slash) {
+                line.name = quint32(c - p);
+                break;
+            }
+            c = static_cast<const char *>(slash) + 1;
+        }
+        chunk.lines.push_back(line);
+    }
+}
+
+// Takes the parsed chunks in order and adds their lines to the tree. The
+// last line of a chunk waits for the first of the next, which tells
+// whether it is a folder.
+void ListingImporter::buildLoop()
+{
+    m_tree = std::make_shared<FolderTree>();
+    std::shared_ptr<Chunk> held;
+    while (true) {
+        std::shared_ptr<Chunk> chunk;
+        {
+            QMutexLocker locker(&m_mutex);
+            while (!m_cancel && !(m_chunks.empty() ? m_readDone : m_chunks.front()->parsed))
+                m_progress.wait(&m_mutex);
+            if (m_cancel || m_chunks.empty())
+                break;
+            chunk = std::move(m_chunks.front());
+            m_chunks.pop_front();
+            m_progress.wakeAll();
+        }
+        TraceSpan span("build chunk", "import");
+        QElapsedTimer timer;
+        timer.start();
+        m_skippedLines += chunk->skipped;
+        const std::vector<Line> &lines = chunk->lines;
+        if (held && !lines.empty())
+            addLine(held->data, held->lines.back(), chunk->data, &lines.front());
+        if (!lines.empty()) {
+            for (size_t i = 0; i + 1 < lines.size(); i++)
+                addLine(chunk->data, lines[i], chunk->data, &lines[i + 1]);
+            held = chunk;
+        }
+        m_dirCount = m_tree->folderCount();
+        m_fileCount = m_tree->fileCount();
+        m_buildNs += timer.nsecsElapsed();
+    }
+    if (!m_cancel) {
+        QElapsedTimer timer;
+        timer.start();
+        if (held)
+            addLine(held->data, held->lines.back(), nullptr, nullptr);
+        flushSizes();
+        if (m_untyped)
+            dropFolderLines();
+        if (!m_tree->isEmpty())
+            m_tree->sortBySize(m_tree->root());
+        m_buildNs += timer.nsecsElapsed();
+        if (m_tree->isEmpty())
+            fail("The listing names no files");
+    }
+
+    ScanStats done = stats();
+    done.dirs = m_tree->folderCount();
+    done.files = m_tree->fileCount() - m_droppedFiles;
+    done.bytes = m_tree->isEmpty() ? 0 : m_tree->node(m_tree->root()).totalSize;
+    done.applyMs = m_buildNs / 1000000;
+    done.complete = !m_cancel && !m_tree->isEmpty();
+    m_stats = done;
+    m_finished = true;
+}
+
+void ListingImporter::addLine(const char *base, const Line &line, const char *nextBase, const Line *next)
+{
+    if (line.type != 0 && line.type != 'f' && line.type != 'd')
+        return;
+    m_untyped = m_untyped || line.type == 0;
+    const char *path = base + line.path;
+    const int length = int(line.length);
+    const bool folderFirst = next && isBelow(nextBase + next->path, next->length, path, line.length);
+    const bool isFolder = line.type == 'd' || folderFirst;
+    if (m_tree->isEmpty() && !placeRoot(path, length, isFolder)) {
+        m_skippedLines++;
+        return;
+    }
+    if (isRoot(path, length))
+        return;
+    while (!underRoot(path, length)) {
+        if (!widenRoot()) {
+            m_skippedLines++;
+            return;
+        }
+    }
+    if (line.hidden > quint32(m_rootLength))
+        return;
+    if (isFolder) {
+        folderFor(path, length);
+        return;
+    }
+    const NodeIndex parent = folderFor(path, int(line.name) - 1);
+    const char *name = path + line.name;
+    const int nameLength = length - int(line.name);
+    // du lists a folder after what is in it; most files are in folders
+    // without subfolders, which need no lookup.
+    if (line.type == 0 && m_tree->node(parent).firstChild != NoIndex && findChild(parent, name, nameLength) != NoIndex)
+        return;
+    if (line.size < MIN_FILE_SIZE)
+        return;
+    if (parent != m_sizeFolder) {
+        flushSizes();
+        m_sizeFolder = parent;
+    }
+    const FileIndex file = m_tree->addFile(parent, name, nameLength, line.size);
+    m_added.add(m_tree->file(file).type, line.size);
+}
+
+// The root is the first line if it is a folder, as with find, and its
+// folder otherwise; widenRoot() moves it up as later lines need.
+bool ListingImporter::placeRoot(const char *path, int length, bool isFolder)
+{
+    if (!isFolder) {
+        int slash = length - 1;
+        while (slash >= 0 && path[slash] != '/')
+            slash--;
+        if (slash < 0)
+            return false;
+        length = slash == 0 ? 1 : slash;
+    }
+    m_rootPath.assign(path, size_t(length));
+    m_rootLength = m_rootPath == "/" ? 0 : length;
+    const NodeIndex root = m_tree->createRoot(QFile::decodeName(QByteArray(path, length)));
+    m_lastPath = m_rootPath.substr(0, size_t(m_rootLength));
+    m_lastFolders.assign(1, std::make_pair(m_rootLength, root));
+    return true;
+}
+
+// Puts the root's parent above it, for a line outside the root.
+bool ListingImporter::widenRoot()
+{
+    if (m_rootLength == 0)
+        return false;
+    const size_t slash = m_rootPath.rfind('/');
+    if (slash == std::string::npos)
+        return false;
+    flushSizes();
+    const NodeIndex oldRoot = m_tree->root();
+    const std::string name = m_rootPath.substr(slash + 1);
+    m_rootPath.resize(slash == 0 ? 1 : slash);
+    m_rootLength = slash == 0 ? 0 : int(slash);
+    const NodeIndex root = m_tree->addParentRoot(QFile::decodeName(QByteArray(m_rootPath.data(), int(m_rootPath.size()))));
+    m_children[(quint64(root) << 32) | NamePool::hash(name.data(), int(name.size()))] = oldRoot;
+    m_lastPath = m_rootPath.substr(0, size_t(m_rootLength));
+    m_lastFolders.assign(1, std::make_pair(m_rootLength, root));
+    return true;
+}
+
+bool ListingImporter::isRoot(const char *path, int length) const
+{
+    if (m_rootLength == 0)
+        return length == 1 && path[0] == '/';
+    return length == m_rootLength && memcmp(path, m_rootPath.data(), size_t(length)) == 0;
+}
+
+bool ListingImporter::underRoot(const char *path, int length) const
+{
+    return isBelow(path, quint32(length), m_rootPath.data(), quint32(m_rootLength));
+}
+
+// The folder at the first length bytes of path, below the root, made if it
+// doesn't exist yet. Only the components after the part path shares with
+// the last one looked up are looked up.
+NodeIndex ListingImporter::folderFor(const char *path, int length)
+{
+    const int shared = int(std::min<size_t>(size_t(length), m_lastPath.size()));
+    int same = 0;
+    while (same < shared && path[same] == m_lastPath[size_t(same)])
+        same++;
+    // Back to the deepest folder both paths have in full; the root stays.
+    while (m_lastFolders.size() > 1) {
+        const int end = m_lastFolders.back().first;
+        if (end <= same && (end == length || path[end] == '/'))
+            break;
+        m_lastFolders.pop_back();
+    }
+    int pos = m_lastFolders.back().first;
+    while (pos < length) {
+        const int start = pos + 1;
+        const void *slash = memchr(path + start, '/', size_t(length - start));
+        const int end = slash ? int(static_cast<const char *>(slash) - path) : length;
+        m_lastFolders.emplace_back(end, child(m_lastFolders.back().second, path + start, end - start));
+        pos = end;
+    }
+    m_lastPath.assign(path, size_t(length));
+    return m_lastFolders.back().second;
+}
+
+NodeIndex ListingImporter::findChild(NodeIndex parent, const char *name, int length) const
+{
+    const auto it = m_children.find((quint64(parent) << 32) | NamePool::hash(name, length));
+    if (it == m_children.end())
+        return NoIndex;
+    int found = 0;
+    const char *data = m_tree->names().data(m_tree->node(it->second).name, found);
+    if (found == length && memcmp(data, name, size_t(length)) == 0)
+        return it->second;
+    // Two names of one folder with the same hash: look through them all.
+    for (NodeIndex child = m_tree->node(parent).firstChild; child != NoIndex; child = m_tree->node(child).nextSibling) {
+        data = m_tree->names().data(m_tree->node(child).name, found);
+        if (found == length && memcmp(data, name, size_t(length)) == 0)
+            return child;
+    }
+    return NoIndex;
+}
+
+NodeIndex ListingImporter::child(NodeIndex parent, const char *name, int length)
+{
+    const NodeIndex found = findChild(parent, name, length);
+    if (found != NoIndex)
+        return found;
+    const NodeIndex added = m_tree->addFolder(parent, name, length);
+    m_children.emplace((quint64(parent) << 32) | NamePool::hash(name, length), added);
+    return added;
+}
+
+// Without types, a folder listed away from what is in it, as in a sorted
+// or shuffled listing, was taken for a file. The folder that what is in
+// it made shows it up: same parent, same name.
+void ListingImporter::dropFolderLines()
+{
+    std::unordered_set<quint64> folders;
+    folders.reserve(m_tree->folderCount());
+    for (NodeIndex i = 0; i < m_tree->folderCount(); i++) {
+        if (i != m_tree->root())
+            folders.insert((quint64(m_tree->node(i).parent) << 32) | m_tree->node(i).name);
+    }
+    std::unordered_map<NodeIndex, std::vector<FileIndex>> misread;
+    for (FileIndex i = 0; i < m_tree->fileCount(); i++) {
+        const FileEntry &file = m_tree->file(i);
+        if (folders.count((quint64(file.parent) << 32) | file.name))
+            misread[file.parent].push_back(i);
+    }
+    for (const auto &entry : misread) {
+        m_tree->removeFiles(entry.first, entry.second);
+        m_droppedFiles += entry.second.size();
+    }
+}
+
+// Adds the files of the folder they were last added to to every total
+// above them, once per run of lines in one folder rather than per line.
+void ListingImporter::flushSizes()
+{
+    if (m_sizeFolder != NoIndex)
+        m_tree->addSize(m_sizeFolder, m_added);
+    m_sizeFolder = NoIndex;
+    m_added = CategorySizes();
+}
@@ -0,0 +1,161 @@
+#ifndef LISTINGIMPORTER_H
+#define LISTINGIMPORTER_H
+
+#include "folderscanner.h"
+#include "foldertree.h"
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QMutex>
+#include <QString>
+#include <QWaitCondition>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct z_stream_s;
+
+// Builds a tree from a listing of files made elsewhere, such as on the
+// storage nodes of a filer far too large to scan from a desktop:
+//
+//   find /data -printf '%s %p\n'       size and path
+//   find /data -printf '%y %s %p\n'    the same with the type, f or d
+//   du -ab /data                       size, a tab and path
+//
+// plain or gzip compressed, from a file or, for "-", standard input, in
+// any order. Sizes are in bytes. Without the type, a line is a folder if
+// anything else lies below it, so an empty folder is taken for a file of
+// its listed size. Other types than f and d, such as symlinks, are left
+// out; find -L lists what they point to instead.
+//
+// The rules of a scan apply: hidden entries and everything below them are
+// left out, as are files smaller than MIN_FILE_SIZE, so the totals come
+// out as a scan of the same folders would have them.
+//
+// A plain file is mapped, not read, and cut into chunks at line ends that
+// worker threads parse side by side; lines point into their chunk rather
+// than being copied. One thread adds them to the tree in order. Lines next
+// to each other mostly share their folder, so it keeps the folders of the
+// last path and only looks up the part of each path that differs.
+//
+// The tree is built on threads of its own and handed over once complete.
+class ListingImporter
+{
+public:
+    // A threadCount of 0 means one parser per core.
+    explicit ListingImporter(int threadCount = 0);
+    // Stops the threads; the tree so far is dropped.
+    ~ListingImporter();
+
+    // Starts reading fileName in the background; false, with
+    // errorString() set, if it can't be opened.
+    bool start(const QString &fileName);
+    // Reads fileName and blocks until the tree is built; null on an error.
+    std::shared_ptr<FolderTree> import(const QString &fileName);
+    // Asks the threads to stop without waiting for them.
+    void cancel();
+
+    bool isFinished() const { return m_finished; }
+    // Once finished: the tree, sorted and final, or null if the listing
+    // couldn't be read or held nothing to show.
+    std::shared_ptr<FolderTree> takeTree();
+    QString errorString() const;
+    ScanStats stats() const;
+
+private:
+    // One line: its size, and where in its chunk the path is.
+    struct Line {
+        qint64 size;
+        quint32 path;                 // Offset of the path in the chunk,
+        quint32 length;               // its length without a trailing slash,
+        quint32 name;                 // where its last component starts,
+        quint32 hidden;               // and its last hidden one; 0 for none.
+        char type;                    // 'f', 'd' and so on; 0 if not listed.
+    };
+
+    // Whole lines of the listing, in a slice of the mapped file or a buffer
+    // of their own.
+    struct Chunk {
+        QByteArray buffer;
+        const char *data = nullptr;
+        qint64 length = 0;
+        std::vector<Line> lines;
+        qint64 skipped = 0;           // Lines that aren't size and path.
+        bool taken = false;           // By a parser,
+        bool parsed = false;          // which is done with it.
+    };
+
+    void readLoop();
+    void parseLoop();
+    void buildLoop();
+    bool nextChunk(Chunk &chunk);
+    qint64 readInput(char *data, qint64 capacity);
+    static void parse(Chunk &chunk);
+    void fail(const QString &error);
+    void stopThreads();
+
+    void addLine(const char *base, const Line &line, const char *nextBase, const Line *next);
+    bool placeRoot(const char *path, int length, bool isFolder);
+    bool widenRoot();
+    bool isRoot(const char *path, int length) const;
+    bool underRoot(const char *path, int length) const;
+    NodeIndex folderFor(const char *path, int length);
+    NodeIndex findChild(NodeIndex parent, const char *name, int length) const;
+    NodeIndex child(NodeIndex parent, const char *name, int length);
+    void flushSizes();
+    void dropFolderLines();
+
+    int m_threadCount;
+    QFile m_file;
+    const char *m_map = nullptr;      // The whole file, if it could be mapped.
+    qint64 m_mapSize = 0;
+    qint64 m_mapPos = 0;
+    z_stream_s *m_inflate = nullptr;  // For a gzip compressed listing.
+    QByteArray m_input;
+    bool m_inputEnded = false;
+    bool m_betweenMembers = true;     // Of the gzip stream, where it may end.
+    QByteArray m_carry;               // The start of a line the last chunk cut off.
+
+    // Chunks in listing order, from the reader through the parsers to the
+    // builder, a few per parser at most.
+    mutable QMutex m_mutex;
+    QWaitCondition m_progress;
+    std::deque<std::shared_ptr<Chunk>> m_chunks;
+    bool m_readDone = false;
+    std::atomic<bool> m_cancel{false};
+    std::atomic<bool> m_finished{false};
+    QString m_error;
+    std::thread m_reader;
+    std::thread m_builder;
+    std::vector<std::thread> m_parsers;
+
+    // Built by the builder thread alone.
+    std::shared_ptr<FolderTree> m_tree;
+    std::string m_rootPath;
+    int m_rootLength = 0;             // 0 for "/", so that its children follow a '/' too.
+    std::unordered_map<quint64, NodeIndex> m_children;  // By parent and name hash.
+    // The folders of the last path looked up, as where each ends in it.
+    std::string m_lastPath;
+    std::vector<std::pair<int, NodeIndex>> m_lastFolders;
+    // The files added to one folder since its total was last brought up to date.
+    NodeIndex m_sizeFolder = NoIndex;
+    CategorySizes m_added;
+    bool m_untyped = false;           // Some lines didn't say whether they are folders.
+    qint64 m_droppedFiles = 0;        // Taken for files at first; see dropFolderLines().
+
+    QElapsedTimer m_timer;
+    bool m_compressed = false;
+    std::atomic<qint64> m_bytesRead{0};
+    std::atomic<qint64> m_dirCount{0};
+    std::atomic<qint64> m_fileCount{0};
+    std::atomic<qint64> m_skippedLines{0};
+    qint64 m_buildNs = 0;
+    ScanStats m_stats;
+};
+
+#endif // LISTINGIMPORTER_H
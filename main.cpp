@@ -1,11 +1,141 @@
+#include "listingimporter.h"
 #include "mainwindow.h"
+#include "trace.h"
+#include "treemapexport.h"
 #include <QApplication>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QTextStream>
+#include <cstring>
+
+// Scans folder, or reads the listing if there is one, and writes its map
+// to fileName; the exit code.
+static int exportMap(const ScanOptions &options, const QString &listing, const QString &folder,
+                     const QString &fileName, const QString &size, double scale) {
+    TreemapExport image;
+    const QStringList sides = size.split('x');
+    if (sides.size() != 2 || sides[0].toInt() <= 0 || sides[1].toInt() <= 0) {
+        QTextStream(stderr) << "Not an image size: " << size << "; give it as width x height, such as 3840x2160\n";
+        return 1;
+    }
+    image.setSize(QSize(sides[0].toInt(), sides[1].toInt()));
+    image.setScale(scale > 0 ? scale : 1);
+    image.setFont(QGuiApplication::font());
+
+    std::shared_ptr<FolderTree> tree;
+    if (!listing.isEmpty()) {
+        ListingImporter importer(options.threadCount);
+        tree = importer.import(listing);
+        if (!tree) {
+            QTextStream(stderr) << importer.errorString() << "\n";
+            return 1;
+        }
+    } else {
+        FolderScanner scanner(options);
+        tree = scanner.scan(folder);
+    }
+    if (!tree || tree->isEmpty()) {
+        QTextStream(stderr) << "Nothing to show in " << (listing.isEmpty() ? folder : listing) << "\n";
+        return 1;
+    }
+    if (!image.save(*tree, tree->root(), fileName)) {
+        QTextStream(stderr) << image.errorString() << "\n";
+        return 1;
+    }
+    QTextStream(stderr) << QString("Wrote %1: %2 items, laid out in %3 ms, drawn in %4 ms, %5 MiB of image at most\n")
+                           .arg(fileName)
+                           .arg(image.itemCount())
+                           .arg(image.layoutMs(), 0, 'f', 0)
+                           .arg(image.renderMs(), 0, 'f', 0)
+                           .arg(image.peakBytes() / (1024.0 * 1024.0), 0, 'f', 1);
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
+    // An export draws without a window, so it needs no screen either.
+    for (int i = 1; i < argc; i++) {
+        if (std::strncmp(argv[i], "--export", 8) == 0 && qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+            qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
     QApplication app(argc, argv);
-    MainWindow window;
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption threadsOption("threads", "Number of scanner threads (default: one per core).", "count", "0");
+    parser.addOption(threadsOption);
+    QCommandLineOption backendOption("backend", "Directory reading backend: native or qdir (default: native where available).", "name", "auto");
+    parser.addOption(backendOption);
+    QCommandLineOption noSnapshotOption("no-snapshot", "Always scan from scratch; don't read or write scan snapshots.");
+    parser.addOption(noSnapshotOption);
+    QCommandLineOption noWatchOption("no-watch", "Don't follow changes on disk once a scan is done.");
+    parser.addOption(noWatchOption);
+    QCommandLineOption summaryOption("summary", "For huge volumes: keep only the largest files of each folder and "
+                                     "count the rest by extension; zooming in rescans a folder in full.", "files");
+    parser.addOption(summaryOption);
+    QCommandLineOption memoryLimitOption("memory-limit", "With --summary, keep fewer files per folder as the "
+                                         "tree approaches this size.", "MiB");
+    parser.addOption(memoryLimitOption);
+    QCommandLineOption oneFileSystemOption("one-file-system", "Don't scan other file systems mounted below the "
+                                           "folder, such as network shares or other disks.");
+    parser.addOption(oneFileSystemOption);
+    QCommandLineOption mountTimeoutOption("mount-timeout", "Give up on a network or FUSE file system once reading "
+                                          "one of its folders takes longer than this; 0 never gives up (default: 10).", "seconds");
+    parser.addOption(mountTimeoutOption);
+    QCommandLineOption deviceProfileOption("device-profile", "Treat every file system as ssd, hdd or network, "
+                                           "which decides how many folders are read from it at once "
+                                           "(default: auto, from the device).", "kind", "auto");
+    parser.addOption(deviceProfileOption);
+    QCommandLineOption importOption("import", "Show the folders of a listing made elsewhere instead of scanning: "
+                                    "find -printf '%s %p\\n' or du -ab output, plain or gzipped; - for "
+                                    "standard input.", "file");
+    parser.addOption(importOption);
+    QCommandLineOption traceOption("trace", "Record a timeline of scanning, layout and painting and write it, "
+                                   "in Chrome trace format, to file on exit.", "file");
+    parser.addOption(traceOption);
+    QCommandLineOption exportOption("export", "Write the map of the folder, or of the --import listing, to a "
+                                    ".png or .svg image and exit, without a window.", "file");
+    parser.addOption(exportOption);
+    QCommandLineOption exportSizeOption("export-size", "Size of the --export image in pixels, any size up to "
+                                        "gigapixel posters (default: 3840x2160).", "width x height", "3840x2160");
+    parser.addOption(exportSizeOption);
+    QCommandLineOption exportScaleOption("export-scale", "Pixels per point of the --export image: above 1, labels "
+                                         "are drawn larger and fewer items fit (default: 1).", "factor", "1");
+    parser.addOption(exportScaleOption);
+    parser.addPositionalArgument("folder", "With --export, the folder to scan (default: the home folder).", "[folder]");
+    parser.process(app);
+
+    ScanOptions options;
+    options.threadCount = parser.value(threadsOption).toInt();
+    options.backend = ScanBackend::kindFromString(parser.value(backendOption));
+    options.useSnapshots = !parser.isSet(noSnapshotOption);
+    options.watchChanges = !parser.isSet(noWatchOption);
+    options.summaryFiles = parser.value(summaryOption).toInt();
+    options.memoryLimit = parser.value(memoryLimitOption).toLongLong() * 1024 * 1024;
+    options.oneFileSystem = parser.isSet(oneFileSystemOption);
+    if (parser.isSet(mountTimeoutOption))
+        options.mountTimeoutMs = int(parser.value(mountTimeoutOption).toDouble() * 1000);
+    options.deviceProfile = DeviceProfiles::kindFromString(parser.value(deviceProfileOption));
+
+    if (parser.isSet(traceOption))
+        Trace::setEnabled(true);
+
+    if (parser.isSet(exportOption)) {
+        const QStringList folders = parser.positionalArguments();
+        const int result = exportMap(options, parser.value(importOption),
+                                     folders.isEmpty() ? QDir::homePath() : QDir(folders[0]).absolutePath(),
+                                     parser.value(exportOption), parser.value(exportSizeOption),
+                                     parser.value(exportScaleOption).toDouble());
+        if (parser.isSet(traceOption))
+            Trace::save(parser.value(traceOption));
+        return result;
+    }
+
+    MainWindow window(options, parser.value(importOption));
     window.resize(1920, 1200);
     window.show();
-    return app.exec();
+    const int result = app.exec();
+    if (parser.isSet(traceOption))
+        Trace::save(parser.value(traceOption));
+    return result;
 }
@@ -1,34 +1,84 @@
 #include "mainwindow.h"
 #include "foldermapwidget.h" // Ensure the full definition is included
+#include "snapshot.h"
 
 #include <QToolBar>
 #include <QAction>
+#include <QDockWidget>
+#include <QListWidget>
 #include <QFileDialog>
 #include <QLineEdit>
+#include <QStatusBar>
 #include <QDebug>
 #include <QDir>
+#include <QSignalBlocker>
 
-MainWindow::MainWindow(QWidget *parent)
+MainWindow::MainWindow(const ScanOptions &options, const QString &listing, QWidget *parent)
     : QMainWindow(parent)
 {
     folderWidget = new FolderMapWidget(this);
+    folderWidget->setScanOptions(options);
     setCentralWidget(folderWidget);
 
     QToolBar *toolbar = addToolBar("Main Toolbar");
     QAction *chooseFolderAction = toolbar->addAction("Choose Folder");
     QAction *homeAct = toolbar->addAction("Home");
+    QAction *importAction = toolbar->addAction("Import Listing");
+    importAction->setToolTip("Show a listing made by find -printf '%s %p\\n' or du -ab, plain or gzipped");
     rootPathEdit = new QLineEdit(this);
     rootPathEdit->setReadOnly(true);
     connect(folderWidget, &FolderMapWidget::rootFolderChanged, this, &MainWindow::updateRootPath);
+    connect(folderWidget, &FolderMapWidget::scanProgress, this, &MainWindow::showScanSummary);
+    connect(folderWidget, &FolderMapWidget::scanFinished, this, &MainWindow::showScanSummary);
 
     toolbar->addWidget(rootPathEdit);
     QAction *zoomOutAction = toolbar->addAction("Zoom Out");
+    QAction *squarifyAction = toolbar->addAction("Squarify");
+    squarifyAction->setCheckable(true);
+    QAction *statsAction = toolbar->addAction("Stats");
+    statsAction->setCheckable(true);
+    statsAction->setShortcut(QKeySequence(Qt::Key_F12));
+    compareAction = toolbar->addAction("Compare");
+    compareAction->setCheckable(true);
+    compareAction->setToolTip("Colour the map by what grew or shrank since an earlier scan");
+
+    searchEdit = new QLineEdit(this);
+    searchEdit->setPlaceholderText("Search: name, *.jpg, /regex/, ext:, type:, size>, after:, before:");
+    searchEdit->setClearButtonEnabled(true);
+    toolbar->addWidget(searchEdit);
+    resultsList = new QListWidget(this);
+    resultsList->setUniformItemSizes(true);
+    resultsDock = new QDockWidget("Largest Matches", this);
+    resultsDock->setWidget(resultsList);
+    addDockWidget(Qt::RightDockWidgetArea, resultsDock);
+    resultsDock->hide();
+    connect(searchEdit, &QLineEdit::textChanged, folderWidget, &FolderMapWidget::setSearch);
+    connect(folderWidget, &FolderMapWidget::searchUpdated, this, &MainWindow::showSearchResults);
+    connect(resultsList, &QListWidget::itemActivated, this,
+            [this](QListWidgetItem *item) { folderWidget->revealMatch(resultsList->row(item)); });
+
+    growthList = new QListWidget(this);
+    growthList->setUniformItemSizes(true);
+    growthDock = new QDockWidget("Largest Growth", this);
+    growthDock->setWidget(growthList);
+    addDockWidget(Qt::RightDockWidgetArea, growthDock);
+    growthDock->hide();
+    connect(compareAction, &QAction::toggled, this, &MainWindow::setComparing);
+    connect(folderWidget, &FolderMapWidget::comparisonUpdated, this, &MainWindow::showComparison);
+    connect(growthList, &QListWidget::itemActivated, this,
+            [this](QListWidgetItem *item) { folderWidget->revealGrowth(growthList->row(item)); });
 
     connect(chooseFolderAction, &QAction::triggered, this, &MainWindow::chooseFolder);
     connect(homeAct, &QAction::triggered, this, &MainWindow::scanHome);
+    connect(importAction, &QAction::triggered, this, &MainWindow::importListing);
     connect(zoomOutAction, &QAction::triggered, this, &MainWindow::zoomOut);
+    connect(squarifyAction, &QAction::toggled, folderWidget, &FolderMapWidget::setSquarified);
+    connect(statsAction, &QAction::toggled, folderWidget, &FolderMapWidget::setStatsVisible);
 
-    folderWidget->buildFolderTree(QDir::homePath());
+    if (listing.isEmpty())
+        folderWidget->buildFolderTree(QDir::homePath());
+    else
+        folderWidget->importListing(listing);
 }
 
 void MainWindow::chooseFolder()
@@ -40,6 +90,14 @@ void MainWindow::chooseFolder()
     }
 }
 
+void MainWindow::importListing()
+{
+    const QString file = QFileDialog::getOpenFileName(this, "Import File Listing", QString(),
+                                                      "Listings (*.txt *.lst *.gz);;All Files (*)");
+    if (!file.isEmpty())
+        folderWidget->importListing(file);
+}
+
 void MainWindow::zoomOut()
 {
     folderWidget->zoomOut();
@@ -54,3 +112,48 @@ void MainWindow::updateRootPath(const QString &path)
 {
     rootPathEdit->setText(path);
 }
+
+void MainWindow::showScanSummary(const QString &summary)
+{
+    statusBar()->showMessage(summary);
+}
+
+void MainWindow::showSearchResults(const QString &summary, const QStringList &largest)
+{
+    statusBar()->showMessage(summary);
+    resultsList->setUpdatesEnabled(false);
+    resultsList->clear();
+    resultsList->addItems(largest);
+    resultsList->setUpdatesEnabled(true);
+    resultsDock->setVisible(!searchEdit->text().trimmed().isEmpty() && !largest.isEmpty());
+}
+
+void MainWindow::setComparing(bool comparing)
+{
+    if (!comparing) {
+        folderWidget->clearComparison();
+        return;
+    }
+    // The scan before the last one is kept next to the last one's snapshot,
+    // which is of the scanned folder, not of the one zoomed to.
+    const QString root = folderWidget->scanRootPath();
+    const QString previous = root.isEmpty() ? QString() : Snapshot::previousFor(Snapshot::fileFor(root));
+    const QString file = QFileDialog::getOpenFileName(this, "Compare With Scan", previous,
+                                                      "Snapshots (*.snapshot *.previous);;All Files (*)");
+    if (file.isEmpty() || !folderWidget->compareWith(file)) {
+        if (!file.isEmpty())
+            statusBar()->showMessage("Can't compare with " + file + ": not a snapshot of these folders");
+        QSignalBlocker blocker(compareAction);
+        compareAction->setChecked(false);
+    }
+}
+
+void MainWindow::showComparison(const QString &summary, const QStringList &grown)
+{
+    statusBar()->showMessage(summary);
+    growthList->setUpdatesEnabled(false);
+    growthList->clear();
+    growthList->addItems(grown);
+    growthList->setUpdatesEnabled(true);
+    growthDock->setVisible(compareAction->isChecked() && !grown.isEmpty());
+}
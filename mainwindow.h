@@ -1,26 +1,46 @@
 #ifndef MAINWINDOW_H
 #define MAINWINDOW_H
 
+#include "folderscanner.h"
+
 #include <QMainWindow>
 #include <QLineEdit>
+#include <QStringList>
 
 class FolderMapWidget; // Forward declaration is sufficient here.
+class QAction;
+class QDockWidget;
+class QListWidget;
 
 class MainWindow : public QMainWindow
 {
     Q_OBJECT
 public:
-    explicit MainWindow(QWidget *parent = nullptr);
+    // Scans the home folder, or with a listing, shows that instead; see
+    // FolderMapWidget::importListing().
+    explicit MainWindow(const ScanOptions &options = ScanOptions(), const QString &listing = QString(),
+                        QWidget *parent = nullptr);
 
 private slots:
     void chooseFolder();
+    void importListing();
     void zoomOut();
     void scanHome();
     void updateRootPath(const QString &path);
+    void showScanSummary(const QString &summary);
+    void showSearchResults(const QString &summary, const QStringList &largest);
+    void setComparing(bool comparing);
+    void showComparison(const QString &summary, const QStringList &grown);
 
 private:
     FolderMapWidget *folderWidget;
     QLineEdit *rootPathEdit;
+    QLineEdit *searchEdit;
+    QDockWidget *resultsDock;
+    QListWidget *resultsList;
+    QAction *compareAction;
+    QDockWidget *growthDock;
+    QListWidget *growthList;
 };
 
 #endif // MAINWINDOW_H
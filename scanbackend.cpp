@@ -0,0 +1,270 @@
+#include "scanbackend.h"
+#include "scanfilter.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QFileInfoList>
+#include <QDateTime>
+#include <algorithm>
+#include <cstring>
+
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <dirent.h>
+#endif
+
+// Large enough that most directories come back from a single getdents64.
+static const size_t DIRENT_BUFFER_SIZE = 256 * 1024;
+
+void DirListing::clear()
+{
+    names.clear();
+    files.clear();
+    dirs.clear();
+    groups.clear();
+    modified = 0;
+    device = 0;
+    statCalls = 0;
+}
+
+void DirListing::addFile(const char *name, int length, qint64 size, qint64 modified)
+{
+    files.push_back({static_cast<quint32>(names.size()), static_cast<quint32>(length), size, modified});
+    names.append(name, length);
+}
+
+void DirListing::addDir(const char *name, int length)
+{
+    dirs.push_back({static_cast<quint32>(names.size()), static_cast<quint32>(length), 0});
+    names.append(name, length);
+}
+
+QByteArray DirListing::name(const Entry &entry) const
+{
+    return names.mid(entry.nameOffset, entry.nameLength);
+}
+
+qint64 ScanBackend::modificationTime(const QString &path)
+{
+    const QFileInfo info(path);
+    return info.exists() ? info.lastModified().toMSecsSinceEpoch() : -1;
+}
+
+std::unique_ptr<ScanBackend> ScanBackend::create(Kind kind)
+{
+#ifdef Q_OS_LINUX
+    if (kind != Portable)
+        return std::unique_ptr<ScanBackend>(new LinuxScanBackend);
+#else
+    Q_UNUSED(kind);
+#endif
+    return std::unique_ptr<ScanBackend>(new QDirScanBackend);
+}
+
+ScanBackend::Kind ScanBackend::kindFromString(const QString &value)
+{
+    if (value == "qdir" || value == "portable")
+        return Portable;
+    if (value == "native" || value == "linux")
+        return Native;
+    return Auto;
+}
+
+bool QDirScanBackend::readDirectory(const QString &path, DirListing &listing)
+{
+    listing.clear();
+    QDir dir(path);
+    if (!dir.exists())
+        return false;
+    listing.modified = modificationTime(path);
+    // One pass for both kinds of entries instead of one per filter.
+    const QFileInfoList infos = dir.entryInfoList(QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot, QDir::NoSort);
+    listing.statCalls = 1 + infos.size();
+    for (const QFileInfo &fi : infos) {
+        if (cancelled())
+            return false;
+        QByteArray name = QFile::encodeName(fi.fileName());
+        if (fi.isDir())
+            listing.addDir(name.constData(), name.size());
+        else
+            listing.addFile(name.constData(), name.size(), fi.size(), fi.lastModified().toMSecsSinceEpoch());
+    }
+    return true;
+}
+
+#ifdef Q_OS_LINUX
+
+namespace {
+
+struct LinuxDirent64 {
+    quint64 d_ino;
+    qint64 d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct EntryStat {
+    unsigned type = 0;                // S_IFMT bits, 0 if the entry can't be stat'ed.
+    qint64 size = 0;
+    quint64 device = 0;
+    quint64 inode = 0;
+    quint32 links = 0;
+    qint64 modified = -1;             // In ms since the epoch.
+};
+
+qint64 timeInMs(const struct timespec &time)
+{
+    return qint64(time.tv_sec) * 1000 + time.tv_nsec / 1000000;
+}
+
+// Stats name relative to dirFd, following symlinks like QFileInfo does.
+EntryStat statEntry(int dirFd, const char *name, bool follow)
+{
+    EntryStat entry;
+    const int flags = follow ? 0 : AT_SYMLINK_NOFOLLOW;
+#ifdef STATX_SIZE
+    struct statx stx;
+    const unsigned mask = STATX_TYPE | STATX_SIZE | STATX_INO | STATX_NLINK | STATX_MTIME;
+    if (statx(dirFd, name, flags | AT_STATX_SYNC_AS_STAT, mask, &stx) != 0)
+        return entry;
+    entry.type = stx.stx_mode & S_IFMT;
+    entry.size = static_cast<qint64>(stx.stx_size);
+    entry.device = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    entry.inode = stx.stx_ino;
+    entry.links = stx.stx_nlink;
+    entry.modified = qint64(stx.stx_mtime.tv_sec) * 1000 + stx.stx_mtime.tv_nsec / 1000000;
+#else
+    struct stat st;
+    if (fstatat(dirFd, name, &st, flags) != 0)
+        return entry;
+    entry.type = st.st_mode & S_IFMT;
+    entry.size = st.st_size;
+    entry.device = st.st_dev;
+    entry.inode = st.st_ino;
+    entry.links = st.st_nlink;
+    entry.modified = timeInMs(st.st_mtim);
+#endif
+    return entry;
+}
+
+} // namespace
+
+LinuxScanBackend::LinuxScanBackend()
+    : m_buffer(DIRENT_BUFFER_SIZE)
+{
+}
+
+bool LinuxScanBackend::readDirectory(const QString &path, DirListing &listing)
+{
+    listing.clear();
+    const QByteArray encodedPath = QFile::encodeName(path);
+    const int fd = open(encodedPath.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    const bool known = fstat(fd, &st) == 0;
+    listing.modified = known ? timeInMs(st.st_mtim) : -1;
+    listing.device = known ? quint64(st.st_dev) : 0;
+    listing.statCalls++;
+    if (known && m_filter && !m_filter->admitDirectory(st.st_dev, st.st_ino)) {
+        close(fd);
+        return true;
+    }
+
+    bool complete = true;
+    int entries = 0;
+    while (complete) {
+        const long bytes = syscall(SYS_getdents64, fd, m_buffer.data(), m_buffer.size());
+        if (bytes == 0)
+            break;
+        // An error such as EIO or ESTALE midway leaves the listing short;
+        // it mustn't pass for the whole directory.
+        if (bytes < 0) {
+            complete = false;
+            break;
+        }
+        for (long offset = 0; offset < bytes;) {
+            const auto *entry = reinterpret_cast<const LinuxDirent64 *>(m_buffer.data() + offset);
+            offset += entry->d_reclen;
+            // Every entry may cost a stat, so a huge directory on a slow
+            // file system can take long; don't make a cancelled scan wait.
+            if ((++entries & 255) == 0 && cancelled()) {
+                complete = false;
+                break;
+            }
+            // Skips ".", ".." and hidden entries, matching QDir's default filter.
+            if (entry->d_name[0] == '.')
+                continue;
+            const int length = static_cast<int>(strlen(entry->d_name));
+            if (m_inodeOrder) {
+                m_pending.push_back({entry->d_ino, quint32(m_pendingNames.size()), quint32(length), entry->d_type});
+                m_pendingNames.append(entry->d_name, length + 1);
+            } else {
+                addEntry(fd, entry->d_name, length, entry->d_type, listing);
+            }
+        }
+    }
+    if (m_inodeOrder) {
+        // Inode numbers follow the disk's layout closely enough that going
+        // by them turns the stats' random seeks into a sweep; subdirectories
+        // get listed, and so read, in the same order.
+        std::sort(m_pending.begin(), m_pending.end(),
+                  [](const Pending &a, const Pending &b) { return a.inode < b.inode; });
+        for (size_t i = 0; complete && i < m_pending.size(); i++) {
+            if ((i & 255) == 255 && cancelled()) {
+                complete = false;
+                break;
+            }
+            const Pending &entry = m_pending[i];
+            addEntry(fd, m_pendingNames.constData() + entry.nameOffset, int(entry.nameLength), entry.type, listing);
+        }
+        m_pending.clear();
+        m_pendingNames.clear();
+    }
+    close(fd);
+    return complete;
+}
+
+// Adds one entry of the directory open as fd to listing; name is
+// null-terminated.
+void LinuxScanBackend::addEntry(int fd, const char *name, int length, unsigned char type, DirListing &listing)
+{
+    switch (type) {
+    case DT_DIR:
+        listing.addDir(name, length);
+        break;
+    case DT_REG:
+    case DT_LNK:
+    case DT_UNKNOWN: {
+        listing.statCalls++;
+        const EntryStat stat = statEntry(fd, name, type != DT_REG);
+        // Hard links and symlinks lead to files other paths may lead to as
+        // well; those are counted once.
+        const bool shared = stat.links > 1 || type == DT_LNK;
+        if (stat.type == S_IFDIR)
+            listing.addDir(name, length);
+        else if (stat.type == S_IFREG && (!shared || !m_filter || m_filter->admitLink(stat.device, stat.inode)))
+            listing.addFile(name, length, stat.size, stat.modified);
+        break;
+    }
+    default:
+        // Devices, fifos and sockets are not shown.
+        break;
+    }
+}
+
+qint64 LinuxScanBackend::modificationTime(const QString &path)
+{
+    struct stat st;
+    if (stat(QFile::encodeName(path).constData(), &st) != 0)
+        return -1;
+    return timeInMs(st.st_mtim);
+}
+
+#endif // Q_OS_LINUX
@@ -0,0 +1,120 @@
+#ifndef SCANBACKEND_H
+#define SCANBACKEND_H
+
+#include <QByteArray>
+#include <QString>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+class ScanFilter;
+
+// Everything one directory read produces. Entry names are stored back to
+// back in a single byte buffer in the file system's own encoding, so a
+// listing costs a handful of allocations however many entries it has.
+struct DirListing {
+    struct Entry {
+        quint32 nameOffset;
+        quint32 nameLength;
+        qint64 size;
+        qint64 modified = -1;         // Files only: mtime in ms since the epoch, -1 if not known.
+    };
+
+    // Files folded by a summary scan; the name is the extension.
+    struct Group : Entry {
+        quint32 count;
+    };
+
+    QByteArray names;
+    std::vector<Entry> files;
+    std::vector<Entry> dirs;
+    std::vector<Group> groups;
+    qint64 modified = 0;              // The directory's own mtime, in ms since the epoch.
+    quint64 device = 0;               // The file system it is on, where the backend can tell.
+    int statCalls = 0;                // Spent on reading this listing.
+
+    void clear();
+    void addFile(const char *name, int length, qint64 size, qint64 modified = -1);
+    void addDir(const char *name, int length);
+    QByteArray name(const Entry &entry) const;
+};
+
+// Reads one directory level. Hidden entries and anything that is neither a
+// regular file nor a directory (after following symlinks) are left out, as
+// QDir does with its default filters. A backend instance is used by one
+// scanner thread at a time and may keep scratch buffers between calls.
+class ScanBackend
+{
+public:
+    enum Kind { Auto, Portable, Native };
+
+    virtual ~ScanBackend() {}
+    virtual bool readDirectory(const QString &path, DirListing &listing) = 0;
+    virtual const char *name() const = 0;
+    // A directory's mtime in ms since the epoch, or -1 if it can't be read.
+    virtual qint64 modificationTime(const QString &path);
+    // Once flag is set, readDirectory() gives up as soon as it can and
+    // returns false.
+    void setCancelFlag(const std::atomic<bool> *flag) { m_cancel = flag; }
+    // Directories the filter turns away are read as empty, and hard links
+    // it has seen before are left out. Only the Linux backend can tell.
+    void setFilter(ScanFilter *filter) { m_filter = filter; }
+    // Whether to stat entries in inode order rather than as the directory
+    // lists them, which saves seeks on a spinning disk. Only the Linux
+    // backend can tell the inodes.
+    void setInodeOrder(bool on) { m_inodeOrder = on; }
+
+    // Native picks the platform backend when there is one; Auto does the same
+    // and Portable always uses QDir.
+    static std::unique_ptr<ScanBackend> create(Kind kind);
+    static Kind kindFromString(const QString &value);
+
+protected:
+    bool cancelled() const { return m_cancel && m_cancel->load(std::memory_order_relaxed); }
+
+    ScanFilter *m_filter = nullptr;
+    bool m_inodeOrder = false;
+
+private:
+    const std::atomic<bool> *m_cancel = nullptr;
+};
+
+// Portable fallback built on QDir::entryInfoList.
+class QDirScanBackend : public ScanBackend
+{
+public:
+    bool readDirectory(const QString &path, DirListing &listing) override;
+    const char *name() const override { return "qdir"; }
+};
+
+#ifdef Q_OS_LINUX
+// Reads each directory once with large getdents64 calls and stats entries
+// relative to the directory fd. Directories are recognised from d_type, so
+// only files (and symlinks or file systems without d_type) cost a statx.
+class LinuxScanBackend : public ScanBackend
+{
+public:
+    LinuxScanBackend();
+    bool readDirectory(const QString &path, DirListing &listing) override;
+    const char *name() const override { return "linux"; }
+    qint64 modificationTime(const QString &path) override;
+
+private:
+    // An entry held back to be looked at in inode order; its name, with
+    // the terminating null, is in m_pendingNames.
+    struct Pending {
+        quint64 inode;
+        quint32 nameOffset;
+        quint32 nameLength;
+        unsigned char type;
+    };
+
+    void addEntry(int fd, const char *name, int length, unsigned char type, DirListing &listing);
+
+    std::vector<char> m_buffer;
+    std::vector<Pending> m_pending;
+    QByteArray m_pendingNames;
+};
+#endif
+
+#endif // SCANBACKEND_H
@@ -0,0 +1,115 @@
+#include "scanfilter.h"
+#include "deviceprofiles.h"
+#include "folderscanner.h"
+
+#include <QFile>
+#include <QMutexLocker>
+#include <QDebug>
+
+#ifdef Q_OS_UNIX
+#include <sys/stat.h>
+#endif
+
+// File systems with nothing on disk: kernel interfaces whose "files" are
+// generated on demand, report made-up sizes, or never end.
+static const char *const PSEUDO_FILE_SYSTEMS[] = {
+    "proc", "sysfs", "devtmpfs", "devpts", "cgroup", "cgroup2", "securityfs", "debugfs",
+    "tracefs", "pstore", "bpf", "configfs", "fusectl", "mqueue", "hugetlbfs", "autofs",
+    "binfmt_misc", "efivarfs", "rpc_pipefs", "nsfs", "selinuxfs",
+};
+
+ScanFilter::ScanFilter(const ScanOptions &options, bool visitOnce)
+    : m_oneFileSystem(options.oneFileSystem), m_visitOnce(visitOnce), m_slowReadMs(options.mountTimeoutMs)
+{
+    if (!options.skipPseudoFileSystems && m_slowReadMs <= 0)
+        return;
+    for (const MountEntry &mount : mountTable()) {
+        if (options.skipPseudoFileSystems) {
+            for (const char *name : PSEUDO_FILE_SYSTEMS) {
+                if (mount.type == name)
+                    m_pseudo.insert(mount.device);
+            }
+        }
+        if (m_slowReadMs > 0 && (DeviceProfiles::isNetworkType(mount.type) || mount.type.startsWith("fuse"))) {
+            m_hanging.insert(mount.device);
+            m_hangingMounts.insert(QFile::decodeName(mount.mountPoint), mount.device);
+        }
+    }
+}
+
+void ScanFilter::setTop(const QString &path)
+{
+#ifdef Q_OS_UNIX
+    struct stat st;
+    m_topKnown = stat(QFile::encodeName(path).constData(), &st) == 0;
+    m_topDevice = m_topKnown ? quint64(st.st_dev) : 0;
+#else
+    Q_UNUSED(path);
+#endif
+}
+
+bool ScanFilter::admitDirectory(quint64 device, quint64 inode)
+{
+    if (m_pseudo.contains(device) || (m_oneFileSystem && m_topKnown && device != m_topDevice) || isSlow(device)) {
+        m_skippedDirs++;
+        return false;
+    }
+    if (!m_visitOnce)
+        return true;
+    QMutexLocker locker(&m_mutex);
+    if (m_dirs.contains({device, inode})) {
+        m_repeatedDirs++;
+        return false;
+    }
+    m_dirs.insert({device, inode});
+    return true;
+}
+
+bool ScanFilter::admitLink(quint64 device, quint64 inode)
+{
+    if (!m_visitOnce)
+        return true;
+    QMutexLocker locker(&m_mutex);
+    if (m_links.contains({device, inode})) {
+        m_repeatedLinks++;
+        return false;
+    }
+    m_links.insert({device, inode});
+    return true;
+}
+
+bool ScanFilter::admitRead(quint64 device)
+{
+    if (!isSlow(device))
+        return true;
+    m_skippedDirs++;
+    return false;
+}
+
+quint64 ScanFilter::mountedAt(const QString &path) const
+{
+    if (m_hangingMounts.isEmpty())
+        return 0;
+    return m_hangingMounts.value(path, 0);
+}
+
+void ScanFilter::markSlow(quint64 device)
+{
+    if (device == 0)
+        return;
+    QMutexLocker locker(&m_mutex);
+    if (m_slow.contains(device))
+        return;
+    m_slow.insert(device);
+    m_slowCount++;
+    qDebug() << "A directory took over" << m_slowReadMs << "ms to read; skipping the rest of its file system";
+}
+
+bool ScanFilter::isSlow(quint64 device) const
+{
+    // Checked before every read; only lock once there is something to find.
+    if (device == 0 || m_slowCount.load(std::memory_order_relaxed) == 0)
+        return false;
+    QMutexLocker locker(&m_mutex);
+    return m_slow.contains(device);
+}
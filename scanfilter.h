@@ -0,0 +1,92 @@
+#ifndef SCANFILTER_H
+#define SCANFILTER_H
+
+#include <QHash>
+#include <QMutex>
+#include <QSet>
+#include <QString>
+#include <atomic>
+#include <vector>
+
+struct MountEntry;
+struct ScanOptions;
+
+// Decides which directories and files one scan takes in, by the device and
+// inode they live on. Every worker of the scan shares it:
+//
+// - A directory is read once, however many paths lead to it, so symlink
+//   loops and bind mounts end where they start over.
+// - A file with several hard links, or symlinks to it, is counted at the
+//   first path that leads to it.
+// - Pseudo file systems such as /proc and /sys, taken from
+//   /proc/self/mountinfo, are left out; with oneFileSystem, so is every
+//   file system but the one the scan starts on.
+// - A network or FUSE file system on which a read has been going on for
+//   longer than the options' mountTimeoutMs is given up on; the rest of
+//   its directories stay empty. Such a read may never return, so the
+//   scanner checks the reads in flight rather than waiting for them to
+//   end. Local disks are never timed: a huge directory on a slow disk
+//   takes long, but gets there.
+//
+// Without visitOnce, as for a watcher that reads the same folders again and
+// again, only the file system checks apply.
+class ScanFilter
+{
+public:
+    explicit ScanFilter(const ScanOptions &options, bool visitOnce = true);
+
+    // The directory the scan starts at, for oneFileSystem.
+    void setTop(const QString &path);
+    // Whether to read the directory just opened; false leaves it empty.
+    bool admitDirectory(quint64 device, quint64 inode);
+    // Whether to count a file that more than one path may lead to.
+    bool admitLink(quint64 device, quint64 inode);
+    // Whether to open a directory on device at all; on a slow file system
+    // even that may hang.
+    bool admitRead(quint64 device);
+
+    // Of the reads that may hang, in ms; 0 for no limit.
+    int timeoutMs() const { return m_slowReadMs; }
+    // Whether reads on device are timed.
+    bool mayHang(quint64 device) const { return m_slowReadMs > 0 && m_hanging.contains(device); }
+    // The device of a file system that may hang mounted at path, if any,
+    // or 0; a directory below it is on that device, not its parent's.
+    quint64 mountedAt(const QString &path) const;
+    // Gives up on device, on which a read has taken too long.
+    void markSlow(quint64 device);
+    // Whether device has been given up on.
+    bool isSlow(quint64 device) const;
+
+    qint64 skippedDirs() const { return m_skippedDirs; }
+    qint64 repeatedDirs() const { return m_repeatedDirs; }
+    qint64 repeatedLinks() const { return m_repeatedLinks; }
+    int slowDevices() const { return m_slowCount; }
+
+private:
+    struct FileId {
+        quint64 device;
+        quint64 inode;
+        bool operator==(const FileId &other) const { return device == other.device && inode == other.inode; }
+    };
+    friend uint qHash(const FileId &id, uint seed) { return qHash(id.device, seed) ^ qHash(id.inode, seed); }
+
+    const bool m_oneFileSystem;
+    const bool m_visitOnce;
+    const int m_slowReadMs;
+    quint64 m_topDevice = 0;
+    bool m_topKnown = false;
+    // Read once, before any worker starts.
+    QSet<quint64> m_pseudo;
+    QSet<quint64> m_hanging;          // Network and FUSE file systems,
+    QHash<QString, quint64> m_hangingMounts;  // by where they are mounted.
+    mutable QMutex m_mutex;
+    QSet<FileId> m_dirs;
+    QSet<FileId> m_links;
+    QSet<quint64> m_slow;
+    std::atomic<int> m_slowCount{0};
+    std::atomic<qint64> m_skippedDirs{0};
+    std::atomic<qint64> m_repeatedDirs{0};
+    std::atomic<qint64> m_repeatedLinks{0};
+};
+
+#endif // SCANFILTER_H
@@ -0,0 +1,560 @@
+#include "searchindex.h"
+
+#include <QByteArrayMatcher>
+#include <QDate>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QTime>
+#include <QtAlgorithms>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+// A size range holding fewer than this share of the files is looked up in
+// the files by size instead of walking the tree.
+static const int SIZE_SLICE_FRACTION = 8;
+
+static const qint64 MS_PER_DAY = 24LL * 3600 * 1000;
+
+static void lowerAscii(char *data, int length) {
+    for (int i = 0; i < length; i++) {
+        if (data[i] >= 'A' && data[i] <= 'Z')
+            data[i] = char(data[i] - 'A' + 'a');
+    }
+}
+
+static QByteArray lowerAscii(QByteArray bytes) {
+    lowerAscii(bytes.data(), bytes.size());
+    return bytes;
+}
+
+static bool isGlob(const QByteArray &word) {
+    return word.contains('*') || word.contains('?');
+}
+
+// Whether all of name matches pattern, where * stands for any run of bytes
+// and ? for any one.
+static bool globMatch(const char *pattern, int patternLength, const char *name, int nameLength) {
+    int p = 0;
+    int n = 0;
+    int star = -1;
+    int resume = 0;
+    while (n < nameLength) {
+        if (p < patternLength && (pattern[p] == '?' || pattern[p] == name[n])) {
+            p++;
+            n++;
+        } else if (p < patternLength && pattern[p] == '*') {
+            star = p++;
+            resume = n;
+        } else if (star >= 0) {
+            p = star + 1;
+            n = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (p < patternLength && pattern[p] == '*')
+        p++;
+    return p == patternLength;
+}
+
+// The words of a query, split at spaces except inside a /regular expression/.
+static QStringList splitWords(const QString &text) {
+    QStringList words;
+    QString word;
+    bool inPattern = false;
+    for (int i = 0; i < text.size(); i++) {
+        const QChar c = text.at(i);
+        if (c == ' ' && !inPattern) {
+            if (!word.isEmpty())
+                words.append(word);
+            word.clear();
+            continue;
+        }
+        if (c == '/' && (word.isEmpty() || inPattern))
+            inPattern = !inPattern;
+        word.append(c);
+    }
+    if (!word.isEmpty())
+        words.append(word);
+    return words;
+}
+
+// "100M", "1.5G" or "4096", in bytes; -1 if it is none of those.
+static qint64 parseSize(QString text) {
+    text = text.toUpper();
+    if (text.endsWith("IB"))
+        text.chop(2);
+    else if (text.endsWith('B'))
+        text.chop(1);
+    static const char UNITS[] = "KMGT";
+    qint64 unit = 1;
+    for (int power = 0; power < 4; power++) {
+        if (text.endsWith(QChar(UNITS[power]))) {
+            unit = qint64(1) << (10 * (power + 1));
+            text.chop(1);
+            break;
+        }
+    }
+    bool ok = false;
+    const double value = text.toDouble(&ok);
+    return ok && value >= 0 ? qint64(value * unit) : -1;
+}
+
+// "2024-03-01", or an age such as "30d", as the start of that day in ms
+// since the epoch; -1 if it is neither.
+static qint64 parseDate(const QString &text) {
+    const QDate date = QDate::fromString(text, Qt::ISODate);
+    if (date.isValid())
+        return QDateTime(date, QTime(0, 0)).toMSecsSinceEpoch();
+    static const char UNITS[] = "dwmy";
+    static const int DAYS[] = {1, 7, 30, 365};
+    const int unit = text.isEmpty() ? -1 : QString(UNITS).indexOf(text.at(text.size() - 1));
+    bool ok = false;
+    const int count = text.left(text.size() - 1).toInt(&ok);
+    if (unit < 0 || !ok || count < 0)
+        return -1;
+    // From the start of today, so that a query means the same all day.
+    const qint64 today = QDateTime(QDate::currentDate(), QTime(0, 0)).toMSecsSinceEpoch();
+    return std::max<qint64>(0, today - qint64(count) * DAYS[unit] * MS_PER_DAY);
+}
+
+SearchQuery SearchQuery::parse(const QString &text, QString *error)
+{
+    SearchQuery query;
+    const auto fail = [error](const QString &message) {
+        if (error)
+            *error = message;
+        return SearchQuery();
+    };
+    for (const QString &word : splitWords(text)) {
+        if (word.size() >= 2 && word.startsWith('/') && word.endsWith('/')) {
+            query.pattern = QRegularExpression(word.mid(1, word.size() - 2),
+                                               QRegularExpression::CaseInsensitiveOption);
+            if (!query.pattern.isValid())
+                return fail(QString("Bad regular expression: %1").arg(query.pattern.errorString()));
+            query.hasPattern = true;
+        } else if (word.startsWith("ext:", Qt::CaseInsensitive)) {
+            for (QString extension : word.mid(4).split(',')) {
+                if (extension.startsWith('.'))
+                    extension.remove(0, 1);
+                if (!extension.isEmpty())
+                    query.extensions.append(lowerAscii(QFile::encodeName(extension)));
+            }
+        } else if (word.startsWith("type:", Qt::CaseInsensitive)) {
+            for (const QString &name : word.mid(5).split(',')) {
+                int found = -1;
+                for (int category = 0; category < FILE_CATEGORY_COUNT && found < 0 && !name.isEmpty(); category++) {
+                    if (categoryName(FileCategory(category)).startsWith(name, Qt::CaseInsensitive))
+                        found = category;
+                }
+                if (found < 0)
+                    return fail(QString("Unknown file type: %1").arg(name));
+                query.categories |= 1u << found;
+            }
+        } else if (word.startsWith("size>", Qt::CaseInsensitive) || word.startsWith("size<", Qt::CaseInsensitive)) {
+            const bool inclusive = word.mid(5).startsWith('=');
+            const qint64 size = parseSize(word.mid(inclusive ? 6 : 5));
+            if (size < 0)
+                return fail(QString("Bad size: %1").arg(word));
+            if (word.at(4) == '>') {
+                query.minSize = std::max(query.minSize, inclusive ? size : size + 1);
+            } else {
+                const qint64 limit = inclusive ? size : size - 1;
+                query.maxSize = query.maxSize < 0 ? limit : std::min(query.maxSize, limit);
+            }
+        } else if (word.startsWith("after:", Qt::CaseInsensitive) || word.startsWith("before:", Qt::CaseInsensitive)) {
+            const bool after = word.startsWith("after:", Qt::CaseInsensitive);
+            const qint64 date = parseDate(word.mid(after ? 6 : 7));
+            if (date < 0)
+                return fail(QString("Bad date: %1").arg(word));
+            if (after)
+                query.modifiedAfter = std::max(query.modifiedAfter, date);
+            else
+                query.modifiedBefore = query.modifiedBefore < 0 ? date : std::min(query.modifiedBefore, date);
+        } else {
+            query.words.append(lowerAscii(QFile::encodeName(word)));
+        }
+    }
+    return query;
+}
+
+bool SearchQuery::isEmpty() const
+{
+    return words.isEmpty() && !hasPattern && categories == 0 && extensions.isEmpty() && minSize == 0 &&
+           maxSize < 0 && modifiedAfter < 0 && modifiedBefore < 0;
+}
+
+// A query turned into what is quickest to test a file against.
+class SearchIndex::Matcher
+{
+public:
+    explicit Matcher(const SearchQuery &query)
+        : m_query(query)
+    {
+        for (const QByteArray &word : query.words) {
+            // The longest piece any matching name has to contain.
+            for (const QByteArray &piece : word.split('*')) {
+                for (const QByteArray &literal : piece.split('?')) {
+                    if (literal.size() > m_literal.size())
+                        m_literal = literal;
+                }
+            }
+        }
+        m_finder.setPattern(m_literal);
+        m_names = !query.words.isEmpty() || query.hasPattern;
+
+        // Extensions without a type of their own can only be told by name.
+        std::vector<bool> listed(256, query.extensions.isEmpty());
+        for (const QByteArray &extension : query.extensions) {
+            const FileType type = extensionType(extension.constData(), extension.size());
+            if (type == UnknownFileType)
+                m_unknownExtensions.append('.' + extension);
+            else
+                listed[type] = true;
+        }
+        for (int type = 0; type < 256; type++) {
+            const FileCategory category = fileCategory(FileType(type));
+            m_types[type] = listed[type] && (query.categories == 0 || (query.categories >> category) & 1);
+            if (m_types[type])
+                m_categories |= quint16(1u << category);
+        }
+        if (!m_unknownExtensions.isEmpty() && (query.categories == 0 || query.categories & (1u << OtherFiles)))
+            m_categories |= 1u << OtherFiles;
+        else
+            m_unknownExtensions.clear();
+
+        m_days = query.modifiedAfter >= 0 || query.modifiedBefore >= 0;
+        if (query.modifiedAfter >= 0)
+            m_firstDay = std::max<quint16>(1, FolderTree::dayOf(query.modifiedAfter));
+        if (query.modifiedBefore >= 0)
+            m_lastDay = quint16(std::max(0, FolderTree::dayOf(query.modifiedBefore) - 1));
+    }
+
+    bool hasNameCondition() const { return m_names; }
+    const QByteArray &literal() const { return m_literal; }
+    const QByteArrayMatcher &finder() const { return m_finder; }
+
+    // A name, lower case and as stored, against the words and the pattern.
+    bool nameMatches(const char *lower, const char *original, int length) const
+    {
+        for (const QByteArray &word : m_query.words) {
+            if (isGlob(word)) {
+                if (!globMatch(word.constData(), word.size(), lower, length))
+                    return false;
+            } else if (std::search(lower, lower + length, word.constData(), word.constData() + word.size()) ==
+                       lower + length && !word.isEmpty()) {
+                return false;
+            }
+        }
+        return !m_query.hasPattern ||
+               m_query.pattern.match(QFile::decodeName(QByteArray::fromRawData(original, length))).hasMatch();
+    }
+
+    // Whether a subtree with these bounds can hold a match.
+    bool mayMatch(const Bounds &bounds) const
+    {
+        if (bounds.maxSize < m_query.minSize || (m_query.maxSize >= 0 && bounds.minSize > m_query.maxSize))
+            return false;
+        if (m_days && (bounds.maxDay < m_firstDay || bounds.minDay > m_lastDay))
+            return false;
+        return bounds.categories & m_categories;
+    }
+
+    bool fileMatches(const FolderTree &tree, const FileEntry &file, const std::vector<quint64> &names) const
+    {
+        if (file.size < m_query.minSize || (m_query.maxSize >= 0 && file.size > m_query.maxSize))
+            return false;
+        if (m_days && (file.modifiedDay < m_firstDay || file.modifiedDay > m_lastDay))
+            return false;
+        if (!m_types[file.type] && !(file.type == UnknownFileType && hasUnknownExtension(tree, file.name)))
+            return false;
+        return !m_names || SearchResult::testBit(names, file.name);
+    }
+
+private:
+    bool hasUnknownExtension(const FolderTree &tree, NameId name) const
+    {
+        if (m_unknownExtensions.isEmpty())
+            return false;
+        int length = 0;
+        const char *data = tree.names().data(name, length);
+        for (const QByteArray &extension : m_unknownExtensions) {
+            if (length > extension.size() &&
+                qstrnicmp(data + length - extension.size(), extension.constData(), uint(extension.size())) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    const SearchQuery &m_query;
+    bool m_names = false;
+    QByteArray m_literal;
+    QByteArrayMatcher m_finder;
+    bool m_types[256];
+    QList<QByteArray> m_unknownExtensions;  // With the dot.
+    quint16 m_categories = 0;
+    bool m_days = false;
+    quint16 m_firstDay = 1;
+    quint16 m_lastDay = 0xffff;
+};
+
+void SearchIndex::build(const FolderTree &tree)
+{
+    QElapsedTimer timer;
+    timer.start();
+    clear();
+    m_tree = &tree;
+    m_version = tree.version();
+
+    const NamePool &pool = tree.names();
+    m_lowerNames.resize(pool.blockCount());
+    m_nameStarts.resize(pool.blockCount());
+    for (int b = 0; b < pool.blockCount(); b++) {
+        const char *block = pool.block(b);
+        const quint32 length = pool.blockLength(b);
+        m_lowerNames[b] = QByteArray(block, int(length));
+        char *lower = m_lowerNames[b].data();
+        for (quint32 pos = 0; pos + sizeof(quint16) <= length;) {
+            quint16 nameLength;
+            memcpy(&nameLength, block + pos, sizeof(nameLength));
+            m_nameStarts[b].push_back(pos);
+            pos += sizeof(nameLength);
+            // Only the name: a length byte may well look like a letter.
+            lowerAscii(lower + pos, int(std::min<quint32>(nameLength, length - pos)));
+            pos += nameLength;
+        }
+    }
+
+    const quint32 folders = tree.folderCount();
+    m_bounds.assign(folders, Bounds());
+    m_order.assign(folders, NoIndex);
+    m_end.assign(folders, 0);
+    if (tree.isEmpty()) {
+        m_buildMs = timer.nsecsElapsed() / 1e6;
+        return;
+    }
+
+    // Down the tree for each folder's own files and its place in the walk,
+    std::vector<NodeIndex> stack(1, tree.root());
+    while (!stack.empty()) {
+        const NodeIndex index = stack.back();
+        stack.pop_back();
+        m_order[index] = quint32(m_walk.size());
+        m_walk.push_back(index);
+        m_fileStarts.push_back(quint32(m_files.size()));
+        const FolderNode &node = tree.node(index);
+        Bounds &bounds = m_bounds[index];
+        for (FileIndex f = node.firstFile; f != NoIndex; f = tree.file(f).next) {
+            const FileEntry &file = tree.file(f);
+            m_files.push_back(f);
+            bounds.minSize = std::min(bounds.minSize, file.size);
+            bounds.maxSize = std::max(bounds.maxSize, file.size);
+            if (file.modifiedDay != 0) {
+                bounds.minDay = std::min(bounds.minDay, file.modifiedDay);
+                bounds.maxDay = std::max(bounds.maxDay, file.modifiedDay);
+            }
+            bounds.categories |= quint16(1u << fileCategory(file.type));
+        }
+        for (NodeIndex child = node.firstChild; child != NoIndex; child = tree.node(child).nextSibling)
+            stack.push_back(child);
+    }
+    m_fileStarts.push_back(quint32(m_files.size()));
+    // then back up for the subtrees: every folder comes after its parent.
+    for (size_t i = m_walk.size(); i-- > 0;) {
+        const NodeIndex index = m_walk[i];
+        m_end[index] += 1;
+        if (index == tree.root())
+            continue;
+        const NodeIndex parent = tree.node(index).parent;
+        const Bounds &bounds = m_bounds[index];
+        Bounds &above = m_bounds[parent];
+        above.minSize = std::min(above.minSize, bounds.minSize);
+        above.maxSize = std::max(above.maxSize, bounds.maxSize);
+        above.minDay = std::min(above.minDay, bounds.minDay);
+        above.maxDay = std::max(above.maxDay, bounds.maxDay);
+        above.categories |= bounds.categories;
+        m_end[parent] += m_end[index];
+    }
+    for (const NodeIndex index : m_walk)
+        m_end[index] += m_order[index];
+
+    // Files by size class: a counting sort, which costs next to nothing
+    // next to sorting by the exact size.
+    quint32 counts[SIZE_CLASSES] = {};
+    for (const FileIndex index : m_files)
+        counts[sizeClass(tree.file(index).size)]++;
+    for (int c = 0; c < SIZE_CLASSES; c++)
+        m_sizeClassStarts[c + 1] = m_sizeClassStarts[c] + counts[c];
+    std::copy(m_sizeClassStarts, m_sizeClassStarts + SIZE_CLASSES, counts);
+    m_bySize.resize(m_files.size());
+    for (const FileIndex index : m_files)
+        m_bySize[counts[sizeClass(tree.file(index).size)]++] = index;
+    m_buildMs = timer.nsecsElapsed() / 1e6;
+}
+
+bool SearchIndex::isCurrent(const FolderTree &tree) const
+{
+    return m_tree == &tree && m_version == tree.version();
+}
+
+void SearchIndex::clear()
+{
+    m_tree = nullptr;
+    m_version = 0;
+    m_buildMs = 0;
+    m_lowerNames.clear();
+    m_nameStarts.clear();
+    m_bounds.clear();
+    m_order.clear();
+    m_end.clear();
+    m_walk.clear();
+    m_fileStarts.clear();
+    m_files.clear();
+    m_bySize.clear();
+    std::fill(m_sizeClassStarts, m_sizeClassStarts + SIZE_CLASSES + 1, 0);
+}
+
+// Sets the bit of every NameId whose name matches. With a literal to look
+// for, only the names around its occurrences in each block are tested.
+void SearchIndex::markNames(const FolderTree &tree, const Matcher &matcher, std::vector<quint64> &names) const
+{
+    const NamePool &pool = tree.names();
+    names.assign((size_t(pool.blockCount()) << NamePool::BLOCK_BITS) / 64, 0);
+    const QByteArray &literal = matcher.literal();
+    for (int b = 0; b < pool.blockCount(); b++) {
+        const char *lower = m_lowerNames[b].constData();
+        const char *original = pool.block(b);
+        const std::vector<quint32> &starts = m_nameStarts[b];
+        const auto test = [&](quint32 start) {
+            quint16 length;
+            memcpy(&length, lower + start, sizeof(length));
+            const quint32 offset = start + sizeof(length);
+            if (matcher.nameMatches(lower + offset, original + offset, length)) {
+                const NameId id = (NameId(b) << NamePool::BLOCK_BITS) | start;
+                names[id / 64] |= quint64(1) << (id % 64);
+            }
+        };
+        if (literal.isEmpty()) {
+            for (const quint32 start : starts)
+                test(start);
+            continue;
+        }
+        const int size = m_lowerNames[b].size();
+        for (int pos = matcher.finder().indexIn(lower, size, 0); pos >= 0;) {
+            // The name the hit falls in, if any: the lengths in between
+            // may look like part of the literal too.
+            const auto next = std::upper_bound(starts.begin(), starts.end(), quint32(pos));
+            const quint32 start = *(next - 1);
+            quint16 length;
+            memcpy(&length, lower + start, sizeof(length));
+            if (quint32(pos) < start + sizeof(length) || quint32(pos + literal.size()) > start + sizeof(length) + length) {
+                pos = matcher.finder().indexIn(lower, size, pos + 1);
+                continue;
+            }
+            test(start);
+            // One hit is enough for each name.
+            pos = next == starts.end() ? -1 : matcher.finder().indexIn(lower, size, int(*next));
+        }
+    }
+}
+
+int SearchIndex::sizeClass(qint64 size)
+{
+    const int bits = size > 0 ? 64 - int(qCountLeadingZeroBits(quint64(size))) : 0;
+    return std::min(bits, SIZE_CLASSES - 1);
+}
+
+SearchResult SearchIndex::search(const FolderTree &tree, NodeIndex scope, const SearchQuery &query, int keep)
+{
+    QElapsedTimer timer;
+    timer.start();
+    SearchResult result;
+    if (query.isEmpty() || !isCurrent(tree) || scope >= m_order.size() || m_order[scope] == NoIndex)
+        return result;
+
+    const Matcher matcher(query);
+    std::vector<quint64> names;
+    if (matcher.hasNameCondition())
+        markNames(tree, matcher, names);
+    result.m_files.assign((size_t(tree.fileCount()) + 63) / 64, 0);
+    result.m_folders.assign((size_t(tree.folderCount()) + 63) / 64, 0);
+
+    const auto take = [&](FileIndex index) {
+        const FileEntry &file = tree.file(index);
+        result.m_files[index / 64] |= quint64(1) << (index % 64);
+        result.m_count++;
+        result.m_bytes += file.size;
+        for (NodeIndex folder = file.parent; !SearchResult::testBit(result.m_folders, folder);
+             folder = tree.node(folder).parent) {
+            result.m_folders[folder / 64] |= quint64(1) << (folder % 64);
+            if (folder == scope)
+                break;
+        }
+    };
+
+    // The largest matches, in a heap with the smallest on top.
+    std::vector<std::pair<qint64, FileIndex>> largest;
+    const auto smaller = std::greater<std::pair<qint64, FileIndex>>();
+    const auto consider = [&](FileIndex index) {
+        const FileEntry &file = tree.file(index);
+        if (!matcher.fileMatches(tree, file, names))
+            return;
+        take(index);
+        if (int(largest.size()) < keep) {
+            largest.emplace_back(file.size, index);
+            std::push_heap(largest.begin(), largest.end(), smaller);
+        } else if (keep > 0 && file.size > largest.front().first) {
+            std::pop_heap(largest.begin(), largest.end(), smaller);
+            largest.back() = std::make_pair(file.size, index);
+            std::push_heap(largest.begin(), largest.end(), smaller);
+        }
+    };
+
+    // A narrow size range: only the files of its size classes,
+    const int lowest = sizeClass(query.minSize);
+    const int highest = query.maxSize < 0 ? SIZE_CLASSES - 1 : sizeClass(query.maxSize);
+    const quint32 first = m_sizeClassStarts[lowest];
+    const quint32 last = lowest <= highest ? m_sizeClassStarts[highest + 1] : first;
+    const quint32 begin = m_order[scope];
+    const quint32 end = m_end[scope];
+    if (size_t(last - first) * SIZE_SLICE_FRACTION < m_files.size()) {
+        for (quint32 i = first; i < last; i++) {
+            const quint32 order = m_order[tree.file(m_bySize[i]).parent];
+            if (order >= begin && order < end)
+                consider(m_bySize[i]);
+        }
+    } else {
+        // or else down the tree, past every subtree that can't hold a match.
+        for (quint32 position = begin; position < end;) {
+            const NodeIndex index = m_walk[position];
+            if (!matcher.mayMatch(m_bounds[index])) {
+                position = m_end[index];
+                continue;
+            }
+            for (quint32 i = m_fileStarts[position]; i < m_fileStarts[position + 1]; i++)
+                consider(m_files[i]);
+            position++;
+        }
+    }
+    std::sort_heap(largest.begin(), largest.end(), smaller);
+    for (const auto &file : largest)
+        result.m_largest.push_back(file.second);
+    result.m_elapsedMs = timer.nsecsElapsed() / 1e6;
+    return result;
+}
+
+qint64 SearchIndex::memoryUsage() const
+{
+    qint64 bytes = 0;
+    for (const QByteArray &block : m_lowerNames)
+        bytes += block.capacity();
+    for (const std::vector<quint32> &starts : m_nameStarts)
+        bytes += qint64(starts.capacity() * sizeof(quint32));
+    bytes += qint64(m_bounds.capacity() * sizeof(Bounds));
+    bytes += qint64((m_order.capacity() + m_end.capacity() + m_fileStarts.capacity()) * sizeof(quint32));
+    bytes += qint64(m_walk.capacity() * sizeof(NodeIndex));
+    bytes += qint64((m_files.capacity() + m_bySize.capacity()) * sizeof(FileIndex));
+    return bytes;
+}
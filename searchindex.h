@@ -0,0 +1,133 @@
+#ifndef SEARCHINDEX_H
+#define SEARCHINDEX_H
+
+#include "foldertree.h"
+
+#include <QByteArray>
+#include <QList>
+#include <QRegularExpression>
+#include <QString>
+#include <limits>
+#include <vector>
+
+// What the search bar asks for: words and conditions separated by spaces,
+// every one of which a file has to meet. Names are compared ignoring case.
+//
+//   report          the name contains "report"
+//   IMG_*.jp*g      the whole name matches the glob, with * and ?
+//   /^\d+\.log$/    the name matches the regular expression
+//   ext:jpg,png     one of these extensions
+//   type:video      one of these categories, as categoryName() calls them
+//   size>100M       larger than this; size< for smaller, >= and <= to
+//                   include it, with K, M, G or T
+//   after:2024-03-01, before:30d
+//                   modified on or after that day, or before it; a number
+//                   of days, weeks, months or years (d, w, m, y) counts
+//                   back from today
+struct SearchQuery {
+    QList<QByteArray> words;          // Lower case; a glob if it has a wildcard.
+    QRegularExpression pattern;
+    bool hasPattern = false;
+    quint32 categories = 0;           // A bit per FileCategory; 0 for any.
+    QList<QByteArray> extensions;     // Lower case, without the dot.
+    qint64 minSize = 0;
+    qint64 maxSize = -1;              // -1 for no limit.
+    qint64 modifiedAfter = -1;        // In ms since the epoch; -1 for no limit.
+    qint64 modifiedBefore = -1;
+
+    // On a word it can't read, sets error and returns an empty query.
+    static SearchQuery parse(const QString &text, QString *error = nullptr);
+    bool isEmpty() const;
+};
+
+// The files of one subtree that meet a query.
+class SearchResult
+{
+public:
+    bool isEmpty() const { return m_count == 0; }
+    qint64 count() const { return m_count; }
+    qint64 bytes() const { return m_bytes; }
+    double elapsedMs() const { return m_elapsedMs; }
+    // The largest matches, largest first.
+    const std::vector<FileIndex> &largest() const { return m_largest; }
+
+    bool matchesFile(FileIndex index) const { return testBit(m_files, index); }
+    // Whether a file below folder matches.
+    bool containsMatch(NodeIndex folder) const { return testBit(m_folders, folder); }
+
+private:
+    friend class SearchIndex;
+
+    static bool testBit(const std::vector<quint64> &bits, quint32 index)
+    {
+        return index / 64 < bits.size() && (bits[index / 64] >> (index % 64)) & 1;
+    }
+
+    std::vector<quint64> m_files;
+    std::vector<quint64> m_folders;
+    std::vector<FileIndex> m_largest;
+    qint64 m_count = 0;
+    qint64 m_bytes = 0;
+    double m_elapsedMs = 0;
+};
+
+// What a search needs to know about a tree ahead of time, so that a query
+// over millions of files takes milliseconds instead of a string compare
+// per file:
+//
+// - A lower case copy of the tree's name pool, which every name is
+//   interned in once however many files share it. The words are looked
+//   for block by block, so most names are never looked at on their own.
+// - Per folder, the smallest and largest file, the oldest and newest
+//   modification day and the categories in its subtree, so the walk
+//   skips every subtree that can't hold a match.
+// - The files grouped by size to the power of two, so that a narrow size
+//   range only looks at the few files in it.
+//
+// Built while nothing changes the tree, on any thread; stale once it does.
+class SearchIndex
+{
+public:
+    void build(const FolderTree &tree);
+    bool isCurrent(const FolderTree &tree) const;
+    void clear();
+
+    // The files below scope that meet query, with the keep largest ones
+    // listed. The index must be current.
+    SearchResult search(const FolderTree &tree, NodeIndex scope, const SearchQuery &query, int keep);
+
+    double buildMs() const { return m_buildMs; }
+    qint64 memoryUsage() const;
+
+private:
+    struct Bounds {
+        qint64 minSize = std::numeric_limits<qint64>::max();
+        qint64 maxSize = -1;
+        quint16 minDay = 0xffff;      // Files without a known day don't count.
+        quint16 maxDay = 0;
+        quint16 categories = 0;
+    };
+    class Matcher;
+
+    // Sizes up to 2^n - 1 bytes are in class n.
+    static const int SIZE_CLASSES = 64;
+    static int sizeClass(qint64 size);
+
+    void markNames(const FolderTree &tree, const Matcher &matcher, std::vector<quint64> &names) const;
+
+    const FolderTree *m_tree = nullptr;
+    quint32 m_version = 0;
+    double m_buildMs = 0;
+    std::vector<QByteArray> m_lowerNames;          // Per block of the name pool.
+    std::vector<std::vector<quint32>> m_nameStarts;
+    std::vector<Bounds> m_bounds;                  // Per folder.
+    std::vector<quint32> m_order;                  // Per folder: its place in a depth first walk,
+    std::vector<quint32> m_end;                    // and just past its subtree's.
+    std::vector<NodeIndex> m_walk;                 // The folders in that order,
+    std::vector<quint32> m_fileStarts;             // where the files of each start in
+    std::vector<FileIndex> m_files;                // all files in that order.
+    std::vector<FileIndex> m_bySize;               // The files by size class,
+    quint32 m_sizeClassStarts[SIZE_CLASSES + 1] = {};  // and where each class starts.
+};
+
+#endif // SEARCHINDEX_H
@@ -0,0 +1,241 @@
+#include "snapshot.h"
+#include "trace.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <cstring>
+
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static const char SNAPSHOT_MAGIC[8] = {'S', 'P', 'C', 'R', 'S', 'N', 'A', 'P'};
+static const quint32 SNAPSHOT_VERSION = 4;
+
+static quint64 aligned(quint64 offset)
+{
+    return (offset + 7) & ~quint64(7);
+}
+
+static bool writePadding(QSaveFile &file, quint64 offset)
+{
+    static const char zeros[8] = {};
+    const qint64 padding = qint64(offset) - file.pos();
+    return padding == 0 || file.write(zeros, padding) == padding;
+}
+
+// A second name for the snapshot about to be replaced, so that it is still
+// there to become the previous one once the new one is in place; false if
+// there is none.
+static bool keepOldFile(const QString &fileName, const QString &kept)
+{
+    if (!QFile::exists(fileName))
+        return false;
+    QFile::remove(kept);
+#ifdef Q_OS_UNIX
+    if (::link(QFile::encodeName(fileName).constData(), QFile::encodeName(kept).constData()) == 0)
+        return true;
+#endif
+    return QFile::copy(fileName, kept);
+}
+
+QString Snapshot::fileFor(const QString &rootPath)
+{
+    const QByteArray key = QCryptographicHash::hash(QFile::encodeName(rootPath), QCryptographicHash::Sha1).toHex();
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/snapshots/" +
+           QString::fromLatin1(key) + ".snapshot";
+}
+
+bool Snapshot::save(const FolderTree &tree, const QString &fileName)
+{
+    TraceSpan span("save", "snapshot");
+    if (tree.isEmpty())
+        return false;
+    // A summary only stands for the folders it folded; revalidating one
+    // would need the same summary settings, so they aren't kept.
+    if (tree.groupCount() > 0)
+        return false;
+    const NamePool &names = tree.m_names;
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.nodeSize = sizeof(FolderNode);
+    header.fileSize = sizeof(FileEntry);
+    header.nodeCount = tree.m_nodes.size();
+    header.fileCount = tree.m_files.size();
+    header.categoryCount = tree.m_categories.size();
+    header.nameCount = names.count();
+    header.nameBlockCount = names.blockCount();
+    header.root = tree.m_root;
+    header.treeVersion = tree.m_version;
+    header.savedAt = QDateTime::currentMSecsSinceEpoch();
+    header.nodesOffset = aligned(sizeof(Header));
+    header.filesOffset = aligned(header.nodesOffset + quint64(header.nodeCount) * sizeof(FolderNode));
+    header.categoriesOffset = aligned(header.filesOffset + quint64(header.fileCount) * sizeof(FileEntry));
+    header.blockTableOffset = aligned(header.categoriesOffset + quint64(header.categoryCount) * sizeof(CategoryTotal));
+
+    std::vector<NameBlock> table(header.nameBlockCount);
+    quint64 offset = aligned(header.blockTableOffset + table.size() * sizeof(NameBlock));
+    for (size_t i = 0; i < table.size(); i++) {
+        table[i].offset = offset;
+        table[i].length = names.blockLength(int(i));
+        table[i].reserved = 0;
+        offset = aligned(offset + table[i].length);
+    }
+
+    QDir().mkpath(QFileInfo(fileName).absolutePath());
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qDebug() << "Cannot write snapshot:" << fileName;
+        return false;
+    }
+    bool ok = file.write(reinterpret_cast<const char *>(&header), sizeof(header)) == sizeof(header);
+    ok = ok && writePadding(file, header.nodesOffset);
+    for (int i = 0; ok && i < tree.m_nodes.chunkCount(); i++) {
+        const qint64 bytes = qint64(tree.m_nodes.chunkLength(i)) * sizeof(FolderNode);
+        ok = file.write(reinterpret_cast<const char *>(tree.m_nodes.chunk(i)), bytes) == bytes;
+    }
+    ok = ok && writePadding(file, header.filesOffset);
+    for (int i = 0; ok && i < tree.m_files.chunkCount(); i++) {
+        const qint64 bytes = qint64(tree.m_files.chunkLength(i)) * sizeof(FileEntry);
+        ok = file.write(reinterpret_cast<const char *>(tree.m_files.chunk(i)), bytes) == bytes;
+    }
+    ok = ok && writePadding(file, header.categoriesOffset);
+    for (int i = 0; ok && i < tree.m_categories.chunkCount(); i++) {
+        const qint64 bytes = qint64(tree.m_categories.chunkLength(i)) * sizeof(CategoryTotal);
+        ok = file.write(reinterpret_cast<const char *>(tree.m_categories.chunk(i)), bytes) == bytes;
+    }
+    ok = ok && writePadding(file, header.blockTableOffset);
+    const qint64 tableBytes = qint64(table.size() * sizeof(NameBlock));
+    ok = ok && file.write(reinterpret_cast<const char *>(table.data()), tableBytes) == tableBytes;
+    for (size_t i = 0; ok && i < table.size(); i++) {
+        ok = writePadding(file, table[i].offset) &&
+             file.write(names.block(int(i)), table[i].length) == qint64(table[i].length);
+    }
+    ok = ok && writePadding(file, offset);
+    // The old file only moves aside once the new one is in place, so a
+    // failed write, as on a full disk, leaves it where it was.
+    const QString kept = previousFor(fileName) + ".new";
+    const bool keeping = ok && keepOldFile(fileName, kept);
+    if (!ok || !file.commit()) {
+        qDebug() << "Cannot write snapshot:" << fileName;
+        if (keeping)
+            QFile::remove(kept);
+        return false;
+    }
+    // Trees that use the old file keep it mapped under its new name.
+    if (keeping) {
+        QFile::remove(previousFor(fileName));
+        QFile::rename(kept, previousFor(fileName));
+    }
+    return true;
+}
+
+std::shared_ptr<Snapshot> Snapshot::open(const QString &fileName)
+{
+    TraceSpan span("open", "snapshot");
+    std::shared_ptr<Snapshot> snapshot(new Snapshot);
+    snapshot->m_file.setFileName(fileName);
+    if (!snapshot->m_file.open(QIODevice::ReadOnly) || !snapshot->map())
+        return std::shared_ptr<Snapshot>();
+    return snapshot;
+}
+
+// Whether the name id stands for, its length included, lies within one of
+// these blocks.
+static bool nameFits(NameId id, const std::vector<const char *> &blocks, const std::vector<quint32> &lengths) {
+    const quint32 block = id >> NamePool::BLOCK_BITS;
+    const quint32 offset = id & ((1u << NamePool::BLOCK_BITS) - 1);
+    if (block >= lengths.size() || quint64(offset) + sizeof(quint16) > lengths[block])
+        return false;
+    quint16 length;
+    memcpy(&length, blocks[block] + offset, sizeof(length));
+    return quint64(offset) + sizeof(length) + length <= lengths[block];
+}
+
+// Maps the file twice and checks that the header describes arrays this
+// build lays out the same way, all inside the file, and that every link
+// and name in them leads somewhere inside them too: the compare dialog
+// opens whatever file it is given.
+bool Snapshot::map()
+{
+    const quint64 size = quint64(m_file.size());
+    if (size < sizeof(Header))
+        return false;
+    m_view = m_file.map(0, m_file.size());
+    m_private = m_file.map(0, m_file.size(), QFileDevice::MapPrivateOption);
+    if (!m_view || !m_private)
+        return false;
+#ifdef Q_OS_UNIX
+    // Adopting reads the whole file front to back; have it read ahead in
+    // large requests rather than faulted in a page at a time, which on a
+    // spinning disk means a seek per page. Both maps share the same cache.
+    madvise(m_private, size_t(size), MADV_WILLNEED);
+#endif
+
+    const Header *header = reinterpret_cast<const Header *>(m_view);
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != SNAPSHOT_VERSION ||
+        header->nodeSize != sizeof(FolderNode) || header->fileSize != sizeof(FileEntry) ||
+        header->root >= header->nodeCount ||
+        header->nodesOffset + quint64(header->nodeCount) * sizeof(FolderNode) > size ||
+        header->filesOffset + quint64(header->fileCount) * sizeof(FileEntry) > size ||
+        header->categoriesOffset + quint64(header->categoryCount) * sizeof(CategoryTotal) > size ||
+        header->blockTableOffset + quint64(header->nameBlockCount) * sizeof(NameBlock) > size)
+        return false;
+    const NameBlock *table = reinterpret_cast<const NameBlock *>(m_view + header->blockTableOffset);
+    std::vector<quint32> lengths;
+    for (quint32 i = 0; i < header->nameBlockCount; i++) {
+        if (table[i].offset + table[i].length > size)
+            return false;
+        m_blocks.push_back(reinterpret_cast<const char *>(m_view + table[i].offset));
+        lengths.push_back(table[i].length);
+    }
+    const auto within = [](quint32 index, quint32 count) { return index == NoIndex || index < count; };
+    const FolderNode *nodes = reinterpret_cast<const FolderNode *>(m_view + header->nodesOffset);
+    for (quint32 i = 0; i < header->nodeCount; i++) {
+        const FolderNode &node = nodes[i];
+        if (!nameFits(node.name, m_blocks, lengths) || !within(node.parent, header->nodeCount) ||
+            !within(node.firstChild, header->nodeCount) || !within(node.nextSibling, header->nodeCount) ||
+            !within(node.firstFile, header->fileCount) || !within(node.firstCategory, header->categoryCount) ||
+            node.firstGroup != NoIndex)
+            return false;
+    }
+    if (nodes[header->root].parent != NoIndex)
+        return false;
+    const FileEntry *files = reinterpret_cast<const FileEntry *>(m_view + header->filesOffset);
+    for (quint32 i = 0; i < header->fileCount; i++) {
+        if (!nameFits(files[i].name, m_blocks, lengths) || files[i].parent >= header->nodeCount ||
+            !within(files[i].next, header->fileCount))
+            return false;
+    }
+    const CategoryTotal *categories = reinterpret_cast<const CategoryTotal *>(m_view + header->categoriesOffset);
+    for (quint32 i = 0; i < header->categoryCount; i++) {
+        if (categories[i].category >= FILE_CATEGORY_COUNT || !within(categories[i].next, header->categoryCount))
+            return false;
+    }
+    m_header = header;
+    m_nodes = nodes;
+    return true;
+}
+
+QByteArray Snapshot::name(NodeIndex index) const
+{
+    const NameId id = m_nodes[index].name;
+    const char *entry = m_blocks[id >> NamePool::BLOCK_BITS] + (id & ((1u << NamePool::BLOCK_BITS) - 1));
+    quint16 length;
+    memcpy(&length, entry, sizeof(length));
+    return QByteArray(entry + sizeof(length), length);
+}
+
+QString Snapshot::rootPath() const
+{
+    return QFile::decodeName(name(root()));
+}
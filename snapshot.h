@@ -0,0 +1,75 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "foldertree.h"
+
+#include <QFile>
+#include <QString>
+#include <memory>
+#include <vector>
+
+// A saved FolderTree. The file holds the node, file, category and name
+// arrays exactly as they are laid out in memory behind a small header, so
+// opening one is a couple of mmaps: a tree adopts a private (copy-on-write)
+// mapping and uses the arrays in place, with no parsing and no copying,
+// while a second, read-only mapping keeps the tree as it was saved for
+// revalidation.
+class Snapshot
+{
+public:
+    // Where the snapshot for a scan of rootPath is kept.
+    static QString fileFor(const QString &rootPath);
+    // Where save() moves the snapshot it replaces, so that the scan before
+    // the last one is kept to compare against.
+    static QString previousFor(const QString &fileName) { return fileName + ".previous"; }
+    static bool save(const FolderTree &tree, const QString &fileName);
+    // Null if the file is missing or isn't a snapshot this build can read.
+    static std::shared_ptr<Snapshot> open(const QString &fileName);
+
+    // The tree as saved; never changes, so any thread may read it.
+    NodeIndex root() const { return m_header->root; }
+    quint32 folderCount() const { return m_header->nodeCount; }
+    const FolderNode &node(NodeIndex index) const { return m_nodes[index]; }
+    QByteArray name(NodeIndex index) const;
+    QString rootPath() const;
+    qint64 savedAt() const { return m_header->savedAt; }
+
+private:
+    friend class FolderTree;
+
+    struct Header {
+        char magic[8];
+        quint32 version;
+        quint32 nodeSize;
+        quint32 fileSize;
+        quint32 nodeCount;
+        quint32 fileCount;
+        quint32 categoryCount;
+        quint32 nameCount;
+        quint32 nameBlockCount;
+        NodeIndex root;
+        quint32 treeVersion;
+        qint64 savedAt;
+        quint64 nodesOffset;
+        quint64 filesOffset;
+        quint64 categoriesOffset;
+        quint64 blockTableOffset;
+    };
+
+    struct NameBlock {
+        quint64 offset;
+        quint32 length;
+        quint32 reserved;
+    };
+
+    bool map();
+
+    QFile m_file;
+    const uchar *m_view = nullptr;
+    uchar *m_private = nullptr;
+    const Header *m_header = nullptr;
+    const FolderNode *m_nodes = nullptr;
+    std::vector<const char *> m_blocks;
+};
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,242 @@
+#include "snapshotdiff.h"
+#include "trace.h"
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QStringList>
+#include <algorithm>
+#include <cstring>
+
+// The folder at path, if it is tree's root or below it.
+static NodeIndex findFolder(const FolderTree &tree, const QString &path) {
+    const QString rootPath = tree.folderPath(tree.root());
+    if (path == rootPath)
+        return tree.root();
+    const QString prefix = rootPath.endsWith('/') ? rootPath : rootPath + '/';
+    if (!path.startsWith(prefix))
+        return NoIndex;
+    NodeIndex folder = tree.root();
+    for (const QString &part : path.mid(prefix.size()).split('/')) {
+        if (part.isEmpty())
+            continue;
+        const QByteArray name = QFile::encodeName(part);
+        NodeIndex found = NoIndex;
+        for (NodeIndex child = tree.node(folder).firstChild; child != NoIndex && found == NoIndex;
+             child = tree.node(child).nextSibling) {
+            if (tree.folderNameBytes(child) == name)
+                found = child;
+        }
+        if (found == NoIndex)
+            return NoIndex;
+        folder = found;
+    }
+    return folder;
+}
+
+// Orders by hash, then by the bytes for the rare names that share one.
+template<typename Named>
+static int compareNamed(const Named &a, const Named &b) {
+    if (a.hash != b.hash)
+        return a.hash < b.hash ? -1 : 1;
+    const int order = memcmp(a.data, b.data, size_t(std::min(a.length, b.length)));
+    return order != 0 ? order : a.length - b.length;
+}
+
+// Sorts both lists and walks them side by side, handing each entry to
+// onlyBefore, onlyAfter or, for a name in both, both.
+template<typename Named, typename OnlyBefore, typename OnlyAfter, typename Both>
+static void merge(std::vector<Named> &older, std::vector<Named> &newer, OnlyBefore onlyBefore, OnlyAfter onlyAfter,
+                  Both both) {
+    const auto less = [](const Named &a, const Named &b) { return compareNamed(a, b) < 0; };
+    std::sort(older.begin(), older.end(), less);
+    std::sort(newer.begin(), newer.end(), less);
+    size_t i = 0;
+    size_t j = 0;
+    while (i < older.size() || j < newer.size()) {
+        const int order = i == older.size() ? 1 : j == newer.size() ? -1 : compareNamed(older[i], newer[j]);
+        if (order < 0) {
+            onlyBefore(older[i++].index);
+        } else if (order > 0) {
+            onlyAfter(newer[j++].index);
+        } else {
+            both(older[i].index, newer[j].index);
+            i++;
+            j++;
+        }
+    }
+}
+
+bool SnapshotDiff::compare(const FolderTree &before, const FolderTree &after)
+{
+    TraceSpan span("compare", "diff");
+    QElapsedTimer timer;
+    timer.start();
+    clear();
+    if (before.isEmpty() || after.isEmpty())
+        return false;
+    // One of the two may have been zoomed out past the other's root.
+    NodeIndex from = before.root();
+    NodeIndex to = findFolder(after, before.folderPath(from));
+    if (to == NoIndex) {
+        to = after.root();
+        from = findFolder(before, after.folderPath(to));
+    }
+    if (from == NoIndex)
+        return false;
+    m_after = &after;
+    m_top = to;
+    m_folders.assign(after.folderCount(), Unchanged);
+    m_deltas.assign(after.folderCount(), 0);
+    m_files.assign(after.fileCount(), Unchanged);
+
+    std::vector<std::pair<NodeIndex, NodeIndex>> stack(1, std::make_pair(from, to));
+    while (!stack.empty()) {
+        from = stack.back().first;
+        to = stack.back().second;
+        stack.pop_back();
+        const FolderNode &was = before.node(from);
+        const FolderNode &is = after.node(to);
+        const qint64 delta = is.totalSize - was.totalSize;
+        m_compared++;
+        m_deltas[to] = delta;
+        m_folders[to] = delta > 0 ? Grown : delta < 0 ? Shrunk : Unchanged;
+        if (delta == 0 && was.modified == is.modified && is.modified >= 0) {
+            m_skipped++;
+            continue;
+        }
+        if (delta > 0)
+            m_candidates.push_back(to);
+        compareFiles(before, from, after, to);
+
+        m_older.clear();
+        m_newer.clear();
+        for (NodeIndex child = was.firstChild; child != NoIndex; child = before.node(child).nextSibling) {
+            int length;
+            const char *data = before.names().data(before.node(child).name, length);
+            m_older.push_back({NamePool::hash(data, length), child, data, length});
+        }
+        for (NodeIndex child = is.firstChild; child != NoIndex; child = after.node(child).nextSibling) {
+            int length;
+            const char *data = after.names().data(after.node(child).name, length);
+            m_newer.push_back({NamePool::hash(data, length), child, data, length});
+        }
+        merge(m_older, m_newer, [&](NodeIndex gone) { countRemoved(before, gone); },
+              [&](NodeIndex added) { markAdded(after, added); },
+              [&](NodeIndex older, NodeIndex newer) { stack.push_back(std::make_pair(older, newer)); });
+    }
+    m_elapsedMs = timer.nsecsElapsed() / 1e6;
+    return true;
+}
+
+void SnapshotDiff::compareFiles(const FolderTree &before, NodeIndex from, const FolderTree &after, NodeIndex to)
+{
+    m_older.clear();
+    m_newer.clear();
+    for (FileIndex file = before.node(from).firstFile; file != NoIndex; file = before.file(file).next) {
+        int length;
+        const char *data = before.names().data(before.file(file).name, length);
+        m_older.push_back({NamePool::hash(data, length), file, data, length});
+    }
+    for (FileIndex file = after.node(to).firstFile; file != NoIndex; file = after.file(file).next) {
+        int length;
+        const char *data = after.names().data(after.file(file).name, length);
+        m_newer.push_back({NamePool::hash(data, length), file, data, length});
+    }
+    merge(m_older, m_newer,
+          [&](FileIndex gone) {
+              m_removedFiles++;
+              m_removedBytes += before.file(gone).size;
+          },
+          [&](FileIndex added) {
+              m_files[added] = Added;
+              m_addedFiles++;
+              m_addedBytes += after.file(added).size;
+          },
+          [&](FileIndex older, FileIndex newer) {
+              const qint64 delta = after.file(newer).size - before.file(older).size;
+              m_files[newer] = delta > 0 ? Grown : delta < 0 ? Shrunk : Unchanged;
+          });
+}
+
+// A folder that is new, with everything below it.
+void SnapshotDiff::markAdded(const FolderTree &after, NodeIndex index)
+{
+    m_candidates.push_back(index);
+    std::vector<NodeIndex> stack(1, index);
+    while (!stack.empty()) {
+        const NodeIndex folder = stack.back();
+        stack.pop_back();
+        const FolderNode &node = after.node(folder);
+        m_folders[folder] = Added;
+        m_deltas[folder] = node.totalSize;
+        for (FileIndex file = node.firstFile; file != NoIndex; file = after.file(file).next) {
+            m_files[file] = Added;
+            m_addedFiles++;
+            m_addedBytes += after.file(file).size;
+        }
+        for (NodeIndex child = node.firstChild; child != NoIndex; child = after.node(child).nextSibling)
+            stack.push_back(child);
+    }
+}
+
+// A folder that is gone, with everything below it.
+void SnapshotDiff::countRemoved(const FolderTree &before, NodeIndex index)
+{
+    m_removedBytes += before.node(index).totalSize;
+    std::vector<NodeIndex> stack(1, index);
+    while (!stack.empty()) {
+        const FolderNode &node = before.node(stack.back());
+        stack.pop_back();
+        m_removedFiles += node.fileCount;
+        for (NodeIndex child = node.firstChild; child != NoIndex; child = before.node(child).nextSibling)
+            stack.push_back(child);
+    }
+}
+
+void SnapshotDiff::clear()
+{
+    m_after = nullptr;
+    m_top = NoIndex;
+    m_folders.clear();
+    m_deltas.clear();
+    m_files.clear();
+    m_candidates.clear();
+    m_addedFiles = 0;
+    m_addedBytes = 0;
+    m_removedFiles = 0;
+    m_removedBytes = 0;
+    m_compared = 0;
+    m_skipped = 0;
+    m_elapsedMs = 0;
+}
+
+std::vector<NodeIndex> SnapshotDiff::grownFolders(int count) const
+{
+    std::vector<NodeIndex> folders;
+    for (const NodeIndex index : m_candidates) {
+        const qint64 delta = folderDelta(index);
+        if (delta <= 0)
+            continue;
+        bool spread = folderChange(index) == Added;
+        if (!spread) {
+            spread = true;
+            for (NodeIndex child = m_after->node(index).firstChild; child != NoIndex && spread;
+                 child = m_after->node(child).nextSibling)
+                spread = folderDelta(child) * 2 <= delta;
+        }
+        if (spread)
+            folders.push_back(index);
+    }
+    const size_t kept = std::min(folders.size(), size_t(std::max(count, 0)));
+    std::partial_sort(folders.begin(), folders.begin() + kept, folders.end(),
+                      [this](NodeIndex a, NodeIndex b) { return folderDelta(a) > folderDelta(b); });
+    folders.resize(kept);
+    return folders;
+}
+
+qint64 SnapshotDiff::memoryUsage() const
+{
+    return qint64(m_folders.capacity() + m_files.capacity()) + qint64(m_deltas.capacity() * sizeof(qint64)) +
+           qint64(m_candidates.capacity() * sizeof(NodeIndex)) +
+           qint64((m_older.capacity() + m_newer.capacity()) * sizeof(Named));
+}
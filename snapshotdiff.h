@@ -0,0 +1,85 @@
+#ifndef SNAPSHOTDIFF_H
+#define SNAPSHOTDIFF_H
+
+#include "foldertree.h"
+
+#include <QString>
+#include <vector>
+
+// What changed in size between two scans of the same folder, such as a
+// saved snapshot and the tree on screen: how much each folder of the later
+// tree grew or shrank, which of its files are new or changed size, and the
+// folders where the growth happened.
+//
+// Folders are matched by name. The children of each matched pair are
+// sorted by the hash of their name and merged in one pass, and so are
+// their files. A folder whose total size and mtime are both the same in
+// the two scans is taken as unchanged without looking inside: its entries
+// weren't added, removed or renamed, and whatever changed size below it
+// evened out. So a diff costs about as much as the part of the tree that
+// changed, not the whole of it.
+class SnapshotDiff
+{
+public:
+    enum Change : quint8 { Unchanged, Added, Grown, Shrunk };
+
+    // Compares after with before, from the folder at the root path of the
+    // one down, for whichever root lies further down. False, with nothing
+    // compared, if the other tree has no folder at that path.
+    bool compare(const FolderTree &before, const FolderTree &after);
+    void clear();
+
+    // Of the later tree; Unchanged and 0 for anything outside the folders
+    // compared.
+    Change folderChange(NodeIndex index) const { return index < m_folders.size() ? Change(m_folders[index]) : Unchanged; }
+    qint64 folderDelta(NodeIndex index) const { return index < m_deltas.size() ? m_deltas[index] : 0; }
+    Change fileChange(FileIndex index) const { return index < m_files.size() ? Change(m_files[index]) : Unchanged; }
+    // The folder compared from in the later tree.
+    NodeIndex top() const { return m_top; }
+
+    // The folders that grew the most, largest growth first. A folder only
+    // counts where its growth is spread out: one whose growth mostly comes
+    // from a single subfolder is left to that subfolder, and a new folder
+    // stands for everything new below it.
+    std::vector<NodeIndex> grownFolders(int count) const;
+
+    qint64 addedFiles() const { return m_addedFiles; }
+    qint64 addedBytes() const { return m_addedBytes; }
+    qint64 removedFiles() const { return m_removedFiles; }
+    qint64 removedBytes() const { return m_removedBytes; }
+    quint32 foldersCompared() const { return m_compared; }
+    quint32 foldersSkipped() const { return m_skipped; }
+    double elapsedMs() const { return m_elapsedMs; }
+    qint64 memoryUsage() const;
+
+private:
+    // A folder or file by name, for merging two lists of them.
+    struct Named {
+        quint32 hash;
+        quint32 index;
+        const char *data;
+        int length;
+    };
+
+    void compareFiles(const FolderTree &before, NodeIndex from, const FolderTree &after, NodeIndex to);
+    void markAdded(const FolderTree &after, NodeIndex index);
+    void countRemoved(const FolderTree &before, NodeIndex index);
+
+    const FolderTree *m_after = nullptr;
+    NodeIndex m_top = NoIndex;
+    std::vector<quint8> m_folders;    // Change per folder of the later tree,
+    std::vector<qint64> m_deltas;     // and its growth in bytes.
+    std::vector<quint8> m_files;      // Change per file.
+    std::vector<NodeIndex> m_candidates;  // Folders that may be listed as grown.
+    std::vector<Named> m_older;       // Scratch for the merges.
+    std::vector<Named> m_newer;
+    qint64 m_addedFiles = 0;
+    qint64 m_addedBytes = 0;
+    qint64 m_removedFiles = 0;
+    qint64 m_removedBytes = 0;
+    quint32 m_compared = 0;
+    quint32 m_skipped = 0;
+    double m_elapsedMs = 0;
+};
+
+#endif // SNAPSHOTDIFF_H
@@ -1,4 +1,4 @@
-QT       += core gui
+QT       += core gui concurrent svg
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
@@ -7,11 +7,45 @@ TEMPLATE = app
 
 CONFIG += c++14
 
+# gzip compressed file listings and PNG export; see ListingImporter
+# and TreemapExport.
+unix: LIBS += -lz
+
 SOURCES += \
     main.cpp \
     mainwindow.cpp \
-    foldermapwidget.cpp
+    foldermapwidget.cpp \
+    deviceprofiles.cpp \
+    filetypes.cpp \
+    folderscanner.cpp \
+    folderwatcher.cpp \
+    foldertree.cpp \
+    listingimporter.cpp \
+    scanbackend.cpp \
+    scanfilter.cpp \
+    searchindex.cpp \
+    snapshot.cpp \
+    snapshotdiff.cpp \
+    trace.cpp \
+    treemapexport.cpp \
+    treemaplayout.cpp \
+    treemaprenderer.cpp
 
 HEADERS += \
     mainwindow.h \
-    foldermapwidget.h
+    foldermapwidget.h \
+    deviceprofiles.h \
+    filetypes.h \
+    folderscanner.h \
+    folderwatcher.h \
+    foldertree.h \
+    listingimporter.h \
+    scanbackend.h \
+    scanfilter.h \
+    searchindex.h \
+    snapshot.h \
+    snapshotdiff.h \
+    trace.h \
+    treemapexport.h \
+    treemaplayout.h \
+    treemaprenderer.h
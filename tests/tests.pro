@@ -0,0 +1,26 @@
+# Unit tests: build with qmake in this directory, run ./spacer-tests.
+QT       += core testlib
+QT       -= gui
+
+TARGET = spacer-tests
+TEMPLATE = app
+
+CONFIG += c++14 console testcase
+CONFIG -= app_bundle
+
+INCLUDEPATH += ..
+
+SOURCES += \
+    tst_searchindex.cpp \
+    ../filetypes.cpp \
+    ../foldertree.cpp \
+    ../searchindex.cpp \
+    ../snapshot.cpp \
+    ../trace.cpp
+
+HEADERS += \
+    ../filetypes.h \
+    ../foldertree.h \
+    ../searchindex.h \
+    ../snapshot.h \
+    ../trace.h
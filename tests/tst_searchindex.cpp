@@ -0,0 +1,103 @@
+#include "searchindex.h"
+
+#include <QtTest>
+
+// The search bar's query language, and the index it is answered from.
+class SearchIndexTest : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void parseWords();
+    void parseConditions();
+    void parseErrors();
+    void globs();
+    void longNames();
+};
+
+// A tree of one folder with a file of each of these names, all of a size
+// that every query takes in.
+static std::shared_ptr<FolderTree> treeOf(const QList<QByteArray> &names) {
+    auto tree = std::make_shared<FolderTree>();
+    const NodeIndex root = tree->createRoot("/search");
+    for (const QByteArray &name : names)
+        tree->addFile(root, name.constData(), name.size(), 4096);
+    return tree;
+}
+
+static qint64 matches(const FolderTree &tree, const QString &text) {
+    SearchIndex index;
+    index.build(tree);
+    return index.search(tree, tree.root(), SearchQuery::parse(text), 0).count();
+}
+
+void SearchIndexTest::parseWords()
+{
+    const SearchQuery query = SearchQuery::parse("  Report  IMG_*.JP*G ");
+    QCOMPARE(query.words, QList<QByteArray>() << "report" << "img_*.jp*g");
+    QVERIFY(!query.hasPattern);
+    QVERIFY(!query.isEmpty());
+    QVERIFY(SearchQuery::parse("   ").isEmpty());
+
+    // A regular expression keeps its spaces.
+    const SearchQuery pattern = SearchQuery::parse("/^a b$/ c");
+    QVERIFY(pattern.hasPattern);
+    QCOMPARE(pattern.pattern.pattern(), QString("^a b$"));
+    QCOMPARE(pattern.words, QList<QByteArray>() << "c");
+}
+
+void SearchIndexTest::parseConditions()
+{
+    const SearchQuery query = SearchQuery::parse("ext:.JPG,png size>=1M size<=2G after:2024-03-01");
+    QCOMPARE(query.extensions, QList<QByteArray>() << "jpg" << "png");
+    QCOMPARE(query.minSize, qint64(1) << 20);
+    QCOMPARE(query.maxSize, qint64(2) << 30);
+    QVERIFY(query.modifiedAfter > 0);
+    QCOMPARE(query.modifiedBefore, qint64(-1));
+    QVERIFY(query.words.isEmpty());
+}
+
+void SearchIndexTest::parseErrors()
+{
+    QString error;
+    QVERIFY(SearchQuery::parse("size>lots", &error).isEmpty());
+    QVERIFY(!error.isEmpty());
+    error.clear();
+    QVERIFY(SearchQuery::parse("/(/", &error).isEmpty());
+    QVERIFY(!error.isEmpty());
+    error.clear();
+    QVERIFY(SearchQuery::parse("before:someday", &error).isEmpty());
+    QVERIFY(!error.isEmpty());
+}
+
+void SearchIndexTest::globs()
+{
+    const auto tree = treeOf(QList<QByteArray>() << "IMG_0001.JPEG" << "img_0002.jpg" << "IMG_0003.png"
+                                                 << "abc" << "abbc" << "xabc");
+    QCOMPARE(matches(*tree, "img_*.jp*g"), qint64(2));
+    QCOMPARE(matches(*tree, "IMG_000?.*"), qint64(3));
+    // A glob is of the whole name, a word anywhere in it.
+    QCOMPARE(matches(*tree, "a?c"), qint64(1));
+    QCOMPARE(matches(*tree, "a*c"), qint64(2));
+    QCOMPARE(matches(*tree, "abc"), qint64(2));
+    QCOMPARE(matches(*tree, "*"), qint64(6));
+}
+
+// Every name is stored after its length in two bytes, which for a name of
+// 65 to 90 bytes reads as a capital letter; they are found all the same.
+void SearchIndexTest::longNames()
+{
+    QList<QByteArray> names;
+    for (int length = 50; length <= 300; length++)
+        names << QByteArray(length - 9, 'X') + "Tail.Data";
+    const auto tree = treeOf(names);
+    QCOMPARE(matches(*tree, "tail.data"), qint64(names.size()));
+    QCOMPARE(matches(*tree, "*TAIL.DATA"), qint64(names.size()));
+    QCOMPARE(matches(*tree, "x*x"), qint64(0));
+    QCOMPARE(matches(*tree, "/^x{56}tail/"), qint64(1));
+    QCOMPARE(matches(*tree, "ext:data"), qint64(names.size()));
+}
+
+QTEST_APPLESS_MAIN(SearchIndexTest)
+
+#include "tst_searchindex.moc"
@@ -0,0 +1,163 @@
+#include "trace.h"
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <QDebug>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// Per thread; past this, events are counted but not kept.
+static const size_t MAX_EVENTS_PER_THREAD = 1 << 20;
+
+namespace {
+
+struct TraceEvent {
+    const char *name;
+    const char *category;
+    char phase;                       // 'X' for a span, 'C' for a counter.
+    qint64 start;
+    qint64 duration;                  // Or the counter's value.
+    QByteArray detail;
+};
+
+struct ThreadBuffer {
+    int thread = 0;
+    QMutex mutex;                     // Only contended while saving.
+    std::vector<TraceEvent> events;
+    qint64 dropped = 0;
+};
+
+std::atomic<bool> traceEnabled{false};
+QMutex buffersMutex;
+std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+thread_local ThreadBuffer *localBuffer = nullptr;
+
+const QElapsedTimer &traceClock()
+{
+    static const QElapsedTimer timer = [] {
+        QElapsedTimer started;
+        started.start();
+        return started;
+    }();
+    return timer;
+}
+
+void record(const TraceEvent &event)
+{
+    if (!localBuffer) {
+        QMutexLocker locker(&buffersMutex);
+        buffers.emplace_back(new ThreadBuffer);
+        localBuffer = buffers.back().get();
+        localBuffer->thread = int(buffers.size());
+    }
+    QMutexLocker locker(&localBuffer->mutex);
+    if (localBuffer->events.size() < MAX_EVENTS_PER_THREAD)
+        localBuffer->events.push_back(event);
+    else
+        localBuffer->dropped++;
+}
+
+void appendJsonString(QByteArray &out, const QByteArray &text)
+{
+    out.append('"');
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out.append('\\');
+            out.append(c);
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[8];
+            qsnprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out.append(escaped);
+        } else {
+            out.append(c);
+        }
+    }
+    out.append('"');
+}
+
+} // namespace
+
+void Trace::setEnabled(bool enabled)
+{
+    traceClock();
+    traceEnabled = enabled;
+}
+
+bool Trace::isEnabled()
+{
+    return traceEnabled.load(std::memory_order_relaxed);
+}
+
+qint64 Trace::now()
+{
+    return traceClock().nsecsElapsed() / 1000;
+}
+
+void Trace::complete(const char *name, const char *category, qint64 start, qint64 duration, const QByteArray &detail)
+{
+    if (isEnabled())
+        record({name, category, 'X', start, duration, detail});
+}
+
+void Trace::counter(const char *name, qint64 value)
+{
+    if (isEnabled())
+        record({name, "counter", 'C', now(), value, QByteArray()});
+}
+
+bool Trace::save(const QString &fileName)
+{
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qDebug() << "Cannot write trace:" << fileName;
+        return false;
+    }
+    QByteArray out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    qint64 dropped = 0;
+    QMutexLocker locker(&buffersMutex);
+    for (const auto &buffer : buffers) {
+        QMutexLocker bufferLocker(&buffer->mutex);
+        dropped += buffer->dropped;
+        for (const TraceEvent &event : buffer->events) {
+            if (!first)
+                out.append(",\n");
+            first = false;
+            out.append("{\"name\":");
+            appendJsonString(out, event.name);
+            out.append(",\"cat\":");
+            appendJsonString(out, event.category);
+            out.append(",\"ph\":\"").append(event.phase).append("\",\"pid\":1,\"tid\":");
+            out.append(QByteArray::number(buffer->thread));
+            out.append(",\"ts\":").append(QByteArray::number(event.start));
+            if (event.phase == 'C') {
+                out.append(",\"args\":{\"value\":").append(QByteArray::number(event.duration)).append('}');
+            } else {
+                out.append(",\"dur\":").append(QByteArray::number(event.duration));
+                if (!event.detail.isEmpty()) {
+                    out.append(",\"args\":{\"detail\":");
+                    appendJsonString(out, event.detail);
+                    out.append('}');
+                }
+            }
+            out.append('}');
+            // Flush as we go; a long session has millions of events.
+            if (out.size() > (1 << 20)) {
+                file.write(out);
+                out.clear();
+            }
+        }
+    }
+    out.append("\n]}\n");
+    file.write(out);
+    if (dropped > 0)
+        qDebug() << "Trace buffers were full;" << dropped << "events were dropped";
+    if (!file.commit()) {
+        qDebug() << "Cannot write trace:" << fileName;
+        return false;
+    }
+    return true;
+}
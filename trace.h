@@ -0,0 +1,57 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <QByteArray>
+#include <QString>
+
+// Optional timeline of what the program spent its time on, written out in
+// the Chrome trace format (chrome://tracing, Perfetto). Off by default;
+// while off, a TraceSpan costs one relaxed atomic load. Every thread
+// records into a buffer of its own, so tracing the scanner threads takes
+// no lock per event.
+class Trace
+{
+public:
+    static void setEnabled(bool enabled);
+    static bool isEnabled();
+
+    // Microseconds since the trace clock started.
+    static qint64 now();
+    // A finished span; name and category must be string literals.
+    static void complete(const char *name, const char *category, qint64 start, qint64 duration,
+                         const QByteArray &detail = QByteArray());
+    // A sample of a counter, shown as a graph.
+    static void counter(const char *name, qint64 value);
+
+    // Writes everything recorded so far; false if the file can't be written.
+    static bool save(const QString &fileName);
+};
+
+// Records a span from construction to destruction when tracing is on.
+class TraceSpan
+{
+public:
+    TraceSpan(const char *name, const char *category)
+        : m_name(name), m_category(category), m_start(Trace::isEnabled() ? Trace::now() : -1)
+    {
+    }
+    ~TraceSpan()
+    {
+        if (m_start >= 0)
+            Trace::complete(m_name, m_category, m_start, Trace::now() - m_start, m_detail);
+    }
+    // Shown with the span, e.g. the directory being read.
+    void setDetail(const QString &detail)
+    {
+        if (m_start >= 0)
+            m_detail = detail.toUtf8();
+    }
+
+private:
+    const char *m_name;
+    const char *m_category;
+    qint64 m_start;
+    QByteArray m_detail;
+};
+
+#endif // TRACE_H
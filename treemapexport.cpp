@@ -0,0 +1,306 @@
+#include "treemapexport.h"
+#include "trace.h"
+#include "treemaprenderer.h"
+
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QImage>
+#include <QPainter>
+#include <QSaveFile>
+#include <QSvgGenerator>
+#include <QtConcurrent/QtConcurrent>
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+
+#ifdef Q_OS_UNIX
+#include <zlib.h>
+#endif
+
+static const QColor BACKGROUND_COLOR = Qt::white;
+// Tiles are this wide and as high as a band; a band is at most this many
+// bytes of image, and as high as a tile is wide.
+static const int TILE_WIDTH = 256;
+static const qint64 BAND_BYTES = 64 * 1024 * 1024;
+// Rows of a band compressed together, on one thread.
+static const int STRIP_ROWS = 16;
+
+TreemapExport::TreemapExport()
+{
+}
+
+TreemapExport::~TreemapExport()
+{
+}
+
+QRectF TreemapExport::outerRect() const
+{
+    // As the widget has it: the whole area less a pixel on every side.
+    return QRectF(0, 0, m_size.width() / m_scale, m_size.height() / m_scale).adjusted(1, 1, -1, -1);
+}
+
+bool TreemapExport::save(const FolderTree &tree, NodeIndex root, const QString &fileName)
+{
+    TraceSpan span("export", "paint");
+    m_error.clear();
+    m_peakBytes = 0;
+    const QString format = QFileInfo(fileName).suffix().toLower();
+    if (format != "png" && format != "svg") {
+        m_error = QString("Can't write %1: only .png and .svg images are supported").arg(fileName);
+        return false;
+    }
+    if (m_size.width() < 16 || m_size.height() < 16 || m_scale <= 0) {
+        m_error = QString("Can't write %1: the image is too small").arg(fileName);
+        return false;
+    }
+
+    m_renderer.reset(new TreemapRenderer(m_font, m_scale));
+    m_layout.invalidate();
+    m_layout.setSquarified(m_squarified);
+    m_layout.setLabelHeight(m_renderer->folderLabelHeight());
+    QElapsedTimer timer;
+    timer.start();
+    m_layout.layout(tree, root, m_renderer->treeRect(outerRect()));
+    m_layoutMs = timer.nsecsElapsed() / 1e6;
+
+    timer.restart();
+    bool ok;
+    if (format == "svg") {
+        ok = saveSvg(tree, root, fileName);
+    } else {
+        QSaveFile file(fileName);
+        ok = file.open(QIODevice::WriteOnly) && savePng(tree, root, file) && file.commit();
+        if (!ok && m_error.isEmpty())
+            m_error = QString("Can't write %1: %2").arg(fileName, file.errorString());
+    }
+    m_renderMs = timer.nsecsElapsed() / 1e6;
+    m_renderer.reset();
+    return ok;
+}
+
+bool TreemapExport::saveSvg(const FolderTree &tree, NodeIndex root, const QString &fileName)
+{
+    QSvgGenerator generator;
+    generator.setFileName(fileName);
+    generator.setSize(m_size);
+    generator.setViewBox(QRect(QPoint(0, 0), m_size));
+    generator.setTitle(tree.folderPath(root));
+    QPainter painter;
+    if (!painter.begin(&generator)) {
+        m_error = QString("Can't write %1").arg(fileName);
+        return false;
+    }
+    // One pass over everything: a vector image has no pixels to bound.
+    const QRectF all(0, 0, m_size.width() / m_scale, m_size.height() / m_scale);
+    painter.fillRect(QRect(QPoint(0, 0), m_size), BACKGROUND_COLOR);
+    painter.scale(m_scale, m_scale);
+    m_renderer->render(painter, *m_renderer->prepare(tree, root, m_layout, outerRect(), all), all);
+    return painter.end();
+}
+
+#ifdef Q_OS_UNIX
+
+// Writes a PNG of 8 bit RGB as its rows come, a band at a time.
+//
+// The image data of a PNG is one zlib stream, which would leave a single
+// thread compressing the whole image. Instead each strip of rows is
+// compressed on its own, like pigz does, and ends on a byte boundary with
+// a sync flush, so the strips can simply be written one after the other;
+// their checksums are combined into the one of the whole stream. Every row
+// is stored as its difference to the row above, which turns the many rows
+// a treemap repeats into runs of zeros, whatever the width of the image.
+class TreemapExport::PngWriter
+{
+public:
+    PngWriter(QIODevice &device, int width) : m_device(device), m_width(width) {}
+
+    bool begin(int height)
+    {
+        static const char signature[] = "\x89PNG\r\n\x1a\n";
+        if (m_device.write(signature, 8) != 8)
+            return false;
+        QByteArray header;
+        appendNumber(header, quint32(m_width));
+        appendNumber(header, quint32(height));
+        header.append(char(8));       // Bits per channel,
+        header.append(char(2));       // RGB,
+        header.append(3, char(0));    // deflate, the usual filters, no interlacing.
+        // The zlib header goes before the first strip: deflate at the
+        // default level with a 32 KiB window.
+        return writeChunk("IHDR", header) && writeChunk("IDAT", QByteArray("\x78\x9c", 2));
+    }
+
+    // Compresses and writes count rows of bits, the previous one of which is
+    // above; nullptr at the top of the image.
+    bool writeRows(const uchar *bits, int bytesPerLine, int count, const uchar *above)
+    {
+        const int stripCount = (count + STRIP_ROWS - 1) / STRIP_ROWS;
+        m_strips.resize(stripCount);
+        std::vector<int> strips(stripCount);
+        std::iota(strips.begin(), strips.end(), 0);
+        QtConcurrent::blockingMap(strips, [&](int strip) {
+            const int first = strip * STRIP_ROWS;
+            const uchar *previous = first == 0 ? above : bits + qint64(first - 1) * bytesPerLine;
+            compressStrip(m_strips[strip], bits + qint64(first) * bytesPerLine, bytesPerLine,
+                          std::min(STRIP_ROWS, count - first), previous);
+        });
+        for (const Strip &strip : m_strips) {
+            if (!strip.ok || !writeChunk("IDAT", strip.data))
+                return false;
+            m_adler = adler32_combine(m_adler, strip.adler, strip.length);
+        }
+        return true;
+    }
+
+    bool end()
+    {
+        // An empty final block and the checksum of everything before it.
+        QByteArray trailer("\x03\x00", 2);
+        appendNumber(trailer, quint32(m_adler));
+        return writeChunk("IDAT", trailer) && writeChunk("IEND", QByteArray());
+    }
+
+    qint64 bufferedBytes() const
+    {
+        qint64 bytes = 0;
+        for (const Strip &strip : m_strips)
+            bytes += strip.data.capacity();
+        return bytes;
+    }
+
+private:
+    struct Strip {
+        QByteArray data;
+        uLong adler = 0;
+        z_off_t length = 0;           // Before compression.
+        bool ok = false;
+    };
+
+    static void appendNumber(QByteArray &bytes, quint32 number)
+    {
+        const char big[4] = { char(number >> 24), char(number >> 16), char(number >> 8), char(number) };
+        bytes.append(big, 4);
+    }
+
+    bool writeChunk(const char *type, const QByteArray &data)
+    {
+        QByteArray head;
+        appendNumber(head, quint32(data.size()));
+        head.append(type, 4);
+        uLong crc = crc32(0, reinterpret_cast<const Bytef *>(type), 4);
+        crc = crc32(crc, reinterpret_cast<const Bytef *>(data.constData()), uInt(data.size()));
+        QByteArray tail;
+        appendNumber(tail, quint32(crc));
+        return m_device.write(head) == head.size() && m_device.write(data) == data.size()
+            && m_device.write(tail) == tail.size();
+    }
+
+    void compressStrip(Strip &strip, const uchar *bits, int bytesPerLine, int count, const uchar *above) const
+    {
+        TraceSpan span("compressRows", "paint");
+        z_stream stream = {};
+        strip.ok = false;
+        // Raw deflate: the zlib header and checksum are written once for all strips.
+        if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return;
+        // Filter type 2, "up", and the differences to the row above.
+        std::vector<Bytef> row(1 + 3 * size_t(m_width));
+        strip.data.resize(int(deflateBound(&stream, uLong(row.size()) * count)) + 64);
+        strip.adler = adler32(0, nullptr, 0);
+        strip.length = 0;
+        stream.next_out = reinterpret_cast<Bytef *>(strip.data.data());
+        stream.avail_out = uInt(strip.data.size());
+        int result = Z_OK;
+        for (int y = 0; y < count && result == Z_OK; y++) {
+            const QRgb *line = reinterpret_cast<const QRgb *>(bits + qint64(y) * bytesPerLine);
+            const QRgb *up = reinterpret_cast<const QRgb *>(y > 0 ? bits + qint64(y - 1) * bytesPerLine : above);
+            Bytef *out = row.data();
+            *out++ = 2;
+            // The image is opaque, so premultiplied is the same as not.
+            for (int x = 0; x < m_width; x++) {
+                const QRgb pixel = line[x];
+                const QRgb before = up ? up[x] : 0;
+                *out++ = Bytef(qRed(pixel) - qRed(before));
+                *out++ = Bytef(qGreen(pixel) - qGreen(before));
+                *out++ = Bytef(qBlue(pixel) - qBlue(before));
+            }
+            strip.adler = adler32(strip.adler, row.data(), uInt(row.size()));
+            strip.length += z_off_t(row.size());
+            stream.next_in = row.data();
+            stream.avail_in = uInt(row.size());
+            result = deflate(&stream, y + 1 == count ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+        }
+        strip.ok = result == Z_OK && stream.avail_in == 0;
+        strip.data.resize(int(stream.total_out));
+        strip.data.squeeze();
+        deflateEnd(&stream);
+    }
+
+    QIODevice &m_device;
+    int m_width;
+    uLong m_adler = adler32(0, nullptr, 0);
+    std::vector<Strip> m_strips;
+};
+
+bool TreemapExport::savePng(const FolderTree &tree, NodeIndex root, QIODevice &device)
+{
+    const int width = m_size.width();
+    const int height = m_size.height();
+    const int bandRows = int(qBound(qint64(1), BAND_BYTES / (qint64(width) * 4), qint64(TILE_WIDTH)));
+    QImage band(width, bandRows, QImage::Format_ARGB32_Premultiplied);
+    if (band.isNull()) {
+        m_error = QString("Can't make an image %1 pixels wide").arg(width);
+        return false;
+    }
+    // The last row of the band before, for the filter of the first of the next.
+    std::vector<QRgb> above(width);
+    const QRectF outer = outerRect();
+    const int columns = (width + TILE_WIDTH - 1) / TILE_WIDTH;
+    std::vector<int> tiles(columns);
+    std::iota(tiles.begin(), tiles.end(), 0);
+
+    PngWriter writer(device, width);
+    if (!writer.begin(height))
+        return false;
+    for (int top = 0; top < height; top += bandRows) {
+        const int rows = std::min(bandRows, height - top);
+        band.fill(BACKGROUND_COLOR);
+        // Tiles are images of their own over their part of the band, so each
+        // thread paints on its own without copying anything afterwards.
+        uchar *bits = band.bits();
+        const int bytesPerLine = band.bytesPerLine();
+        const QRectF bandArea(0, top / m_scale, width / m_scale, rows / m_scale);
+        // Items and labels only for the band, and dropped after it: a
+        // poster may have millions of them.
+        const std::shared_ptr<TreemapFrame> frame = m_renderer->prepare(tree, root, m_layout, outer, bandArea);
+        QtConcurrent::blockingMap(tiles, [&](int column) {
+            TraceSpan span("renderTile", "paint");
+            const int left = column * TILE_WIDTH;
+            QImage tile(bits + left * 4, std::min(TILE_WIDTH, width - left), rows, bytesPerLine,
+                        QImage::Format_ARGB32_Premultiplied);
+            const QRectF area(left / m_scale, top / m_scale, tile.width() / m_scale, rows / m_scale);
+            QPainter painter(&tile);
+            painter.setRenderHint(QPainter::Antialiasing);
+            painter.scale(m_scale, m_scale);
+            painter.translate(-area.topLeft());
+            painter.setClipRect(area);
+            m_renderer->render(painter, *frame, area);
+        });
+        m_renderer->clearLabels();
+        if (!writer.writeRows(bits, bytesPerLine, rows, top == 0 ? nullptr : reinterpret_cast<const uchar *>(above.data())))
+            return false;
+        std::memcpy(above.data(), bits + qint64(rows - 1) * bytesPerLine, size_t(width) * 4);
+        m_peakBytes = std::max(m_peakBytes, band.sizeInBytes() + writer.bufferedBytes());
+    }
+    return writer.end();
+}
+
+#else
+
+bool TreemapExport::savePng(const FolderTree &, NodeIndex, QIODevice &)
+{
+    m_error = "This build can't write PNG images; try .svg";
+    return false;
+}
+
+#endif
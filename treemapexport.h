@@ -0,0 +1,69 @@
+#ifndef TREEMAPEXPORT_H
+#define TREEMAPEXPORT_H
+
+#include "foldertree.h"
+#include "treemaplayout.h"
+
+#include <QFont>
+#include <QSize>
+#include <QString>
+#include <memory>
+
+class QIODevice;
+class TreemapRenderer;
+
+// Renders the treemap of a tree to a PNG or SVG file without a window, at
+// any size up to posters of a gigapixel and more.
+//
+// The tree is laid out once at the size of the image; every tile is then
+// cut from that one layout, so the map looks the same whatever the tiles.
+// A PNG is rendered a band of rows at a time, each band as tiles side by
+// side on the thread pool, and its rows compressed and written to the file
+// before the next band starts. So however large the image, only one band
+// of it is in memory. An SVG is the map in vector form, drawn in one go.
+class TreemapExport
+{
+public:
+    TreemapExport();
+    ~TreemapExport();
+
+    // Of the image, in pixels.
+    void setSize(const QSize &size) { m_size = size; }
+    // Pixels per point: above 1, the map is laid out for a smaller area
+    // and drawn enlarged, with labels readable at that scale, as on a
+    // high density screen.
+    void setScale(qreal scale) { m_scale = scale; }
+    void setFont(const QFont &font) { m_font = font; }
+    void setSquarified(bool squarified) { m_squarified = squarified; }
+
+    // Writes the map of the folder root of tree to fileName, as PNG or SVG
+    // by its suffix; false, with errorString() set, if it can't.
+    bool save(const FolderTree &tree, NodeIndex root, const QString &fileName);
+    QString errorString() const { return m_error; }
+
+    int itemCount() const { return int(m_layout.items().size()); }
+    double layoutMs() const { return m_layoutMs; }
+    double renderMs() const { return m_renderMs; }
+    // The most memory the image took at once.
+    qint64 peakBytes() const { return m_peakBytes; }
+
+private:
+    class PngWriter;
+
+    bool savePng(const FolderTree &tree, NodeIndex root, QIODevice &device);
+    bool saveSvg(const FolderTree &tree, NodeIndex root, const QString &fileName);
+    QRectF outerRect() const;
+
+    QSize m_size = QSize(3840, 2160);
+    qreal m_scale = 1;
+    QFont m_font;
+    bool m_squarified = false;
+    TreemapLayout m_layout;
+    std::unique_ptr<TreemapRenderer> m_renderer;
+    QString m_error;
+    double m_layoutMs = 0;
+    double m_renderMs = 0;
+    qint64 m_peakBytes = 0;
+};
+
+#endif // TREEMAPEXPORT_H
@@ -0,0 +1,528 @@
+#include "treemaplayout.h"
+#include "trace.h"
+
+#include <QMutexLocker>
+#include <QtConcurrent/QtConcurrent>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+// Items that would get less area than this, in pixels, are rolled up
+// before the layout; what ends up under ROLLUP_THRESHOLD on a side anyway
+// is caught afterwards.
+static const double MIN_ITEM_AREA = 2 * ROLLUP_THRESHOLD * ROLLUP_THRESHOLD;
+// Folders this deep or less hand the subtrees of their subfolders to the
+// thread pool; below, there are enough of them running already.
+static const int PARALLEL_DEPTH = 2;
+
+static bool largerFirst(const LayoutItem &a, const LayoutItem &b)
+{
+    return a.size > b.size;
+}
+
+// Squarified layout (Bruls, Huizing, van Wijk): items, largest first, go
+// into rows along the shorter side of what is left, and a row takes one
+// more item only while that keeps its worst aspect ratio from getting
+// worse. The gap is made by laying out into a rectangle one gap larger and
+// trimming every item by one gap on its right and bottom.
+static void squarify(std::vector<LayoutItem> &items, const QRectF &area, double totalSize, double gap)
+{
+    QRectF rest(area.x(), area.y(), std::max(0.0, area.width()) + gap, std::max(0.0, area.height()) + gap);
+    double restSize = totalSize;
+    size_t i = 0;
+    while (i < items.size() && restSize > 0) {
+        const double scale = rest.width() * rest.height() / restSize;   // Pixels per size unit.
+        const double side = std::min(rest.width(), rest.height());
+        const double largest = items[i].size * scale;
+        size_t end = i;
+        double rowSize = 0;
+        double worst = std::numeric_limits<double>::max();
+        while (end < items.size()) {
+            const double rowArea = (rowSize + items[end].size) * scale;
+            const double smallest = std::max(items[end].size * scale, 1e-9);
+            const double aspect = std::max(side * side * largest / (rowArea * rowArea),
+                                           rowArea * rowArea / (side * side * smallest));
+            if (end > i && aspect > worst)
+                break;
+            worst = aspect;
+            rowSize += items[end].size;
+            end++;
+        }
+        const double thickness = side > 0 ? rowSize * scale / side : 0;
+        double offset = 0;
+        for (size_t k = i; k < end; k++) {
+            const double length = thickness > 0 ? items[k].size * scale / thickness : 0;
+            if (rest.width() >= rest.height())
+                items[k].rect = QRectF(rest.left(), rest.top() + offset, thickness, length);
+            else
+                items[k].rect = QRectF(rest.left() + offset, rest.top(), length, thickness);
+            offset += length;
+        }
+        if (rest.width() >= rest.height())
+            rest.setLeft(rest.left() + thickness);
+        else
+            rest.setTop(rest.top() + thickness);
+        restSize -= rowSize;
+        i = end;
+    }
+    for (; i < items.size(); i++)
+        items[i].rect = QRectF(rest.topLeft(), QSizeF(0, 0));
+    for (LayoutItem &item : items) {
+        item.rect.setWidth(std::max(0.0, item.rect.width() - gap));
+        item.rect.setHeight(std::max(0.0, item.rect.height() - gap));
+    }
+}
+
+static void divideDisplayArea(std::vector<LayoutItem> &items, int start, int count, const QRectF &area, double totalSize, double gap)
+{
+    double safeWidth = std::max(0.0, area.width());
+    double safeHeight = std::max(0.0, area.height());
+    QRectF safeArea(area.x(), area.y(), safeWidth, safeHeight);
+
+    if (count <= 0)
+        return;
+    if (count == 1) {
+        items[start].rect = safeArea;
+        return;
+    }
+    int groupACount = 0;
+    double sizeA = 0;
+    int i = start;
+    sizeA += items[i].size;
+    groupACount++;
+    i++;
+    while (i < start + count && (sizeA + items[i].size) * 2 < totalSize && items[i].size > 0) {
+        sizeA += items[i].size;
+        groupACount++;
+        i++;
+    }
+    int groupBCount = count - groupACount;
+    double sizeB = totalSize - sizeA;
+
+    bool horizontalSplit = safeWidth >= safeHeight;
+    if (horizontalSplit) {
+        double effectiveWidth = std::max(0.0, safeWidth - gap);
+        double mid = (totalSize > 0) ? (sizeA / totalSize) * effectiveWidth : effectiveWidth / 2.0;
+        QRectF areaA(safeArea.x(), safeArea.y(), std::max(0.0, mid), safeHeight);
+        QRectF areaB(safeArea.x() + mid + gap, safeArea.y(), std::max(0.0, safeWidth - mid - gap), safeHeight);
+        divideDisplayArea(items, start, groupACount, areaA, sizeA, gap);
+        divideDisplayArea(items, start + groupACount, groupBCount, areaB, sizeB, gap);
+    } else {
+        double effectiveHeight = std::max(0.0, safeHeight - gap);
+        double mid = (totalSize > 0) ? (sizeA / totalSize) * effectiveHeight : effectiveHeight / 2.0;
+        QRectF areaA(safeArea.x(), safeArea.y(), safeWidth, std::max(0.0, mid));
+        QRectF areaB(safeArea.x(), safeArea.y() + mid + gap, safeWidth, std::max(0.0, safeHeight - mid - gap));
+        divideDisplayArea(items, start, groupACount, areaA, sizeA, gap);
+        divideDisplayArea(items, start + groupACount, groupBCount, areaB, sizeB, gap);
+    }
+}
+
+// Aim for about this many items per cell; cells never get smaller than
+// MIN_CELL_SIZE pixels, so a huge layout doesn't turn into a huge grid.
+static const double ITEMS_PER_CELL = 2.0;
+static const double MIN_CELL_SIZE = 8.0;
+static const int MAX_GRID_SIZE = 512;
+
+void LayoutGrid::clear()
+{
+    m_columns = m_rows = 0;
+    m_cellStart.clear();
+    m_entries.clear();
+}
+
+void LayoutGrid::build(const std::vector<LayoutItem> &items, const QRectF &bounds)
+{
+    clear();
+    if (items.empty() || bounds.width() <= 0 || bounds.height() <= 0)
+        return;
+    m_bounds = bounds;
+    const double cellArea = bounds.width() * bounds.height() * ITEMS_PER_CELL / items.size();
+    const double cellSize = std::max(MIN_CELL_SIZE, std::sqrt(cellArea));
+    m_columns = qBound(1, int(std::ceil(bounds.width() / cellSize)), MAX_GRID_SIZE);
+    m_rows = qBound(1, int(std::ceil(bounds.height() / cellSize)), MAX_GRID_SIZE);
+    m_cellWidth = bounds.width() / m_columns;
+    m_cellHeight = bounds.height() / m_rows;
+
+    // Count first, then fill, so every cell's list is one contiguous run.
+    m_cellStart.assign(size_t(m_columns) * m_rows + 1, 0);
+    int left, top, right, bottom;
+    for (const LayoutItem &item : items) {
+        if (!cellRange(item.rect, left, top, right, bottom))
+            continue;
+        for (int row = top; row <= bottom; row++)
+            for (int column = left; column <= right; column++)
+                m_cellStart[row * m_columns + column + 1]++;
+    }
+    for (size_t i = 1; i < m_cellStart.size(); i++)
+        m_cellStart[i] += m_cellStart[i - 1];
+    m_entries.resize(m_cellStart.back());
+    std::vector<quint32> fill(m_cellStart.begin(), m_cellStart.end() - 1);
+    for (size_t i = 0; i < items.size(); i++) {
+        if (!cellRange(items[i].rect, left, top, right, bottom))
+            continue;
+        for (int row = top; row <= bottom; row++)
+            for (int column = left; column <= right; column++)
+                m_entries[fill[row * m_columns + column]++] = quint32(i);
+    }
+}
+
+// Cells overlapped by rect, clipped to the grid. False if there are none.
+bool LayoutGrid::cellRange(const QRectF &rect, int &left, int &top, int &right, int &bottom) const
+{
+    if (m_columns == 0 || !rect.intersects(m_bounds))
+        return false;
+    left = qBound(0, int((rect.left() - m_bounds.left()) / m_cellWidth), m_columns - 1);
+    right = qBound(0, int((rect.right() - m_bounds.left()) / m_cellWidth), m_columns - 1);
+    top = qBound(0, int((rect.top() - m_bounds.top()) / m_cellHeight), m_rows - 1);
+    bottom = qBound(0, int((rect.bottom() - m_bounds.top()) / m_cellHeight), m_rows - 1);
+    return true;
+}
+
+int LayoutGrid::itemAt(const std::vector<LayoutItem> &items, const QPointF &point, int before) const
+{
+    if (m_columns == 0 || !m_bounds.contains(point))
+        return -1;
+    const int column = qBound(0, int((point.x() - m_bounds.left()) / m_cellWidth), m_columns - 1);
+    const int row = qBound(0, int((point.y() - m_bounds.top()) / m_cellHeight), m_rows - 1);
+    const size_t cell = size_t(row) * m_columns + column;
+    for (quint32 i = m_cellStart[cell + 1]; i > m_cellStart[cell]; i--) {
+        const quint32 index = m_entries[i - 1];
+        if (before >= 0 && index >= quint32(before))
+            continue;
+        if (items[index].rect.contains(point))
+            return int(index);
+    }
+    return -1;
+}
+
+std::vector<int> LayoutGrid::itemsIn(const std::vector<LayoutItem> &items, const QRectF &region) const
+{
+    std::vector<int> found;
+    int left, top, right, bottom;
+    if (!cellRange(region, left, top, right, bottom))
+        return found;
+    for (int row = top; row <= bottom; row++) {
+        for (int column = left; column <= right; column++) {
+            const size_t cell = size_t(row) * m_columns + column;
+            for (quint32 i = m_cellStart[cell]; i < m_cellStart[cell + 1]; i++) {
+                if (items[m_entries[i]].rect.intersects(region))
+                    found.push_back(int(m_entries[i]));
+            }
+        }
+    }
+    // Items spanning several cells were found once per cell.
+    std::sort(found.begin(), found.end());
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+    return found;
+}
+
+void TreemapLayout::setLabelHeight(int height)
+{
+    if (height != m_labelHeight) {
+        m_labelHeight = height;
+        invalidate();
+    }
+}
+
+void TreemapLayout::setSquarified(bool squarified)
+{
+    if (squarified != m_squarified) {
+        m_squarified = squarified;
+        invalidate();
+    }
+}
+
+void TreemapLayout::invalidate()
+{
+    m_levels.clear();
+    m_items.clear();
+    m_grid.clear();
+    m_valid = false;
+}
+
+const std::vector<LayoutItem> &TreemapLayout::layout(const FolderTree &tree, NodeIndex root, const QRectF &rect)
+{
+    if (&tree != m_tree) {
+        invalidate();
+        m_tree = &tree;
+    }
+    m_changed.clear();
+    m_changedAll = false;
+    m_cancelled = false;
+    if (m_valid && root == m_root && rect == m_rect && tree.version() == m_version)
+        return m_items;
+
+    TraceSpan span("layout", "layout");
+    m_changedAll = !m_valid || root != m_root || rect != m_rect;
+    m_root = root;
+    m_rect = rect;
+    m_version = tree.version();
+    m_pass++;
+    Pass pass;
+    pass.items.swap(m_items);
+    pass.items.clear();
+    if (root != NoIndex)
+        layoutFolder(tree, root, rect, 1, pass);
+    m_items.swap(pass.items);
+    m_changed.swap(pass.changed);
+    if (m_cancelled) {
+        // Levels laid out so far are cached, but their changes were never
+        // reported; the next layout makes up for it by reporting everything.
+        m_items.clear();
+        m_grid.clear();
+        m_valid = false;
+        return m_items;
+    }
+    m_grid.build(m_items, rect);
+    m_valid = true;
+
+    // Forget levels that have scrolled out of view, so zooming around a
+    // big tree does not accumulate them forever.
+    for (auto it = m_levels.begin(); it != m_levels.end();) {
+        if (it->second.pass != m_pass)
+            it = m_levels.erase(it);
+        else
+            ++it;
+    }
+    return m_items;
+}
+
+void TreemapLayout::layoutFolder(const FolderTree &tree, NodeIndex node, const QRectF &rect, int depth, Pass &pass)
+{
+    if (m_cancel && m_cancel->load(std::memory_order_relaxed)) {
+        m_cancelled = true;
+        return;
+    }
+    const Level &cached = level(tree, node, rect, depth, pass);
+    const std::vector<LayoutItem> &items = cached.items;
+    // The positions in items of the subfolders that get laid out.
+    std::vector<int> inside;
+    for (int i = 0; i < int(items.size()); i++) {
+        const LayoutItem &item = items[i];
+        if (item.isFolder && !item.isRollup) {
+            const QRectF inner = childRect(item);
+            if (inner.width() > 50 && inner.height() > 30)
+                inside.push_back(i);
+        }
+    }
+    if (depth > PARALLEL_DEPTH || inside.size() < 2) {
+        size_t next = 0;
+        for (int i = 0; i < int(items.size()); i++) {
+            pass.items.push_back(items[i]);
+            if (next < inside.size() && inside[next] == i) {
+                layoutFolder(tree, items[i].index, childRect(items[i]), depth + 1, pass);
+                next++;
+            }
+        }
+        return;
+    }
+
+    // The subtrees don't share a folder, so each is laid out on its own and
+    // spliced in after its folder's item.
+    std::vector<Pass> subtrees(inside.size());
+    std::vector<int> order(inside.size());
+    std::iota(order.begin(), order.end(), 0);
+    QtConcurrent::blockingMap(order, [&](int k) {
+        const LayoutItem &item = items[inside[k]];
+        layoutFolder(tree, item.index, childRect(item), depth + 1, subtrees[k]);
+    });
+    size_t next = 0;
+    for (int i = 0; i < int(items.size()); i++) {
+        pass.items.push_back(items[i]);
+        if (next < inside.size() && inside[next] == i) {
+            Pass &subtree = subtrees[next++];
+            pass.items.insert(pass.items.end(), subtree.items.begin(), subtree.items.end());
+            pass.changed.insert(pass.changed.end(), subtree.changed.begin(), subtree.changed.end());
+        }
+    }
+}
+
+const TreemapLayout::Level &TreemapLayout::level(const FolderTree &tree, NodeIndex node, const QRectF &rect, int depth,
+                                                 Pass &pass)
+{
+    QMutexLocker locker(&m_levelsMutex);
+    Level &cached = m_levels[node];
+    locker.unlock();
+    const quint32 stamp = tree.node(node).stamp;
+    if (cached.pass == 0 || cached.rect != rect || cached.stamp != stamp || cached.depth != depth) {
+        const bool moved = cached.pass == 0 || cached.rect != rect || cached.depth != depth;
+        pass.previous.swap(cached.items);
+        cached.rect = rect;
+        cached.stamp = stamp;
+        cached.depth = depth;
+        computeLevel(tree, node, cached);
+        if (moved)
+            pass.changed.push_back(rect);
+        else
+            compareLevel(pass.previous, cached, pass.changed);
+    }
+    cached.pass = m_pass;
+    return cached;
+}
+
+void TreemapLayout::computeLevel(const FolderTree &tree, NodeIndex node, Level &level) const
+{
+    std::vector<LayoutItem> &items = level.items;
+    items.clear();
+    const FolderNode &folder = tree.node(node);
+    const double area = std::max(0.0, level.rect.width()) * std::max(0.0, level.rect.height());
+    // Anything smaller than this would get less than MIN_ITEM_AREA pixels,
+    // so it goes straight to the rollup without being laid out.
+    const qint64 minSize = area > 0 ? qint64(std::ceil(folder.totalSize * MIN_ITEM_AREA / area))
+                                    : std::numeric_limits<qint64>::max();
+    LayoutItem rollupItem;
+    rollupItem.depth = level.depth;
+    rollupItem.isRollup = true;
+    auto rollUp = [&rollupItem](qint64 size, int count) {
+        rollupItem.size += size;
+        rollupItem.rollupCount += count;
+        rollupItem.rollupMaxSize = std::max(rollupItem.rollupMaxSize, size);
+    };
+
+    LayoutItem item;
+    item.depth = level.depth;
+    item.isFolder = true;
+    qint64 rest = folder.totalSize;
+    for (NodeIndex sub = folder.firstChild; sub != NoIndex; sub = tree.node(sub).nextSibling) {
+        const qint64 size = tree.node(sub).totalSize;
+        rest -= size;
+        if (size > 0 && size >= minSize) {
+            item.index = sub;
+            item.size = size;
+            items.push_back(item);
+        } else if (size > 0) {
+            rollUp(size, 1);
+        }
+    }
+    const size_t folderCount = items.size();
+    // Files that a summary scan folded come rolled up already.
+    item.isFolder = false;
+    item.isRollup = true;
+    for (GroupIndex group = folder.firstGroup; group != NoIndex; group = tree.group(group).next) {
+        const FileGroup &folded = tree.group(group);
+        rest -= folded.size;
+        if (folded.size >= minSize) {
+            item.index = group;
+            item.size = folded.size;
+            item.rollupCount = int(folded.count);
+            items.push_back(item);
+        } else {
+            rollUp(folded.size, int(folded.count));
+        }
+    }
+    // Files are kept largest first, so the visible ones come first and the
+    // others are what is left of the folder's total: a folder with a
+    // million files costs no more than the handful that show.
+    item.isRollup = false;
+    item.rollupCount = 0;
+    quint32 shown = 0;
+    for (FileIndex file = folder.firstFile; file != NoIndex; file = tree.file(file).next) {
+        const qint64 size = tree.file(file).size;
+        if (size < minSize)
+            break;
+        item.index = file;
+        item.size = size;
+        items.push_back(item);
+        rest -= size;
+        shown++;
+    }
+    if (folder.fileCount > shown && rest > 0) {
+        rollupItem.size += rest;
+        rollupItem.rollupCount += int(folder.fileCount - shown);
+        rollupItem.rollupMaxSize = std::max(rollupItem.rollupMaxSize, std::min(rest, minSize - 1));
+    }
+    if (items.empty() && rollupItem.rollupCount == 0)
+        return;
+
+    // Folders are normally largest first once the scan has finished, and
+    // files and groups always are, so this is mostly a merge; a full sort is
+    // needed only while folder sizes are still growing.
+    if (!std::is_sorted(items.begin(), items.begin() + folderCount, largerFirst))
+        std::stable_sort(items.begin(), items.begin() + folderCount, largerFirst);
+    if (!std::is_sorted(items.begin() + folderCount, items.end(), largerFirst))
+        std::stable_sort(items.begin() + folderCount, items.end(), largerFirst);
+    std::inplace_merge(items.begin(), items.begin() + folderCount, items.end(), largerFirst);
+    if (rollupItem.rollupCount > 0)
+        items.insert(std::upper_bound(items.begin(), items.end(), rollupItem, largerFirst), rollupItem);
+
+    qint64 total = 0;
+    for (const auto &it : items)
+        total += it.size;
+    arrange(items, level.rect, total);
+
+    // Area alone doesn't make an item visible: one that came out too thin
+    // is rolled up after all, which takes a second pass.
+    auto tooThin = [](const LayoutItem &it) {
+        return (it.rect.width() < ROLLUP_THRESHOLD || it.rect.height() < ROLLUP_THRESHOLD) &&
+               !(it.isRollup && it.index == NoIndex);
+    };
+    if (std::any_of(items.begin(), items.end(), tooThin)) {
+        size_t kept = 0;
+        for (size_t i = 0; i < items.size(); i++) {
+            const LayoutItem &it = items[i];
+            if (tooThin(it))
+                rollUp(it.size, it.isRollup ? it.rollupCount : 1);
+            else if (!(it.isRollup && it.index == NoIndex))
+                items[kept++] = it;
+        }
+        items.resize(kept);
+        items.insert(std::upper_bound(items.begin(), items.end(), rollupItem, largerFirst), rollupItem);
+        arrange(items, level.rect, total);
+    }
+
+    for (auto &it : items) {
+        if (it.isFolder)
+            it.hasLabel = it.rect.width() >= MIN_LABEL_WIDTH &&
+                          it.rect.height() >= (TOP_MARGIN_FOLDER_LABEL + m_labelHeight);
+    }
+}
+
+void TreemapLayout::arrange(std::vector<LayoutItem> &items, const QRectF &rect, qint64 total) const
+{
+    if (m_squarified)
+        squarify(items, rect, total, GAP_BETWEEN_ITEMS);
+    else
+        divideDisplayArea(items, 0, int(items.size()), rect, total, GAP_BETWEEN_ITEMS);
+}
+
+// Records which parts of a relaid level look different now. A folder that
+// only changed size needs just its label redrawn; whatever happened inside it
+// is found when its own level is compared.
+void TreemapLayout::compareLevel(const std::vector<LayoutItem> &before, const Level &level,
+                                 std::vector<QRectF> &changed) const
+{
+    const std::vector<LayoutItem> &after = level.items;
+    if (before.size() != after.size()) {
+        changed.push_back(level.rect);
+        return;
+    }
+    for (size_t i = 0; i < after.size(); i++) {
+        const LayoutItem &a = before[i];
+        const LayoutItem &b = after[i];
+        if (a.index != b.index || a.isFolder != b.isFolder || a.isRollup != b.isRollup ||
+            a.hasLabel != b.hasLabel || a.rect != b.rect) {
+            changed.push_back(a.rect);
+            changed.push_back(b.rect);
+        } else if (a.size != b.size || a.rollupCount != b.rollupCount) {
+            if (b.isFolder && !b.isRollup) {
+                if (b.hasLabel)
+                    changed.push_back(QRectF(b.rect.left(), b.rect.top(), b.rect.width(),
+                                               TOP_MARGIN_FOLDER_LABEL + m_labelHeight));
+            } else {
+                changed.push_back(b.rect);
+            }
+        }
+    }
+}
+
+// Area left for a folder's children. If its label doesn't fit, the children
+// move up into the label's place.
+QRectF TreemapLayout::childRect(const LayoutItem &item) const
+{
+    const int textHeight = item.hasLabel ? m_labelHeight : 0;
+    return QRectF(item.rect.left() + SIDE_MARGIN_FOLDER_LABEL + EXTRA_SIDE_BUFFER,
+                  item.rect.top() + TOP_MARGIN_FOLDER_LABEL + textHeight,
+                  item.rect.width() - 2 * SIDE_MARGIN_FOLDER_LABEL - 2 * EXTRA_SIDE_BUFFER,
+                  item.rect.height() - TOP_MARGIN_FOLDER_LABEL - textHeight - BOTTOM_MARGIN_FOLDER_LABEL);
+}
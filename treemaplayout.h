@@ -0,0 +1,149 @@
+#ifndef TREEMAPLAYOUT_H
+#define TREEMAPLAYOUT_H
+
+#include "foldertree.h"
+
+#include <QMutex>
+#include <QRectF>
+#include <atomic>
+#include <unordered_map>
+#include <vector>
+
+// Layout parameters shared by the layout and the painting code.
+static const double GAP_BETWEEN_ITEMS = 1.5;
+static const int EXTRA_SIDE_BUFFER = 2;
+static const int TOP_MARGIN_FOLDER_LABEL = 4;
+static const int SIDE_MARGIN_FOLDER_LABEL = 2;
+static const int BOTTOM_MARGIN_FOLDER_LABEL = 2;
+static const double ROLLUP_THRESHOLD = 3.0;
+static const qreal MIN_LABEL_WIDTH = 50.0;
+
+// One rectangle of the treemap.
+struct LayoutItem {
+    QRectF rect;
+    qint64 size = 0;
+    quint32 index = NoIndex;          // NodeIndex if isFolder is true, FileIndex otherwise; for rollups a
+                                      // GroupIndex, or NoIndex for the items too small to show.
+    int depth = 0;
+    bool isFolder = false;
+    bool isRollup = false;
+    bool hasLabel = false;            // Folder whose name fits above its children.
+    int rollupCount = 0;
+    qint64 rollupMaxSize = 0;
+};
+
+// Uniform grid over the rectangles of a layout. Each cell lists, in paint
+// order, the items overlapping it, so a point query only looks at one short
+// list and the last hit is the deepest item.
+class LayoutGrid
+{
+public:
+    void build(const std::vector<LayoutItem> &items, const QRectF &bounds);
+    void clear();
+
+    // Position in items of the deepest item containing point, or -1. With
+    // before >= 0 only items ahead of that position count, which walks up
+    // from a hit to the folders enclosing it.
+    int itemAt(const std::vector<LayoutItem> &items, const QPointF &point, int before = -1) const;
+    // Positions of all items intersecting region, in paint order.
+    std::vector<int> itemsIn(const std::vector<LayoutItem> &items, const QRectF &region) const;
+
+private:
+    bool cellRange(const QRectF &rect, int &left, int &top, int &right, int &bottom) const;
+
+    QRectF m_bounds;
+    int m_columns = 0;
+    int m_rows = 0;
+    double m_cellWidth = 1;
+    double m_cellHeight = 1;
+    std::vector<quint32> m_cellStart;     // m_columns * m_rows + 1 offsets into m_entries
+    std::vector<quint32> m_entries;
+};
+
+// Computes the treemap geometry for a folder tree, separately from painting.
+//
+// The result is a flat list in paint order: every folder is followed by
+// everything laid out inside it. The complete list is reused as long as the
+// tree, the root and the rectangle stay the same, and each folder's own level
+// is cached as well, so after a change only the folders whose size or
+// rectangle actually moved are laid out again. The subtrees of the biggest
+// folders near the top are laid out side by side on the thread pool.
+class TreemapLayout
+{
+public:
+    // Height of a folder label; a folder's children go below its label when
+    // the label fits.
+    void setLabelHeight(int height);
+    // Squarified rows instead of the default halving by size: squarer
+    // tiles, so fewer of them end up too thin to show.
+    void setSquarified(bool squarified);
+    bool isSquarified() const { return m_squarified; }
+
+    const std::vector<LayoutItem> &layout(const FolderTree &tree, NodeIndex root, const QRectF &rect);
+    const std::vector<LayoutItem> &items() const { return m_items; }
+    const LayoutGrid &grid() const { return m_grid; }
+
+    // Hit testing on the last layout; see LayoutGrid.
+    int itemAt(const QPointF &point, int before = -1) const { return m_grid.itemAt(m_items, point, before); }
+    std::vector<int> itemsIn(const QRectF &region) const { return m_grid.itemsIn(m_items, region); }
+
+    // What the last layout() call changed compared to the one before:
+    // everything, or only the listed areas (none if it was a cache hit).
+    bool changedAll() const { return m_changedAll; }
+    const std::vector<QRectF> &changedAreas() const { return m_changed; }
+
+    // Drops every cached level, e.g. when the tree is replaced.
+    void invalidate();
+
+    // For a layout made on another thread: once *cancel turns true, it
+    // stops at the next folder and cancelled() is true. The items are then
+    // incomplete, and the next layout reports everything as changed.
+    void setCancelFlag(const std::atomic<bool> *cancel) { m_cancel = cancel; }
+    bool cancelled() const { return m_cancelled; }
+
+private:
+    struct Level {
+        QRectF rect;
+        quint32 stamp = 0;
+        int depth = 0;
+        quint32 pass = 0;
+        std::vector<LayoutItem> items;
+    };
+
+    // What one thread lays out: a subtree's items in paint order and the
+    // areas that look different.
+    struct Pass {
+        std::vector<LayoutItem> items;
+        std::vector<QRectF> changed;
+        std::vector<LayoutItem> previous;     // Scratch for compareLevel().
+    };
+
+    void layoutFolder(const FolderTree &tree, NodeIndex node, const QRectF &rect, int depth, Pass &pass);
+    const Level &level(const FolderTree &tree, NodeIndex node, const QRectF &rect, int depth, Pass &pass);
+    void computeLevel(const FolderTree &tree, NodeIndex node, Level &level) const;
+    void arrange(std::vector<LayoutItem> &items, const QRectF &rect, qint64 total) const;
+    void compareLevel(const std::vector<LayoutItem> &before, const Level &level, std::vector<QRectF> &changed) const;
+    QRectF childRect(const LayoutItem &item) const;
+
+    const FolderTree *m_tree = nullptr;
+    NodeIndex m_root = NoIndex;
+    QRectF m_rect;
+    quint32 m_version = 0;
+    int m_labelHeight = 0;
+    bool m_squarified = false;
+    bool m_valid = false;
+    quint32 m_pass = 0;
+    std::vector<LayoutItem> m_items;
+    LayoutGrid m_grid;
+    bool m_changedAll = true;
+    std::vector<QRectF> m_changed;
+    // Not a QHash: levels are referenced while the recursion, and other
+    // threads, insert more. The mutex is only held to look one up; each
+    // level is filled in by the one thread laying out its folder.
+    std::unordered_map<NodeIndex, Level> m_levels;
+    QMutex m_levelsMutex;
+    const std::atomic<bool> *m_cancel = nullptr;
+    std::atomic<bool> m_cancelled{false};
+};
+
+#endif // TREEMAPLAYOUT_H
@@ -0,0 +1,365 @@
+#include "treemaprenderer.h"
+#include "trace.h"
+
+#include <QColor>
+#include <QFontMetrics>
+#include <QPainter>
+#include <QPainterPath>
+#include <QPen>
+#include <QString>
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+// Adjustable Parameters
+static const int CORNER_ROUNDNESS = 3;
+static const int FILE_FONT_SIZE = 5;
+static const int FOLDER_FONT_SIZE = 5;
+
+// Color settings
+//static const QColor COLOR_ROLLUP = Qt::darkGray;
+static const QColor COLOR_ROLLUP = QColor(180, 180, 180);  // Softer gray
+// Searching: what doesn't match fades towards this, and matches get a
+// darker outline.
+static const QColor COLOR_FADED = QColor(238, 238, 238);
+static const int FADE_PERCENT = 75;
+static const QColor COLOR_MATCH_OUTLINE = QColor(20, 20, 20);
+// Comparing with an earlier scan.
+static const QColor COLOR_UNCHANGED = QColor(215, 215, 215);
+static const QColor COLOR_ADDED = QColor(215, 45, 45);
+static const QColor COLOR_GROWN = QColor(240, 120, 100);
+static const QColor COLOR_SHRUNK = QColor(90, 140, 225);
+
+// Function to adjust color based on index
+static QColor adjustColor(QColor baseColor, int index, int variation = 20) {
+    int r = qBound(0, baseColor.red() + index * variation - 10, 255);
+    int g = qBound(0, baseColor.green() + index * variation - 10, 255);
+    int b = qBound(0, baseColor.blue() + index * variation - 10, 255);
+    return QColor(r, g, b);
+}
+
+// Extended File Type Coloring with Less Pastel Tones, in FileCategory order.
+static const QColor CATEGORY_COLORS[FILE_CATEGORY_COUNT] = {
+    QColor(100, 170, 220), // Other files: Richer Sky Blue
+    QColor(240, 180, 140), // Images: Warmer Peach
+    QColor(255, 225, 100), // Video: Stronger Yellow
+    QColor(200, 90, 200),  // Audio: Richer Lavender
+    QColor(180, 160, 180), // Text: Deeper Lavender
+    QColor(100, 230, 100), // Documents: Deeper Green
+    QColor(230, 200, 80),  // PDF: Stronger Gold
+    QColor(230, 210, 150), // Archives: Warmer Beige
+    QColor(120, 170, 220), // Source code: Richer Blue
+    QColor(120, 200, 220), // Libraries and data: Stronger Cyan
+    QColor(190, 60, 60),   // Executables: Stronger Red
+    QColor(100, 150, 100), // Databases: Deeper Sage
+    QColor(250, 120, 140), // Vector graphics: Stronger Pink
+    QColor(80, 200, 80),   // Shell scripts: Vibrant Green
+    QColor(190, 140, 80),  // Configuration: Deeper Tan
+    QColor(90, 110, 140),  // Programs: Deeper Blue Gray
+};
+
+// One colour per file type, each a shade of its category's, worked out
+// once.
+static QColor getFileTypeColor(FileType type) {
+    static const std::vector<QColor> colors = [] {
+        std::vector<QColor> table;
+        table.push_back(CATEGORY_COLORS[OtherFiles]);
+        for (int t = 1; t < fileTypeCount(); t++)
+            table.push_back(adjustColor(CATEGORY_COLORS[fileCategory(FileType(t))], fileTypeRank(FileType(t))));
+        return table;
+    }();
+    return type < colors.size() ? colors[type] : colors[UnknownFileType];
+}
+
+static QColor getFolderDepthColor(int depth) {
+    double maxDepth = 10.0;
+    double factor = std::min(depth / maxDepth, 1.0);
+    int r = static_cast<int>(200 * (1 - factor) + 150 * factor);
+    int g = static_cast<int>(238 * (1 - factor) + 170 * factor);
+    int b = static_cast<int>(200 * (1 - factor) + 120 * factor);
+    return QColor(r, g, b);
+}
+
+static QColor fade(const QColor &color) {
+    const auto mix = [](int from, int to) { return from + (to - from) * FADE_PERCENT / 100; };
+    return QColor(mix(color.red(), COLOR_FADED.red()), mix(color.green(), COLOR_FADED.green()),
+                  mix(color.blue(), COLOR_FADED.blue()));
+}
+
+static QColor mixColor(const QColor &from, const QColor &to, double amount) {
+    const auto mix = [amount](int a, int b) { return int(a + (b - a) * amount); };
+    return QColor(mix(from.red(), to.red()), mix(from.green(), to.green()), mix(from.blue(), to.blue()));
+}
+
+// A folder's colour when comparing: the more of it is new, the stronger.
+static QColor folderChangeColor(const SnapshotDiff &diff, NodeIndex index, qint64 size) {
+    const qint64 delta = diff.folderDelta(index);
+    if (diff.folderChange(index) == SnapshotDiff::Added)
+        return COLOR_ADDED;
+    if (delta == 0)
+        return COLOR_UNCHANGED;
+    const double share = std::min(1.0, double(std::abs(delta)) / double(std::max<qint64>(size, 1)));
+    return mixColor(COLOR_UNCHANGED, delta > 0 ? COLOR_ADDED : COLOR_SHRUNK, 0.3 + 0.7 * share);
+}
+
+static QColor fileChangeColor(SnapshotDiff::Change change) {
+    switch (change) {
+    case SnapshotDiff::Added:
+        return COLOR_ADDED;
+    case SnapshotDiff::Grown:
+        return COLOR_GROWN;
+    case SnapshotDiff::Shrunk:
+        return COLOR_SHRUNK;
+    default:
+        return COLOR_UNCHANGED;
+    }
+}
+
+// Function to format file sizes in a human-readable format
+QString formatFileSize(qint64 size) {
+    if (size < 1024) return QString::number(size) + " B";
+    double kb = size / 1024.0;
+    if (kb < 1024) return QString::number(kb, 'f', 1) + " KB";
+    double mb = kb / 1024.0;
+    if (mb < 1024) return QString::number(mb, 'f', 1) + " MB";
+    double gb = mb / 1024.0;
+    return QString::number(gb, 'f', 1) + " GB";
+}
+
+static QFont derivedFont(const QFont &font, int pointSize, bool bold) {
+    QFont derived = font;
+    derived.setPointSize(pointSize);
+    derived.setBold(bold);
+    return derived;
+}
+
+static QImage metricsDevice(qreal ratio) {
+    QImage device(1, 1, QImage::Format_ARGB32_Premultiplied);
+    device.setDevicePixelRatio(ratio);
+    return device;
+}
+
+TreemapRenderer::TreemapRenderer(const QFont &font, qreal ratio)
+    : m_font(font)
+    , m_ratio(ratio)
+    , m_rootFont(derivedFont(font, FOLDER_FONT_SIZE + 2, true))
+    , m_folderFont(derivedFont(font, FOLDER_FONT_SIZE, true))  // Folder names in bold
+    // Use a smaller, non-bold font for the size text.
+    , m_folderSizeFont(derivedFont(font, FOLDER_FONT_SIZE - 1, false))
+    , m_fileFont(derivedFont(font, FILE_FONT_SIZE, false))
+    , m_device(metricsDevice(ratio))
+    , m_rootMetrics(m_rootFont, &m_device)
+    , m_folderMetrics(m_folderFont, &m_device)
+    , m_folderSizeMetrics(m_folderSizeFont, &m_device)
+    , m_fileMetrics(m_fileFont, &m_device)
+{
+    // Everything render() needs from the metrics, measured once.
+    m_folderHeight = m_folderMetrics.height();
+    m_folderAscent = m_folderMetrics.ascent();
+    m_fileHeight = m_fileMetrics.height();
+    m_rootHeight = m_rootMetrics.height();
+}
+
+QRectF TreemapRenderer::treeRect(const QRectF &outerRect) const
+{
+    // Adjust the inner area (treemap) so it doesn't overlap the label
+    return outerRect.adjusted(10, m_rootHeight + 10, -10, -10);
+}
+
+int TreemapRenderer::folderLabelHeight() const
+{
+    return m_folderHeight;
+}
+
+// Whether a file's tile has room for its name and size.
+bool TreemapRenderer::fileHasLabel(const LayoutItem &item) const
+{
+    const QRectF innerRect = item.rect.adjusted(0.5, 0.5, -0.5, -0.5);
+    return innerRect.width() >= MIN_LABEL_WIDTH && innerRect.height() >= m_fileHeight * 2;
+}
+
+static quint64 labelKey(const LayoutItem &item)
+{
+    return (quint64(item.isFolder) << 32) | item.index;
+}
+
+static NameId labelName(const FolderTree &tree, const LayoutItem &item)
+{
+    return item.isFolder ? tree.node(item.index).name : tree.file(item.index).name;
+}
+
+// Indices get reused when the tree changes, hence the name check.
+bool TreemapRenderer::isCurrent(const TreemapLabel &label, const FolderTree &tree, const LayoutItem &item) const
+{
+    return label.size == item.size && label.width == labelWidth(item) && label.name == labelName(tree, item);
+}
+
+// A folder's name goes on one line with its size in brackets, elided so
+// both fit; a file's name and size go on two lines.
+void TreemapRenderer::makeLabel(const FolderTree &tree, const LayoutItem &item, TreemapLabel &label) const
+{
+    label.size = item.size;
+    label.name = labelName(tree, item);
+    if (item.isFolder) {
+        label.width = labelWidth(item);
+        label.sizeText = QString(" (%1)").arg(formatFileSize(item.size));
+        label.sizeWidth = m_folderSizeMetrics.horizontalAdvance(label.sizeText);
+        label.text = m_folderMetrics.elidedText(tree.folderName(item.index), Qt::ElideRight, label.width - label.sizeWidth);
+        label.nameWidth = m_folderMetrics.horizontalAdvance(label.text);
+    } else {
+        label.width = labelWidth(item);
+        label.text = m_fileMetrics.elidedText(tree.fileName(item.index), Qt::ElideRight, label.width);
+        label.sizeText = formatFileSize(item.size);
+    }
+}
+
+QColor TreemapRenderer::fillColor(const FolderTree &tree, const LayoutItem &item) const
+{
+    if (item.isRollup)
+        return COLOR_ROLLUP;
+    if (m_diff && item.isFolder)
+        return folderChangeColor(*m_diff, item.index, item.size);
+    if (m_diff)
+        return fileChangeColor(m_diff->fileChange(item.index));
+    if (item.isFolder)
+        return getFolderDepthColor(item.depth);
+    return getFileTypeColor(tree.file(item.index).type);
+}
+
+std::shared_ptr<TreemapFrame> TreemapRenderer::prepare(const FolderTree &tree, NodeIndex root,
+                                                       const TreemapLayout &layout, const QRectF &outerRect,
+                                                       const QRectF &clip)
+{
+    TraceSpan span("prepare", "paint");
+    std::shared_ptr<TreemapFrame> frame = std::make_shared<TreemapFrame>();
+    frame->outerRect = outerRect;
+    frame->rootLabel = m_rootMetrics.elidedText(tree.folderName(root), Qt::ElideRight, static_cast<int>(outerRect.width() - 20));
+
+    // Mostly the whole layout, whose grid then serves as it is.
+    const std::vector<LayoutItem> &items = layout.items();
+    const std::vector<int> shown = layout.itemsIn(clip);
+    if (shown.size() == items.size()) {
+        frame->items = items;
+        frame->grid = layout.grid();
+    } else {
+        frame->items.reserve(shown.size());
+        for (int index : shown)
+            frame->items.push_back(items[index]);
+        frame->grid.build(frame->items, clip);
+    }
+
+    // Labels of items long gone from view pile up otherwise.
+    if (m_labels.size() > 2 * frame->items.size() + 1024)
+        m_labels.clear();
+    frame->looks.resize(frame->items.size());
+    for (size_t i = 0; i < frame->items.size(); i++) {
+        const LayoutItem &item = frame->items[i];
+        TreemapFrame::Look &look = frame->looks[i];
+        look.fill = fillColor(tree, item);
+        // Rolled up and folded files can't be searched, so they never match.
+        look.faded = m_highlight && (item.isRollup || (item.isFolder ? !m_highlight->containsMatch(item.index)
+                                                                     : !m_highlight->matchesFile(item.index)));
+        look.outlined = m_highlight && !look.faded && !item.isFolder;
+        if (item.isRollup) {
+            TreemapLabel label;
+            label.text = item.index != NoIndex ? QString("%1 (%2)").arg(tree.groupName(item.index)).arg(item.rollupCount)
+                                               : QString("Rollup (%1)").arg(item.rollupCount);
+            look.label = int(frame->labels.size());
+            frame->labels.push_back(label);
+            continue;
+        }
+        if (item.isFolder ? !item.hasLabel : !fileHasLabel(item))
+            continue;
+        TreemapLabel &label = m_labels[labelKey(item)];
+        if (!isCurrent(label, tree, item))
+            makeLabel(tree, item, label);
+        look.label = int(frame->labels.size());
+        frame->labels.push_back(label);
+    }
+    return frame;
+}
+
+void TreemapRenderer::clearLabels()
+{
+    m_labels.clear();
+}
+
+int TreemapRenderer::labelWidth(const LayoutItem &item) const
+{
+    if (item.isFolder)
+        return static_cast<int>(item.rect.width() - 2 * SIDE_MARGIN_FOLDER_LABEL);
+    return static_cast<int>(item.rect.adjusted(0.5, 0.5, -0.5, -0.5).width());
+}
+
+void TreemapRenderer::render(QPainter &painter, const TreemapFrame &frame, const QRectF &clip) const
+{
+    const QRectF &outerRect = frame.outerRect;
+    painter.setPen(QColor(150, 150, 150));
+    QPainterPath outerPath;
+    outerPath.addRoundedRect(outerRect, CORNER_ROUNDNESS, CORNER_ROUNDNESS);
+    painter.fillPath(outerPath, painter.brush());
+    painter.drawPath(outerPath);
+
+    // Draw the root folder name label inside the outer rectangle
+    painter.setFont(m_rootFont);
+    QRectF labelRect(outerRect.left() + SIDE_MARGIN_FOLDER_LABEL,
+                     outerRect.top() + TOP_MARGIN_FOLDER_LABEL,
+                     outerRect.width() - 2 * SIDE_MARGIN_FOLDER_LABEL,
+                     m_rootHeight);
+    painter.setPen(Qt::black);
+    painter.drawText(labelRect, Qt::AlignCenter, frame.rootLabel);
+
+    // Draw each item with rounded corners and a 1-pixel gap, parents first.
+    for (int index : frame.itemsIn(clip))
+        renderItem(painter, frame, index);
+    painter.setFont(m_font);
+}
+
+void TreemapRenderer::renderItem(QPainter &painter, const TreemapFrame &frame, int index) const
+{
+    const LayoutItem &item = frame.items[index];
+    const TreemapFrame::Look &look = frame.looks[index];
+    const QColor &fillColor = look.fill;
+    QRectF innerRect = item.rect.adjusted(0.5, 0.5, -0.5, -0.5);
+    QPainterPath path;
+    path.addRoundedRect(innerRect, CORNER_ROUNDNESS, CORNER_ROUNDNESS);
+    if (look.faded) {
+        painter.setPen(fade(QColor(100, 100, 100)));
+        painter.fillPath(path, fade(fillColor));
+    } else if (look.outlined) {
+        painter.setPen(QPen(COLOR_MATCH_OUTLINE, 2));
+        painter.fillPath(path, fillColor);
+    } else {
+        painter.setPen(QColor(100, 100, 100));
+        painter.fillPath(path, fillColor);
+    }
+    painter.drawPath(path);
+    if (look.label < 0)
+        return;
+    const TreemapLabel &label = frame.labels[look.label];
+    painter.setPen(look.faded ? fade(Qt::black) : QColor(Qt::black));
+    if (item.isRollup) {
+        painter.setFont(m_folderFont);
+        painter.drawText(innerRect, Qt::AlignCenter, label.text);
+    } else if (item.isFolder) {
+        // For folders: display the name with its size (in brackets) on the same line.
+        int totalTextWidth = label.nameWidth + label.sizeWidth;
+        double startX = item.rect.left() + SIDE_MARGIN_FOLDER_LABEL +
+                        (item.rect.width() - 2 * SIDE_MARGIN_FOLDER_LABEL - totalTextWidth) / 2.0;
+        int baseline = item.rect.top() + TOP_MARGIN_FOLDER_LABEL + m_folderAscent;
+
+        // Draw folder name.
+        painter.setFont(m_folderFont);
+        painter.drawText(QPointF(startX, baseline), label.text);
+        // Draw the size in the smaller font.
+        painter.setFont(m_folderSizeFont);
+        painter.drawText(QPointF(startX + label.nameWidth, baseline), label.sizeText);
+    } else {
+        // For files: display name on the first line and size underneath.
+        painter.setFont(m_fileFont);
+        QRectF nameRect(innerRect.left(), innerRect.top(), innerRect.width(), m_fileHeight);
+        QRectF sizeRect(innerRect.left(), innerRect.top() + m_fileHeight, innerRect.width(), m_fileHeight);
+        painter.drawText(nameRect, Qt::AlignCenter, label.text);
+        painter.drawText(sizeRect, Qt::AlignCenter, label.sizeText);
+    }
+}
@@ -0,0 +1,129 @@
+#ifndef TREEMAPRENDERER_H
+#define TREEMAPRENDERER_H
+
+#include "foldertree.h"
+#include "searchindex.h"
+#include "snapshotdiff.h"
+#include "treemaplayout.h"
+
+#include <QColor>
+#include <QFont>
+#include <QFontMetrics>
+#include <QImage>
+#include <QRectF>
+#include <QString>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class QPainter;
+
+// "1.5 MB" and the like, as the labels show sizes.
+QString formatFileSize(qint64 size);
+
+// The text of one item, elided to fit: a folder's name with its size in
+// brackets on one line, a file's name over its size, or what a rollup
+// stands for.
+struct TreemapLabel {
+    NameId name = NoIndex;
+    qint64 size = -1;
+    int width = -1;                   // Room the name was elided for.
+    QString text;                     // The name as shown.
+    QString sizeText;
+    int nameWidth = 0;                // Folders only: name and size share a line.
+    int sizeWidth = 0;
+};
+
+// A map ready to draw: the items of a layout that meet some area, with the
+// colour and label of each worked out, and a grid to find them by. It is
+// made from the tree but never looks at it again, and doesn't change once
+// made, so the GUI thread can draw one and hit test on it while the next
+// is made on another thread.
+struct TreemapFrame {
+    struct Look {
+        QColor fill;
+        int label = -1;               // Into labels; -1 for none.
+        bool faded = false;           // Doesn't match the search.
+        bool outlined = false;        // A file that does.
+    };
+
+    QRectF outerRect;
+    QString rootLabel;
+    std::vector<LayoutItem> items;    // In paint order, as the layout has them.
+    std::vector<Look> looks;          // Per item.
+    std::vector<TreemapLabel> labels;
+    LayoutGrid grid;
+
+    int itemAt(const QPointF &point, int before = -1) const { return grid.itemAt(items, point, before); }
+    std::vector<int> itemsIn(const QRectF &region) const { return grid.itemsIn(items, region); }
+};
+
+// Paints a laid-out treemap in two steps. prepare() takes what is to be
+// drawn from the tree and the layout into a frame; render() paints a frame
+// and nothing else, so tiles can be painted on several threads at once,
+// each with its own QPainter, and while the next frame is prepared.
+//
+// Fonts and metrics are set up once per renderer, for drawing at one
+// device pixel ratio. Labels are elided and measured by prepare() and kept
+// per item until its size or width changes, so most frames only copy them.
+class TreemapRenderer
+{
+public:
+    explicit TreemapRenderer(const QFont &font, qreal ratio = 1);
+    const QFont &font() const { return m_font; }
+    qreal ratio() const { return m_ratio; }
+
+    // Area left for the treemap inside the outer frame, below the root label.
+    QRectF treeRect(const QRectF &outerRect) const;
+    // Height of a folder's name label inside the map.
+    int folderLabelHeight() const;
+
+    // The frame of the items of layout that meet clip, for a map of root
+    // drawn in outerRect. One prepare() at a time; clearLabels() is for a
+    // new tree, whose indices mean other folders and files.
+    std::shared_ptr<TreemapFrame> prepare(const FolderTree &tree, NodeIndex root, const TreemapLayout &layout,
+                                          const QRectF &outerRect, const QRectF &clip);
+    void clearLabels();
+    // Draws the outer frame, the root label and every item of frame
+    // intersecting clip.
+    void render(QPainter &painter, const TreemapFrame &frame, const QRectF &clip) const;
+
+    // Shows the matches of a search: everything else is drawn faded. The
+    // result must stay put while prepare() runs; nullptr for no search.
+    void setHighlight(const SearchResult *result) { m_highlight = result; }
+    // Colours by what changed since an earlier scan instead of by type and
+    // depth: red for growth, blue for shrinkage, grey for the rest. Like the
+    // search result, it must stay put; nullptr for the usual colours.
+    void setDiff(const SnapshotDiff *diff) { m_diff = diff; }
+
+private:
+    void renderItem(QPainter &painter, const TreemapFrame &frame, int index) const;
+    bool fileHasLabel(const LayoutItem &item) const;
+    int labelWidth(const LayoutItem &item) const;
+    QColor fillColor(const FolderTree &tree, const LayoutItem &item) const;
+    bool isCurrent(const TreemapLabel &label, const FolderTree &tree, const LayoutItem &item) const;
+    void makeLabel(const FolderTree &tree, const LayoutItem &item, TreemapLabel &label) const;
+
+    QFont m_font;
+    qreal m_ratio;
+    QFont m_rootFont;
+    QFont m_folderFont;
+    QFont m_folderSizeFont;
+    QFont m_fileFont;
+    // Measured on an image at the ratio the tiles have.
+    QImage m_device;
+    QFontMetrics m_rootMetrics;
+    QFontMetrics m_folderMetrics;
+    QFontMetrics m_folderSizeMetrics;
+    QFontMetrics m_fileMetrics;
+    int m_folderHeight;
+    int m_folderAscent;
+    int m_fileHeight;
+    int m_rootHeight;
+    // Keyed by item kind and index.
+    std::unordered_map<quint64, TreemapLabel> m_labels;
+    const SearchResult *m_highlight = nullptr;
+    const SnapshotDiff *m_diff = nullptr;
+};
+
+#endif // TREEMAPRENDERER_H